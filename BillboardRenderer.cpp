@@ -1,7 +1,8 @@
 #include <glm/glm.hpp>
 #include <iostream>
 #include "BillboardRenderer.h"
-#include "ShaderUtils.h"
+#include "ShaderLibrary.h"
+#include "GLStateCache.h"
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -49,23 +50,15 @@ namespace GE {
 
 	BillboardRenderer::BillboardRenderer()
 	{
-
+		pipeline = nullptr;
 	}
 
 	void BillboardRenderer::init()
 	{
-		// New! Load shader source from files.  Need the new ShaderUtils files
-		std::string v_shader_source = loadShaderSourceCode("billboard.vs");
-		std::string f_shader_source = loadShaderSourceCode("billboard.fs");
-
-		// Due to the unique way OpenGL handles shader source, OpenGL expects
-		// an array of strings.  In this case, create an array of the
-		// loaded source code strings and pass to compileProgram for compilation
-		const GLchar* v_source_array[] = { v_shader_source.c_str() };
-		const GLchar* f_source_array[] = { f_shader_source.c_str() };
-
-		// Compile shaders into a program
-		if (!compileProgram(v_source_array, f_source_array, &programId)) {
+		// Shader files come from the shader library, shared with any other
+		// billboard renderer
+		programId = ShaderLibrary::get().getProgram("billboard.vs", "billboard.fs");
+		if (programId == 0) {
 			std::cerr << "Problem building billboard program.  Check console log for more information." << std::endl;
 		}
 
@@ -99,6 +92,18 @@ namespace GE {
 		// Transfer vertices to graphics memory
 		glBufferData(GL_ARRAY_BUFFER, sizeof(billboard), billboard, GL_STATIC_DRAW);
 
+		// Record the structure of a vertex into the VAO so draw only binds it
+		vertexArray.addAttrib(vboQuad, vertexLocation, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		vertexArray.addAttrib(vboQuad, vertexUVLocation, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+		vertexArray.build();
+
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = vertexArray.getName();
+		desc.cull = true;
+		desc.setBlend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		pipeline = PipelineCache::get().create(desc);
+
 		// Lot of duplication going on here, so think about how you could reduce this
 		// duplication.  Don't forget, billboard is a quad so doesn't need a model to
 		// be loaded from a file
@@ -106,9 +111,10 @@ namespace GE {
 
 	void BillboardRenderer::draw(Billboard* b, Camera* cam)
 	{
-		glEnable(GL_CULL_FACE);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		// Program, quad layout and state in one, the state cache skips
+		// what is already set
+		GLStateCache& gl = GLStateCache::get();
+		PipelineCache::get().bind(pipeline);
 
 		glm::vec3 rotation = glm::vec3(0, 0, 0);
 
@@ -131,45 +137,22 @@ namespace GE {
 		glm::mat4 viewMat = cam->getViewMatrix();
 		glm::mat4 projectionMat = cam->getProjectionMatrix();
 
-		// Select the program into the rendering context
-		glUseProgram(programId);
-
 		// Set the uniforms in the shader
-		glUniformMatrix4fv(transformUniformId, 1, GL_FALSE, glm::value_ptr(transformationMat));
-		glUniformMatrix4fv(viewUniformId, 1, GL_FALSE, glm::value_ptr(viewMat));
-		glUniformMatrix4fv(projectionUniformId, 1, GL_FALSE, glm::value_ptr(projectionMat));
+		gl.uniformMatrix4fv(transformUniformId, glm::value_ptr(transformationMat));
+		gl.uniformMatrix4fv(viewUniformId, glm::value_ptr(viewMat));
+		gl.uniformMatrix4fv(projectionUniformId, glm::value_ptr(projectionMat));
 
-		// Enable the attribute to be passed vertices from the vertex buffer object
-		glEnableVertexAttribArray(vertexLocation);
-		// Select the vertex buffer object into the context
-		glBindBuffer(GL_ARRAY_BUFFER, vboQuad);
-
-		// Define the structure of a vertex for OpenGL to select values from vertex buffer
-		// and store in vertexPos2DLocation attribute
-		glVertexAttribPointer(vertexLocation, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
-
-		// Enable the attribute to be passed vertices from the vertex buffer object
-		glEnableVertexAttribArray(vertexUVLocation);
-		// Define where the vertex specification will find the colour data and how much
-		// Colour data is four float values, located at where the r member is.  Stride is a vertex apart
-		glVertexAttribPointer(vertexUVLocation, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, u));
-
-		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(samplerId, 0);
-		glBindTexture(GL_TEXTURE_2D, b->getTexture()->getTextureName());
+		gl.uniform1i(samplerId, 0);
+		gl.bindTexture(0, GL_TEXTURE_2D, b->getTexture()->getTextureName());
 
 		// Draw the model
 		glDrawArrays(GL_TRIANGLES, 0, 6);
 
-		// Unselect the attribute from the context
-		glDisableVertexAttribArray(vertexLocation);
-		glDisableVertexAttribArray(vertexUVLocation);
+		// Unselect the vertex layout from the context
+		gl.bindVertexArray(0);
 
 		// Unselect the program from the context
-		glUseProgram(0);
-
-		//glDisable(GL_BLEND);
-		glDisable(GL_CULL_FACE);
+		gl.useProgram(0);
 	}
 
 }
\ No newline at end of file
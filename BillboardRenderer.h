@@ -1,6 +1,8 @@
 #pragma once
 #include "Camera.h"
 #include "Billboard.h"
+#include "VertexArray.h"
+#include "PipelineState.h"
 
 namespace GE {
 	class BillboardRenderer
@@ -10,6 +12,7 @@ namespace GE {
 
 		~BillboardRenderer() {
 			glDeleteBuffers(1, &vboQuad);
+			vertexArray.destroy();
 		}
 
 		void init();
@@ -33,6 +36,12 @@ namespace GE {
 		// transferred from this code to the graphics memory
 		GLuint vboQuad;
 
+		// Layout of the quad recorded once at init
+		VertexArray vertexArray;
+
+		// Blended and back face culled, declared at init so draw only binds it
+		const PipelineState* pipeline;
+
 		// GLSL uniform variables for the transformation, view and projection matrices
 		GLuint transformUniformId;
 		GLuint viewUniformId;
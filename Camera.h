@@ -2,8 +2,18 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <SDL.h>
+#include "Frustum.h"
 
 namespace GE {
+	// View and projection of the scene. Setters only flag the matrices as
+	// out of date, they are rebuilt by the first getter that needs them, so
+	// moving the camera several times in a frame costs one rebuild. The
+	// view-projection, its inverse and the frustum planes are cached too,
+	// so every system culling or drawing with the camera shares them
+	//
+	// Each camera keeps its own cache, so extra views of the scene (a
+	// shadow or probe camera) are simply more Camera objects. The getters
+	// write the cache, so fetch what job system workers need beforehand
 	class Camera {
 	public:
 		Camera(glm::vec3 cam_pos, glm::vec3 cam_target, glm::vec3 cam_upDir, float fov, float ar, float near, float far) {
@@ -15,7 +25,10 @@ namespace GE {
 			aspectR = ar;
 			nearClip = near;
 			farClip = far;
-			updateCamMatrices();
+			orthographic = false;
+			orthoWidth = orthoHeight = 0.0f;
+			viewDirty = projectionDirty = true;
+			derivedDirty = DERIVED_ALL;
 			SDL_GetMouseState(&oldMouseX, &oldMouseY);	
 		}
 
@@ -65,55 +78,107 @@ namespace GE {
 			return oldMouseY;
 		}
 
+		float getNearClip() {
+			return nearClip;
+		}
+
+		float getFarClip() {
+			return farClip;
+		}
+
 		// Return camera view matrix
 		// Used by draw  to send view matrix to vertex shader
-		glm::mat4 getViewMatrix() {
+		const glm::mat4& getViewMatrix() {
+			if (viewDirty) {
+				viewMat = glm::lookAt(pos, target, up);
+				viewDirty = false;
+			}
 			return viewMat;
 		}
 
 		// Return the camera projection matrix
-		glm::mat4 getProjectionMatrix() {
+		const glm::mat4& getProjectionMatrix() {
+			if (projectionDirty) {
+				if (orthographic) {
+					projectionMat = glm::ortho(-orthoWidth * 0.5f, orthoWidth * 0.5f, -orthoHeight * 0.5f, orthoHeight * 0.5f, nearClip, farClip);
+				}
+				else {
+					projectionMat = glm::perspective(glm::radians(fovy), aspectR, nearClip, farClip);
+				}
+				projectionDirty = false;
+			}
 			return projectionMat;
 		}
 
+		// Projection * view
+		const glm::mat4& getViewProjectionMatrix() {
+			if (derivedDirty & DERIVED_VIEW_PROJECTION) {
+				viewProjectionMat = getProjectionMatrix() * getViewMatrix();
+				derivedDirty &= ~DERIVED_VIEW_PROJECTION;
+			}
+			return viewProjectionMat;
+		}
+
+		// Clip space back to world space, for unprojecting screen positions
+		const glm::mat4& getInverseViewProjectionMatrix() {
+			if (derivedDirty & DERIVED_INVERSE) {
+				inverseViewProjectionMat = glm::inverse(getViewProjectionMatrix());
+				derivedDirty &= ~DERIVED_INVERSE;
+			}
+			return inverseViewProjectionMat;
+		}
+
+		// Planes of the view-projection for culling
+		const Frustum& getFrustum() {
+			if (derivedDirty & DERIVED_FRUSTUM) {
+				frustum.extract(getViewProjectionMatrix());
+				derivedDirty &= ~DERIVED_FRUSTUM;
+			}
+			return frustum;
+		}
+
+		bool isOrthographic() {
+			return orthographic;
+		}
+
 		// Mutator methods
 		void setPosX(float newX) {
 			pos = glm::vec3(newX, pos.y, pos.z);
-			updateCamMatrices();
+			viewChanged();
 		}
 
 		void setPosY(float newY) {
 			pos = glm::vec3(pos.x, newY, pos.z);
-			updateCamMatrices();
+			viewChanged();
 		}
 
 		void setPosZ(float newZ) {
 			pos = glm::vec3(pos.x, pos.y, newZ);
-			updateCamMatrices();
+			viewChanged();
 		}
 
 		// Set position for all axes in one method
 		void setPos(float newX, float newY, float newZ) {
 			pos = glm::vec3(newX, newY, newZ);
-			updateCamMatrices();
+			viewChanged();
 		}
 
 		void setPos(glm::vec3 newPos) {
 			pos = newPos;
-			updateCamMatrices();
+			viewChanged();
 		}
 
 
 		// Set new target
 		void setTarget(glm::vec3 newTarget) {
 			target = newTarget;
-			updateCamMatrices();
+			viewChanged();
 		}
 
 		// Set up direction on the camera
 		void setUpDir(glm::vec3 newUp) {
 			up = newUp;
-			updateCamMatrices();
+			viewChanged();
 		}
 		void setPitch(float newPitch) {
 
@@ -137,31 +202,66 @@ namespace GE {
 		// Set the Field of View
 		void setFov(float newFov) {
 			fovy = newFov;
-			updateCamMatrices();
+			projectionChanged();
 		}
 
 		// Set the aspect ration
 		void setAspectRation(float newAR) {
 			aspectR = newAR;
-			updateCamMatrices();
+			projectionChanged();
 		}
 
 		// Set clipping planes for the camera
 		void setNearClip(float newNearClip) {
 			nearClip = newNearClip;
-			updateCamMatrices();
+			projectionChanged();
 		}
 
 		void setFarClip(float newFarClip) {
 			farClip = newFarClip;
-			updateCamMatrices();
+			projectionChanged();
 		}
 
-		// Update the camera matrices in response to member variable changes
+		// Switch to an orthographic projection width by height units across,
+		// for shadow views. The field of view and aspect ratio are unused
+		void setOrthographic(float width, float height) {
+			orthographic = true;
+			orthoWidth = width;
+			orthoHeight = height;
+			projectionChanged();
+		}
+
+		void setPerspective() {
+			orthographic = false;
+			projectionChanged();
+		}
+
+		// Bring the matrices up to date now, only the ones that changed are
+		// rebuilt. The getters do this on their own
 		void updateCamMatrices() {
-			viewMat = glm::lookAt(pos, target, up);
-			projectionMat = glm::perspective(glm::radians(fovy), aspectR, nearClip, farClip);
+			getViewMatrix();
+			getProjectionMatrix();
 		}
+
+	private:
+		// Products of the view and projection, each rebuilt when first asked for
+		enum {
+			DERIVED_VIEW_PROJECTION = 1,
+			DERIVED_INVERSE = 2,
+			DERIVED_FRUSTUM = 4,
+			DERIVED_ALL = 7
+		};
+
+		void viewChanged() {
+			viewDirty = true;
+			derivedDirty = DERIVED_ALL;
+		}
+
+		void projectionChanged() {
+			projectionDirty = true;
+			derivedDirty = DERIVED_ALL;
+		}
+
 	private:
 		// Member variables
 		// Camera view variables
@@ -179,9 +279,19 @@ namespace GE {
 		float yaw = 50.0f;
 
 		int oldMouseX, oldMouseY;
-		// View and projection matrices
+		// Orthographic projection size, with orthographic set
+		bool orthographic;
+		float orthoWidth, orthoHeight;
+
+		// View and projection matrices and what is built from them,
+		// valid while the dirty flags are clear
 		glm::mat4 viewMat;
 		glm::mat4 projectionMat;
+		glm::mat4 viewProjectionMat;
+		glm::mat4 inverseViewProjectionMat;
+		Frustum frustum;
+		bool viewDirty, projectionDirty;
+		int derivedDirty;
 
 		
 	};
@@ -0,0 +1,488 @@
+#include "DynamicBVH.h"
+#include "Random.h"
+#include "Timing.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace GE {
+	static AABB combine(const AABB& a, const AABB& b) {
+		return AABB(glm::min(a.min, b.min), glm::max(a.max, b.max));
+	}
+
+	// Half the surface area, only compared so the factor doesn't matter
+	static float area(const AABB& box) {
+		glm::vec3 d = box.max - box.min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	static bool contains(const AABB& outer, const AABB& inner) {
+		return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+	}
+
+	static bool overlaps(const AABB& a, const AABB& b) {
+		return glm::all(glm::lessThanEqual(a.min, b.max)) && glm::all(glm::greaterThanEqual(a.max, b.min));
+	}
+
+	DynamicBVH::DynamicBVH(float _margin) {
+		margin = _margin;
+		root = NULL_NODE;
+		freeList = NULL_NODE;
+		numProxies = 0;
+	}
+
+	int DynamicBVH::allocateNode() {
+		if (freeList == NULL_NODE) {
+			nodes.push_back(Node());
+			freeList = (int)nodes.size() - 1;
+			nodes[freeList].parent = NULL_NODE;
+		}
+
+		int node = freeList;
+		freeList = nodes[node].parent;
+
+		Node& n = nodes[node];
+		n.parent = NULL_NODE;
+		n.left = NULL_NODE;
+		n.right = NULL_NODE;
+		n.userData = -1;
+		n.height = 0;
+
+		return node;
+	}
+
+	void DynamicBVH::freeNode(int node) {
+		nodes[node].parent = freeList;
+		nodes[node].height = -1;
+		freeList = node;
+	}
+
+	int DynamicBVH::insert(const AABB& box, int userData) {
+		int leaf = allocateNode();
+
+		glm::vec3 m(margin);
+		nodes[leaf].box = AABB(box.min - m, box.max + m);
+		nodes[leaf].userData = userData;
+
+		insertLeaf(leaf);
+		numProxies++;
+
+		return leaf;
+	}
+
+	void DynamicBVH::remove(int proxy) {
+		removeLeaf(proxy);
+		freeNode(proxy);
+		numProxies--;
+	}
+
+	bool DynamicBVH::update(int proxy, const AABB& box) {
+		if (contains(nodes[proxy].box, box)) {
+			return false;
+		}
+
+		removeLeaf(proxy);
+
+		glm::vec3 m(margin);
+		nodes[proxy].box = AABB(box.min - m, box.max + m);
+
+		insertLeaf(proxy);
+		return true;
+	}
+
+	void DynamicBVH::refit(int proxy, const AABB& box) {
+		glm::vec3 m(margin);
+		nodes[proxy].box = AABB(box.min - m, box.max + m);
+
+		// Boxes only, the structure stays as it is
+		for (int n = nodes[proxy].parent; n != NULL_NODE; n = nodes[n].parent) {
+			nodes[n].box = combine(nodes[nodes[n].left].box, nodes[nodes[n].right].box);
+		}
+	}
+
+	void DynamicBVH::clear() {
+		nodes.clear();
+		root = NULL_NODE;
+		freeList = NULL_NODE;
+		numProxies = 0;
+	}
+
+	void DynamicBVH::insertLeaf(int leaf) {
+		if (root == NULL_NODE) {
+			root = leaf;
+			nodes[root].parent = NULL_NODE;
+			return;
+		}
+
+		// Walk down choosing the child whose box grows least, stop when
+		// making this node the sibling is cheaper than going further down
+		AABB leafBox = nodes[leaf].box;
+		int index = root;
+
+		while (!nodes[index].isLeaf()) {
+			const Node& n = nodes[index];
+
+			float combinedArea = area(combine(n.box, leafBox));
+
+			// A new parent here has the combined box, and every ancestor
+			// below would grow by the same amount as this node
+			float cost = 2.0f * combinedArea;
+			float inheritance = 2.0f * (combinedArea - area(n.box));
+
+			float childCost[2];
+			int children[2] = { n.left, n.right };
+
+			for (int c = 0; c < 2; c++) {
+				const Node& child = nodes[children[c]];
+				float grown = area(combine(child.box, leafBox));
+
+				childCost[c] = (child.isLeaf() ? grown : grown - area(child.box)) + inheritance;
+			}
+
+			if (cost < childCost[0] && cost < childCost[1]) {
+				break;
+			}
+
+			index = childCost[0] < childCost[1] ? n.left : n.right;
+		}
+
+		int sibling = index;
+		int oldParent = nodes[sibling].parent;
+		int newParent = allocateNode();
+
+		nodes[newParent].parent = oldParent;
+		nodes[newParent].box = combine(leafBox, nodes[sibling].box);
+		nodes[newParent].height = nodes[sibling].height + 1;
+		nodes[newParent].left = sibling;
+		nodes[newParent].right = leaf;
+		nodes[sibling].parent = newParent;
+		nodes[leaf].parent = newParent;
+
+		if (oldParent == NULL_NODE) {
+			root = newParent;
+		}
+		else if (nodes[oldParent].left == sibling) {
+			nodes[oldParent].left = newParent;
+		}
+		else {
+			nodes[oldParent].right = newParent;
+		}
+
+		fixUpwards(nodes[leaf].parent);
+	}
+
+	void DynamicBVH::removeLeaf(int leaf) {
+		if (leaf == root) {
+			root = NULL_NODE;
+			return;
+		}
+
+		// The sibling takes the parent's place
+		int parent = nodes[leaf].parent;
+		int grandParent = nodes[parent].parent;
+		int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+		freeNode(parent);
+
+		if (grandParent == NULL_NODE) {
+			root = sibling;
+			nodes[sibling].parent = NULL_NODE;
+			return;
+		}
+
+		if (nodes[grandParent].left == parent) {
+			nodes[grandParent].left = sibling;
+		}
+		else {
+			nodes[grandParent].right = sibling;
+		}
+		nodes[sibling].parent = grandParent;
+
+		fixUpwards(grandParent);
+	}
+
+	void DynamicBVH::fixUpwards(int node) {
+		while (node != NULL_NODE) {
+			node = balance(node);
+
+			Node& n = nodes[node];
+			n.height = 1 + std::max(nodes[n.left].height, nodes[n.right].height);
+			n.box = combine(nodes[n.left].box, nodes[n.right].box);
+
+			node = n.parent;
+		}
+	}
+
+	int DynamicBVH::balance(int a) {
+		Node& A = nodes[a];
+		if (A.isLeaf() || A.height < 2) {
+			return a;
+		}
+
+		int b = A.left;
+		int c = A.right;
+		int diff = nodes[c].height - nodes[b].height;
+
+		if (diff > 1 || diff < -1) {
+			// Rotate the taller child (up) above a, a keeps the other child
+			// and the shorter grandchild of up
+			int up = diff > 1 ? c : b;
+			int other = diff > 1 ? b : c;
+			Node& U = nodes[up];
+
+			int f = U.left;
+			int g = U.right;
+			int keep = nodes[f].height > nodes[g].height ? f : g;
+			int give = keep == f ? g : f;
+
+			// up replaces a under a's parent
+			U.parent = A.parent;
+			if (U.parent == NULL_NODE) {
+				root = up;
+			}
+			else if (nodes[U.parent].left == a) {
+				nodes[U.parent].left = up;
+			}
+			else {
+				nodes[U.parent].right = up;
+			}
+
+			U.left = a;
+			U.right = keep;
+			A.parent = up;
+
+			if (diff > 1) {
+				A.right = give;
+			}
+			else {
+				A.left = give;
+			}
+			nodes[give].parent = a;
+
+			A.box = combine(nodes[other].box, nodes[give].box);
+			A.height = 1 + std::max(nodes[other].height, nodes[give].height);
+			U.box = combine(A.box, nodes[keep].box);
+			U.height = 1 + std::max(A.height, nodes[keep].height);
+
+			return up;
+		}
+
+		return a;
+	}
+
+	void DynamicBVH::collectLeaves(int node, std::vector<int>& out) const {
+		std::vector<int> stack;
+		stack.push_back(node);
+
+		while (!stack.empty()) {
+			const Node& n = nodes[stack.back()];
+			stack.pop_back();
+
+			if (n.isLeaf()) {
+				out.push_back(n.userData);
+			}
+			else {
+				stack.push_back(n.left);
+				stack.push_back(n.right);
+			}
+		}
+	}
+
+	void DynamicBVH::queryFrustum(const Frustum& frustum, std::vector<int>& out) const {
+		if (root == NULL_NODE) {
+			return;
+		}
+
+		// Each entry carries the planes its box still straddles, planes a
+		// parent is fully inside aren't tested again below it
+		struct Entry {
+			int node;
+			unsigned int planes;
+		};
+
+		std::vector<Entry> stack;
+		stack.push_back({ root, (1u << Frustum::NUM_PLANES) - 1 });
+
+		while (!stack.empty()) {
+			Entry e = stack.back();
+			stack.pop_back();
+
+			const Node& n = nodes[e.node];
+			bool outside = false;
+
+			for (int p = 0; p < Frustum::NUM_PLANES && !outside; p++) {
+				if ((e.planes & (1u << p)) == 0) {
+					continue;
+				}
+
+				const glm::vec4& plane = frustum.getPlane(p);
+				glm::vec3 normal(plane);
+
+				// Corners furthest along and against the normal
+				glm::vec3 positive = glm::mix(n.box.min, n.box.max, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+				glm::vec3 negative = glm::mix(n.box.max, n.box.min, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+
+				if (glm::dot(normal, positive) + plane.w < 0.0f) {
+					outside = true;
+				}
+				else if (glm::dot(normal, negative) + plane.w >= 0.0f) {
+					e.planes &= ~(1u << p);
+				}
+			}
+
+			if (outside) {
+				continue;
+			}
+
+			if (e.planes == 0) {
+				// Fully inside, no more tests needed
+				collectLeaves(e.node, out);
+			}
+			else if (n.isLeaf()) {
+				out.push_back(n.userData);
+			}
+			else {
+				stack.push_back({ n.left, e.planes });
+				stack.push_back({ n.right, e.planes });
+			}
+		}
+	}
+
+	void DynamicBVH::queryOverlap(const AABB& box, std::vector<int>& out) const {
+		if (root == NULL_NODE) {
+			return;
+		}
+
+		std::vector<int> stack;
+		stack.push_back(root);
+
+		while (!stack.empty()) {
+			const Node& n = nodes[stack.back()];
+			stack.pop_back();
+
+			if (!overlaps(n.box, box)) {
+				continue;
+			}
+
+			if (n.isLeaf()) {
+				out.push_back(n.userData);
+			}
+			else {
+				stack.push_back(n.left);
+				stack.push_back(n.right);
+			}
+		}
+	}
+
+	// Slab test, entry distance along the ray or -1 if missed
+	static float rayBox(glm::vec3 origin, glm::vec3 invDir, const AABB& box, float maxDistance) {
+		glm::vec3 t0 = (box.min - origin) * invDir;
+		glm::vec3 t1 = (box.max - origin) * invDir;
+
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+
+		float enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+		float exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+
+		return enter <= exit ? enter : -1.0f;
+	}
+
+	int DynamicBVH::raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance, float* hitDistance) const {
+		if (root == NULL_NODE) {
+			return -1;
+		}
+
+		// Division by a zero component gives infinity, which the slab test handles
+		glm::vec3 invDir = 1.0f / direction;
+
+		int hit = -1;
+		float closest = maxDistance;
+
+		std::vector<int> stack;
+		stack.push_back(root);
+
+		while (!stack.empty()) {
+			const Node& n = nodes[stack.back()];
+			stack.pop_back();
+
+			// Boxes further than the closest hit so far can be skipped
+			float t = rayBox(origin, invDir, n.box, closest);
+			if (t < 0.0f) {
+				continue;
+			}
+
+			if (n.isLeaf()) {
+				hit = n.userData;
+				closest = t;
+			}
+			else {
+				stack.push_back(n.left);
+				stack.push_back(n.right);
+			}
+		}
+
+		if (hitDistance != nullptr && hit != -1) {
+			*hitDistance = closest;
+		}
+
+		return hit;
+	}
+
+	void DynamicBVH::runBenchmark(int count) {
+		// Same density whatever the count, so the number of visible
+		// objects stays about the same while the world grows
+		float worldSize = 20.0f * std::cbrt((float)count);
+
+		std::vector<AABB> boxes(count);
+		unsigned int seed = 1u;
+		for (int i = 0; i < count; i++) {
+			glm::vec3 c;
+			for (int k = 0; k < 3; k++) {
+				c[k] = (randomFloat(seed) - 0.5f) * worldSize;
+			}
+			boxes[i] = AABB(c - glm::vec3(1.0f), c + glm::vec3(1.0f));
+		}
+
+		Clock::time_point start = Clock::now();
+
+		DynamicBVH bvh;
+		for (int i = 0; i < count; i++) {
+			bvh.insert(boxes[i], i);
+		}
+
+		float buildMs = elapsedMs(start);
+
+		glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		glm::mat4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 300.0f);
+		Frustum frustum(projection * view);
+
+		const int ITERATIONS = 10;
+		std::vector<int> visible;
+
+		start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			visible.clear();
+			bvh.queryFrustum(frustum, visible);
+		}
+		float bvhMs = elapsedMs(start) / ITERATIONS;
+
+		size_t bvhVisible = visible.size();
+
+		start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			visible.clear();
+			for (int i = 0; i < count; i++) {
+				if (frustum.testAABB(boxes[i])) {
+					visible.push_back(i);
+				}
+			}
+		}
+		float bruteMs = elapsedMs(start) / ITERATIONS;
+
+		std::cout << "DynamicBVH: " << count << " boxes, height " << bvh.getHeight()
+			<< ", build " << buildMs << " ms | cull " << bvhMs << " ms (" << bvhVisible
+			<< " visible) vs brute force " << bruteMs << " ms (" << visible.size() << " visible)" << std::endl;
+	}
+}
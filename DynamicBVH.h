@@ -0,0 +1,120 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Frustum.h"
+
+namespace GE {
+	// Dynamic bounding volume hierarchy over the AABBs of scene objects
+	// (renderers, billboards, terrain chunks). Objects are inserted as
+	// leaves with a box fattened by a margin, so small movements don't
+	// change the tree. Inserting picks the sibling that grows the surface
+	// area least and tree rotations keep it balanced, so objects can be
+	// added, moved and removed at any time without a rebuild
+	//
+	// Culling walks the tree and stops at nodes fully outside the frustum,
+	// nodes fully inside add all their leaves without further tests
+	class DynamicBVH {
+	public:
+		static const int NULL_NODE = -1;
+
+		// Margin added around each box when it is inserted
+		explicit DynamicBVH(float margin = 0.1f);
+		~DynamicBVH() {}
+
+		// Add a box, userData is what the queries report. Returns the proxy
+		// used to move or remove it
+		int insert(const AABB& box, int userData);
+
+		void remove(int proxy);
+
+		// Move a proxy. Nothing changes while the box stays inside the fat
+		// box, otherwise it is reinserted. Returns true if the tree changed
+		bool update(int proxy, const AABB& box);
+
+		// Move a proxy without reinserting, the ancestors are grown or shrunk
+		// to fit. Cheaper than update but the tree quality isn't maintained,
+		// suits small movements of many objects
+		void refit(int proxy, const AABB& box);
+
+		// Remove everything
+		void clear();
+
+		// User data of every proxy touching the frustum
+		void queryFrustum(const Frustum& frustum, std::vector<int>& out) const;
+
+		// User data of every proxy whose box overlaps the box
+		void queryOverlap(const AABB& box, std::vector<int>& out) const;
+
+		// Closest proxy box hit by the ray, returns its user data or -1.
+		// direction needn't be normalised, distances are in its units
+		int raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance, float* hitDistance = nullptr) const;
+
+		// Accessors
+		int getUserData(int proxy) const {
+			return nodes[proxy].userData;
+		}
+
+		const AABB& getFatBox(int proxy) const {
+			return nodes[proxy].box;
+		}
+
+		int getNumProxies() const {
+			return numProxies;
+		}
+
+		// Height of the tree, 0 for a single leaf
+		int getHeight() const {
+			return root == NULL_NODE ? 0 : nodes[root].height;
+		}
+
+		// Time building, culling and brute force culling count boxes and
+		// print the results to the console
+		static void runBenchmark(int count);
+
+	private:
+		struct Node {
+			AABB box;
+			int parent;
+
+			// Both NULL_NODE for leaves
+			int left;
+			int right;
+
+			int userData;
+
+			// Leaves are 0, free nodes -1
+			int height;
+
+			bool isLeaf() const {
+				return left == NULL_NODE;
+			}
+		};
+
+		int allocateNode();
+		void freeNode(int node);
+
+		void insertLeaf(int leaf);
+		void removeLeaf(int leaf);
+
+		// Recompute the boxes and heights from node up to the root,
+		// rotating where the children are unbalanced
+		void fixUpwards(int node);
+
+		// Rotate the taller grandchild up if the children's heights differ
+		// by more than one, returns the node now at this position
+		int balance(int a);
+
+		// Add the user data of every leaf below node
+		void collectLeaves(int node, std::vector<int>& out) const;
+
+	private:
+		std::vector<Node> nodes;
+		int root;
+
+		// Head of the free node list, linked through parent
+		int freeList;
+
+		int numProxies;
+		float margin;
+	};
+}
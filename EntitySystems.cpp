@@ -0,0 +1,214 @@
+#include "EntitySystems.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include "FrameUniforms.h"
+#include "Timing.h"
+#include <atomic>
+#include <iostream>
+
+namespace GE {
+	void TransformSystem::update(EntityWorld& world, SceneGraph* scene, JobSystem* jobs) {
+		Clock::time_point start = Clock::now();
+
+		std::atomic<int> updated(0);
+
+		// Without a parent only the local transform moves the entity
+		world.parallelForEachChunk(EntityQuery(EntityWorld::maskOf<LocalTransform, WorldTransform>(), EntityWorld::maskOf<SceneParent>()), jobs, [&updated](Chunk& chunk) {
+			LocalTransform* locals = chunk.get<LocalTransform>();
+			WorldTransform* worlds = chunk.get<WorldTransform>();
+			int count = 0;
+
+			for (int i = 0; i < chunk.count; i++) {
+				if (!locals[i].changed) {
+					continue;
+				}
+
+				worlds[i].matrix = SceneGraph::composeTRS(locals[i].position, locals[i].rotation, locals[i].scale);
+				locals[i].changed = false;
+				count++;
+			}
+
+			updated += count;
+		});
+
+		// Only reads the scene graph, so the workers can share it. Entities
+		// under a node that didn't move keep their matrix
+		if (scene != nullptr) {
+			world.parallelForEachChunk(EntityQuery(EntityWorld::maskOf<LocalTransform, SceneParent, WorldTransform>()), jobs, [scene, &updated](Chunk& chunk) {
+				LocalTransform* locals = chunk.get<LocalTransform>();
+				SceneParent* parents = chunk.get<SceneParent>();
+				WorldTransform* worlds = chunk.get<WorldTransform>();
+				int count = 0;
+
+				for (int i = 0; i < chunk.count; i++) {
+					uint32_t version = scene->getWorldVersion(parents[i].node);
+					if (!locals[i].changed && worlds[i].parentVersion == version) {
+						continue;
+					}
+
+					worlds[i].matrix = scene->getWorldMatrix(parents[i].node) * SceneGraph::composeTRS(locals[i].position, locals[i].rotation, locals[i].scale);
+					worlds[i].parentVersion = version;
+					locals[i].changed = false;
+					count++;
+				}
+
+				updated += count;
+			});
+		}
+
+		numUpdated = updated;
+		updateMs = elapsedMs(start);
+	}
+
+	void CullingSystem::update(EntityWorld& world, Camera* cam, JobSystem* jobs) {
+		Clock::time_point start = Clock::now();
+
+		const Frustum& frustum = cam->getFrustum();
+		std::atomic<int> visible(0);
+
+		world.parallelForEachChunk(EntityQuery(EntityWorld::maskOf<WorldTransform, LocalBounds, Visibility>()), jobs, [&frustum, &visible](Chunk& chunk) {
+			WorldTransform* transforms = chunk.get<WorldTransform>();
+			LocalBounds* bounds = chunk.get<LocalBounds>();
+			Visibility* visibility = chunk.get<Visibility>();
+			int count = 0;
+
+			for (int i = 0; i < chunk.count; i++) {
+				// World box around the transformed local box, the extents
+				// go through the absolute values of the rotation and scale
+				const glm::mat4& m = transforms[i].matrix;
+				glm::vec3 centre = glm::vec3(m * glm::vec4(bounds[i].box.getCentre(), 1.0f));
+				glm::vec3 e = bounds[i].box.getExtents();
+				glm::vec3 extents = glm::abs(glm::vec3(m[0])) * e.x + glm::abs(glm::vec3(m[1])) * e.y + glm::abs(glm::vec3(m[2])) * e.z;
+
+				visibility[i].visible = frustum.testAABB(AABB(centre - extents, centre + extents));
+				count += visibility[i].visible ? 1 : 0;
+			}
+
+			visible += count;
+		});
+
+		numVisible = visible;
+		cullMs = elapsedMs(start);
+	}
+
+	MeshDrawSystem::MeshDrawSystem() {
+		programId = 0;
+		samplerId = -1;
+		occlusionQueries = nullptr;
+		submitted = 0;
+	}
+
+	void MeshDrawSystem::init() {
+		//The same program as ModelRenderer, so the library shares it
+		const char* attributes[] = { "vertexPos3D", "vUV" };
+
+		programId = ShaderLibrary::get().requestProgram("model.vs", "model.fs", "", attributes, 2, [this](GLuint program) {
+			samplerId = glGetUniformLocation(program, "sampler");
+		});
+
+		if (programId == 0) {
+			std::cerr << "Failed to create MeshDrawSystem program. Check console for errors" << std::endl;
+		}
+	}
+
+	int MeshDrawSystem::addMesh(Model* model) {
+		Mesh mesh;
+		mesh.model = model;
+
+		glGenBuffers(1, &mesh.vbo);
+		GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+		glBufferData(GL_ARRAY_BUFFER, model->getNumVertices() * sizeof(Vertex), model->getVertices(), GL_STATIC_DRAW);
+
+		mesh.vertexArray.addAttrib(mesh.vbo, 0, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		mesh.vertexArray.addAttrib(mesh.vbo, 1, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+		mesh.vertexArray.build();
+
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = mesh.vertexArray.getName();
+		desc.cull = true;
+		mesh.pipeline = PipelineCache::get().create(desc);
+
+		Vertex* v = (Vertex*)model->getVertices();
+		for (int i = 0; i < model->getNumVertices(); i++) {
+			glm::vec3 p(v[i].x, v[i].y, v[i].z);
+			if (i == 0) {
+				mesh.bounds = AABB(p, p);
+			}
+			else {
+				mesh.bounds.expand(p);
+			}
+		}
+
+		meshes.push_back(mesh);
+		return (int)meshes.size() - 1;
+	}
+
+	void MeshDrawSystem::submit(EntityWorld& world, RenderQueue* queue, Camera* cam) {
+		submitted = 0;
+		if (programId == 0) {
+			return;
+		}
+
+		GLuint fallbackProgramId = ShaderLibrary::get().getFallbackProgram();
+		glm::vec3 camPos = cam->getPos();
+
+		// The queue isn't thread safe, so one chunk after another
+		world.forEachChunk(EntityQuery(EntityWorld::maskOf<WorldTransform, MeshInstance, Visibility>()), [&](Chunk& chunk) {
+			WorldTransform* transforms = chunk.get<WorldTransform>();
+			MeshInstance* instances = chunk.get<MeshInstance>();
+			Visibility* visibility = chunk.get<Visibility>();
+			LocalBounds* bounds = chunk.get<LocalBounds>();
+			OcclusionTested* tested = chunk.get<OcclusionTested>();
+
+			for (int i = 0; i < chunk.count; i++) {
+				if (!visibility[i].visible) {
+					continue;
+				}
+
+				const Mesh& mesh = meshes[instances[i].mesh];
+				const glm::mat4& transform = transforms[i].matrix;
+
+				ObjectData objectData;
+				objectData.transform = transform;
+
+				DrawPacket packet;
+				packet.pass = PASS_OPAQUE;
+				packet.pipeline = mesh.pipeline;
+				packet.fallbackProgramId = fallbackProgramId;
+				packet.textureTarget = GL_TEXTURE_2D;
+				packet.textureName = instances[i].material->getTextureName();
+				packet.mode = GL_TRIANGLES;
+				packet.count = mesh.model->getNumVertices();
+				packet.drawDataOffset = queue->allocateDrawData(&objectData, sizeof(objectData));
+				packet.drawDataSize = sizeof(objectData);
+				packet.depth = glm::length(glm::vec3(transform[3]) - camPos);
+				packet.owner = this;
+
+				if (occlusionQueries != nullptr && tested != nullptr) {
+					const AABB& box = bounds != nullptr ? bounds[i].box : mesh.bounds;
+					packet.conditionQuery = occlusionQueries->submit(queue, cam, tested[i].queryObject, transform, box);
+				}
+
+				queue->submit(packet);
+				submitted++;
+			}
+		});
+	}
+
+	void MeshDrawSystem::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		//Texture is always bound to unit 0
+		GLStateCache::get().uniform1i(samplerId, 0);
+	}
+
+	//The program belongs to the shader library
+	void MeshDrawSystem::destroy() {
+		for (Mesh& mesh : meshes) {
+			glDeleteBuffers(1, &mesh.vbo);
+			GLStateCache::get().onBufferDeleted(mesh.vbo);
+			mesh.vertexArray.destroy();
+		}
+
+		meshes.clear();
+	}
+}
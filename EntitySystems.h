@@ -0,0 +1,186 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <vector>
+#include "Camera.h"
+#include "EntityWorld.h"
+#include "Frustum.h"
+#include "JobSystem.h"
+#include "Model.h"
+#include "OcclusionQueries.h"
+#include "RenderQueue.h"
+#include "SceneGraph.h"
+#include "Texture.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Components of the scene objects kept in an EntityWorld
+
+	// Position, rotation and scale, relative to the SceneParent if there
+	// is one. Set changed when writing them, or the SceneParent, so the
+	// TransformSystem recomputes the world matrix
+	struct LocalTransform {
+		glm::vec3 position;
+		glm::quat rotation;
+		glm::vec3 scale;
+		bool changed;
+	};
+
+	// Written by the TransformSystem, along with the version of the
+	// SceneParent's world matrix it was built from
+	struct WorldTransform {
+		glm::mat4 matrix;
+		uint32_t parentVersion;
+	};
+
+	// Scene graph node the entity follows
+	struct SceneParent {
+		int node;
+	};
+
+	// Model space bounds culled against the camera
+	struct LocalBounds {
+		AABB box;
+	};
+
+	// Written by the CullingSystem every frame
+	struct Visibility {
+		bool visible;
+	};
+
+	// Mesh from MeshDrawSystem::addMesh drawn with a texture
+	struct MeshInstance {
+		int mesh;
+		Texture* material;
+	};
+
+	// Object in the draw system's OcclusionQueries, the draw is skipped
+	// while its bounding box is hidden
+	struct OcclusionTested {
+		int queryObject;
+	};
+
+	// Composes the WorldTransform of every entity with a LocalTransform,
+	// parented to its scene graph node when it has a SceneParent. Only
+	// entities whose local transform changed or whose node moved are
+	// recomputed, a static scene costs one check per entity
+	class TransformSystem {
+	public:
+		TransformSystem() {
+			numUpdated = 0;
+			updateMs = 0.0f;
+		}
+
+		~TransformSystem() {}
+
+		// The scene graph must have been updated first
+		void update(EntityWorld& world, SceneGraph* scene, JobSystem* jobs);
+
+		// Accessors
+		// World matrices recomputed by the last update
+		int getUpdatedCount() {
+			return numUpdated;
+		}
+
+		float getUpdateMs() {
+			return updateMs;
+		}
+
+	private:
+		int numUpdated;
+		float updateMs;
+	};
+
+	// Tests the world space bounds of every entity with LocalBounds and a
+	// WorldTransform against the camera frustum and stores the result in
+	// its Visibility
+	class CullingSystem {
+	public:
+		CullingSystem() {
+			numVisible = 0;
+			cullMs = 0.0f;
+		}
+
+		~CullingSystem() {}
+
+		void update(EntityWorld& world, Camera* cam, JobSystem* jobs);
+
+		// Accessors
+		// Entities found visible by the last update
+		int getNumVisible() {
+			return numVisible;
+		}
+
+		float getCullMs() {
+			return cullMs;
+		}
+
+	private:
+		int numVisible;
+		float cullMs;
+	};
+
+	// Owns the GL buffers of the meshes entities draw, once per mesh
+	// rather than per object, and submits a packet for every visible
+	// entity with a MeshInstance
+	class MeshDrawSystem : public Renderable {
+	public:
+		MeshDrawSystem();
+		~MeshDrawSystem() {}
+
+		// Request the program, before adding meshes
+		void init();
+
+		// Upload a model, returns the index for MeshInstance::mesh
+		int addMesh(Model* model);
+
+		// Model space bounds of a mesh, for LocalBounds
+		const AABB& getMeshBounds(int mesh) {
+			return meshes[mesh].bounds;
+		}
+
+		// Queries for entities with OcclusionTested, nullptr draws them
+		// unconditionally
+		void setOcclusionQueries(OcclusionQueries* oq) {
+			occlusionQueries = oq;
+		}
+
+		OcclusionQueries* getOcclusionQueries() {
+			return occlusionQueries;
+		}
+
+		void submit(EntityWorld& world, RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		// Packets submitted last frame
+		int getSubmitted() {
+			return submitted;
+		}
+
+	private:
+		struct Mesh {
+			Model* model;
+			GLuint vbo;
+			VertexArray vertexArray;
+			const PipelineState* pipeline;
+			AABB bounds;
+		};
+
+	private:
+		// Shared model program from the shader library
+		GLuint programId;
+		GLint samplerId;
+
+		std::vector<Mesh> meshes;
+
+		OcclusionQueries* occlusionQueries;
+		int submitted;
+	};
+}
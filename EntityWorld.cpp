@@ -0,0 +1,492 @@
+#include "EntityWorld.h"
+#include "Random.h"
+#include "Timing.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <iostream>
+
+namespace GE {
+	// Component arrays start on this boundary within a chunk
+	const int COMPONENT_ALIGN = 16;
+
+	struct ComponentInfo {
+		int size;
+		int align;
+	};
+
+	// Shared by every world, filled in as component types are first used
+	static std::vector<ComponentInfo>& componentInfos() {
+		static std::vector<ComponentInfo> infos;
+		return infos;
+	}
+
+	static std::mutex registryMutex;
+
+	int EntityWorld::registerComponent(int size, int align) {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		std::vector<ComponentInfo>& infos = componentInfos();
+
+		assert((int)infos.size() < MAX_COMPONENTS && align <= COMPONENT_ALIGN);
+
+		ComponentInfo info;
+		info.size = size;
+		info.align = align;
+		infos.push_back(info);
+		return (int)infos.size() - 1;
+	}
+
+	int EntityWorld::getComponentSize(int component) {
+		return componentInfos()[component].size;
+	}
+
+	static int alignUp(int value, int align) {
+		return (value + align - 1) / align * align;
+	}
+
+	EntityWorld::EntityWorld() {
+		numEntities = 0;
+		iterating = 0;
+	}
+
+	EntityWorld::~EntityWorld() {
+		for (Archetype* archetype : archetypes) {
+			for (Chunk* chunk : archetype->chunks) {
+				delete[] chunk->data;
+				delete chunk;
+			}
+			delete archetype;
+		}
+	}
+
+	Archetype* EntityWorld::findArchetype(ComponentMask mask) {
+		auto it = archetypeByMask.find(mask);
+		if (it != archetypeByMask.end()) {
+			return it->second;
+		}
+
+		Archetype* archetype = new Archetype();
+		archetype->mask = mask;
+
+		int rowSize = sizeof(Entity);
+		for (int c = 0; c < MAX_COMPONENTS; c++) {
+			archetype->offsets[c] = -1;
+			if (mask & ((ComponentMask)1 << c)) {
+				archetype->components.push_back(c);
+				rowSize += getComponentSize(c);
+			}
+		}
+
+		// Leave room for aligning the start of every array
+		int padding = COMPONENT_ALIGN * (int)(archetype->components.size() + 1);
+		archetype->capacity = std::max(1, (CHUNK_SIZE - padding) / rowSize);
+
+		int offset = 0;
+		archetype->entityOffset = offset;
+		offset += archetype->capacity * (int)sizeof(Entity);
+
+		for (int c : archetype->components) {
+			offset = alignUp(offset, COMPONENT_ALIGN);
+			archetype->offsets[c] = offset;
+			offset += archetype->capacity * getComponentSize(c);
+		}
+
+		assert(offset <= CHUNK_SIZE);
+
+		archetypes.push_back(archetype);
+		archetypeByMask[mask] = archetype;
+		return archetype;
+	}
+
+	void EntityWorld::allocateRow(Archetype* archetype, Entity e) {
+		if (archetype->chunks.empty() || archetype->chunks.back()->count == archetype->capacity) {
+			Chunk* chunk = new Chunk();
+			chunk->archetype = archetype;
+			chunk->data = new unsigned char[CHUNK_SIZE];
+			chunk->count = 0;
+			archetype->chunks.push_back(chunk);
+		}
+
+		Chunk* chunk = archetype->chunks.back();
+		int row = chunk->count++;
+
+		for (int c : archetype->components) {
+			int size = getComponentSize(c);
+			memset(chunk->data + archetype->offsets[c] + row * size, 0, size);
+		}
+		chunk->getEntities()[row] = e;
+
+		EntityRecord& record = records[e.index];
+		record.chunk = chunk;
+		record.row = row;
+	}
+
+	void EntityWorld::freeRow(Chunk* chunk, int row) {
+		Archetype* archetype = chunk->archetype;
+		Chunk* last = archetype->chunks.back();
+		int lastRow = last->count - 1;
+
+		// Keep the chunks packed, the archetype's last entity takes the row
+		if (chunk != last || row != lastRow) {
+			for (int c : archetype->components) {
+				int size = getComponentSize(c);
+				int offset = archetype->offsets[c];
+				memcpy(chunk->data + offset + row * size, last->data + offset + lastRow * size, size);
+			}
+
+			Entity moved = last->getEntities()[lastRow];
+			chunk->getEntities()[row] = moved;
+			records[moved.index].chunk = chunk;
+			records[moved.index].row = row;
+		}
+
+		last->count--;
+		if (last->count == 0) {
+			delete[] last->data;
+			delete last;
+			archetype->chunks.pop_back();
+		}
+	}
+
+	Entity EntityWorld::create(ComponentMask mask) {
+		assert(iterating == 0);
+
+		uint32_t index;
+		if (!freeIndices.empty()) {
+			index = freeIndices.back();
+			freeIndices.pop_back();
+		}
+		else {
+			index = (uint32_t)records.size();
+			EntityRecord record;
+			record.chunk = nullptr;
+			record.row = 0;
+			record.generation = 0;
+			records.push_back(record);
+		}
+
+		Entity e(index, records[index].generation);
+		allocateRow(findArchetype(mask), e);
+		numEntities++;
+		return e;
+	}
+
+	void EntityWorld::destroy(Entity e) {
+		if (!isAlive(e)) {
+			return;
+		}
+		assert(iterating == 0);
+
+		EntityRecord& record = records[e.index];
+		freeRow(record.chunk, record.row);
+
+		record.chunk = nullptr;
+		record.generation++;
+		freeIndices.push_back(e.index);
+		numEntities--;
+	}
+
+	void EntityWorld::changeArchetype(Entity e, ComponentMask mask) {
+		assert(iterating == 0);
+
+		Chunk* from = records[e.index].chunk;
+		int fromRow = records[e.index].row;
+		Archetype* fromArchetype = from->archetype;
+
+		Archetype* to = findArchetype(mask);
+		allocateRow(to, e);
+
+		Chunk* chunk = records[e.index].chunk;
+		int row = records[e.index].row;
+
+		for (int c : to->components) {
+			if (fromArchetype->offsets[c] >= 0) {
+				int size = getComponentSize(c);
+				memcpy(chunk->data + to->offsets[c] + row * size, from->data + fromArchetype->offsets[c] + fromRow * size, size);
+			}
+		}
+
+		freeRow(from, fromRow);
+	}
+
+	void* EntityWorld::getComponent(Entity e, int component) {
+		if (!isAlive(e)) {
+			return nullptr;
+		}
+
+		const EntityRecord& record = records[e.index];
+		int offset = record.chunk->archetype->offsets[component];
+		if (offset < 0) {
+			return nullptr;
+		}
+
+		return record.chunk->data + offset + record.row * getComponentSize(component);
+	}
+
+	int EntityWorld::setComponent(Entity e, int component, const void* value) {
+		void* data = getComponent(e, component);
+		if (data != nullptr) {
+			memcpy(data, value, getComponentSize(component));
+		}
+		return component;
+	}
+
+	void EntityWorld::addComponent(Entity e, int component, const void* value) {
+		if (!isAlive(e)) {
+			return;
+		}
+
+		ComponentMask mask = records[e.index].chunk->archetype->mask;
+		ComponentMask bit = (ComponentMask)1 << component;
+		if ((mask & bit) == 0) {
+			changeArchetype(e, mask | bit);
+		}
+
+		setComponent(e, component, value);
+	}
+
+	void EntityWorld::removeComponent(Entity e, int component) {
+		if (!isAlive(e)) {
+			return;
+		}
+
+		ComponentMask mask = records[e.index].chunk->archetype->mask;
+		ComponentMask bit = (ComponentMask)1 << component;
+		if (mask & bit) {
+			changeArchetype(e, mask & ~bit);
+		}
+	}
+
+	void EntityWorld::forEachChunk(const EntityQuery& query, const ChunkFunc& func) {
+		iterating++;
+
+		for (Archetype* archetype : archetypes) {
+			if (!query.matches(archetype->mask)) {
+				continue;
+			}
+
+			for (Chunk* chunk : archetype->chunks) {
+				func(*chunk);
+			}
+		}
+
+		iterating--;
+	}
+
+	void EntityWorld::parallelForEachChunk(const EntityQuery& query, JobSystem* jobs, const ChunkFunc& func) {
+		std::vector<Chunk*> chunks;
+		for (Archetype* archetype : archetypes) {
+			if (query.matches(archetype->mask)) {
+				chunks.insert(chunks.end(), archetype->chunks.begin(), archetype->chunks.end());
+			}
+		}
+
+		iterating++;
+
+		// A single chunk isn't worth waking the workers for
+		if (jobs == nullptr || chunks.size() <= 1) {
+			for (Chunk* chunk : chunks) {
+				func(*chunk);
+			}
+		}
+		else {
+			jobs->parallelFor((int)chunks.size(), 1, [&chunks, &func](int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					func(*chunks[i]);
+				}
+			});
+		}
+
+		iterating--;
+	}
+
+	int EntityWorld::getChunkCount() {
+		int count = 0;
+		for (Archetype* archetype : archetypes) {
+			count += (int)archetype->chunks.size();
+		}
+		return count;
+	}
+
+	int EntityCommandBuffer::record(CommandType type, Entity e, ComponentMask mask, int component, const void* value) {
+		Command command;
+		command.type = type;
+		command.component = component;
+		command.entity = e;
+		command.mask = mask;
+
+		size_t at = commands.size();
+		int size = value != nullptr ? EntityWorld::getComponentSize(component) : 0;
+		commands.resize(at + sizeof(Command) + size);
+		memcpy(&commands[at], &command, sizeof(Command));
+		if (size > 0) {
+			memcpy(&commands[at + sizeof(Command)], value, size);
+		}
+
+		numCommands++;
+		return component;
+	}
+
+	void EntityCommandBuffer::playback(EntityWorld& world) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		Entity created;
+		size_t at = 0;
+
+		while (at < commands.size()) {
+			// Copied out, the values after each header aren't aligned
+			Command command;
+			memcpy(&command, &commands[at], sizeof(Command));
+			at += sizeof(Command);
+
+			const void* value = &commands[0] + at;
+			if (command.type == CMD_SET_CREATED || command.type == CMD_ADD) {
+				at += EntityWorld::getComponentSize(command.component);
+			}
+
+			switch (command.type) {
+			case CMD_CREATE:
+				created = world.create(command.mask);
+				break;
+			case CMD_SET_CREATED:
+				world.setComponent(created, command.component, value);
+				break;
+			case CMD_DESTROY:
+				world.destroy(command.entity);
+				break;
+			case CMD_ADD:
+				world.addComponent(command.entity, command.component, value);
+				break;
+			case CMD_REMOVE:
+				world.removeComponent(command.entity, command.component);
+				break;
+			}
+		}
+
+		commands.clear();
+		numCommands = 0;
+	}
+
+	// Components of the benchmark, the integration step of a simple
+	// simulation
+	struct BenchPosition {
+		glm::vec3 value;
+	};
+
+	struct BenchVelocity {
+		glm::vec3 value;
+	};
+
+	struct BenchExpired {
+		float age;
+	};
+
+	// The same data the way scene objects were kept before, one heap
+	// allocation each with the hot fields among cold ones
+	struct BenchObject {
+		glm::vec3 position;
+		unsigned int glHandles[8];
+		glm::vec3 velocity;
+		float coldState[40];
+	};
+
+	void EntityWorld::runBenchmark(int numEntities, JobSystem* jobs) {
+		const float DT = 1.0f / 60.0f;
+		const int ITERATIONS = 10;
+
+		unsigned int seed = 7u;
+		auto random = [&seed]() {
+			return randomFloat(seed) - 0.5f;
+		};
+
+		// Allocated between other allocations, as objects made over the
+		// life of a game end up scattered through the heap
+		std::vector<BenchObject*> objects(numEntities);
+		std::vector<float*> clutter(numEntities);
+		for (int i = 0; i < numEntities; i++) {
+			objects[i] = new BenchObject();
+			objects[i]->position = glm::vec3(random(), random(), random()) * 100.0f;
+			objects[i]->velocity = glm::vec3(random(), random(), random());
+			clutter[i] = new float[(i * 7) % 29 + 1];
+		}
+
+		EntityWorld world;
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < numEntities; i++) {
+			BenchPosition position = { objects[i]->position };
+			BenchVelocity velocity = { objects[i]->velocity };
+			world.create(position, velocity);
+		}
+		float createMs = elapsedMs(start);
+
+		start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			for (BenchObject* object : objects) {
+				object->position += object->velocity * DT;
+			}
+		}
+		float heapMs = elapsedMs(start) / ITERATIONS;
+
+		start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			world.forEach<BenchPosition, BenchVelocity>([DT](BenchPosition& p, BenchVelocity& v) {
+				p.value += v.value * DT;
+			});
+		}
+		float chunkMs = elapsedMs(start) / ITERATIONS;
+
+		start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			world.parallelForEach<BenchPosition, BenchVelocity>(jobs, [DT](BenchPosition& p, BenchVelocity& v) {
+				p.value += v.value * DT;
+			});
+		}
+		float parallelMs = elapsedMs(start) / ITERATIONS;
+
+		// Tag 1% from the workers, structural changes wait for playback
+		EntityCommandBuffer commands;
+		start = Clock::now();
+		world.parallelForEachChunk(EntityQuery(maskOf<BenchPosition>()), jobs, [&commands](Chunk& chunk) {
+			Entity* entities = chunk.getEntities();
+			for (int i = 0; i < chunk.count; i++) {
+				if (entities[i].index % 100 == 0) {
+					BenchExpired expired = { 0.0f };
+					commands.add(entities[i], expired);
+				}
+			}
+		});
+		float recordMs = elapsedMs(start);
+		int numCommands = commands.getCommandCount();
+
+		start = Clock::now();
+		commands.playback(world);
+		float playbackMs = elapsedMs(start);
+
+		// Then destroy them and check the rest are still there
+		world.forEachChunk(EntityQuery(maskOf<BenchExpired>()), [&commands](Chunk& chunk) {
+			for (int i = 0; i < chunk.count; i++) {
+				commands.destroy(chunk.getEntities()[i]);
+			}
+		});
+		commands.playback(world);
+
+		int remaining = 0;
+		world.forEach<BenchPosition>([&remaining](BenchPosition&) {
+			remaining++;
+		});
+
+		for (BenchObject* object : objects) {
+			delete object;
+		}
+		for (float* c : clutter) {
+			delete[] c;
+		}
+
+		std::cout << "EntityWorld " << numEntities << " entities, " << world.getChunkCount() << " chunks: "
+			<< "create " << createMs << " ms, "
+			<< "update heap objects " << heapMs << " ms, "
+			<< "chunks " << chunkMs << " ms (" << numEntities / (chunkMs * 1000000.0f) << " entities/ns), "
+			<< "chunks on " << (jobs ? jobs->getNumThreads() : 1) << " threads " << parallelMs << " ms, "
+			<< numCommands << " deferred adds recorded " << recordMs << " ms played back " << playbackMs << " ms, "
+			<< remaining << " left after destroying them" << std::endl;
+	}
+}
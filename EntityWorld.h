@@ -0,0 +1,325 @@
+#pragma once
+#include <assert.h>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "JobSystem.h"
+
+namespace GE {
+	// Handle to an entity. The generation tells a destroyed entity apart
+	// from a newer one given the same index
+	struct Entity {
+		uint32_t index;
+		uint32_t generation;
+
+		Entity() {
+			index = 0xFFFFFFFF;
+			generation = 0;
+		}
+
+		Entity(uint32_t i, uint32_t g) {
+			index = i;
+			generation = g;
+		}
+
+		bool isNull() const {
+			return index == 0xFFFFFFFF;
+		}
+
+		bool operator==(const Entity& other) const {
+			return index == other.index && generation == other.generation;
+		}
+
+		bool operator!=(const Entity& other) const {
+			return !(*this == other);
+		}
+	};
+
+	// One bit per component type
+	typedef uint64_t ComponentMask;
+
+	class EntityWorld;
+	struct Archetype;
+
+	// Fixed size block of entities sharing an archetype. Every component
+	// has its own contiguous array in the block, so a system reading two
+	// components streams through two arrays and nothing else
+	struct Chunk {
+		Archetype* archetype;
+		unsigned char* data;
+		int count;
+
+		// Array of component T for the count entities, nullptr if the
+		// archetype doesn't have T
+		template<typename T> T* get();
+
+		Entity* getEntities();
+	};
+
+	// Entities with exactly the same set of components, packed into chunks.
+	// Every chunk but the last is full
+	struct Archetype {
+		ComponentMask mask;
+
+		// Component ids in the archetype, ascending
+		std::vector<int> components;
+
+		// Byte offset of each component's array in a chunk by id, -1 if absent
+		int offsets[sizeof(ComponentMask) * 8];
+		int entityOffset;
+
+		// Entities per chunk
+		int capacity;
+
+		std::vector<Chunk*> chunks;
+	};
+
+	// Archetypes a query visits: every component in all, none in none
+	struct EntityQuery {
+		ComponentMask all;
+		ComponentMask none;
+
+		EntityQuery(ComponentMask _all = 0, ComponentMask _none = 0) {
+			all = _all;
+			none = _none;
+		}
+
+		bool matches(ComponentMask mask) const {
+			return (mask & all) == all && (mask & none) == 0;
+		}
+	};
+
+	// Entities and their components stored by archetype. Components are
+	// plain data structs, any trivially copyable type can be one, and are
+	// given ids on first use
+	//
+	// Adding or removing components, creating and destroying entities are
+	// structural changes that move entities between chunks. They are not
+	// allowed while a query is running, record them in an
+	// EntityCommandBuffer and play it back afterwards instead
+	class EntityWorld {
+	public:
+		typedef std::function<void(Chunk&)> ChunkFunc;
+
+		// Bytes per chunk, a small multiple of the page size
+		static const int CHUNK_SIZE = 16 * 1024;
+
+		static const int MAX_COMPONENTS = sizeof(ComponentMask) * 8;
+
+		EntityWorld();
+		~EntityWorld();
+
+		// Id of component type T, the same for every world
+		template<typename T> static int componentId() {
+			static_assert(std::is_trivially_copyable<T>::value, "Components are moved between chunks with memcpy");
+			static const int id = registerComponent(sizeof(T), std::alignment_of<T>::value);
+			return id;
+		}
+
+		template<typename... T> static ComponentMask maskOf() {
+			ComponentMask bits[] = { 0, ((ComponentMask)1 << componentId<T>())... };
+			ComponentMask mask = 0;
+			for (ComponentMask bit : bits) {
+				mask |= bit;
+			}
+			return mask;
+		}
+
+		// New entity with the given components, zero filled
+		Entity create(ComponentMask mask);
+
+		// New entity with the components set to the values given
+		template<typename... T> Entity create(const T&... components) {
+			Entity e = create(maskOf<T...>());
+			int ids[] = { 0, setComponent(e, componentId<T>(), &components)... };
+			(void)ids;
+			return e;
+		}
+
+		void destroy(Entity e);
+
+		bool isAlive(Entity e) {
+			return e.index < records.size() && records[e.index].generation == e.generation && records[e.index].chunk != nullptr;
+		}
+
+		// Give the entity a component, or overwrite the one it has
+		template<typename T> void add(Entity e, const T& value) {
+			addComponent(e, componentId<T>(), &value);
+		}
+
+		template<typename T> void remove(Entity e) {
+			removeComponent(e, componentId<T>());
+		}
+
+		template<typename T> bool has(Entity e) {
+			return getComponent(e, componentId<T>()) != nullptr;
+		}
+
+		// The entity's component, nullptr if it doesn't have one. Only valid
+		// until the next structural change
+		template<typename T> T* get(Entity e) {
+			return (T*)getComponent(e, componentId<T>());
+		}
+
+		// Untyped versions of the above, for command buffer playback
+		void addComponent(Entity e, int component, const void* value);
+		void removeComponent(Entity e, int component);
+		void* getComponent(Entity e, int component);
+
+		// Returns the id so create can expand over its components
+		int setComponent(Entity e, int component, const void* value);
+
+		// Run func on every chunk the query matches
+		void forEachChunk(const EntityQuery& query, const ChunkFunc& func);
+
+		// The same split over the job system, a chunk per batch. func runs
+		// on several threads at once, each with different chunks
+		void parallelForEachChunk(const EntityQuery& query, JobSystem* jobs, const ChunkFunc& func);
+
+		// Run func(T&...) on every entity with all of T and none of without.
+		// The loop over a chunk is inlined into the caller
+		template<typename... T, typename F> void forEach(const F& func, ComponentMask without = 0) {
+			forEachChunk(EntityQuery(maskOf<T...>(), without), [&func](Chunk& chunk) {
+				eachRow(func, chunk.count, chunk.get<T>()...);
+			});
+		}
+
+		template<typename... T, typename F> void parallelForEach(JobSystem* jobs, const F& func, ComponentMask without = 0) {
+			parallelForEachChunk(EntityQuery(maskOf<T...>(), without), jobs, [&func](Chunk& chunk) {
+				eachRow(func, chunk.count, chunk.get<T>()...);
+			});
+		}
+
+		// Accessors
+		int getEntityCount() {
+			return numEntities;
+		}
+
+		int getArchetypeCount() {
+			return (int)archetypes.size();
+		}
+
+		int getChunkCount();
+
+		// Size in bytes of a component type, by id
+		static int getComponentSize(int component);
+
+		// Print the time to update a million transforms stored in chunks
+		// against the same data in individually allocated objects, and the
+		// cost of deferred structural changes, to the console
+		static void runBenchmark(int numEntities, JobSystem* jobs);
+
+	private:
+		// Where an entity lives, chunk is nullptr once destroyed
+		struct EntityRecord {
+			Chunk* chunk;
+			int row;
+			uint32_t generation;
+		};
+
+		static int registerComponent(int size, int align);
+
+		Archetype* findArchetype(ComponentMask mask);
+
+		// Append a zero filled row for e to the archetype
+		void allocateRow(Archetype* archetype, Entity e);
+
+		// Fill the hole left by a row with the archetype's last entity
+		void freeRow(Chunk* chunk, int row);
+
+		// Move an entity to the archetype for mask, keeping the shared components
+		void changeArchetype(Entity e, ComponentMask mask);
+
+		template<typename F, typename... P> static void eachRow(const F& func, int count, P*... arrays) {
+			for (int i = 0; i < count; i++) {
+				func(arrays[i]...);
+			}
+		}
+
+	private:
+		std::vector<Archetype*> archetypes;
+		std::unordered_map<ComponentMask, Archetype*> archetypeByMask;
+
+		std::vector<EntityRecord> records;
+		std::vector<uint32_t> freeIndices;
+		int numEntities;
+
+		// Queries in progress, structural changes are an error meanwhile
+		int iterating;
+	};
+
+	template<typename T> T* Chunk::get() {
+		int offset = archetype->offsets[EntityWorld::componentId<T>()];
+		return offset >= 0 ? (T*)(data + offset) : nullptr;
+	}
+
+	inline Entity* Chunk::getEntities() {
+		return (Entity*)(data + archetype->entityOffset);
+	}
+
+	// Structural changes recorded while queries run, possibly on several
+	// threads, and applied in order by playback afterwards. Commands on
+	// entities destroyed in the meantime are dropped
+	class EntityCommandBuffer {
+	public:
+		EntityCommandBuffer() {
+			numCommands = 0;
+		}
+
+		~EntityCommandBuffer() {}
+
+		// Create an entity with the given components at playback
+		template<typename... T> void create(const T&... components) {
+			std::lock_guard<std::mutex> lock(mutex);
+			record(CMD_CREATE, Entity(), EntityWorld::maskOf<T...>(), 0, nullptr);
+			int ids[] = { 0, record(CMD_SET_CREATED, Entity(), 0, EntityWorld::componentId<T>(), &components)... };
+			(void)ids;
+		}
+
+		void destroy(Entity e) {
+			std::lock_guard<std::mutex> lock(mutex);
+			record(CMD_DESTROY, e, 0, 0, nullptr);
+		}
+
+		template<typename T> void add(Entity e, const T& value) {
+			std::lock_guard<std::mutex> lock(mutex);
+			record(CMD_ADD, e, 0, EntityWorld::componentId<T>(), &value);
+		}
+
+		template<typename T> void remove(Entity e) {
+			std::lock_guard<std::mutex> lock(mutex);
+			record(CMD_REMOVE, e, 0, EntityWorld::componentId<T>(), nullptr);
+		}
+
+		// Apply and clear the commands. Not while a query runs on world
+		void playback(EntityWorld& world);
+
+		// Accessors
+		int getCommandCount() {
+			return numCommands;
+		}
+
+	private:
+		enum CommandType { CMD_CREATE, CMD_SET_CREATED, CMD_DESTROY, CMD_ADD, CMD_REMOVE };
+
+		// Fixed header followed by the component value, if any
+		struct Command {
+			CommandType type;
+			int component;
+			Entity entity;
+			ComponentMask mask;
+		};
+
+		// Caller holds the mutex. Returns the component id
+		int record(CommandType type, Entity e, ComponentMask mask, int component, const void* value);
+
+	private:
+		std::vector<unsigned char> commands;
+		int numCommands;
+		std::mutex mutex;
+	};
+}
@@ -0,0 +1,34 @@
+#include "FrameUniforms.h"
+#include "GLStateCache.h"
+#include "ShaderUtils.h"
+
+namespace GE {
+	void FrameUniforms::init() {
+		glGenBuffers(1, &ubo);
+
+		GLStateCache& gl = GLStateCache::get();
+		gl.bindBuffer(GL_UNIFORM_BUFFER, ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+
+		// Stays bound for the lifetime of the engine
+		gl.bindBufferBase(GL_UNIFORM_BUFFER, GE_FRAME_DATA_BINDING, ubo);
+	}
+
+	void FrameUniforms::update(Camera* cam, float seconds, float deltaSeconds) {
+		data.view = cam->getViewMatrix();
+		data.projection = cam->getProjectionMatrix();
+		data.viewProjection = cam->getViewProjectionMatrix();
+		data.cameraPos = glm::vec4(cam->getPos(), 1.0f);
+		data.time = glm::vec4(seconds, deltaSeconds, 0.0f, 0.0f);
+
+		// One upload per frame for every renderer
+		GLStateCache::get().bindBuffer(GL_UNIFORM_BUFFER, ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+	}
+
+	void FrameUniforms::destroy() {
+		glDeleteBuffers(1, &ubo);
+		GLStateCache::get().onBufferDeleted(ubo);
+		ubo = 0;
+	}
+}
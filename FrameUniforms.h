@@ -0,0 +1,53 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "Camera.h"
+
+namespace GE {
+	// Per frame values shared by every shader, std140 layout
+	// Must match GE_FRAME_DATA_GLSL in ShaderUtils.h
+	struct FrameData {
+		glm::mat4 view;
+		glm::mat4 projection;
+		glm::mat4 viewProjection;
+
+		// xyz is the camera position, w unused
+		glm::vec4 cameraPos;
+
+		// x is seconds since start, y seconds since the last frame
+		glm::vec4 time;
+	};
+
+	// Per draw values, std140 layout. Must match GE_OBJECT_DATA_GLSL
+	struct ObjectData {
+		glm::mat4 transform;
+	};
+
+	// Uniform buffer holding FrameData. Updated once per frame and bound
+	// to GE_FRAME_DATA_BINDING, so renderers no longer upload the camera
+	// matrices to each of their programs
+	class FrameUniforms {
+	public:
+		FrameUniforms() {
+			ubo = 0;
+		}
+
+		~FrameUniforms() {}
+
+		// Create the buffer and bind it to its binding point
+		void init();
+
+		// Fill the block from the camera and upload it
+		void update(Camera* cam, float seconds, float deltaSeconds);
+
+		void destroy();
+
+		const FrameData& getData() {
+			return data;
+		}
+
+	private:
+		GLuint ubo;
+		FrameData data;
+	};
+}
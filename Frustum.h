@@ -0,0 +1,110 @@
+#pragma once
+#include <glm/glm.hpp>
+
+namespace GE {
+	// Axis aligned bounding box in world space
+	struct AABB {
+		glm::vec3 min;
+		glm::vec3 max;
+
+		AABB() {
+			min = glm::vec3(0.0f);
+			max = glm::vec3(0.0f);
+		}
+
+		AABB(glm::vec3 _min, glm::vec3 _max) {
+			min = _min;
+			max = _max;
+		}
+
+		glm::vec3 getCentre() const {
+			return (min + max) * 0.5f;
+		}
+
+		glm::vec3 getExtents() const {
+			return (max - min) * 0.5f;
+		}
+
+		// Grow the box to contain the point
+		void expand(glm::vec3 p) {
+			min = glm::min(min, p);
+			max = glm::max(max, p);
+		}
+	};
+
+	// View frustum as six planes, normals pointing into the frustum
+	// Planes are stored as (nx, ny, nz, d) so a point p is inside when
+	// dot(n, p) + d >= 0 for every plane
+	class Frustum {
+	public:
+		enum Plane { LEFT = 0, RIGHT, BOTTOM, TOP, NEAR_PLANE, FAR_PLANE, NUM_PLANES };
+
+		Frustum() {
+			for (int i = 0; i < NUM_PLANES; i++) {
+				planes[i] = glm::vec4(0.0f);
+			}
+		}
+
+		// Build the frustum from a combined projection * view matrix
+		explicit Frustum(const glm::mat4& viewProjection) {
+			extract(viewProjection);
+		}
+
+		// Extract the planes from the rows of the view-projection matrix
+		// (Gribb/Hartmann). glm matrices are column major so m[col][row]
+		void extract(const glm::mat4& m) {
+			glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+			glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+			glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+			glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+			planes[LEFT] = row3 + row0;
+			planes[RIGHT] = row3 - row0;
+			planes[BOTTOM] = row3 + row1;
+			planes[TOP] = row3 - row1;
+			planes[NEAR_PLANE] = row3 + row2;
+			planes[FAR_PLANE] = row3 - row2;
+
+			// Normalise so plane distances are in world units
+			for (int i = 0; i < NUM_PLANES; i++) {
+				float len = glm::length(glm::vec3(planes[i]));
+				planes[i] /= len;
+			}
+		}
+
+		const glm::vec4& getPlane(int i) const {
+			return planes[i];
+		}
+
+		// True if any part of the sphere is inside the frustum
+		bool testSphere(glm::vec3 centre, float radius) const {
+			for (int i = 0; i < NUM_PLANES; i++) {
+				if (glm::dot(glm::vec3(planes[i]), centre) + planes[i].w < -radius) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// True if any part of the box is inside the frustum
+		bool testAABB(const AABB& box) const {
+			glm::vec3 centre = box.getCentre();
+			glm::vec3 extents = box.getExtents();
+
+			for (int i = 0; i < NUM_PLANES; i++) {
+				glm::vec3 n = glm::vec3(planes[i]);
+
+				// Projected radius of the box onto the plane normal
+				float r = glm::dot(extents, glm::abs(n));
+
+				if (glm::dot(n, centre) + planes[i].w < -r) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+	private:
+		glm::vec4 planes[NUM_PLANES];
+	};
+}
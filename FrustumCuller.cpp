@@ -0,0 +1,321 @@
+#include "FrustumCuller.h"
+#include "Random.h"
+#include "SimdConfig.h"
+#include "Timing.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <cfloat>
+#include <cstring>
+#include <iostream>
+
+namespace GE {
+	// Arrays are padded to the AVX2 width whichever path is compiled
+	const int CULL_BLOCK = 8;
+
+	// Objects per job system batch, large enough to amortise the scheduling
+	const int CULL_BATCH = 4096;
+
+	// Round up to a whole number of blocks
+	static int paddedSize(int count) {
+		return (count + CULL_BLOCK - 1) / CULL_BLOCK * CULL_BLOCK;
+	}
+
+	// Grow the array to hold count objects, new entries get the padding value
+	static void reserveBlocks(std::vector<float>& v, int count, float pad) {
+		int size = paddedSize(count);
+		if ((int)v.size() < size) {
+			v.resize(size, pad);
+		}
+	}
+
+	FrustumCuller::FrustumCuller() {
+		numSpheres = 0;
+		numBoxes = 0;
+	}
+
+	int FrustumCuller::addSphere(glm::vec3 centre, float radius) {
+		// A negative infinite radius is outside every plane
+		reserveBlocks(sphereX, numSpheres + 1, 0.0f);
+		reserveBlocks(sphereY, numSpheres + 1, 0.0f);
+		reserveBlocks(sphereZ, numSpheres + 1, 0.0f);
+		reserveBlocks(sphereR, numSpheres + 1, -FLT_MAX);
+
+		setSphere(numSpheres, centre, radius);
+		return numSpheres++;
+	}
+
+	int FrustumCuller::addBox(const AABB& box) {
+		// An inverted box is outside every plane
+		reserveBlocks(boxMinX, numBoxes + 1, FLT_MAX);
+		reserveBlocks(boxMinY, numBoxes + 1, FLT_MAX);
+		reserveBlocks(boxMinZ, numBoxes + 1, FLT_MAX);
+		reserveBlocks(boxMaxX, numBoxes + 1, -FLT_MAX);
+		reserveBlocks(boxMaxY, numBoxes + 1, -FLT_MAX);
+		reserveBlocks(boxMaxZ, numBoxes + 1, -FLT_MAX);
+
+		setBox(numBoxes, box);
+		return numBoxes++;
+	}
+
+	void FrustumCuller::setSphere(int index, glm::vec3 centre, float radius) {
+		sphereX[index] = centre.x;
+		sphereY[index] = centre.y;
+		sphereZ[index] = centre.z;
+		sphereR[index] = radius;
+	}
+
+	void FrustumCuller::setBox(int index, const AABB& box) {
+		boxMinX[index] = box.min.x;
+		boxMinY[index] = box.min.y;
+		boxMinZ[index] = box.min.z;
+		boxMaxX[index] = box.max.x;
+		boxMaxY[index] = box.max.y;
+		boxMaxZ[index] = box.max.z;
+	}
+
+	void FrustumCuller::clear() {
+		sphereX.clear();
+		sphereY.clear();
+		sphereZ.clear();
+		sphereR.clear();
+		numSpheres = 0;
+
+		boxMinX.clear();
+		boxMinY.clear();
+		boxMinZ.clear();
+		boxMaxX.clear();
+		boxMaxY.clear();
+		boxMaxZ.clear();
+		numBoxes = 0;
+	}
+
+	const char* FrustumCuller::getSIMDName() {
+#if defined(GE_SIMD_AVX2)
+		return "AVX2";
+#elif defined(GE_SIMD_SSE)
+		return "SSE";
+#else
+		return "scalar";
+#endif
+	}
+
+	int FrustumCuller::cullSphereRange(const Frustum& frustum, int begin, int end, int* out) {
+		int n = 0;
+
+		const float* xs = sphereX.data();
+		const float* ys = sphereY.data();
+		const float* zs = sphereZ.data();
+		const float* rs = sphereR.data();
+
+#if defined(GE_SIMD_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+
+		for (int i = begin; i < end; i += 8) {
+			__m256 x = _mm256_loadu_ps(xs + i);
+			__m256 y = _mm256_loadu_ps(ys + i);
+			__m256 z = _mm256_loadu_ps(zs + i);
+			__m256 negR = _mm256_sub_ps(zero, _mm256_loadu_ps(rs + i));
+
+			__m256 outside = zero;
+			for (int p = 0; p < Frustum::NUM_PLANES; p++) {
+				const glm::vec4& plane = frustum.getPlane(p);
+
+				__m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), x), _mm256_set1_ps(plane.w));
+				d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.y), y));
+				d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.z), z));
+
+				outside = _mm256_or_ps(outside, _mm256_cmp_ps(d, negR, _CMP_LT_OQ));
+			}
+
+			n = appendLanes(out, n, i, ~_mm256_movemask_ps(outside) & 0xFF, 8);
+		}
+#elif defined(GE_SIMD_SSE)
+		const __m128 zero = _mm_setzero_ps();
+
+		for (int i = begin; i < end; i += 4) {
+			__m128 x = _mm_loadu_ps(xs + i);
+			__m128 y = _mm_loadu_ps(ys + i);
+			__m128 z = _mm_loadu_ps(zs + i);
+			__m128 negR = _mm_sub_ps(zero, _mm_loadu_ps(rs + i));
+
+			__m128 outside = zero;
+			for (int p = 0; p < Frustum::NUM_PLANES; p++) {
+				const glm::vec4& plane = frustum.getPlane(p);
+
+				__m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x), _mm_set1_ps(plane.w));
+				d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.y), y));
+				d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.z), z));
+
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(d, negR));
+			}
+
+			n = appendLanes(out, n, i, ~_mm_movemask_ps(outside) & 0xF, 4);
+		}
+#else
+		for (int i = begin; i < end; i++) {
+			out[n] = i;
+			n += frustum.testSphere(glm::vec3(xs[i], ys[i], zs[i]), rs[i]) ? 1 : 0;
+		}
+#endif
+
+		return n;
+	}
+
+	int FrustumCuller::cullBoxRange(const Frustum& frustum, int begin, int end, int* out) {
+		int n = 0;
+
+		// For each plane only the corner furthest along the normal matters,
+		// its components come from min or max depending on the normal's signs
+		const float* px[Frustum::NUM_PLANES];
+		const float* py[Frustum::NUM_PLANES];
+		const float* pz[Frustum::NUM_PLANES];
+
+		for (int p = 0; p < Frustum::NUM_PLANES; p++) {
+			const glm::vec4& plane = frustum.getPlane(p);
+			px[p] = plane.x >= 0.0f ? boxMaxX.data() : boxMinX.data();
+			py[p] = plane.y >= 0.0f ? boxMaxY.data() : boxMinY.data();
+			pz[p] = plane.z >= 0.0f ? boxMaxZ.data() : boxMinZ.data();
+		}
+
+#if defined(GE_SIMD_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+
+		for (int i = begin; i < end; i += 8) {
+			__m256 outside = zero;
+			for (int p = 0; p < Frustum::NUM_PLANES; p++) {
+				const glm::vec4& plane = frustum.getPlane(p);
+
+				__m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), _mm256_loadu_ps(px[p] + i)), _mm256_set1_ps(plane.w));
+				d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.y), _mm256_loadu_ps(py[p] + i)));
+				d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(plane.z), _mm256_loadu_ps(pz[p] + i)));
+
+				outside = _mm256_or_ps(outside, _mm256_cmp_ps(d, zero, _CMP_LT_OQ));
+			}
+
+			n = appendLanes(out, n, i, ~_mm256_movemask_ps(outside) & 0xFF, 8);
+		}
+#elif defined(GE_SIMD_SSE)
+		const __m128 zero = _mm_setzero_ps();
+
+		for (int i = begin; i < end; i += 4) {
+			__m128 outside = zero;
+			for (int p = 0; p < Frustum::NUM_PLANES; p++) {
+				const glm::vec4& plane = frustum.getPlane(p);
+
+				__m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), _mm_loadu_ps(px[p] + i)), _mm_set1_ps(plane.w));
+				d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.y), _mm_loadu_ps(py[p] + i)));
+				d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(plane.z), _mm_loadu_ps(pz[p] + i)));
+
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+			}
+
+			n = appendLanes(out, n, i, ~_mm_movemask_ps(outside) & 0xF, 4);
+		}
+#else
+		for (int i = begin; i < end; i++) {
+			bool inside = true;
+			for (int p = 0; p < Frustum::NUM_PLANES && inside; p++) {
+				const glm::vec4& plane = frustum.getPlane(p);
+				inside = plane.x * px[p][i] + plane.y * py[p][i] + plane.z * pz[p][i] + plane.w >= 0.0f;
+			}
+
+			out[n] = i;
+			n += inside ? 1 : 0;
+		}
+#endif
+
+		return n;
+	}
+
+	void FrustumCuller::cullParallel(const Frustum& frustum, int count, bool boxes, std::vector<int>& visible, JobSystem* jobs) {
+		// Room for every object to be visible, trimmed afterwards
+		int padded = paddedSize(count);
+		visible.resize(padded);
+
+		// Small sets aren't worth waking the workers for
+		if (jobs == nullptr || padded <= CULL_BATCH * 2) {
+			int n = boxes ? cullBoxRange(frustum, 0, padded, visible.data()) : cullSphereRange(frustum, 0, padded, visible.data());
+			visible.resize(n);
+			return;
+		}
+
+		// Every batch writes its indices at its own start in the list, then
+		// the batches are packed together in order so the visible list is
+		// the same whichever thread ran which batch
+		int numBatches = (padded + CULL_BATCH - 1) / CULL_BATCH;
+		batchCounts.resize(numBatches);
+
+		jobs->parallelFor(padded, CULL_BATCH, [&](int begin, int end) {
+			int* out = visible.data() + begin;
+			batchCounts[begin / CULL_BATCH] = boxes ? cullBoxRange(frustum, begin, end, out) : cullSphereRange(frustum, begin, end, out);
+		});
+
+		int n = batchCounts[0];
+		for (int b = 1; b < numBatches; b++) {
+			std::memmove(visible.data() + n, visible.data() + b * CULL_BATCH, batchCounts[b] * sizeof(int));
+			n += batchCounts[b];
+		}
+		visible.resize(n);
+	}
+
+	void FrustumCuller::cullSpheres(Camera* cam, std::vector<int>& visible, JobSystem* jobs) {
+		cullSpheres(cam->getFrustum(), visible, jobs);
+	}
+
+	void FrustumCuller::cullSpheres(const Frustum& frustum, std::vector<int>& visible, JobSystem* jobs) {
+		cullParallel(frustum, numSpheres, false, visible, jobs);
+	}
+
+	void FrustumCuller::cullBoxes(Camera* cam, std::vector<int>& visible, JobSystem* jobs) {
+		cullBoxes(cam->getFrustum(), visible, jobs);
+	}
+
+	void FrustumCuller::cullBoxes(const Frustum& frustum, std::vector<int>& visible, JobSystem* jobs) {
+		cullParallel(frustum, numBoxes, true, visible, jobs);
+	}
+
+	void FrustumCuller::runBenchmark(int count, JobSystem* jobs) {
+		// Spheres spread through a cube around a camera looking down -z,
+		// roughly a quarter of them end up visible
+		FrustumCuller culler;
+		unsigned int seed = 1u;
+		for (int i = 0; i < count; i++) {
+			glm::vec3 c;
+			for (int k = 0; k < 3; k++) {
+				c[k] = (randomFloat(seed) - 0.5f) * 2000.0f;
+			}
+			culler.addSphere(c, 2.0f);
+		}
+
+		glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		glm::mat4 projection = glm::perspective(glm::radians(90.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+		Frustum frustum(projection * view);
+
+		std::vector<int> visible;
+		visible.reserve(count);
+
+		const int ITERATIONS = 20;
+
+		for (int pass = 0; pass < 2; pass++) {
+			JobSystem* passJobs = pass == 0 ? nullptr : jobs;
+			if (pass == 1 && jobs == nullptr) {
+				break;
+			}
+
+			// Warm up the caches and the visible list capacity
+			culler.cullSpheres(frustum, visible, passJobs);
+
+			Clock::time_point start = Clock::now();
+			for (int it = 0; it < ITERATIONS; it++) {
+				culler.cullSpheres(frustum, visible, passJobs);
+			}
+			float elapsed = elapsedMs(start);
+
+			double perNs = (double)count * ITERATIONS / (elapsed * 1e6);
+
+			std::cout << "FrustumCuller (" << getSIMDName() << ", "
+				<< (passJobs ? jobs->getNumThreads() : 1) << " threads): "
+				<< count << " spheres, " << visible.size() << " visible, "
+				<< perNs << " objects/ns" << std::endl;
+		}
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Camera.h"
+#include "Frustum.h"
+#include "JobSystem.h"
+
+namespace GE {
+	// Tests large numbers of bounding spheres and boxes against the camera
+	// frustum. Bounds are stored structure of arrays (all x, then all y...)
+	// so 8 objects are tested at once with AVX2, 4 with SSE, and the
+	// indices of the visible ones are written to a compact list
+	//
+	// Spheres and boxes are separate sets, each with its own indices
+	class FrustumCuller {
+	public:
+		FrustumCuller();
+		~FrustumCuller() {}
+
+		// Add bounds, returns the index reported in the visible list
+		int addSphere(glm::vec3 centre, float radius);
+		int addBox(const AABB& box);
+
+		// Move bounds that have already been added
+		void setSphere(int index, glm::vec3 centre, float radius);
+		void setBox(int index, const AABB& box);
+
+		// Remove every sphere and box
+		void clear();
+
+		// Indices of the spheres inside or touching the camera frustum.
+		// With a job system large sets are split across the workers
+		void cullSpheres(Camera* cam, std::vector<int>& visible, JobSystem* jobs = nullptr);
+		void cullSpheres(const Frustum& frustum, std::vector<int>& visible, JobSystem* jobs = nullptr);
+
+		// Same for the boxes
+		void cullBoxes(Camera* cam, std::vector<int>& visible, JobSystem* jobs = nullptr);
+		void cullBoxes(const Frustum& frustum, std::vector<int>& visible, JobSystem* jobs = nullptr);
+
+		// Accessors
+		int getNumSpheres() {
+			return numSpheres;
+		}
+
+		int getNumBoxes() {
+			return numBoxes;
+		}
+
+		// Name of the instruction set the tests were compiled for
+		static const char* getSIMDName();
+
+		// Time culling count random spheres and print the objects tested
+		// per nanosecond, single threaded and on the job system
+		static void runBenchmark(int count, JobSystem* jobs);
+
+	private:
+		// Test the spheres in [begin, end), a multiple of the block size,
+		// and write the visible indices to out. Returns how many were written
+		int cullSphereRange(const Frustum& frustum, int begin, int end, int* out);
+		int cullBoxRange(const Frustum& frustum, int begin, int end, int* out);
+
+		// Split the range over the workers and join the visible lists in order
+		void cullParallel(const Frustum& frustum, int count, bool boxes, std::vector<int>& visible, JobSystem* jobs);
+
+	private:
+		// Sphere centres and radii, padded to a whole number of SIMD blocks
+		// with spheres that are always outside
+		std::vector<float> sphereX, sphereY, sphereZ, sphereR;
+		int numSpheres;
+
+		// Box corners, padded the same way
+		std::vector<float> boxMinX, boxMinY, boxMinZ;
+		std::vector<float> boxMaxX, boxMaxY, boxMaxZ;
+		int numBoxes;
+
+		// Visible count of each batch in the parallel path
+		std::vector<int> batchCounts;
+	};
+}
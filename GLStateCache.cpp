@@ -0,0 +1,350 @@
+#include "GLStateCache.h"
+#include <cstring>
+
+namespace GE {
+	GLStateCache& GLStateCache::get() {
+		static GLStateCache cache;
+		return cache;
+	}
+
+	GLStateCache::GLStateCache() {
+		resetCounters();
+		invalidate();
+	}
+
+	void GLStateCache::reset() {
+		// Defaults from the OpenGL specification
+		program = 0;
+		vertexArray = 0;
+
+		for (int i = 0; i < NUM_BUFFER_SLOTS; i++) {
+			buffers[i] = 0;
+		}
+
+		activeUnit = 0;
+		for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			for (int t = 0; t < NUM_TEXTURE_SLOTS; t++) {
+				textures[unit][t] = 0;
+			}
+		}
+
+		// Everything starts disabled
+		enabledKnown = 0xFFFFFFFFu;
+		enabledBits = 0;
+
+		blendSrc = blendSrcAlpha = GL_ONE;
+		blendDst = blendDstAlpha = GL_ZERO;
+		depthFuncValue = GL_LESS;
+		depthWrite = GL_TRUE;
+		colorWrite = GL_TRUE;
+		cullMode = GL_BACK;
+		offsetFactor = offsetUnits = 0.0f;
+		offsetKnown = true;
+
+		uniforms.clear();
+	}
+
+	void GLStateCache::invalidate() {
+		program = UNKNOWN;
+		vertexArray = UNKNOWN;
+
+		for (int i = 0; i < NUM_BUFFER_SLOTS; i++) {
+			buffers[i] = UNKNOWN;
+		}
+
+		activeUnit = UNKNOWN;
+		for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			for (int t = 0; t < NUM_TEXTURE_SLOTS; t++) {
+				textures[unit][t] = UNKNOWN;
+			}
+		}
+
+		enabledKnown = 0;
+		enabledBits = 0;
+
+		blendSrc = blendDst = blendSrcAlpha = blendDstAlpha = UNKNOWN;
+		depthFuncValue = UNKNOWN;
+		depthWrite = UNKNOWN;
+		colorWrite = UNKNOWN;
+		cullMode = UNKNOWN;
+		offsetKnown = false;
+
+		uniforms.clear();
+	}
+
+	int GLStateCache::bufferSlot(GLenum target) {
+		switch (target) {
+		case GL_ARRAY_BUFFER: return BUFFER_ARRAY;
+		case GL_ELEMENT_ARRAY_BUFFER: return BUFFER_ELEMENT_ARRAY;
+		case GL_COPY_READ_BUFFER: return BUFFER_COPY_READ;
+		case GL_COPY_WRITE_BUFFER: return BUFFER_COPY_WRITE;
+		case GL_UNIFORM_BUFFER: return BUFFER_UNIFORM;
+		case GL_TEXTURE_BUFFER: return BUFFER_TEXTURE;
+		case GL_PIXEL_UNPACK_BUFFER: return BUFFER_PIXEL_UNPACK;
+		case GL_DRAW_INDIRECT_BUFFER: return BUFFER_DRAW_INDIRECT;
+		case GL_SHADER_STORAGE_BUFFER: return BUFFER_SHADER_STORAGE;
+		case GL_TRANSFORM_FEEDBACK_BUFFER: return BUFFER_TRANSFORM_FEEDBACK;
+		default: return -1;
+		}
+	}
+
+	int GLStateCache::textureSlot(GLenum target) {
+		switch (target) {
+		case GL_TEXTURE_2D: return TEXTURE_2D;
+		case GL_TEXTURE_CUBE_MAP: return TEXTURE_CUBE_MAP;
+		case GL_TEXTURE_2D_ARRAY: return TEXTURE_2D_ARRAY;
+		case GL_TEXTURE_BUFFER: return TEXTURE_BUFFER;
+		default: return -1;
+		}
+	}
+
+	int GLStateCache::capBit(GLenum cap) {
+		switch (cap) {
+		case GL_DEPTH_TEST: return 1 << 0;
+		case GL_CULL_FACE: return 1 << 1;
+		case GL_BLEND: return 1 << 2;
+		case GL_SCISSOR_TEST: return 1 << 3;
+		case GL_POLYGON_OFFSET_FILL: return 1 << 4;
+		case GL_RASTERIZER_DISCARD: return 1 << 5;
+		case GL_PROGRAM_POINT_SIZE: return 1 << 6;
+		case GL_STENCIL_TEST: return 1 << 7;
+		default: return 0;
+		}
+	}
+
+	void GLStateCache::useProgram(GLuint programId) {
+		if (issue(program != programId)) {
+			glUseProgram(programId);
+			program = programId;
+		}
+	}
+
+	void GLStateCache::bindBuffer(GLenum target, GLuint buffer) {
+		int slot = bufferSlot(target);
+
+		// Untracked target, always pass through
+		if (slot < 0) {
+			issue(true);
+			glBindBuffer(target, buffer);
+			return;
+		}
+
+		if (issue(buffers[slot] != buffer)) {
+			glBindBuffer(target, buffer);
+			buffers[slot] = buffer;
+		}
+	}
+
+	void GLStateCache::bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+		// Indexed bindings also change the generic binding point
+		issue(true);
+		glBindBufferBase(target, index, buffer);
+
+		int slot = bufferSlot(target);
+		if (slot >= 0) {
+			buffers[slot] = buffer;
+		}
+	}
+
+	void GLStateCache::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+		issue(true);
+		glBindBufferRange(target, index, buffer, offset, size);
+
+		int slot = bufferSlot(target);
+		if (slot >= 0) {
+			buffers[slot] = buffer;
+		}
+	}
+
+	void GLStateCache::bindVertexArray(GLuint vao) {
+		if (issue(vertexArray != vao)) {
+			glBindVertexArray(vao);
+			vertexArray = vao;
+
+			// Element buffer binding is part of the VAO
+			buffers[BUFFER_ELEMENT_ARRAY] = UNKNOWN;
+		}
+	}
+
+	void GLStateCache::bindTexture(GLuint unit, GLenum target, GLuint texture) {
+		int slot = textureSlot(target);
+
+		if (slot < 0 || unit >= MAX_TEXTURE_UNITS) {
+			issue(true);
+			glActiveTexture(GL_TEXTURE0 + unit);
+			glBindTexture(target, texture);
+			activeUnit = unit;
+			return;
+		}
+
+		if (!issue(textures[unit][slot] != texture)) {
+			return;
+		}
+
+		if (activeUnit != unit) {
+			glActiveTexture(GL_TEXTURE0 + unit);
+			activeUnit = unit;
+		}
+
+		glBindTexture(target, texture);
+		textures[unit][slot] = texture;
+	}
+
+	void GLStateCache::setEnabled(GLenum cap, bool enabled) {
+		unsigned int bit = capBit(cap);
+
+		bool changed = bit == 0 || (enabledKnown & bit) == 0 || ((enabledBits & bit) != 0) != enabled;
+
+		if (!issue(changed)) {
+			return;
+		}
+
+		if (enabled) {
+			glEnable(cap);
+			enabledBits |= bit;
+		}
+		else {
+			glDisable(cap);
+			enabledBits &= ~bit;
+		}
+		enabledKnown |= bit;
+	}
+
+	void GLStateCache::blendFunc(GLenum src, GLenum dst) {
+		if (issue(blendSrc != src || blendDst != dst || blendSrcAlpha != src || blendDstAlpha != dst)) {
+			glBlendFunc(src, dst);
+			blendSrc = blendSrcAlpha = src;
+			blendDst = blendDstAlpha = dst;
+		}
+	}
+
+	void GLStateCache::blendFuncSeparate(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha) {
+		if (issue(blendSrc != srcRGB || blendDst != dstRGB || blendSrcAlpha != srcAlpha || blendDstAlpha != dstAlpha)) {
+			glBlendFuncSeparate(srcRGB, dstRGB, srcAlpha, dstAlpha);
+			blendSrc = srcRGB;
+			blendDst = dstRGB;
+			blendSrcAlpha = srcAlpha;
+			blendDstAlpha = dstAlpha;
+		}
+	}
+
+	void GLStateCache::depthFunc(GLenum func) {
+		if (issue(depthFuncValue != func)) {
+			glDepthFunc(func);
+			depthFuncValue = func;
+		}
+	}
+
+	void GLStateCache::depthMask(GLboolean write) {
+		if (issue(depthWrite != (GLuint)write)) {
+			glDepthMask(write);
+			depthWrite = write;
+		}
+	}
+
+	void GLStateCache::colorMask(GLboolean write) {
+		if (issue(colorWrite != (GLuint)write)) {
+			glColorMask(write, write, write, write);
+			colorWrite = write;
+		}
+	}
+
+	void GLStateCache::cullFace(GLenum mode) {
+		if (issue(cullMode != mode)) {
+			glCullFace(mode);
+			cullMode = mode;
+		}
+	}
+
+	void GLStateCache::polygonOffset(GLfloat factor, GLfloat units) {
+		if (issue(!offsetKnown || offsetFactor != factor || offsetUnits != units)) {
+			glPolygonOffset(factor, units);
+			offsetFactor = factor;
+			offsetUnits = units;
+			offsetKnown = true;
+		}
+	}
+
+	bool GLStateCache::uniformChanged(GLint location, const void* value, size_t size) {
+		// Unused uniforms have location -1, nothing to send
+		if (location < 0 || program == UNKNOWN) {
+			return location >= 0;
+		}
+
+		unsigned long long key = ((unsigned long long)program << 32) | (unsigned int)location;
+		std::unordered_map<unsigned long long, UniformValue>::iterator it = uniforms.find(key);
+
+		if (it != uniforms.end() && std::memcmp(it->second.data, value, size) == 0) {
+			return false;
+		}
+
+		UniformValue& stored = uniforms[key];
+		std::memcpy(stored.data, value, size);
+		return true;
+	}
+
+	void GLStateCache::uniform1i(GLint location, GLint value) {
+		if (issue(uniformChanged(location, &value, sizeof(value)))) {
+			glUniform1i(location, value);
+		}
+	}
+
+	void GLStateCache::uniform1f(GLint location, GLfloat value) {
+		if (issue(uniformChanged(location, &value, sizeof(value)))) {
+			glUniform1f(location, value);
+		}
+	}
+
+	void GLStateCache::uniform4fv(GLint location, const GLfloat* value) {
+		if (issue(uniformChanged(location, value, 4 * sizeof(GLfloat)))) {
+			glUniform4fv(location, 1, value);
+		}
+	}
+
+	void GLStateCache::uniformMatrix4fv(GLint location, const GLfloat* value) {
+		if (issue(uniformChanged(location, value, 16 * sizeof(GLfloat)))) {
+			glUniformMatrix4fv(location, 1, GL_FALSE, value);
+		}
+	}
+
+	void GLStateCache::onProgramDeleted(GLuint programId) {
+		if (program == programId) {
+			program = UNKNOWN;
+		}
+
+		// Drop the remembered uniforms of the program
+		for (std::unordered_map<unsigned long long, UniformValue>::iterator it = uniforms.begin(); it != uniforms.end();) {
+			if ((GLuint)(it->first >> 32) == programId) {
+				it = uniforms.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	void GLStateCache::onBufferDeleted(GLuint buffer) {
+		// GL unbinds a deleted buffer from the current context
+		for (int i = 0; i < NUM_BUFFER_SLOTS; i++) {
+			if (buffers[i] == buffer) {
+				buffers[i] = 0;
+			}
+		}
+	}
+
+	void GLStateCache::onTextureDeleted(GLuint texture) {
+		for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			for (int t = 0; t < NUM_TEXTURE_SLOTS; t++) {
+				if (textures[unit][t] == texture) {
+					textures[unit][t] = 0;
+				}
+			}
+		}
+	}
+
+	void GLStateCache::onVertexArrayDeleted(GLuint vao) {
+		if (vertexArray == vao) {
+			vertexArray = 0;
+		}
+	}
+}
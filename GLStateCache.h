@@ -0,0 +1,172 @@
+#pragma once
+#include <GL/glew.h>
+#include <unordered_map>
+
+namespace GE {
+	// Shadow copy of the OpenGL state the engine changes. Every call is
+	// compared against the shadow and only reaches the driver when the
+	// value actually changes. State is never read back with glGet* or
+	// glIsEnabled, which can stall the pipeline waiting on the driver
+	//
+	// All engine code that binds objects or toggles state should go through
+	// the cache so the shadow stays correct. Code that talks to GL directly
+	// must call invalidate() afterwards
+	class GLStateCache {
+	public:
+		// Maximum texture units tracked
+		static const int MAX_TEXTURE_UNITS = 16;
+
+		// Counters since the last resetCounters()
+		struct Counters {
+			int issued;
+			int elided;
+		};
+
+		// One cache per GL context, the engine only has one
+		static GLStateCache& get();
+
+		GLStateCache();
+
+		// Set the shadow to the defaults of a freshly created context
+		void reset();
+
+		// Forget everything, the next call of each kind always reaches GL
+		void invalidate();
+
+		// Programs and buffers
+		void useProgram(GLuint programId);
+		void bindBuffer(GLenum target, GLuint buffer);
+		void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+		void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+		void bindVertexArray(GLuint vao);
+
+		// Textures, bound to the given unit
+		void bindTexture(GLuint unit, GLenum target, GLuint texture);
+
+		// Enable bits
+		void setEnabled(GLenum cap, bool enabled);
+
+		void enable(GLenum cap) {
+			setEnabled(cap, true);
+		}
+
+		void disable(GLenum cap) {
+			setEnabled(cap, false);
+		}
+
+		// Fixed function state
+		void blendFunc(GLenum src, GLenum dst);
+		void blendFuncSeparate(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha);
+		void depthFunc(GLenum func);
+		void depthMask(GLboolean write);
+
+		// Same write mask for every colour channel
+		void colorMask(GLboolean write);
+		void cullFace(GLenum mode);
+		void polygonOffset(GLfloat factor, GLfloat units);
+
+		// Uniforms of the current program, values are remembered per program
+		// and location so re-uploading an unchanged value is skipped
+		void uniform1i(GLint location, GLint value);
+		void uniform1f(GLint location, GLfloat value);
+		void uniform4fv(GLint location, const GLfloat* value);
+		void uniformMatrix4fv(GLint location, const GLfloat* value);
+
+		// Call when GL objects are deleted so a recycled name isn't mistaken
+		// for the old, still bound, object
+		void onProgramDeleted(GLuint programId);
+		void onBufferDeleted(GLuint buffer);
+		void onTextureDeleted(GLuint texture);
+		void onVertexArrayDeleted(GLuint vao);
+
+		// Accessors, return the shadow value without asking GL
+		GLuint getProgram() {
+			return program;
+		}
+
+		const Counters& getCounters() {
+			return counters;
+		}
+
+		void resetCounters() {
+			counters.issued = 0;
+			counters.elided = 0;
+		}
+
+	private:
+		// Buffer targets that have their own binding
+		enum BufferSlot {
+			BUFFER_ARRAY = 0,
+			BUFFER_ELEMENT_ARRAY,
+			BUFFER_COPY_READ,
+			BUFFER_COPY_WRITE,
+			BUFFER_UNIFORM,
+			BUFFER_TEXTURE,
+			BUFFER_PIXEL_UNPACK,
+			BUFFER_DRAW_INDIRECT,
+			BUFFER_SHADER_STORAGE,
+			BUFFER_TRANSFORM_FEEDBACK,
+			NUM_BUFFER_SLOTS
+		};
+
+		// Texture targets tracked on each unit
+		enum TextureSlot {
+			TEXTURE_2D = 0,
+			TEXTURE_CUBE_MAP,
+			TEXTURE_2D_ARRAY,
+			TEXTURE_BUFFER,
+			NUM_TEXTURE_SLOTS
+		};
+
+		// A uniform value large enough for a 4x4 matrix
+		struct UniformValue {
+			GLfloat data[16];
+		};
+
+		static int bufferSlot(GLenum target);
+		static int textureSlot(GLenum target);
+		static int capBit(GLenum cap);
+
+		// Compare and store a uniform, true if it changed
+		bool uniformChanged(GLint location, const void* value, size_t size);
+
+		// Count a call that was sent to GL or skipped
+		bool issue(bool changed) {
+			if (changed) {
+				counters.issued++;
+			}
+			else {
+				counters.elided++;
+			}
+			return changed;
+		}
+
+	private:
+		// Value used for state that isn't known
+		static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+		GLuint program;
+		GLuint vertexArray;
+		GLuint buffers[NUM_BUFFER_SLOTS];
+		GLuint activeUnit;
+		GLuint textures[MAX_TEXTURE_UNITS][NUM_TEXTURE_SLOTS];
+
+		// Known enable bits and their values
+		unsigned int enabledKnown;
+		unsigned int enabledBits;
+
+		GLenum blendSrc, blendDst;
+		GLenum blendSrcAlpha, blendDstAlpha;
+		GLenum depthFuncValue;
+		GLuint depthWrite;
+		GLuint colorWrite;
+		GLenum cullMode;
+		GLfloat offsetFactor, offsetUnits;
+		bool offsetKnown;
+
+		// Uniform values keyed by program and location
+		std::unordered_map<unsigned long long, UniformValue> uniforms;
+
+		Counters counters;
+	};
+}
@@ -0,0 +1,463 @@
+#include "GPUParticleSystem.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include "ShaderUtils.h"
+#include "FrameUniforms.h"
+#include "Timing.h"
+#include <algorithm>
+#include <iostream>
+
+namespace GE {
+	static bool hasTimerQueries() {
+		return GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+	}
+
+	GPUParticleSystem::GPUParticleSystem() {
+		updateProgramId = 0;
+		updatePositionAgeLocation = updateVelocityLifeLocation = -1;
+		drawPositionAgeLocation = drawVelocityLifeLocation = -1;
+		drawPrograms[0].programId = drawPrograms[1].programId = 0;
+		drawPrograms[0].pipeline = drawPrograms[1].pipeline = nullptr;
+		frame = 0;
+		nextTimer = 0;
+		updateMs = gpuUpdateMs = 0.0f;
+
+		for (int i = 0; i < NUM_TIMER_QUERIES; i++) {
+			timerQueries[i] = 0;
+			timerPending[i] = false;
+		}
+	}
+
+	void GPUParticleSystem::init() {
+		// The draw reads each slot as an instance, which needs glVertexAttribDivisor
+		if (!GLEW_VERSION_3_3 && !GLEW_ARB_instanced_arrays) {
+			std::cerr << "GPUParticleSystem needs GL 3.3 or ARB_instanced_arrays, GPU particles disabled" << std::endl;
+			return;
+		}
+
+		// One vertex per slot, the outputs are captured into the other buffer
+		const GLchar* U_ShaderCode[] = {
+			"#version 140\n"
+			"layout(std140) uniform ParticleSpawn {\n"
+			"vec4 positionStep;\n"
+			"vec4 velocitySpread;\n"
+			"vec4 gravity;\n"
+			"vec4 life;\n"
+			"ivec4 spawn;\n"
+			"};\n"
+			"in vec4 positionAge;\n"
+			"in vec4 velocityLife;\n"
+			"out vec4 outPositionAge;\n"
+			"out vec4 outVelocityLife;\n"
+			"uint hash(uint x) {\n"
+			"x ^= x >> 16; x *= 0x7feb352du;\n"
+			"x ^= x >> 15; x *= 0x846ca68bu;\n"
+			"return x ^ (x >> 16);\n"
+			"}\n"
+			"float random(inout uint seed) {\n"
+			"seed = hash(seed);\n"
+			"return float(seed >> 8) / 16777216.0;\n"
+			"}\n"
+			"void main() {\n"
+			"float dt = positionStep.w;\n"
+			"int ring = gl_VertexID - spawn.x;\n"
+			"if (ring < 0) ring += spawn.z;\n"
+			"if (ring < spawn.y) {\n"
+			"	uint seed = uint(gl_VertexID) ^ hash(uint(spawn.w));\n"
+			"	vec3 offset = vec3(random(seed), random(seed), random(seed)) * 2.0 - 1.0;\n"
+			"	outPositionAge = vec4(positionStep.xyz, 0.0);\n"
+			"	outVelocityLife = vec4(velocitySpread.xyz + offset * velocitySpread.w, mix(life.x, life.y, random(seed)));\n"
+			"}\n"
+			"else {\n"
+			"	vec3 velocity = velocityLife.xyz + gravity.xyz * dt;\n"
+			"	outPositionAge = vec4(positionAge.xyz + velocity * dt, positionAge.w + dt);\n"
+			"	outVelocityLife = vec4(velocity, velocityLife.w);\n"
+			"}\n"
+			"}\n" };
+
+		const GLchar* varyings[] = { "outPositionAge", "outVelocityLife" };
+
+		if (!compileTransformFeedbackProgram(U_ShaderCode, varyings, 2, &updateProgramId)) {
+			std::cerr << "Failed to create GPUParticleSystem update program. Check console for errors" << std::endl;
+			return;
+		}
+
+		// Same camera facing quads as ParticleSystem, size and colour come
+		// from the age. Dead slots collapse to a point and draw nothing
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			"in vec4 positionAge;\n"
+			"in vec4 velocityLife;\n"
+			"uniform float startSize;\n"
+			"uniform float endSize;\n"
+			"uniform vec4 startColour;\n"
+			"uniform vec4 endColour;\n"
+			"out vec2 uv;\n"
+			"out vec4 colour;\n"
+			"const vec2 corners[6] = vec2[6](vec2(-0.5, -0.5), vec2(0.5, -0.5), vec2(0.5, 0.5),\n"
+			"	vec2(-0.5, -0.5), vec2(0.5, 0.5), vec2(-0.5, 0.5));\n"
+			"void main() {\n"
+			"vec2 corner = corners[gl_VertexID];\n"
+			"float t = positionAge.w / velocityLife.w;\n"
+			"if (!(t < 1.0)) {\n"
+			"	gl_Position = vec4(2.0, 2.0, 2.0, 1.0);\n"
+			"	uv = vec2(0.0);\n"
+			"	colour = vec4(0.0);\n"
+			"	return;\n"
+			"}\n"
+			"vec3 right = vec3(view[0][0], view[1][0], view[2][0]);\n"
+			"vec3 up = vec3(view[0][1], view[1][1], view[2][1]);\n"
+			"float size = mix(startSize, endSize, t);\n"
+			"vec3 p = positionAge.xyz + (right * corner.x + up * corner.y) * size;\n"
+			"gl_Position = viewProjection * vec4(p, 1);\n"
+			"uv = corner + 0.5;\n"
+			"colour = mix(startColour, endColour, t);\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			GE_TRANSPARENT_OUTPUT_GLSL
+			"in vec2 uv;\n"
+			"in vec4 colour;\n"
+			"uniform sampler2D sampler;\n"
+			"uniform int useTexture;\n"
+			"void main()\n"
+			"{\n"
+			"if (useTexture != 0) {\n"
+			"	writeTransparent(texture(sampler, uv) * colour);\n"
+			"}\n"
+			"else {\n"
+			"	float d = length(uv - 0.5) * 2.0;\n"
+			"	writeTransparent(vec4(colour.rgb, colour.a * clamp(1.0 - d * d, 0.0, 1.0)));\n"
+			"}\n"
+			"}\n" };
+
+		const char* attributes[] = { "positionAge", "velocityLife" };
+		const char* defines[2] = { "", "GE_WEIGHTED_OIT" };
+
+		// Built in the background, packets are skipped until they're ready
+		for (int i = 0; i < 2; i++) {
+			DrawProgram& program = drawPrograms[i];
+			program.samplerId = program.useTextureLocation = -1;
+			program.startSizeLocation = program.endSizeLocation = -1;
+			program.startColourLocation = program.endColourLocation = -1;
+			program.programId = ShaderLibrary::get().requestProgramFromSource(V_ShaderCode[0], F_ShaderCode[0], defines[i], attributes, 2,
+				[&program](GLuint programId) {
+					program.samplerId = glGetUniformLocation(programId, "sampler");
+					program.useTextureLocation = glGetUniformLocation(programId, "useTexture");
+					program.startSizeLocation = glGetUniformLocation(programId, "startSize");
+					program.endSizeLocation = glGetUniformLocation(programId, "endSize");
+					program.startColourLocation = glGetUniformLocation(programId, "startColour");
+					program.endColourLocation = glGetUniformLocation(programId, "endColour");
+				});
+
+			if (program.programId == 0) {
+				std::cerr << "Failed to create GPUParticleSystem draw program. Check console for errors" << std::endl;
+				drawPrograms[0].programId = 0;
+				return;
+			}
+		}
+
+		updatePositionAgeLocation = glGetAttribLocation(updateProgramId, "positionAge");
+		updateVelocityLifeLocation = glGetAttribLocation(updateProgramId, "velocityLife");
+
+		// Bound in the order of attributes
+		drawPositionAgeLocation = 0;
+		drawVelocityLifeLocation = 1;
+
+		// Blended like the CPU particles. Each emitter draws from its own
+		// ping-pong vertex arrays, so those come with the packets
+		for (int i = 0; i < 2; i++) {
+			PipelineDesc desc;
+			desc.programId = drawPrograms[i].programId;
+			desc.depthWrite = false;
+			if (i == 0) {
+				desc.setBlend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			}
+			else {
+				WeightedBlendedOIT::setAccumulateBlend(desc);
+			}
+			drawPrograms[i].pipeline = PipelineCache::get().create(desc);
+		}
+
+		if (updatePositionAgeLocation == -1 || updateVelocityLifeLocation == -1) {
+			std::cerr << "Problem getting GPUParticleSystem attributes" << std::endl;
+		}
+
+		spawnRing.init(GE_PARTICLE_SPAWN_BINDING, 4 * 1024);
+
+		if (hasTimerQueries()) {
+			glGenQueries(NUM_TIMER_QUERIES, timerQueries);
+		}
+	}
+
+	int GPUParticleSystem::addEmitter(const ParticleEmitterDesc& desc, Texture* texture) {
+		emitters.push_back(Emitter());
+		Emitter& e = emitters.back();
+		e.desc = desc;
+		e.texture = texture;
+		e.current = 0;
+		e.spawnCursor = 0;
+		e.spawnAccumulator = 0.0f;
+
+		// Every slot starts dead, age and life both 0
+		std::vector<Particle> slots(desc.maxParticles, Particle{ glm::vec4(0.0f), glm::vec4(0.0f) });
+
+		glGenBuffers(2, e.buffers);
+		for (int i = 0; i < 2; i++) {
+			GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, e.buffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, slots.size() * sizeof(Particle), slots.data(), GL_DYNAMIC_COPY);
+
+			e.updateArrays[i].addAttrib(e.buffers[i], updatePositionAgeLocation, 4, GL_FLOAT, sizeof(Particle), offsetof(Particle, positionAge));
+			e.updateArrays[i].addAttrib(e.buffers[i], updateVelocityLifeLocation, 4, GL_FLOAT, sizeof(Particle), offsetof(Particle, velocityLife));
+			e.updateArrays[i].build();
+
+			e.drawArrays[i].addAttrib(e.buffers[i], drawPositionAgeLocation, 4, GL_FLOAT, sizeof(Particle), offsetof(Particle, positionAge), 1);
+			e.drawArrays[i].addAttrib(e.buffers[i], drawVelocityLifeLocation, 4, GL_FLOAT, sizeof(Particle), offsetof(Particle, velocityLife), 1);
+			e.drawArrays[i].build();
+		}
+
+		return (int)emitters.size() - 1;
+	}
+
+	void GPUParticleSystem::setEmitterPosition(int emitter, glm::vec3 position) {
+		emitters[emitter].desc.position = position;
+	}
+
+	int GPUParticleSystem::getCapacity() {
+		int n = 0;
+		for (const Emitter& e : emitters) {
+			n += e.desc.maxParticles;
+		}
+		return n;
+	}
+
+	void GPUParticleSystem::collectTimerResults() {
+		// The oldest query is the next one to be reused
+		for (int k = 0; k < NUM_TIMER_QUERIES; k++) {
+			int i = (nextTimer + k) % NUM_TIMER_QUERIES;
+			if (!timerPending[i]) {
+				continue;
+			}
+
+			GLuint available = 0;
+			glGetQueryObjectuiv(timerQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				return;
+			}
+
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(timerQueries[i], GL_QUERY_RESULT, &ns);
+			gpuUpdateMs = ns / 1000000.0f;
+			timerPending[i] = false;
+		}
+	}
+
+	void GPUParticleSystem::update(float deltaSeconds) {
+		if (updateProgramId == 0 || emitters.empty()) {
+			return;
+		}
+
+		Clock::time_point start = Clock::now();
+		frame++;
+
+		// Every emitter's spawn block for this step in one upload
+		spawnRing.reset();
+
+		std::vector<GLintptr> offsets(emitters.size());
+		for (int i = 0; i < (int)emitters.size(); i++) {
+			Emitter& e = emitters[i];
+			const ParticleEmitterDesc& d = e.desc;
+
+			e.spawnAccumulator += d.spawnRate * deltaSeconds;
+			int n = std::min((int)e.spawnAccumulator, d.maxParticles);
+			e.spawnAccumulator -= (int)e.spawnAccumulator;
+
+			ParticleSpawnData data;
+			data.positionStep = glm::vec4(d.position, deltaSeconds);
+			data.velocitySpread = glm::vec4(d.velocity, d.velocitySpread);
+			data.gravity = glm::vec4(d.gravity, 0.0f);
+			data.life = glm::vec4(d.minLife, d.maxLife, 0.0f, 0.0f);
+			data.spawn = glm::ivec4(e.spawnCursor, n, d.maxParticles, (int)(frame * 7919u + i));
+
+			offsets[i] = spawnRing.allocate(&data, sizeof(data));
+			e.spawnCursor = (e.spawnCursor + n) % d.maxParticles;
+		}
+
+		spawnRing.upload();
+
+		collectTimerResults();
+
+		bool timing = timerQueries[nextTimer] != 0 && !timerPending[nextTimer];
+		if (timing) {
+			glBeginQuery(GL_TIME_ELAPSED, timerQueries[nextTimer]);
+		}
+
+		GLStateCache& gl = GLStateCache::get();
+		gl.useProgram(updateProgramId);
+
+		// Nothing is drawn, the vertex outputs are all that's wanted
+		gl.enable(GL_RASTERIZER_DISCARD);
+
+		for (int i = 0; i < (int)emitters.size(); i++) {
+			Emitter& e = emitters[i];
+			int next = 1 - e.current;
+
+			spawnRing.bindRange(offsets[i], sizeof(ParticleSpawnData));
+			gl.bindVertexArray(e.updateArrays[e.current].getName());
+			gl.bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, e.buffers[next]);
+
+			glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, e.desc.maxParticles);
+			glEndTransformFeedback();
+
+			e.current = next;
+		}
+
+		gl.disable(GL_RASTERIZER_DISCARD);
+
+		// Leave no buffer bound for capture, the next draw reads it as vertices
+		gl.bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+
+		if (timing) {
+			glEndQuery(GL_TIME_ELAPSED);
+			timerPending[nextTimer] = true;
+			nextTimer = (nextTimer + 1) % NUM_TIMER_QUERIES;
+		}
+
+		spawnRing.endFrame();
+
+		updateMs = elapsedMs(start);
+	}
+
+	void GPUParticleSystem::submit(RenderQueue* queue, Camera* cam) {
+		if (drawPrograms[0].programId == 0) {
+			return;
+		}
+
+		glm::vec3 camPos = cam->getPos();
+		const PipelineState* pipeline = drawPrograms[queue->getWeightedOIT() != nullptr ? 1 : 0].pipeline;
+
+		for (int i = 0; i < (int)emitters.size(); i++) {
+			Emitter& e = emitters[i];
+
+			DrawPacket packet;
+			packet.pass = PASS_TRANSPARENT;
+			packet.pipeline = pipeline;
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = e.texture ? e.texture->getTextureName() : 0;
+			packet.vao = e.drawArrays[e.current].getName();
+			packet.mode = GL_TRIANGLES;
+			packet.count = 6;
+			packet.instanceCount = e.desc.maxParticles;
+			packet.depth = glm::length(e.desc.position - camPos);
+			packet.owner = this;
+			packet.ownerIndex = i;
+
+			queue->submit(packet);
+		}
+	}
+
+	void GPUParticleSystem::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		//Camera matrices come from the shared FrameData block
+		GLStateCache::get().uniform1i(getDrawProgram(packet.pipeline).samplerId, 0);
+	}
+
+	void GPUParticleSystem::setDrawUniforms(const DrawPacket& packet) {
+		const Emitter& e = emitters[packet.ownerIndex];
+		const DrawProgram& program = getDrawProgram(packet.pipeline);
+		GLStateCache& gl = GLStateCache::get();
+
+		gl.uniform1i(program.useTextureLocation, e.texture != nullptr ? 1 : 0);
+		gl.uniform1f(program.startSizeLocation, e.desc.startSize);
+		gl.uniform1f(program.endSizeLocation, e.desc.endSize);
+		gl.uniform4fv(program.startColourLocation, &e.desc.startColour[0]);
+		gl.uniform4fv(program.endColourLocation, &e.desc.endColour[0]);
+	}
+
+	void GPUParticleSystem::destroy() {
+		for (Emitter& e : emitters) {
+			for (int i = 0; i < 2; i++) {
+				e.updateArrays[i].destroy();
+				e.drawArrays[i].destroy();
+				GLStateCache::get().onBufferDeleted(e.buffers[i]);
+			}
+			glDeleteBuffers(2, e.buffers);
+		}
+		emitters.clear();
+
+		if (timerQueries[0] != 0) {
+			glDeleteQueries(NUM_TIMER_QUERIES, timerQueries);
+		}
+
+		glDeleteProgram(updateProgramId);
+		GLStateCache::get().onProgramDeleted(updateProgramId);
+
+		// The draw programs belong to the shader library
+		drawPrograms[0].programId = drawPrograms[1].programId = 0;
+		drawPrograms[0].pipeline = drawPrograms[1].pipeline = nullptr;
+
+		spawnRing.destroy();
+	}
+
+	void GPUParticleSystem::runBenchmark(int maxParticles, JobSystem* jobs) {
+		// Spawn fast enough to keep the pool about three quarters full
+		ParticleEmitterDesc desc;
+		desc.maxParticles = maxParticles;
+		desc.minLife = 2.0f;
+		desc.maxLife = 4.0f;
+		desc.spawnRate = maxParticles / 4.0f;
+
+		const float STEP = 1.0f / 60.0f;
+		const int WARM_UP = 240;
+		const int ITERATIONS = 60;
+
+		// Only the simulation is compared, the CPU emitter isn't drawn so
+		// its copy into the stream buffer isn't counted
+		ParticleSystem cpu;
+		cpu.setJobSystem(jobs);
+		cpu.addEmitter(desc);
+
+		for (int i = 0; i < WARM_UP; i++) {
+			cpu.update(STEP);
+		}
+
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < ITERATIONS; i++) {
+			cpu.update(STEP);
+		}
+		float cpuMs = elapsedMs(start) / ITERATIONS;
+
+		GPUParticleSystem gpu;
+		gpu.init();
+
+		if (gpu.updateProgramId == 0) {
+			std::cout << "Particles " << maxParticles << " slots: CPU " << ParticleSystem::getSIMDName() << " " << cpuMs
+				<< " ms per step, GPU particles unavailable" << std::endl;
+			return;
+		}
+
+		gpu.addEmitter(desc);
+
+		for (int i = 0; i < WARM_UP; i++) {
+			gpu.update(STEP);
+		}
+		glFinish();
+
+		// Wait for every step so the time covers the GPU's work too
+		start = Clock::now();
+		for (int i = 0; i < ITERATIONS; i++) {
+			gpu.update(STEP);
+			glFinish();
+		}
+		float gpuMs = elapsedMs(start) / ITERATIONS;
+
+		std::cout << "Particles " << maxParticles << " slots (" << cpu.getNumParticles() << " alive on the CPU)"
+			<< ": CPU " << ParticleSystem::getSIMDName() << " " << cpuMs << " ms"
+			<< ", GPU transform feedback " << gpuMs << " ms per step" << std::endl;
+
+		gpu.destroy();
+	}
+}
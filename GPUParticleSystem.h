@@ -0,0 +1,169 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "Camera.h"
+#include "JobSystem.h"
+#include "ParticleSystem.h"
+#include "RenderQueue.h"
+#include "Texture.h"
+#include "UniformRing.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Per emitter spawn values for one simulation step, std140 layout.
+	// Must match the ParticleSpawn block in the update shader
+	struct ParticleSpawnData {
+		// xyz position, w the step in seconds
+		glm::vec4 positionStep;
+
+		// xyz velocity, w the random spread on each axis
+		glm::vec4 velocitySpread;
+
+		// xyz acceleration, w unused
+		glm::vec4 gravity;
+
+		// x min life, y max life, zw unused
+		glm::vec4 life;
+
+		// x first slot to respawn, y how many, z slots in the pool, w random seed
+		glm::ivec4 spawn;
+	};
+
+	// Particles that live entirely on the GPU, for effects the CPU never
+	// needs to read back. Each emitter owns a fixed pool of slots in two
+	// buffers. Every update a vertex shader reads one buffer and writes the
+	// other with transform feedback, with rasterisation off, then the
+	// buffers swap and the latest one is drawn instanced like ParticleSystem
+	//
+	// Spawning walks a ring over the pool: each step the next few slots are
+	// respawned from the ParticleSpawn uniform block. Slots are reused in
+	// the order they were spawned, so a pool too small for spawnRate *
+	// maxLife recycles its oldest particles early. Dead slots stay in the
+	// pool and are collapsed to nothing in the vertex shader
+	//
+	// Needs GL 3.1 (transform feedback, uniform buffers and gl_VertexID)
+	// and instanced attributes for the draw, core in GL 3.3 or through
+	// ARB_instanced_arrays. Without them init() leaves the system disabled
+	class GPUParticleSystem : public Renderable {
+	public:
+		GPUParticleSystem();
+		~GPUParticleSystem() {}
+
+		// Create the update and draw programs and the spawn uniform ring
+		void init();
+
+		// Add an emitter with maxParticles slots, texture is optional (a
+		// soft disc without), returns the emitter index
+		int addEmitter(const ParticleEmitterDesc& desc, Texture* texture = nullptr);
+
+		void setEmitterPosition(int emitter, glm::vec3 position);
+
+		// Spawn and move every emitter's particles on the GPU. Issues its
+		// own GL calls, call outside the render queue's execute
+		void update(float deltaSeconds);
+
+		// Add one instanced packet per emitter, drawing the latest buffer
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+		void setDrawUniforms(const DrawPacket& packet);
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		// Slots in every pool, the GPU doesn't report how many are alive
+		int getCapacity();
+
+		// CPU time of the last update and GPU time of a recent one, the
+		// GPU time is 0 without timer queries
+		float getUpdateMs() {
+			return updateMs;
+		}
+
+		float getGPUUpdateMs() {
+			return gpuUpdateMs;
+		}
+
+		// Step the same emitter on ParticleSystem and GPUParticleSystem at
+		// a fixed rate and print the time per step of each to the console.
+		// Needs a current GL context
+		static void runBenchmark(int maxParticles, JobSystem* jobs);
+
+	private:
+		// One slot as the update shader reads and writes it
+		struct Particle {
+			// xyz position, w age in seconds
+			glm::vec4 positionAge;
+
+			// xyz velocity, w life in seconds, dead once age reaches it
+			glm::vec4 velocityLife;
+		};
+
+		struct Emitter {
+			ParticleEmitterDesc desc;
+			Texture* texture;
+
+			// Ping-pong pair, current is the one written last
+			GLuint buffers[2];
+			int current;
+
+			// Update reads from one buffer, draw reads the other as instances
+			VertexArray updateArrays[2];
+			VertexArray drawArrays[2];
+
+			// Next slot to respawn and the fraction of a particle carried over
+			int spawnCursor;
+			float spawnAccumulator;
+		};
+
+		// Read back the oldest finished timer query without waiting
+		void collectTimerResults();
+
+	private:
+		// Timer queries in flight
+		static const int NUM_TIMER_QUERIES = 3;
+
+		GLuint updateProgramId;
+		GLint updatePositionAgeLocation;
+		GLint updateVelocityLifeLocation;
+
+		// Draw program, its uniforms and its pipeline
+		struct DrawProgram {
+			GLuint programId;
+			GLint samplerId;
+			GLint useTextureLocation;
+			GLint startSizeLocation;
+			GLint endSizeLocation;
+			GLint startColourLocation;
+			GLint endColourLocation;
+			const PipelineState* pipeline;
+		};
+
+		// The permutation a packet was submitted with
+		const DrawProgram& getDrawProgram(const PipelineState* pipeline) {
+			return pipeline == drawPrograms[1].pipeline ? drawPrograms[1] : drawPrograms[0];
+		}
+
+		// Blending and GE_WEIGHTED_OIT permutations, picked by the render
+		// queue's transparency mode. Both share the attribute locations
+		DrawProgram drawPrograms[2];
+		GLint drawPositionAgeLocation;
+		GLint drawVelocityLifeLocation;
+
+		// ParticleSpawn blocks for every emitter, one range per update
+		UniformRing spawnRing;
+
+		std::vector<Emitter> emitters;
+		unsigned int frame;
+
+		GLuint timerQueries[NUM_TIMER_QUERIES];
+		bool timerPending[NUM_TIMER_QUERIES];
+		int nextTimer;
+
+		float updateMs;
+		float gpuUpdateMs;
+	};
+}
@@ -1,4 +1,7 @@
 #include "GameEngine.h"
+#include "Random.h"
+#include "ShaderCache.h"
+#include "ShaderLibrary.h"
 #include <iostream>
 #include <assert.h>
 
@@ -21,6 +24,10 @@ namespace GE {
 			std::cerr << "Unable to initialise SDL! SDL error: " << SDL_GetError() << std::endl;
 			return false;
 		}
+		// Startup time is logged at the end, compare a first launch with
+		// the next to see what the shader cache saves
+		Uint32 startTicks = SDL_GetTicks();
+
 		// Set the OpenGL version for the program
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3); // OpenGL 3+
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1); // OpenGL 3.1
@@ -48,6 +55,8 @@ namespace GE {
 
 		// Initialise GLEW. GLEW solves a problem with OpenGL on windows
 		// GLEW binds latest extensions that can be used
+		// Experimental is needed for GLEW to load all entry points on a core profile
+		glewExperimental = GL_TRUE;
 		GLenum status = glewInit();
 		// Check GLEW initialised
 		if (status != GLEW_OK) {
@@ -55,6 +64,15 @@ namespace GE {
 			return false;
 		}
 
+		// Fresh context, so the GL state shadow starts from the defaults
+		GLStateCache::get().reset();
+
+		// Linked programs saved by earlier launches, in the working directory
+		ShaderCache::get().init("shadercache");
+
+		// Shader files and the programs shared between renderers
+		ShaderLibrary::get().init(".\\resources\\shaders");
+
 		// Try to turn on VSync, if requested
 		if (vsync) {
 			if (SDL_GL_SetSwapInterval(1) != 0) {
@@ -69,6 +87,27 @@ namespace GE {
 			glm::vec3(0.0f, 1.0f, 0.0f),				// cam up direction
 			120, w / h, 0.1f, 800.0f);					// fov, aspect ratio, near and far clip planes
 		cam->setTarget(glm::vec3(0.5f, 0.0f, 0.5f));
+		camPos = previousCamPos = cam->getPos();
+
+		for (int i = 0; i < NUM_KEYS; i++) {
+			keyStates[i] = false;
+		}
+
+		// Worker threads shared by the engine systems
+		jobs = new JobSystem();
+		jobs->init();
+
+		renderQueue = new RenderQueue();
+		renderQueue->init();
+
+		frameUniforms = new FrameUniforms();
+		frameUniforms->init();
+		lastFrameTicks = SDL_GetTicks();
+
+		// Off until I is pressed, the transparent pass blends in sorted order
+		oit = new WeightedBlendedOIT();
+		oit->init(w, h);
+		weightedOIT = false;
 
 		// Initialise the object renderers
 		m = new Model();
@@ -81,11 +120,89 @@ namespace GE {
 		
 		mat = new Texture(".\\space_frigate_6_color.png");
 
+		scene = new SceneGraph();
+		scene->setJobSystem(jobs);
+
 		mr = new ModelRenderer(m);
 		mr->init();
+		mr->attachToScene(scene);
 		mr->setPos(0.0f, 0.0f, -20.0f);
 		mr->setMaterial(mat);
+		shipAngle = previousShipAngle = 0.0f;
+
+		// 500 copies of the ship in a grid behind the first one
+		fleet = new InstancedModelRenderer(m);
+		fleet->init();
+		fleet->setMaterial(mat);
+		for (int row = 0; row < 20; row++) {
+			for (int col = 0; col < 25; col++) {
+				glm::mat4 t = glm::translate(glm::mat4(1.0f), glm::vec3((col - 12) * 15.0f, 10.0f + row * 4.0f, -60.0f - row * 15.0f));
+				t = glm::scale(t, glm::vec3(2.0f));
+				fleet->addInstance(ModelInstance(t, glm::vec4(0.8f + 0.01f * row, 0.8f, 0.8f + 0.008f * col, 1.0f)));
+			}
+		}
+
+
+		// Scattered ships, each its own object in the multi draw batch
+		// Raise DEBRIS_COUNT (e.g. 100 to 100000) to check the draw calls stay flat,
+		// G switches between CPU and GPU culling to compare their submit time
+		const int DEBRIS_COUNT = 1000;
+		debris = new MultiDrawRenderer();
+		debris->init();
+		debris->setJobSystem(jobs);
+		int debrisMesh = debris->addMesh(m);
+		unsigned int seed = 12345u;
+		for (int i = 0; i < DEBRIS_COUNT; i++) {
+			float angle = randomFloat(seed) * 6.2831853f;
+			float radius = 150.0f + randomFloat(seed) * 250.0f;
+			float height = -40.0f + randomFloat(seed) * 120.0f;
+
+			glm::mat4 t = glm::translate(glm::mat4(1.0f), glm::vec3(cos(angle) * radius, height, sin(angle) * radius));
+			t = glm::rotate(t, angle * 3.0f, glm::vec3(0.3f, 1.0f, 0.1f));
+			debris->addObject(debrisMesh, t, mat);
+		}
+
+		// Ships lined up behind the first one, hidden from the start position.
+		// Each is queried with its bounding box and skipped while hidden,
+		// Q turns the queries off to compare
+		occlusionQueries = new OcclusionQueries();
+		occlusionQueries->init();
+		occlusionQueryShips = true;
+		const int HIDDEN_SHIPS = 24;
+
+		entities = new EntityWorld();
+		transformSystem = new TransformSystem();
+		cullingSystem = new CullingSystem();
+		meshDraw = new MeshDrawSystem();
+		meshDraw->init();
+		meshDraw->setOcclusionQueries(occlusionQueries);
+		int shipMesh = meshDraw->addMesh(m);
+
+		// Placed relative to one group node, which never moves, so their
+		// transforms are computed once
+		hiddenGroup = scene->createNode();
+		scene->setPosition(hiddenGroup, glm::vec3(0.0f, 0.0f, -45.0f));
+
+		for (int i = 0; i < HIDDEN_SHIPS; i++) {
+			LocalTransform local;
+			local.position = glm::vec3(((i % 4) - 1.5f) * 2.0f, ((i / 4) % 2 - 0.5f) * 2.0f, -(i / 8) * 20.0f);
+			local.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+			local.scale = glm::vec3(1.0f, 1.0f, 2.0f);
+			local.changed = true;
+
+			SceneParent parent = { hiddenGroup };
+			LocalBounds bounds = { meshDraw->getMeshBounds(shipMesh) };
+			MeshInstance instance = { shipMesh, mat };
+			OcclusionTested tested = { occlusionQueries->addObject() };
+
+			entities->create(local, parent, WorldTransform(), bounds, Visibility(), instance, tested);
+		}
 
+		// The first ship hides the debris behind it, O turns this off
+		occlusion = new OcclusionCuller();
+		occlusion->setJobSystem(jobs);
+		shipOccluder = occlusion->addOccluder(occlusion->addOccluderMesh(m), glm::mat4(1.0f));
+		debris->setOcclusionCuller(occlusion);
 
 		/* 
 		mr = new ModelRenderer(m);
@@ -96,6 +213,65 @@ namespace GE {
 			"right.jpg", "left.jpg",
 			"top.jpg", "bottom.jpg");
 
+		// Scatter grass over the terrain heightmap
+		terrainHeights = new Heightmap(".\\resources\\terrain\\terrain-heightmap.png", 2.0f, 40.0f);
+		terrainHeights->setOrigin(terrainHeights->getOrigin() + glm::vec3(0.0f, -50.0f, 0.0f));
+		grassTex = new Texture(".\\resources\\terrain\\terrain-texture.png");
+
+		ScatterSpecies grass;
+		grass.name = "grass";
+		grass.texture = grassTex;
+		grass.density = 4.0f;
+		grass.minScale = 0.5f;
+		grass.maxScale = 1.2f;
+		grass.maxSlope = 0.3f;
+		grass.drawDistance = 150.0f;
+
+		scatter = new ScatterSystem(terrainHeights);
+		scatter->addSpecies(grass);
+		scatter->generate(jobs);
+		scatter->init();
+
+		// Sparks rising from beside the first ship. Raise the rate to 250000
+		// (with maxParticles 1000000) to check the 1M particle update time
+		particles = new ParticleSystem();
+		particles->init();
+		particles->setJobSystem(jobs);
+		ParticleEmitterDesc sparks;
+		sparks.position = glm::vec3(-25.0f, -10.0f, -40.0f);
+		sparks.spawnRate = 20000.0f;
+		sparks.maxParticles = 100000;
+		sparks.minLife = 2.0f;
+		sparks.maxLife = 4.0f;
+		sparks.velocity = glm::vec3(0.0f, 12.0f, 0.0f);
+		sparks.velocitySpread = 4.0f;
+		sparks.gravity = glm::vec3(0.0f, -4.0f, 0.0f);
+		sparks.startSize = 0.4f;
+		sparks.endSize = 0.1f;
+		sparks.startColour = glm::vec4(1.0f, 0.8f, 0.3f, 1.0f);
+		sparks.endColour = glm::vec4(1.0f, 0.2f, 0.0f, 0.0f);
+		particles->addEmitter(sparks);
+
+		// The same sparks on the other side, simulated with transform feedback
+		gpuParticles = new GPUParticleSystem();
+		gpuParticles->init();
+		sparks.position = glm::vec3(25.0f, -10.0f, -40.0f);
+		gpuParticles->addEmitter(sparks);
+
+		// Startup is the loading screen, so build everything requested so far
+		// now. Programs requested later build in the background
+		ShaderLibrary::get().warmUp();
+
+		ShaderCache& shaderCache = ShaderCache::get();
+		std::cout << "Startup took " << SDL_GetTicks() - startTicks << " ms. Shader programs: "
+			<< shaderCache.getLoaded() << " loaded from cache in " << shaderCache.getLoadMs() << " ms, "
+			<< shaderCache.getCompiled() << " compiled in " << shaderCache.getCompileMs() << " ms, "
+			<< "library " << ShaderLibrary::get().getProgramCount() << " programs for " << ShaderLibrary::get().getRequestCount() << " requests";
+		if (shaderCache.getRejected() > 0) {
+			std::cout << " (" << shaderCache.getRejected() << " cached binaries rejected by the driver)";
+		}
+		std::cout << std::endl;
+
 		return true;
 	}
 
@@ -117,13 +293,46 @@ namespace GE {
 	}
 
 	// Update method which updates the game logic
-	// Used to invoke GE object update methods
-	void GameEngine::update() {
-		mr->setRotation(0.0f, mr->getRotY() + 2.5f, 0.0f);
+	// Used to invoke GE object update methods. Called a fixed number of
+	// times per second whatever the frame rate, so everything moves by step
+	void GameEngine::update(float step) {
+		const float SHIP_SPIN = 150.0f;		// Degrees per second
+		const float CAM_SPEED = 12.0f;		// Units per second
+
+		previousShipAngle = shipAngle;
+		shipAngle += SHIP_SPIN * step;
+
+		// Both wrap together so blending between them never spans the wrap
+		if (shipAngle >= 360.0f) {
+			shipAngle -= 360.0f;
+			previousShipAngle -= 360.0f;
+		}
+
+		// Along the direction the mouse last set
+		glm::vec3 right = glm::normalize(glm::cross(cam->getTarget(), cam->getUpDir()));
+		previousCamPos = camPos;
+
+		if (keyStates[KEY_UP]) {
+			camPos += cam->getTarget() * CAM_SPEED * step;
+		}
+
+		if (keyStates[KEY_DOWN]) {
+			camPos -= cam->getTarget() * CAM_SPEED * step;
+		}
+
+		if (keyStates[KEY_LEFT]) {
+			camPos -= right * CAM_SPEED * step;
+		}
+
+		if (keyStates[KEY_RIGHT]) {
+			camPos += right * CAM_SPEED * step;
+		}
+
+		particles->update(step);
+		gpuParticles->update(step);
 	}
 
 	void GameEngine::processInput() {
-		const float camSpeed = 0.2f;
 		const float	mouseSens = 0.1f;
 		int mouse_x, mouse_y;
 		SDL_GetMouseState(&mouse_x, &mouse_y);
@@ -139,24 +348,95 @@ namespace GE {
 		direction.z = sin(glm::radians(cam->getYaw())) * cos(glm::radians(cam->getPitch()));
 		cam->setTarget(glm::normalize(direction));
 
-		bool keyStates[4] = { 0, 0, 0, 0 };
-		int UP = 0, DOWN = 1, LEFT = 2, RIGHT = 3;
-
 		SDL_Event e;
 		if (SDL_PollEvent(&e)) {
 			if (e.type == SDL_KEYDOWN) {
 				switch (e.key.keysym.scancode) {
 				case SDL_SCANCODE_UP:
-						keyStates[UP] = true;
+						keyStates[KEY_UP] = true;
 						break;
 				case SDL_SCANCODE_DOWN:
-						keyStates[DOWN] = true;
+						keyStates[KEY_DOWN] = true;
 						break;
 				case SDL_SCANCODE_LEFT:
-						keyStates[LEFT] = true;
+						keyStates[KEY_LEFT] = true;
 						break;
 				case SDL_SCANCODE_RIGHT:
-						keyStates[RIGHT] = true;
+						keyStates[KEY_RIGHT] = true;
+						break;
+				case SDL_SCANCODE_B:
+						// Print the frustum culling throughput to the console
+						FrustumCuller::runBenchmark(1000000, jobs);
+						break;
+				case SDL_SCANCODE_V:
+						// Print BVH against brute force culling times to the console
+						DynamicBVH::runBenchmark(10000);
+						DynamicBVH::runBenchmark(100000);
+						DynamicBVH::runBenchmark(1000000);
+						break;
+				case SDL_SCANCODE_P:
+						// Print CPU against GPU particle simulation times to the console
+						GPUParticleSystem::runBenchmark(100000, jobs);
+						GPUParticleSystem::runBenchmark(1000000, jobs);
+						break;
+				case SDL_SCANCODE_E:
+						// Print entity iteration and structural change times to the console
+						EntityWorld::runBenchmark(1000000, jobs);
+						break;
+				case SDL_SCANCODE_N:
+						// Print scene graph update times to the console
+						SceneGraph::runBenchmark(100000, jobs);
+						break;
+				case SDL_SCANCODE_K:
+						// Print transparency sort times to the console
+						TransparencySorter::runBenchmark(100000, jobs);
+						TransparencySorter::runBenchmark(1000000, jobs);
+						break;
+				case SDL_SCANCODE_A:
+						// Print VAO against per draw attribute setup times to the console
+						VertexArray::runBenchmark(10000);
+						VertexArray::runBenchmark(100000);
+						break;
+				case SDL_SCANCODE_M:
+						// Print multi draw submit times and GL calls by object count to the console
+						MultiDrawRenderer::runBenchmark(m, mat, jobs);
+						break;
+				case SDL_SCANCODE_C:
+						// Print CPU against GPU culling of the multi draw renderer to the console
+						MultiDrawRenderer::runBenchmark(m, mat, jobs, MultiDrawRenderer::CULL_CPU);
+						MultiDrawRenderer::runBenchmark(m, mat, jobs, MultiDrawRenderer::CULL_GPU);
+						break;
+				case SDL_SCANCODE_I:
+						// Switch between sorted blending and weighted blended OIT,
+						// the window title compares the transparent pass times
+						if (oit->isReady()) {
+							weightedOIT = !weightedOIT;
+							renderQueue->setWeightedOIT(weightedOIT ? oit : nullptr);
+							particles->setSorted(!weightedOIT);
+						}
+						break;
+				case SDL_SCANCODE_T:
+						// Toggle back to front sorting of the CPU particles
+						particles->setSorted(!particles->isSorted());
+						break;
+				case SDL_SCANCODE_Q:
+						// Toggle the occlusion queries of the hidden ships
+						meshDraw->setOcclusionQueries(occlusionQueryShips ? nullptr : occlusionQueries);
+						occlusionQueryShips = !occlusionQueryShips;
+						break;
+				case SDL_SCANCODE_O:
+						// Toggle occlusion culling of the debris
+						debris->setOcclusionCuller(debris->getOcclusionCuller() ? nullptr : occlusion);
+						break;
+				case SDL_SCANCODE_D:
+						// Toggle setting only the state that differs between
+						// pipelines, the window title compares the state calls
+						renderQueue->setPipelineDiffing(!renderQueue->getPipelineDiffing());
+						break;
+				case SDL_SCANCODE_G:
+						// Toggle between CPU and GPU culling of the debris
+						debris->setCullMode(debris->getCullMode() == MultiDrawRenderer::CULL_GPU ?
+							MultiDrawRenderer::CULL_CPU : MultiDrawRenderer::CULL_GPU);
 						break;
 				}
 			}
@@ -164,16 +444,16 @@ namespace GE {
 			if (e.type == SDL_KEYUP) {
 				switch (e.key.keysym.scancode) {
 				case SDL_SCANCODE_UP:
-					keyStates[UP] = false;
+					keyStates[KEY_UP] = false;
 					break;
 				case SDL_SCANCODE_DOWN:
-					keyStates[DOWN] = false;
+					keyStates[KEY_DOWN] = false;
 					break;
 				case SDL_SCANCODE_LEFT:
-					keyStates[LEFT] = false;
+					keyStates[KEY_LEFT] = false;
 					break;
 				case SDL_SCANCODE_RIGHT:
-					keyStates[RIGHT] = false;
+					keyStates[KEY_RIGHT] = false;
 					break;
 				}
 
@@ -181,41 +461,74 @@ namespace GE {
 
 		}
 
-		if (keyStates[UP]) {
-			cam->setPos(cam->getPos() + cam->getTarget() * camSpeed);
-		}
-
-		if (keyStates[DOWN]) {
-			cam->setPos(cam->getPos() - cam->getTarget() * camSpeed);
-		}
-
-		if (keyStates[LEFT]) {
-			cam->setPos(cam->getPos() - glm::normalize(glm::cross(cam->getTarget(), cam->getUpDir())) * camSpeed);
-		}
-
-		if (keyStates[RIGHT]) {
-			cam->setPos(cam->getPos() + glm::normalize(glm::cross(cam->getTarget(), cam->getUpDir())) * camSpeed);
-		}
-
-		cam->updateCamMatrices();
-
+		// The matrices are rebuilt once, by whatever uses them first this frame
 		cam->setOldMouseX(w / 2);
 		cam->setOldMouseY(h / 2);
 
 	}
 	
 	// Draw method. Used to render scenes to the window frame
-	// For now, just clears the background
-	void GameEngine::draw() {
+	// Renderers submit packets to the render queue which sorts and draws them
+	void GameEngine::draw(float interpolation) {
+		// Pick up shader programs finished since the last frame
+		ShaderLibrary::get().update();
+
+		// Transforms drawn this frame, part way from the previous step to the latest
+		mr->setRotation(0.0f, previousShipAngle + (shipAngle - previousShipAngle) * interpolation, 0.0f);
+		cam->setPos(previousCamPos + (camPos - previousCamPos) * interpolation);
+
+		// Only the spinning ship is recomputed
+		scene->update();
+
+		// Entities parented to scene nodes follow them
+		transformSystem->update(*entities, scene, jobs);
+
+		// The OIT resolve needs the frame offscreen
+		if (weightedOIT) {
+			oit->bindScene();
+		}
+
 		glClearColor(0.392f, 0.584f, 0.929f, 1.0f);
-		glEnable(GL_DEPTH_TEST);
+		GLStateCache::get().enable(GL_DEPTH_TEST);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		// Camera and time for every shader, uploaded once
+		Uint32 ticks = SDL_GetTicks();
+		float delta = (ticks - lastFrameTicks) / 1000.0f;
+		frameUniforms->update(cam, ticks / 1000.0f, delta);
+		lastFrameTicks = ticks;
+
+		renderQueue->begin(cam);
 
-		skybox->draw(cam);
+		skybox->submit(renderQueue, cam);
 
+		scatter->submit(renderQueue, cam);
+
+		mr->submit(renderQueue, cam);
+
+		occlusionQueries->beginFrame();
+		cullingSystem->update(*entities, cam, jobs);
+		meshDraw->submit(*entities, renderQueue, cam);
+
+		fleet->submit(renderQueue, cam);
+
+		// Occluders follow the ship's transform from its submit
+		occlusion->setOccluderTransform(shipOccluder, mr->getTransform());
+		occlusion->render(cam);
+
+		debris->submit(renderQueue, cam);
+
+		particles->submit(renderQueue, cam);
+		gpuParticles->submit(renderQueue, cam);
+
+		renderQueue->execute();
+
+		if (weightedOIT) {
+			oit->present();
+		}
 
-		mr->draw(cam);
+		debris->endFrame();
+		particles->endFrame();
 
 		SDL_GL_SwapWindow(window);
 	}
@@ -225,12 +538,43 @@ namespace GE {
 	void GameEngine::shutdown() {
 		// Release object renderers
 		mr->destroy();
+		meshDraw->destroy();
+		occlusionQueries->destroy();
+		particles->destroy();
+		oit->destroy();
+		gpuParticles->destroy();
+		fleet->destroy();
+		debris->destroy();
 		skybox->destroy();
+		scatter->destroy();
+		ShaderLibrary::get().destroy();
+		PipelineCache::get().destroy();
+		jobs->destroy();
+		frameUniforms->destroy();
+		renderQueue->destroy();
 
 		// Release memory associate with camera and primitive renderers
 		delete skybox;
+		delete scatter;
+		delete grassTex;
+		delete terrainHeights;
+		delete jobs;
 		delete mr;
+		delete meshDraw;
+		delete cullingSystem;
+		delete transformSystem;
+		delete entities;
+		delete scene;
+		delete occlusionQueries;
+		delete particles;
+		delete oit;
+		delete gpuParticles;
+		delete fleet;
+		delete debris;
+		delete occlusion;
 		delete m;
+		delete frameUniforms;
+		delete renderQueue;
 		delete cam;
 		
 
@@ -6,8 +6,22 @@
 #include "Camera.h"
 #include "Texture.h"
 #include "ModelRenderer.h"
+#include "InstancedModelRenderer.h"
+#include "MultiDrawRenderer.h"
+#include "OcclusionCuller.h"
+#include "ParticleSystem.h"
+#include "GPUParticleSystem.h"
 #include "Model.h"
 #include "SkyboxRenderer.h"
+#include "JobSystem.h"
+#include "Heightmap.h"
+#include "ScatterSystem.h"
+#include "RenderQueue.h"
+#include "FrameUniforms.h"
+#include "WeightedBlendedOIT.h"
+#include "SceneGraph.h"
+#include "EntityWorld.h"
+#include "EntitySystems.h"
 
 namespace GE {
 	class GameEngine {
@@ -18,11 +32,61 @@ namespace GE {
 		bool init(bool vsync = false);		// Object initialisation, vsync default off
 		bool keep_running();				// Window closed?
 		void processInput();
-		void update();						// Update Game Logic
-		void draw();						// Render the frame
+		void update(float step);			// Advance the game logic by one fixed step in seconds
+		void draw(float interpolation);		// Render the frame between the last two steps, 0 to 1
 		void shutdown();					// Release objects and close safely
 
 		void setwindowtitle(const char*);
+
+		// Render queue counters for the last frame
+		const RenderStats& getRenderStats() {
+			return renderQueue->getStats();
+		}
+
+		// Multi draw batch, for its cull mode and submit time
+		MultiDrawRenderer* getDebris() {
+			return debris;
+		}
+
+		// Occlusion queries of the hidden ships, for their statistics
+		OcclusionQueries* getOcclusionQueries() {
+			return occlusionQueries;
+		}
+
+		// CPU particles, for their count and stage timings
+		ParticleSystem* getParticles() {
+			return particles;
+		}
+
+		// GPU particles, for their update times
+		GPUParticleSystem* getGPUParticles() {
+			return gpuParticles;
+		}
+
+		// Whether the transparent pass uses weighted blended OIT
+		bool isWeightedOIT() {
+			return weightedOIT;
+		}
+
+		// Whether pipeline changes only set the state that differs
+		bool isPipelineDiffing() {
+			return renderQueue->getPipelineDiffing();
+		}
+
+		// Scene objects kept as entities and the culling of them
+		EntityWorld* getEntities() {
+			return entities;
+		}
+
+		CullingSystem* getEntityCulling() {
+			return cullingSystem;
+		}
+
+		// Software occlusion culling of the debris, for its statistics
+		OcclusionCuller* getOcclusion() {
+			return occlusion;
+		}
+
 		bool fullscreen = false;			// Logic handle for fullscreen mode
 		int w, h;							// Window width and height
 		int windowflags;					// Hold info on how to display the window
@@ -36,7 +100,29 @@ namespace GE {
 
 		// Camera
 		Camera* cam;
+
+		// Arrow keys held, moving the camera every step until released
+		enum { KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, NUM_KEYS };
+		bool keyStates[NUM_KEYS];
+
+		// Camera position after the last two steps, blended like the ship spin
+		glm::vec3 camPos, previousCamPos;
+
+		// Renderers submit their draws here every frame
+		RenderQueue* renderQueue;
+
+		// Camera matrices and time shared by every shader
+		FrameUniforms* frameUniforms;
+		Uint32 lastFrameTicks;
+
+		// Order independent alternative to sorting the blended draws
+		WeightedBlendedOIT* oit;
+		bool weightedOIT;
 		glm::vec3 dist;
+
+		// Transforms of the model renderers, only recomputed when they move
+		SceneGraph* scene;
+
 		// Object renderers
 
 
@@ -48,9 +134,50 @@ namespace GE {
 
 		ModelRenderer* mr;
 
+		// Spin of the first ship after the last two steps, in degrees. The
+		// frame drawn blends them, so the spin is smooth at any frame rate
+		float shipAngle, previousShipAngle;
+
+		// Fleet of ship copies drawn with one instanced draw
+		InstancedModelRenderer* fleet;
+
+		// Field of independent ships drawn with multi draw indirect
+		MultiDrawRenderer* debris;
+
+		// Scene objects as entities, their transforms, culling and draws
+		// run as systems over the components
+		EntityWorld* entities;
+		TransformSystem* transformSystem;
+		CullingSystem* cullingSystem;
+		MeshDrawSystem* meshDraw;
+
+		// Heavy ships hidden behind the first one, entities drawn with
+		// conditional rendering on occlusion queries of their bounding boxes
+		int hiddenGroup;
+		OcclusionQueries* occlusionQueries;
+		bool occlusionQueryShips;
+
+		// The first ship rasterised as an occluder for the debris
+		OcclusionCuller* occlusion;
+		int shipOccluder;
+
 
 		SkyboxRenderer* skybox;
 
+		// Worker threads shared by the engine systems
+		JobSystem* jobs;
+
+		// Terrain heights and the vegetation scattered over them
+		Heightmap* terrainHeights;
+		Texture* grassTex;
+		ScatterSystem* scatter;
+
+		// Emitters simulated on the CPU and drawn instanced
+		ParticleSystem* particles;
+
+		// Emitters simulated with transform feedback, never read back
+		GPUParticleSystem* gpuParticles;
+
 
 		/* // Billboard Objects
 		Texture* bbTex;
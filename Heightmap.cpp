@@ -0,0 +1,76 @@
+#include "Heightmap.h"
+#include <iostream>
+
+namespace GE {
+	bool Heightmap::loadFromFile(std::string filename) {
+		SDL_Surface* surfaceImage = IMG_Load(filename.c_str());
+
+		if (surfaceImage == nullptr) {
+			std::cerr << "Unable to load heightmap " << filename << " SDL_image error: " << IMG_GetError() << std::endl;
+			return false;
+		}
+
+		// Convert to a known layout so the red channel is always the first byte
+		SDL_Surface* rgba = SDL_ConvertSurfaceFormat(surfaceImage, SDL_PIXELFORMAT_RGBA32, 0);
+		SDL_FreeSurface(surfaceImage);
+
+		if (rgba == nullptr) {
+			std::cerr << "Unable to convert heightmap " << filename << " SDL error: " << SDL_GetError() << std::endl;
+			return false;
+		}
+
+		width = rgba->w;
+		height = rgba->h;
+		values.resize(width * height);
+
+		SDL_LockSurface(rgba);
+		for (int y = 0; y < height; y++) {
+			const Uint8* row = (const Uint8*)rgba->pixels + y * rgba->pitch;
+			for (int x = 0; x < width; x++) {
+				values[y * width + x] = row[x * 4] / 255.0f;
+			}
+		}
+		SDL_UnlockSurface(rgba);
+		SDL_FreeSurface(rgba);
+
+		// Centre the map on the world origin
+		origin = glm::vec3(-getWorldSizeX() * 0.5f, 0.0f, -getWorldSizeZ() * 0.5f);
+
+		return true;
+	}
+
+	float Heightmap::sample(float u, float v) {
+		if (values.empty()) {
+			return 0.0f;
+		}
+
+		float fx = glm::clamp(u, 0.0f, 1.0f) * (width - 1);
+		float fy = glm::clamp(v, 0.0f, 1.0f) * (height - 1);
+
+		int x0 = (int)fx;
+		int y0 = (int)fy;
+		float tx = fx - x0;
+		float ty = fy - y0;
+
+		float top = glm::mix(getValue(x0, y0), getValue(x0 + 1, y0), tx);
+		float bottom = glm::mix(getValue(x0, y0 + 1), getValue(x0 + 1, y0 + 1), tx);
+
+		return glm::mix(top, bottom, ty);
+	}
+
+	float Heightmap::getWorldHeight(float x, float z) {
+		float u = (x - origin.x) / getWorldSizeX();
+		float v = (z - origin.z) / getWorldSizeZ();
+
+		return origin.y + sample(u, v) * heightScale;
+	}
+
+	glm::vec3 Heightmap::getWorldNormal(float x, float z) {
+		float hl = getWorldHeight(x - cellSize, z);
+		float hr = getWorldHeight(x + cellSize, z);
+		float hd = getWorldHeight(x, z - cellSize);
+		float hu = getWorldHeight(x, z + cellSize);
+
+		return glm::normalize(glm::vec3(hl - hr, 2.0f * cellSize, hd - hu));
+	}
+}
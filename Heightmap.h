@@ -0,0 +1,103 @@
+#pragma once
+#include <SDL.h>
+#include <SDL_image.h>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+namespace GE {
+	// Greyscale image loaded into CPU memory so it can be sampled by the
+	// engine, e.g. the terrain heightmap or a density mask. Values are in
+	// the range 0 to 1, taken from the red channel of the image
+	class Heightmap {
+	public:
+		Heightmap() {
+			width = 0;
+			height = 0;
+			cellSize = 1.0f;
+			heightScale = 1.0f;
+			origin = glm::vec3(0.0f);
+		}
+
+		// Load the image, cellSize is the world distance between two pixels
+		// and heightScale the world height of a white pixel. The map is
+		// centred on the world origin
+		Heightmap(std::string filename, float _cellSize = 1.0f, float _heightScale = 1.0f) : Heightmap() {
+			cellSize = _cellSize;
+			heightScale = _heightScale;
+			loadFromFile(filename);
+		}
+
+		~Heightmap() {}
+
+		bool loadFromFile(std::string filename);
+
+		// Accessor methods
+		bool isLoaded() {
+			return !values.empty();
+		}
+
+		int getWidth() {
+			return width;
+		}
+
+		int getHeight() {
+			return height;
+		}
+
+		float getCellSize() {
+			return cellSize;
+		}
+
+		float getHeightScale() {
+			return heightScale;
+		}
+
+		// World position of pixel 0, 0
+		glm::vec3 getOrigin() {
+			return origin;
+		}
+
+		// Move the map, by default it is centred on the world origin
+		void setOrigin(glm::vec3 newOrigin) {
+			origin = newOrigin;
+		}
+
+		// World size of the map on x and z
+		float getWorldSizeX() {
+			return (width - 1) * cellSize;
+		}
+
+		float getWorldSizeZ() {
+			return (height - 1) * cellSize;
+		}
+
+		// Raw value of a pixel, coordinates are clamped to the image
+		float getValue(int x, int y) {
+			if (x < 0) x = 0;
+			if (y < 0) y = 0;
+			if (x >= width) x = width - 1;
+			if (y >= height) y = height - 1;
+			return values[y * width + x];
+		}
+
+		// Bilinear sample using normalised 0 to 1 coordinates
+		float sample(float u, float v);
+
+		// World height at a world x, z position
+		float getWorldHeight(float x, float z);
+
+		// Surface normal at a world x, z position from central differences
+		glm::vec3 getWorldNormal(float x, float z);
+
+	private:
+		int width;
+		int height;
+		float cellSize;
+		float heightScale;
+		glm::vec3 origin;
+
+		// One value per pixel, row major
+		std::vector<float> values;
+	};
+}
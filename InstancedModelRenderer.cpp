@@ -0,0 +1,172 @@
+#include "InstancedModelRenderer.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include <iostream>
+#include <glm/gtc/type_ptr.hpp>
+
+namespace GE {
+	InstancedModelRenderer::InstancedModelRenderer(Model* m) {
+		model = m;
+		material = nullptr;
+
+		programId = 0;
+		pipeline = nullptr;
+		vboModel = 0;
+		vboInstances = 0;
+		instanceCapacity = 0;
+		instancesDirty = false;
+	}
+
+	InstancedModelRenderer::~InstancedModelRenderer() {
+	}
+
+	void InstancedModelRenderer::init() {
+		// Same shading as ModelRenderer, the transform comes from the instance
+		// buffer instead of a uniform
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"in vec2 vUV;\n"
+			"in mat4 instanceTransform;\n"
+			"in vec4 instanceTint;\n"
+			"out vec2 uv;\n"
+			"out vec4 tint;\n"
+			"void main() {\n"
+			"gl_Position = viewProjection * instanceTransform * vec4(vertexPos3D, 1);\n"
+			"uv = vUV;\n"
+			"tint = instanceTint;\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			"in vec2 uv;\n"
+			"in vec4 tint;\n"
+			"uniform sampler2D sampler;\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"fragmentColour = texture(sampler, uv) * tint;\n"
+			"}\n" };
+
+		// Built in the background with fixed attribute locations, the
+		// matrix last as it takes four. The packet is skipped until ready,
+		// the fallback program has no per instance transform
+		const char* attributes[] = { "vertexPos3D", "vUV", "instanceTint", "instanceTransform" };
+		vertexPos3DLocation = 0;
+		vertexUVLocation = 1;
+		instanceTintLocation = 2;
+		instanceTransformLocation = 3;
+		samplerId = -1;
+
+		programId = ShaderLibrary::get().requestProgramFromSource(V_ShaderCode[0], F_ShaderCode[0], "", attributes, 4, [this](GLuint program) {
+			samplerId = glGetUniformLocation(program, "sampler");
+		});
+
+		if (programId == 0) {
+			std::cerr << "Failed to create InstancedModelRenderer program. Check console for errors" << std::endl;
+			return;
+		}
+
+		GLStateCache& gl = GLStateCache::get();
+
+		// Model vertices, same layout as ModelRenderer
+		glGenBuffers(1, &vboModel);
+		gl.bindBuffer(GL_ARRAY_BUFFER, vboModel);
+		glBufferData(GL_ARRAY_BUFFER, model->getNumVertices() * sizeof(Vertex), model->getVertices(), GL_STATIC_DRAW);
+
+		// Instance buffer is sized at the first submit
+		glGenBuffers(1, &vboInstances);
+
+		vertexArray.addAttrib(vboModel, vertexPos3DLocation, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		vertexArray.addAttrib(vboModel, vertexUVLocation, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+
+		// Each column of the matrix is its own attribute location
+		for (int col = 0; col < 4; col++) {
+			vertexArray.addAttrib(vboInstances, instanceTransformLocation + col, 4, GL_FLOAT, sizeof(ModelInstance),
+				offsetof(ModelInstance, transform) + col * sizeof(glm::vec4), 1);
+		}
+		vertexArray.addAttrib(vboInstances, instanceTintLocation, 4, GL_FLOAT, sizeof(ModelInstance), offsetof(ModelInstance, tint), 1);
+		vertexArray.build();
+
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = vertexArray.getName();
+		desc.cull = true;
+		pipeline = PipelineCache::get().create(desc);
+	}
+
+	void InstancedModelRenderer::setInstances(const ModelInstance* data, int count) {
+		instances.assign(data, data + count);
+		instancesDirty = true;
+	}
+
+	int InstancedModelRenderer::addInstance(const ModelInstance& instance) {
+		instances.push_back(instance);
+		instancesDirty = true;
+		return (int)instances.size() - 1;
+	}
+
+	void InstancedModelRenderer::setInstance(int index, const ModelInstance& instance) {
+		instances[index] = instance;
+		instancesDirty = true;
+	}
+
+	void InstancedModelRenderer::clearInstances() {
+		instances.clear();
+		instancesDirty = true;
+	}
+
+	void InstancedModelRenderer::submit(RenderQueue* queue, Camera* cam) {
+		if (programId == 0 || instances.empty()) {
+			return;
+		}
+
+		if (instancesDirty) {
+			GLStateCache& gl = GLStateCache::get();
+			gl.bindBuffer(GL_ARRAY_BUFFER, vboInstances);
+
+			GLsizeiptr bytes = instances.size() * sizeof(ModelInstance);
+
+			// Grow with headroom, otherwise orphan the old storage so the
+			// upload doesn't wait for last frame's draw to finish
+			if ((int)instances.size() > instanceCapacity) {
+				instanceCapacity = (int)instances.size() + (int)instances.size() / 2;
+			}
+			glBufferData(GL_ARRAY_BUFFER, instanceCapacity * sizeof(ModelInstance), nullptr, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instances.data());
+
+			instancesDirty = false;
+		}
+
+		// One packet however many copies there are
+		DrawPacket packet;
+		packet.pass = PASS_OPAQUE;
+		packet.pipeline = pipeline;
+		packet.textureTarget = GL_TEXTURE_2D;
+		packet.textureName = material ? material->getTextureName() : 0;
+		packet.mode = GL_TRIANGLES;
+		packet.count = model->getNumVertices();
+		packet.instanceCount = (GLsizei)instances.size();
+		packet.owner = this;
+
+		queue->submit(packet);
+	}
+
+	void InstancedModelRenderer::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		// Camera matrices come from the shared FrameData block
+		GLStateCache::get().uniform1i(samplerId, 0);
+	}
+
+	// The program belongs to the shader library
+	void InstancedModelRenderer::destroy() {
+		GLStateCache& gl = GLStateCache::get();
+
+		glDeleteBuffers(1, &vboModel);
+		glDeleteBuffers(1, &vboInstances);
+		gl.onBufferDeleted(vboModel);
+		gl.onBufferDeleted(vboInstances);
+
+		vertexArray.destroy();
+	}
+}
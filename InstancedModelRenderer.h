@@ -0,0 +1,102 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "Camera.h"
+#include "Model.h"
+#include "Texture.h"
+#include "RenderQueue.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Data for one copy of the model, streamed to the vertex shader
+	struct ModelInstance {
+		glm::mat4 transform;
+
+		// Multiplied with the texture colour
+		glm::vec4 tint;
+
+		ModelInstance() {
+			transform = glm::mat4(1.0f);
+			tint = glm::vec4(1.0f);
+		}
+
+		ModelInstance(const glm::mat4& _transform, glm::vec4 _tint = glm::vec4(1.0f)) {
+			transform = _transform;
+			tint = _tint;
+		}
+	};
+
+	// Draws many copies of one model with a single instanced draw call
+	// The per instance transforms and tints are uploaded to an instance
+	// buffer when they change, so the number of draw calls and uniform
+	// uploads doesn't grow with the number of copies
+	class InstancedModelRenderer : public Renderable {
+	public:
+		InstancedModelRenderer(Model* m);
+		~InstancedModelRenderer();
+
+		// Create shaders, the model VBO, the instance buffer and the VAO
+		void init();
+
+		// Replace every instance
+		void setInstances(const ModelInstance* data, int count);
+
+		// Add one instance, returns its index
+		int addInstance(const ModelInstance& instance);
+
+		// Change one instance
+		void setInstance(int index, const ModelInstance& instance);
+
+		void clearInstances();
+
+		// Upload changed instances and add one packet for all of them
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		int getNumInstances() {
+			return (int)instances.size();
+		}
+
+		void setMaterial(Texture* mat) {
+			material = mat;
+		}
+
+	private:
+		// Member fields
+		// Program object that contains the shaders
+		GLuint programId;
+		GLint vertexPos3DLocation;
+		GLint vertexUVLocation;
+
+		// A mat4 attribute takes four consecutive locations
+		GLint instanceTransformLocation;
+		GLint instanceTintLocation;
+
+		GLuint vboModel;
+
+		// Instance data in graphics memory and how many instances it can hold
+		GLuint vboInstances;
+		int instanceCapacity;
+
+		VertexArray vertexArray;
+		const PipelineState* pipeline;
+
+		// GLSL uniform for the texture sampler, matrices come from FrameData
+		GLint samplerId;
+
+		Model* model;
+		Texture* material;
+
+		// CPU copy of the instances, uploaded at submit when dirty
+		std::vector<ModelInstance> instances;
+		bool instancesDirty;
+	};
+}
@@ -0,0 +1,143 @@
+#include "JobSystem.h"
+
+namespace GE {
+	JobSystem::JobSystem() {
+		jobFunc = nullptr;
+		jobCount = 0;
+		jobBatchSize = 1;
+		nextItem = 0;
+		batchesLeft = 0;
+		jobGeneration = 0;
+		activeWorkers = 0;
+		quit = false;
+	}
+
+	JobSystem::~JobSystem() {
+		destroy();
+	}
+
+	void JobSystem::init(int numThreads) {
+		if (numThreads <= 0) {
+			// Leave one hardware thread for the main loop
+			numThreads = (int)std::thread::hardware_concurrency() - 1;
+		}
+
+		quit = false;
+
+		for (int i = 0; i < numThreads; i++) {
+			workers.push_back(std::thread(&JobSystem::workerLoop, this));
+		}
+	}
+
+	void JobSystem::parallelFor(int count, int batchSize, const RangeFunc& func) {
+		if (count <= 0) {
+			return;
+		}
+
+		if (batchSize < 1) {
+			batchSize = 1;
+		}
+
+		// Not worth waking the workers for a single batch
+		if (count <= batchSize) {
+			func(0, count);
+			return;
+		}
+
+		// No workers, run the batches here. Still one call per batch, callers
+		// may index per batch results by begin / batchSize
+		if (workers.empty()) {
+			for (int begin = 0; begin < count; begin += batchSize) {
+				func(begin, begin + batchSize < count ? begin + batchSize : count);
+			}
+			return;
+		}
+
+		std::lock_guard<std::mutex> submitLock(submitMutex);
+
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			jobFunc = &func;
+			jobCount = count;
+			jobBatchSize = batchSize;
+			nextItem = 0;
+			batchesLeft = (count + batchSize - 1) / batchSize;
+			jobGeneration++;
+		}
+		jobReady.notify_all();
+
+		// Calling thread works on the job too
+		runBatches();
+
+		// Wait for batches still running on the workers. Workers that joined
+		// late must also have left before the job fields can be reused
+		std::unique_lock<std::mutex> lock(jobMutex);
+		jobDone.wait(lock, [this] { return batchesLeft == 0 && activeWorkers == 0; });
+		jobFunc = nullptr;
+	}
+
+	void JobSystem::runBatches() {
+		while (true) {
+			int begin = nextItem.fetch_add(jobBatchSize);
+
+			if (begin >= jobCount) {
+				return;
+			}
+
+			int end = begin + jobBatchSize;
+			if (end > jobCount) {
+				end = jobCount;
+			}
+
+			(*jobFunc)(begin, end);
+
+			batchesLeft.fetch_sub(1);
+		}
+	}
+
+	void JobSystem::workerLoop() {
+		unsigned int seenGeneration = 0;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(jobMutex);
+				jobReady.wait(lock, [&] { return quit || jobGeneration != seenGeneration; });
+
+				if (quit) {
+					return;
+				}
+
+				seenGeneration = jobGeneration;
+
+				// Job may already have been completed by the other threads
+				if (jobFunc == nullptr) {
+					continue;
+				}
+
+				activeWorkers++;
+			}
+
+			runBatches();
+
+			{
+				std::lock_guard<std::mutex> lock(jobMutex);
+				activeWorkers--;
+			}
+			jobDone.notify_all();
+		}
+	}
+
+	void JobSystem::destroy() {
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			quit = true;
+		}
+		jobReady.notify_all();
+
+		for (std::thread& t : workers) {
+			t.join();
+		}
+
+		workers.clear();
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <atomic>
+
+namespace GE {
+	// Small pool of worker threads used to spread CPU heavy engine work
+	// (procedural generation, culling, particle updates) across the cores.
+	// Work is submitted as a range which is split into batches, the calling
+	// thread helps out and returns once the whole range has been processed
+	class JobSystem {
+	public:
+		// Range function receives [begin, end) of the items to process
+		typedef std::function<void(int, int)> RangeFunc;
+
+		JobSystem();
+		~JobSystem();
+
+		// Start the workers. 0 threads means one per hardware thread minus
+		// the calling thread
+		void init(int numThreads = 0);
+
+		// Process count items in batches of batchSize on the workers and the
+		// calling thread. Blocks until every batch has finished
+		void parallelFor(int count, int batchSize, const RangeFunc& func);
+
+		// Stop and join the worker threads
+		void destroy();
+
+		// Number of threads that take part in parallelFor, including the caller
+		int getNumThreads() {
+			return (int)workers.size() + 1;
+		}
+
+	private:
+		void workerLoop();
+
+		// Grab and run batches of the current job until none are left
+		void runBatches();
+
+	private:
+		std::vector<std::thread> workers;
+
+		// Guards the job fields below and wakes the workers
+		std::mutex jobMutex;
+		std::condition_variable jobReady;
+		std::condition_variable jobDone;
+
+		// Current job, only one parallelFor runs at a time
+		const RangeFunc* jobFunc;
+		int jobCount;
+		int jobBatchSize;
+		std::atomic<int> nextItem;
+		std::atomic<int> batchesLeft;
+
+		// Incremented for every job so sleeping workers can tell a new one started
+		unsigned int jobGeneration;
+
+		// Workers currently inside runBatches for the current job
+		int activeWorkers;
+		bool quit;
+
+		// Serialises callers of parallelFor
+		std::mutex submitMutex;
+	};
+}
@@ -1,7 +1,9 @@
 #include "ModelRenderer.h"
+#include "GLStateCache.h"
 #include <iostream>
 #include <glm/gtc/type_ptr.hpp>
-#include "ShaderUtils.h"
+#include "ShaderLibrary.h"
+#include "FrameUniforms.h"
 
 namespace GE {
 	
@@ -14,233 +16,165 @@ namespace GE {
 		scale_z = 10.0f;
 
 		model = m;
+
+		occlusionQueries = nullptr;
+		queryObject = -1;
+		pipeline = nullptr;
+
+		transformDirty = true;
+		scene = nullptr;
+		node = SceneGraph::NO_PARENT;
 	}
 
 	ModelRenderer::~ModelRenderer()
 	{
 	}
 
-	//This is a helper function that allows us to see
-	//shader compiler error messages should our shaders not compile okay
-	void displayShaderCompilerError(GLuint shaderId) {
-		//First, get the lenght of the error message string 
-		GLint MsgLen = 0;
-
-		glGetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &MsgLen);
-
-		//Only display the message is more than 1 character was returned 
-		if (MsgLen > 1) {
-			//Create a character buffer to store the error message characters 
-			GLchar* Msg = new GLchar[MsgLen + 1];
-
-			//Get the error message characters from the OpenGL internal log 
-			//into the Msg buffer
-			glGetShaderInfoLog(shaderId, MsgLen, NULL, Msg);
-
-			//Display the error message so we can see what the problem
-			//was with the shader
-			std::cerr << "Error compiling shader" << Msg << std::endl;
-
-			//Release the memory allocated to the string
-			delete[] Msg;
-		}
-	}
-
-	
 	void ModelRenderer::init() {
-		
-		GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-
-		//The shader code as described in lecture
-		const GLchar* V_ShaderCode[] = {
-			"#version 140\n"
-			"in vec3 vertexPos3D;\n"
-			"in vec2 vUV;\n"
-			"out vec2 uv;\n"
-			"uniform mat4 transform;\n"
-			"uniform mat4 view;\n"
-			"uniform mat4 projection;\n"
-			"void main() {\n"
-			"vec4 v = vec4(vertexPos3D.xyz, 1);\n"
-			"v = projection * view * transform * v;\n"
-			"gl_Position = v;\n"
-			"uv = vUV;\n"
-			"}\n" };
-
-		//Copy the source to OpenGL ready for compilation
-		glShaderSource(vertexShader, 1, V_ShaderCode, NULL);
-
-		//Compile the code
-		glCompileShader(vertexShader);
-
-		//Check for compiler errors
-		//Presume shader didn't compile
-		GLint isShaderCompiledOK = GL_FALSE;
-
-		//Get the compile status from OpenGL
-		glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &isShaderCompiledOK);
-
-		//Has the shader failed to compile?
-		if (isShaderCompiledOK != GL_TRUE) {
-			//Yes, so display an error message
-			std::cerr << "Unable to compile vertex shader" << std::endl;
-
-			displayShaderCompilerError(vertexShader);
-
-			return;
-		}
-		GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-		//Fragment shader source code
-		const GLchar* F_ShaderCode[] = {
-			"#version 140\n"
-			"in vec2 uv;\n"
-			"uniform sampler2D sampler;\n"
-			"out vec4 fragmentColour;\n"
-			"void main()\n"
-			"{\n"
-			"fragmentColour = texture(sampler,uv).rgba;\n"
-			"}\n" };
-
-		//Transfer the shader code
-		glShaderSource(fragmentShader, 1, F_ShaderCode, NULL);
-
-		//Compile the code
-		glCompileShader(fragmentShader);
-
-		//Check for compiler errors
-		isShaderCompiledOK = GL_FALSE;
-
-		//Get the compile status from OpenGL
-		glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &isShaderCompiledOK);
-
-		//Has the shader failed to compile?
-		if (isShaderCompiledOK != GL_TRUE) {
-			//Yes, so display an error message
-			std::cerr << "Unable to compile fragment shader" << std::endl;
-
-			displayShaderCompilerError(fragmentShader);
-
+		//Every ModelRenderer shares the one program from the shader library.
+		//It builds in the background, the attributes are bound to fixed
+		//locations so the vertex layout doesn't have to wait for it
+		const char* attributes[] = { "vertexPos3D", "vUV" };
+		vertexPos3DLocation = 0;
+		vertexUVLocation = 1;
+		samplerId = -1;
+
+		programId = ShaderLibrary::get().requestProgram("model.vs", "model.fs", "", attributes, 2, [this](GLuint program) {
+			//Link the uniforms to the member fields
+			samplerId = glGetUniformLocation(program, "sampler");
+		});
+
+		if (programId == 0) {
+			std::cerr << "Failed to create ModelRenderer program. Check console for errors" << std::endl;
 			return;
 		}
 
-		//Create the program object
-		programId = glCreateProgram();
-
-		//Attach shaders to the program object
-		glAttachShader(programId, vertexShader);
-		glAttachShader(programId, fragmentShader);
-
-		//Link the program to create an executable program we 
-		//use to render the object
-		//Program executable will exist in graphics memory
-		glLinkProgram(programId);
-
-		//Check for linking errors
-		GLint isProgramLinked = GL_FALSE;
-		glGetProgramiv(programId, GL_LINK_STATUS, &isProgramLinked);
-		if (isProgramLinked != GL_TRUE) {
-			std::cerr << "Failed to link program" << std::endl;
-		}
-
-		//Now get a link to the vertexPos2D so we can link the attribute 
-		//to our vertices when rendering 
-		vertexPos3DLocation = glGetAttribLocation(programId, "vertexPos3D");
-
-		//check for errors
-		if (vertexPos3DLocation == -1) {
-			std::cerr << "Problem gettting vertex3DPos" << std::endl;
-		}
-
-		vertexUVLocation = glGetAttribLocation(programId, "vUV");
-
-		//Check for errors
-		if (vertexUVLocation == -1) {
-			std::cerr << "Problem getting vUV" << std::endl;
-		}
-
-		//Link the uniforms to the member fields
-		transformUniformId = glGetUniformLocation(programId, "transform");
-		viewUniformId = glGetUniformLocation(programId, "view");
-		projectionUniformId = glGetUniformLocation(programId, "projection");
-		samplerId = glGetUniformLocation(programId, "sampler");
-
 		//Create the vertex buffer object
 		glGenBuffers(1, &vboModel);
-		glBindBuffer(GL_ARRAY_BUFFER, vboModel);
+		GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, vboModel);
 
 		//Transfer vertices to graphics memory
 		glBufferData(GL_ARRAY_BUFFER, model->getNumVertices() * sizeof(Vertex), model -> getVertices(), GL_STATIC_DRAW);
+
+		//Record the structure of a vertex into the VAO once, draw only binds it
+		vertexArray.addAttrib(vboModel, vertexPos3DLocation, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		vertexArray.addAttrib(vboModel, vertexUVLocation, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+		vertexArray.build();
+
+		//Declare the draw state once, opaque and back face culled
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = vertexArray.getName();
+		desc.cull = true;
+		pipeline = PipelineCache::get().create(desc);
+
+		//Model space bounds for the occlusion query proxy
+		Vertex* v = (Vertex*)model->getVertices();
+		for (int i = 0; i < model->getNumVertices(); i++) {
+			glm::vec3 p(v[i].x, v[i].y, v[i].z);
+			if (i == 0) {
+				bounds = AABB(p, p);
+			}
+			else {
+				bounds.expand(p);
+			}
+		}
 	}
 
 	void ModelRenderer::update()
 	{
 	}
 
-	void ModelRenderer::draw(Camera* cam) {
-
-		glEnable(GL_CULL_FACE);
-
-		//Calculate the transformation matrix for the object. Start with the identity matrix
-		glm::mat4 transformationMat = glm::mat4(1.0f);
-
-		transformationMat = glm::translate(transformationMat, glm::vec3(pos_x, pos_y, pos_z));
-		transformationMat = glm::rotate(transformationMat, glm::radians(rot_x), glm::vec3(1.0f, 0.0f, 0.0f));
-		transformationMat = glm::rotate(transformationMat, glm::radians(rot_y), glm::vec3(0.0f, 1.0f, 0.0f));
-		transformationMat = glm::rotate(transformationMat, glm::radians(rot_z), glm::vec3(0.0f, 0.0f, 1.0f));
-		transformationMat = glm::scale(transformationMat, glm::vec3(scale_x, scale_y, scale_z));
-
-		//Get the view and projection matrices
-		glm::mat4 viewMat = cam->getViewMatrix();
-		glm::mat4 projectionMat = cam->getProjectionMatrix();
+	//Rotation about x, then y, then z, angles in degrees
+	static glm::quat eulerRotation(float rx, float ry, float rz) {
+		return glm::angleAxis(glm::radians(rx), glm::vec3(1.0f, 0.0f, 0.0f)) *
+			glm::angleAxis(glm::radians(ry), glm::vec3(0.0f, 1.0f, 0.0f)) *
+			glm::angleAxis(glm::radians(rz), glm::vec3(0.0f, 0.0f, 1.0f));
+	}
 
-		//Select the program into the rendering context
-		glUseProgram(programId);
+	void ModelRenderer::attachToScene(SceneGraph* sg, int parent) {
+		scene = sg;
+		node = scene->createNode(parent);
+		transformChanged();
+	}
 
-		//Set the uniforms in the shader
-		glUniformMatrix4fv(transformUniformId, 1, GL_FALSE, glm::value_ptr(transformationMat));
-		glUniformMatrix4fv(viewUniformId, 1, GL_FALSE, glm::value_ptr(viewMat));
-		glUniformMatrix4fv(projectionUniformId, 1, GL_FALSE, glm::value_ptr(projectionMat));
+	void ModelRenderer::transformChanged() {
+		if (scene == nullptr) {
+			transformDirty = true;
+			return;
+		}
 
-		
-		glEnableVertexAttribArray(vertexPos3DLocation);
-		//Define the structure of a vertex for OpenGL to select values from vertex buffer
-		//and store in vertexPos2DLocation attribute
-		glVertexAttribPointer(vertexPos3DLocation, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
+		scene->setLocal(node, glm::vec3(pos_x, pos_y, pos_z), eulerRotation(rot_x, rot_y, rot_z), glm::vec3(scale_x, scale_y, scale_z));
+	}
 
-		glEnableVertexAttribArray(vertexUVLocation);
+	const glm::mat4& ModelRenderer::getTransform() {
+		if (scene != nullptr) {
+			return scene->getWorldMatrix(node);
+		}
 
-		glVertexAttribPointer(vertexUVLocation, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, u));
-		
+		//Static models keep the matrix from the last change
+		if (transformDirty) {
+			transformationMat = SceneGraph::composeTRS(glm::vec3(pos_x, pos_y, pos_z), eulerRotation(rot_x, rot_y, rot_z),
+				glm::vec3(scale_x, scale_y, scale_z));
+			transformDirty = false;
+		}
 
-		//Enable the attribute to be passed vertices from the vertex buffer object
-		
+		return transformationMat;
+	}
 
-		//Select the vertex buffer object into the context
-		glBindBuffer(GL_ARRAY_BUFFER, vboModel);
-		
-		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(samplerId, 0);
-		glBindTexture(GL_TEXTURE_2D, material->getTextureName());
+	void ModelRenderer::submit(RenderQueue* queue, Camera* cam) {
+		if (pipeline == nullptr) {
+			return;
+		}
 
-		//Draw the model
-		glDrawArrays(GL_TRIANGLES, 0, model -> getNumVertices());
+		//Cached, only rebuilt when the model moved
+		const glm::mat4& transform = getTransform();
+
+		//Per object uniforms go in the queue's per draw ring
+		ObjectData objectData;
+		objectData.transform = transform;
+
+		//Describe the draw, the queue does the binds shared with other packets
+		DrawPacket packet;
+		packet.pass = PASS_OPAQUE;
+		packet.pipeline = pipeline;
+		packet.fallbackProgramId = ShaderLibrary::get().getFallbackProgram();
+		packet.textureTarget = GL_TEXTURE_2D;
+		packet.textureName = material->getTextureName();
+		packet.mode = GL_TRIANGLES;
+		packet.count = model->getNumVertices();
+		packet.drawDataOffset = queue->allocateDrawData(&objectData, sizeof(objectData));
+		packet.drawDataSize = sizeof(objectData);
+		packet.depth = glm::length(glm::vec3(transform[3]) - cam->getPos());
+		packet.owner = this;
+
+		if (occlusionQueries != nullptr) {
+			packet.conditionQuery = occlusionQueries->submit(queue, cam, queryObject, transform, bounds);
+		}
 
-		//Unselect the attribute from the context
-		glDisableVertexAttribArray(vertexPos3DLocation);
-		glDisableVertexAttribArray(vertexUVLocation);
+		queue->submit(packet);
+	}
 
-		//Unselect the program from the context
-		glUseProgram(0);
+	void ModelRenderer::setOcclusionQueries(OcclusionQueries* oq) {
+		occlusionQueries = oq;
 
+		if (oq != nullptr && queryObject == -1) {
+			queryObject = oq->addObject();
+		}
+	}
 
+	void ModelRenderer::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		//Camera matrices come from the shared FrameData block
+		//Texture is always bound to unit 0
+		GLStateCache::get().uniform1i(samplerId, 0);
 	}
 
-	//Release objects allocated for program and vertex buffer object
+	//Release the vertex buffer object, the program belongs to the shader library
 	void ModelRenderer::destroy() {
-		glDeleteProgram(programId);
-
 		glDeleteBuffers(1, &vboModel);
+		GLStateCache::get().onBufferDeleted(vboModel);
+
+		vertexArray.destroy();
 	}
 
 
@@ -7,9 +7,14 @@
 #include "Camera.h"
 #include "Model.h"
 #include "Texture.h"
+#include "RenderQueue.h"
+#include "Frustum.h"
+#include "OcclusionQueries.h"
+#include "SceneGraph.h"
+#include "VertexArray.h"
 
 namespace GE {
-	class ModelRenderer {
+	class ModelRenderer : public Renderable {
 	public:
 		ModelRenderer(Model* m);
 		~ModelRenderer();
@@ -20,8 +25,11 @@ namespace GE {
 		// Update method to update object state, e.g. animation
 		void update();
 
-		
-		void draw(Camera* cam);
+		// Add a draw packet for the model to the render queue
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
 
 		// Release method to free up objects
 		void destroy();
@@ -58,27 +66,54 @@ namespace GE {
 			return scale_z;
 		}
 
+		// World transformation. In a scene graph it is the node's world
+		// matrix as of the last SceneGraph::update
+		const glm::mat4& getTransform();
+
+		// Node in the scene graph, NO_PARENT if not in one
+		int getSceneNode() {
+			return node;
+		}
+
 		// Mutator methods
 		void setPos(float x, float y, float z) {
 			pos_x = x;
 			pos_y = y;
 			pos_z = z;
+			transformChanged();
 		}
 		void setRotation(float rx, float ry, float rz) {
 			rot_x = rx;
 			rot_y = ry;
 			rot_z = rz;
+			transformChanged();
 		}
 		void setScale(float sx, float sy, float sz) {
 			scale_x = sx;
 			scale_y = sy;
 			scale_z = sz;
+			transformChanged();
 		}
 
+		// Give the model a node in scene under parent, so it follows the
+		// parent's transform. Position, rotation and scale become local
+		// to the parent
+		void attachToScene(SceneGraph* scene, int parent = SceneGraph::NO_PARENT);
+
 		void setMaterial(Texture* mat) {
 			material = mat;
 		}
 
+		// Skip the draw with conditional rendering while an occlusion query
+		// of the model's bounding box is hidden. Worth it for heavy models
+		// only. Pass the same OcclusionQueries every time, nullptr turns it off
+		void setOcclusionQueries(OcclusionQueries* oq);
+
+	private:
+		// Push a changed position, rotation or scale to the scene node, or
+		// rebuild the transformation at the next getTransform
+		void transformChanged();
+
 	private:
 		// Member fields
 		// Program object that contains the shaders
@@ -92,15 +127,32 @@ namespace GE {
 		
 		GLuint vboModel;
 
+		// Vertex layout recorded once at init
+		VertexArray vertexArray;
+
+		// Program, vertex layout and state of every draw, made at init
+		const PipelineState* pipeline;
+
 		// Location, rotation and scale variables
 		float pos_x, pos_y, pos_z;
 		float rot_x, rot_y, rot_z;
 		float scale_x, scale_y, scale_z;
 
-		// GLSL uniform variables for the transformation, view and projection matrices
-		GLuint transformUniformId;
-		GLuint viewUniformId;
-		GLuint projectionUniformId;
+		// Transformation copied into the per draw uniform ring, rebuilt only
+		// when it changes. Outside a scene graph only
+		glm::mat4 transformationMat;
+		bool transformDirty;
+
+		// Node holding the transformation inside a scene graph
+		SceneGraph* scene;
+		int node;
+
+		// Model space bounds and this renderer's object in the occlusion queries
+		AABB bounds;
+		OcclusionQueries* occlusionQueries;
+		int queryObject;
+
+		// GLSL uniform for the texture sampler, matrices come from uniform blocks
 		GLuint samplerId;
 		Model* model;
 		Texture* material;
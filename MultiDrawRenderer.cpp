@@ -0,0 +1,714 @@
+#include "MultiDrawRenderer.h"
+#include "FrameUniforms.h"
+#include "Frustum.h"
+#include "GLStateCache.h"
+#include "Random.h"
+#include "ShaderLibrary.h"
+#include "ShaderUtils.h"
+#include "Timing.h"
+#include <algorithm>
+#include <iostream>
+
+namespace GE {
+	// Initial space for one frame of commands and transforms, multiples of
+	// the transform size so base instances stay whole numbers
+	const GLsizeiptr COMMAND_REGION_SIZE = 1024 * sizeof(DrawArraysIndirectCommand);
+	const GLsizeiptr DRAW_REGION_SIZE = 1024 * sizeof(glm::mat4);
+
+	// Threads per work group of the compute shaders
+	const GLuint CULL_GROUP_SIZE = 64;
+
+	// Zero the commands so the unused ones at the end of each texture
+	// group draw nothing, and reset the visible counts
+	static const GLchar* C_ClearShaderCode[] = {
+		"#version 430\n"
+		"layout(local_size_x = 64) in;\n"
+		"struct Command { uint count; uint instanceCount; uint first; uint baseInstance; };\n"
+		"layout(std430, binding = 1) writeonly buffer Commands { Command commands[]; };\n"
+		"layout(std430, binding = 2) writeonly buffer Counts { uint counts[]; };\n"
+		"uniform uint numCommands;\n"
+		"uniform uint numGroups;\n"
+		"void main() {\n"
+		"uint i = gl_GlobalInvocationID.x;\n"
+		"if (i < numCommands) commands[i] = Command(0u, 0u, 0u, 0u);\n"
+		"if (i < numGroups) counts[i] = 0u;\n"
+		"}\n" };
+
+	// Test each object's sphere against the frustum planes and append a
+	// command for the visible ones to its texture group
+	static const GLchar* C_CullShaderCode[] = {
+		"#version 430\n"
+		"layout(local_size_x = 64) in;\n"
+		"struct Object { mat4 transform; vec4 sphere; uvec4 draw; };\n"
+		"struct Command { uint count; uint instanceCount; uint first; uint baseInstance; };\n"
+		"layout(std430, binding = 0) readonly buffer Objects { Object objects[]; };\n"
+		"layout(std430, binding = 1) writeonly buffer Commands { Command commands[]; };\n"
+		"layout(std430, binding = 2) buffer Counts { uint counts[]; };\n"
+		"uniform vec4 planes[6];\n"
+		"uniform uint numObjects;\n"
+		"void main() {\n"
+		"uint i = gl_GlobalInvocationID.x;\n"
+		"if (i >= numObjects) return;\n"
+		"vec4 s = objects[i].sphere;\n"
+		"for (int p = 0; p < 6; p++) {\n"
+		"if (dot(planes[p].xyz, s.xyz) + planes[p].w < -s.w) return;\n"
+		"}\n"
+		"uvec4 d = objects[i].draw;\n"
+		"uint slot = d.z + atomicAdd(counts[d.w], 1u);\n"
+		"commands[slot] = Command(d.y, 1u, d.x, i);\n"
+		"}\n" };
+
+	MultiDrawRenderer::MultiDrawRenderer() {
+		programId = 0;
+		pipeline = nullptr;
+		vboMeshes = 0;
+		layoutBuffer = 0;
+		indirect = false;
+		meshesDirty = false;
+		visibleObjects = 0;
+
+		cullMode = CULL_CPU;
+		gpuCullingSupported = false;
+		indirectCount = false;
+		clearProgramId = cullProgramId = 0;
+		objectBuffer = commandBuffer = countBuffer = 0;
+		gpuLayoutDirty = true;
+		submitMs = 0.0f;
+		jobs = nullptr;
+		occlusion = nullptr;
+	}
+
+	MultiDrawRenderer::~MultiDrawRenderer() {
+	}
+
+	void MultiDrawRenderer::init() {
+		indirect = (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance);
+
+		// Indirect draws fetch the transform from the per draw buffer through
+		// the base instance, the fallback uses the per draw uniform block
+		const GLchar* V_IndirectShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"in vec2 vUV;\n"
+			"in mat4 drawTransform;\n"
+			"out vec2 uv;\n"
+			"void main() {\n"
+			"gl_Position = viewProjection * drawTransform * vec4(vertexPos3D, 1);\n"
+			"uv = vUV;\n"
+			"}\n" };
+
+		const GLchar* V_ObjectShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			GE_OBJECT_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"in vec2 vUV;\n"
+			"out vec2 uv;\n"
+			"void main() {\n"
+			"gl_Position = viewProjection * transform * vec4(vertexPos3D, 1);\n"
+			"uv = vUV;\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			"in vec2 uv;\n"
+			"uniform sampler2D sampler;\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"fragmentColour = texture(sampler, uv);\n"
+			"}\n" };
+
+		// Built in the background with fixed attribute locations, the
+		// matrix last as it takes four. Only the per object packets can
+		// draw with the fallback meanwhile, it reads ObjectData
+		const char* attributes[] = { "vertexPos3D", "vUV", "drawTransform" };
+		vertexPos3DLocation = 0;
+		vertexUVLocation = 1;
+		drawTransformLocation = indirect ? 2 : -1;
+		samplerId = -1;
+
+		programId = ShaderLibrary::get().requestProgramFromSource(indirect ? V_IndirectShaderCode[0] : V_ObjectShaderCode[0], F_ShaderCode[0], "",
+			attributes, indirect ? 3 : 2, [this](GLuint program) {
+				samplerId = glGetUniformLocation(program, "sampler");
+			});
+
+		if (programId == 0) {
+			std::cerr << "Failed to create MultiDrawRenderer program. Check console for errors" << std::endl;
+			return;
+		}
+
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.cull = true;
+		pipeline = PipelineCache::get().create(desc);
+
+		if (!indirect) {
+			std::cout << "MultiDrawRenderer: multi draw indirect unavailable, drawing objects one by one" << std::endl;
+		}
+
+		// Mesh vertices are uploaded at the first submit
+		glGenBuffers(1, &vboMeshes);
+
+		if (indirect) {
+			commandStream.init(GL_DRAW_INDIRECT_BUFFER, COMMAND_REGION_SIZE);
+			drawStream.init(GL_ARRAY_BUFFER, DRAW_REGION_SIZE);
+		}
+
+		// GPU culling needs compute shaders and storage buffers as well
+		gpuCullingSupported = indirect &&
+			(GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object));
+
+		if (gpuCullingSupported) {
+			if (!compileComputeProgram(C_ClearShaderCode, &clearProgramId) ||
+				!compileComputeProgram(C_CullShaderCode, &cullProgramId)) {
+				std::cerr << "Failed to create MultiDrawRenderer cull programs, culling on the CPU" << std::endl;
+				gpuCullingSupported = false;
+			}
+		}
+
+		if (gpuCullingSupported) {
+			clearCommandsLocation = glGetUniformLocation(clearProgramId, "numCommands");
+			clearGroupsLocation = glGetUniformLocation(clearProgramId, "numGroups");
+			planesLocation = glGetUniformLocation(cullProgramId, "planes");
+			numObjectsLocation = glGetUniformLocation(cullProgramId, "numObjects");
+
+			indirectCount = GLEW_ARB_indirect_parameters != 0;
+
+			// Sized when the objects are first uploaded
+			glGenBuffers(1, &objectBuffer);
+			glGenBuffers(1, &commandBuffer);
+			glGenBuffers(1, &countBuffer);
+		}
+
+		buildVertexArray();
+	}
+
+	void MultiDrawRenderer::buildVertexArray() {
+		vertexArray.destroy();
+		vertexArray = VertexArray();
+
+		vertexArray.addAttrib(vboMeshes, vertexPos3DLocation, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		vertexArray.addAttrib(vboMeshes, vertexUVLocation, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+
+		if (indirect) {
+			// Transforms come from this frame's per draw buffer, or straight
+			// from the object buffer when the GPU builds the commands
+			GLsizei stride = sizeof(glm::mat4);
+			layoutBuffer = drawStream.getBuffer();
+
+			if (cullMode == CULL_GPU) {
+				stride = sizeof(GPUObject);
+				layoutBuffer = objectBuffer;
+			}
+
+			// Each column of the matrix is its own attribute location
+			for (int col = 0; col < 4; col++) {
+				vertexArray.addAttrib(layoutBuffer, drawTransformLocation + col, 4, GL_FLOAT, stride,
+					col * sizeof(glm::vec4), 1);
+			}
+		}
+
+		vertexArray.build();
+	}
+
+	int MultiDrawRenderer::addMesh(Model* model) {
+		Mesh mesh;
+		mesh.first = (GLint)vertices.size();
+		mesh.count = model->getNumVertices();
+		mesh.radius = 0.0f;
+
+		const Vertex* v = (const Vertex*)model->getVertices();
+		for (int i = 0; i < mesh.count; i++) {
+			vertices.push_back(v[i]);
+			mesh.radius = glm::max(mesh.radius, glm::length(glm::vec3(v[i].x, v[i].y, v[i].z)));
+		}
+
+		meshes.push_back(mesh);
+		meshesDirty = true;
+
+		return (int)meshes.size() - 1;
+	}
+
+	int MultiDrawRenderer::addObject(int mesh, const glm::mat4& transform, Texture* texture) {
+		Object obj;
+		obj.mesh = mesh;
+		obj.texture = texture;
+		objects.push_back(obj);
+		gpuLayoutDirty = true;
+
+		// Same index in the culler as in objects
+		culler.addSphere(glm::vec3(0.0f), 0.0f);
+
+		setTransform((int)objects.size() - 1, transform);
+
+		return (int)objects.size() - 1;
+	}
+
+	void MultiDrawRenderer::setTransform(int object, const glm::mat4& transform) {
+		Object& obj = objects[object];
+		obj.transform = transform;
+
+		float scale = glm::max(glm::length(glm::vec3(transform[0])),
+			glm::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+		obj.radius = meshes[obj.mesh].radius * scale;
+
+		culler.setSphere(object, glm::vec3(transform[3]), obj.radius);
+
+		// Only this object is uploaded at the next GPU culled submit. The
+		// CPU path never uploads them, switching to the GPU rebuilds all
+		if (cullMode == CULL_GPU && !gpuLayoutDirty) {
+			int slot = objectSlots[object];
+			fillGPUObject(object, slot, gpuObjects[slot].group, gpuObjects[slot].commandStart);
+			dirtySlots.push_back(slot);
+		}
+	}
+
+	void MultiDrawRenderer::setCullMode(CullMode mode) {
+		if (mode == CULL_GPU && !gpuCullingSupported) {
+			mode = CULL_CPU;
+		}
+
+		if (mode != cullMode) {
+			cullMode = mode;
+
+			// Transforms set while culling on the CPU were not kept up to date
+			if (cullMode == CULL_GPU) {
+				gpuLayoutDirty = true;
+			}
+
+			// Instanced transforms move to a different buffer
+			if (programId != 0) {
+				buildVertexArray();
+			}
+		}
+	}
+
+	void MultiDrawRenderer::fillGPUObject(int object, int slot, int group, int commandStart) {
+		const Object& obj = objects[object];
+		const Mesh& mesh = meshes[obj.mesh];
+		GPUObject& g = gpuObjects[slot];
+
+		g.transform = obj.transform;
+		g.sphere = glm::vec4(glm::vec3(obj.transform[3]), obj.radius);
+		g.first = mesh.first;
+		g.count = mesh.count;
+		g.commandStart = commandStart;
+		g.group = group;
+	}
+
+	void MultiDrawRenderer::rebuildGPUObjects() {
+		// Objects sharing a texture get neighbouring slots, and their
+		// commands a range of the command buffer of the same size
+		std::vector<int> order(objects.size());
+		for (int i = 0; i < (int)objects.size(); i++) {
+			order[i] = i;
+		}
+
+		std::sort(order.begin(), order.end(), [this](int a, int b) {
+			GLuint ta = objects[a].texture ? objects[a].texture->getTextureName() : 0;
+			GLuint tb = objects[b].texture ? objects[b].texture->getTextureName() : 0;
+			return ta < tb;
+		});
+
+		gpuObjects.resize(objects.size());
+		objectSlots.resize(objects.size());
+		groups.clear();
+
+		for (int slot = 0; slot < (int)order.size(); slot++) {
+			const Object& obj = objects[order[slot]];
+			GLuint texture = obj.texture ? obj.texture->getTextureName() : 0;
+
+			if (groups.empty() || groups.back().texture != texture) {
+				TextureGroup group;
+				group.texture = texture;
+				group.start = slot;
+				group.size = 0;
+				groups.push_back(group);
+			}
+			groups.back().size++;
+
+			objectSlots[order[slot]] = slot;
+			fillGPUObject(order[slot], slot, (int)groups.size() - 1, groups.back().start);
+		}
+
+		GLStateCache& gl = GLStateCache::get();
+
+		gl.bindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, gpuObjects.size() * sizeof(GPUObject), gpuObjects.data(), GL_DYNAMIC_DRAW);
+
+		gl.bindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(DrawArraysIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+
+		gl.bindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, groups.size() * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+
+		dirtySlots.clear();
+		gpuLayoutDirty = false;
+	}
+
+	void MultiDrawRenderer::uploadGPUObjects() {
+		if (dirtySlots.empty()) {
+			return;
+		}
+
+		std::sort(dirtySlots.begin(), dirtySlots.end());
+		dirtySlots.erase(std::unique(dirtySlots.begin(), dirtySlots.end()), dirtySlots.end());
+
+		GLStateCache::get().bindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+
+		// One upload per run of neighbouring changed slots
+		size_t start = 0;
+		for (size_t i = 1; i <= dirtySlots.size(); i++) {
+			if (i < dirtySlots.size() && dirtySlots[i] == dirtySlots[i - 1] + 1) {
+				continue;
+			}
+
+			int first = dirtySlots[start];
+			int count = dirtySlots[i - 1] - first + 1;
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(GPUObject), count * sizeof(GPUObject), &gpuObjects[first]);
+
+			start = i;
+		}
+
+		dirtySlots.clear();
+	}
+
+	void MultiDrawRenderer::submitGPU(RenderQueue* queue, Camera* cam) {
+		if (gpuLayoutDirty) {
+			rebuildGPUObjects();
+		}
+		uploadGPUObjects();
+
+		GLuint numObjects = (GLuint)gpuObjects.size();
+		GLuint numGroups = (GLuint)groups.size();
+
+		GLStateCache& gl = GLStateCache::get();
+		gl.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, objectBuffer);
+		gl.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+		gl.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, countBuffer);
+
+		// Reset the counts, and the commands when the draw can't read the counts
+		GLuint clearCommands = indirectCount ? 0 : numObjects;
+		GLuint clearThreads = glm::max(clearCommands, numGroups);
+
+		gl.useProgram(clearProgramId);
+		glUniform1ui(clearCommandsLocation, clearCommands);
+		glUniform1ui(clearGroupsLocation, numGroups);
+		glDispatchCompute((clearThreads + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		// Planes go straight to GL, the state cache only remembers single values
+		const Frustum& frustum = cam->getFrustum();
+
+		gl.useProgram(cullProgramId);
+		glUniform4fv(planesLocation, Frustum::NUM_PLANES, &frustum.getPlane(0).x);
+		glUniform1ui(numObjectsLocation, numObjects);
+		glDispatchCompute((numObjects + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+		// Commands and counts are read by the draw, not by another shader
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+		visibleObjects = -1;
+
+		// One packet per texture group, the GPU decides how many of its commands draw
+		for (int g = 0; g < (int)groups.size(); g++) {
+			DrawPacket packet;
+			packet.pass = PASS_OPAQUE;
+			packet.pipeline = pipeline;
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = groups[g].texture;
+			packet.vao = vertexArray.getName();
+			packet.mode = GL_TRIANGLES;
+			packet.indirectBuffer = commandBuffer;
+			packet.indirectOffset = groups[g].start * sizeof(DrawArraysIndirectCommand);
+			packet.drawCount = groups[g].size;
+			if (indirectCount) {
+				packet.indirectCountBuffer = countBuffer;
+				packet.indirectCountOffset = g * sizeof(GLuint);
+			}
+			packet.owner = this;
+
+			queue->submit(packet);
+		}
+	}
+
+	void MultiDrawRenderer::submit(RenderQueue* queue, Camera* cam) {
+		if (programId == 0 || objects.empty()) {
+			return;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		if (meshesDirty) {
+			GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, vboMeshes);
+			glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+			meshesDirty = false;
+		}
+
+		if (cullMode == CULL_GPU) {
+			submitGPU(queue, cam);
+		}
+		else {
+			submitCPU(queue, cam);
+		}
+
+		submitMs = elapsedMs(start);
+	}
+
+	void MultiDrawRenderer::submitCPU(RenderQueue* queue, Camera* cam) {
+		// SIMD frustum test of every object, then grouped by texture and
+		// front to back within a texture
+		culler.cullSpheres(cam, visibleIndices, jobs);
+
+		glm::vec3 camPos = cam->getPos();
+
+		visible.clear();
+		for (int i : visibleIndices) {
+			const Object& obj = objects[i];
+
+			if (occlusion != nullptr && !occlusion->testSphere(glm::vec3(obj.transform[3]), obj.radius)) {
+				continue;
+			}
+
+			VisibleObject vo;
+			vo.texture = obj.texture ? obj.texture->getTextureName() : 0;
+			vo.depth = glm::length(glm::vec3(obj.transform[3]) - camPos);
+			vo.object = i;
+			visible.push_back(vo);
+		}
+
+		visibleObjects = (int)visible.size();
+
+		std::sort(visible.begin(), visible.end(), [](const VisibleObject& a, const VisibleObject& b) {
+			return a.texture != b.texture ? a.texture < b.texture : a.depth < b.depth;
+		});
+
+		if (!indirect) {
+			submitObjects(queue, cam);
+			return;
+		}
+
+		if (visible.empty()) {
+			return;
+		}
+
+		commandStream.beginFrame();
+		drawStream.beginFrame();
+		queue->addFenceWait(commandStream.getFenceWaitMs() + drawStream.getFenceWaitMs());
+
+		// Transforms in draw order
+		transforms.clear();
+		for (const VisibleObject& vo : visible) {
+			transforms.push_back(objects[vo.object].transform);
+		}
+
+		GLintptr drawOffset = drawStream.write(transforms.data(), transforms.size() * sizeof(glm::mat4), sizeof(glm::mat4));
+
+		// A larger frame can replace the per draw buffer
+		if (drawStream.getBuffer() != layoutBuffer) {
+			buildVertexArray();
+		}
+
+		// The instanced attribute reads from the start of the buffer, so
+		// the base instance also skips to this frame's region
+		GLuint baseInstance = (GLuint)((drawStream.getRegionOffset() + drawOffset) / sizeof(glm::mat4));
+
+		commands.clear();
+		for (int i = 0; i < (int)visible.size(); i++) {
+			const Mesh& mesh = meshes[objects[visible[i].object].mesh];
+
+			DrawArraysIndirectCommand cmd;
+			cmd.count = mesh.count;
+			cmd.instanceCount = 1;
+			cmd.first = mesh.first;
+			cmd.baseInstance = baseInstance + i;
+			commands.push_back(cmd);
+		}
+
+		GLintptr commandOffset = commandStream.write(commands.data(), commands.size() * sizeof(DrawArraysIndirectCommand),
+			sizeof(DrawArraysIndirectCommand));
+		commandOffset += commandStream.getRegionOffset();
+
+		commandStream.flush();
+		drawStream.flush();
+
+		// One packet for each run of objects sharing a texture
+		int start = 0;
+		for (int i = 1; i <= (int)visible.size(); i++) {
+			if (i < (int)visible.size() && visible[i].texture == visible[start].texture) {
+				continue;
+			}
+
+			DrawPacket packet;
+			packet.pass = PASS_OPAQUE;
+			packet.pipeline = pipeline;
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = visible[start].texture;
+			packet.vao = vertexArray.getName();
+			packet.mode = GL_TRIANGLES;
+			packet.indirectBuffer = commandStream.getBuffer();
+			packet.indirectOffset = commandOffset + start * sizeof(DrawArraysIndirectCommand);
+			packet.drawCount = i - start;
+			packet.depth = visible[start].depth;
+			packet.owner = this;
+
+			queue->submit(packet);
+
+			start = i;
+		}
+	}
+
+	void MultiDrawRenderer::submitObjects(RenderQueue* queue, Camera* cam) {
+		for (const VisibleObject& vo : visible) {
+			const Object& obj = objects[vo.object];
+			const Mesh& mesh = meshes[obj.mesh];
+
+			ObjectData objectData;
+			objectData.transform = obj.transform;
+
+			DrawPacket packet;
+			packet.pass = PASS_OPAQUE;
+			packet.pipeline = pipeline;
+			packet.fallbackProgramId = ShaderLibrary::get().getFallbackProgram();
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = vo.texture;
+			packet.vao = vertexArray.getName();
+			packet.mode = GL_TRIANGLES;
+			packet.first = mesh.first;
+			packet.count = mesh.count;
+			packet.drawDataOffset = queue->allocateDrawData(&objectData, sizeof(objectData));
+			packet.drawDataSize = sizeof(objectData);
+			packet.depth = vo.depth;
+			packet.owner = this;
+
+			queue->submit(packet);
+		}
+	}
+
+	void MultiDrawRenderer::endFrame() {
+		if (indirect) {
+			commandStream.endFrame();
+			drawStream.endFrame();
+		}
+	}
+
+	void MultiDrawRenderer::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		// Camera matrices come from the shared FrameData block
+		GLStateCache::get().uniform1i(samplerId, 0);
+	}
+
+	void MultiDrawRenderer::destroy() {
+		GLStateCache& gl = GLStateCache::get();
+
+		// The draw program belongs to the shader library
+		glDeleteBuffers(1, &vboMeshes);
+		gl.onBufferDeleted(vboMeshes);
+
+		if (indirect) {
+			commandStream.destroy();
+			drawStream.destroy();
+		}
+
+		if (gpuCullingSupported) {
+			glDeleteProgram(clearProgramId);
+			glDeleteProgram(cullProgramId);
+			gl.onProgramDeleted(clearProgramId);
+			gl.onProgramDeleted(cullProgramId);
+
+			GLuint buffers[] = { objectBuffer, commandBuffer, countBuffer };
+			glDeleteBuffers(3, buffers);
+			for (GLuint b : buffers) {
+				gl.onBufferDeleted(b);
+			}
+		}
+
+		vertexArray.destroy();
+	}
+
+	void MultiDrawRenderer::runBenchmark(Model* model, Texture* texture, JobSystem* jobs, CullMode mode) {
+		// Objects spread through a cube around a camera looking down -z,
+		// roughly a quarter of them in view, like FrustumCuller's benchmark
+		Camera cam(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f), 90.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+
+		RenderQueue queue;
+		queue.init();
+
+		// Draw from the camera the objects are culled for. The engine's
+		// frame block is bound back afterwards, and refilled next frame
+		GLint engineFrameData = 0;
+		glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, GE_FRAME_DATA_BINDING, &engineFrameData);
+
+		FrameUniforms frameUniforms;
+		frameUniforms.init();
+		frameUniforms.update(&cam, 0.0f, 0.0f);
+
+		const int ITERATIONS = 10;
+
+		for (int count = 100; count <= 100000; count *= 10) {
+			MultiDrawRenderer renderer;
+			renderer.init();
+			renderer.setJobSystem(jobs);
+
+			// Only the first renderer's program isn't built yet
+			ShaderLibrary::get().warmUp();
+			renderer.setCullMode(mode);
+
+			if (renderer.getCullMode() != mode) {
+				std::cout << "MultiDrawRenderer: GPU culling unsupported, nothing to compare" << std::endl;
+				renderer.destroy();
+				break;
+			}
+			int mesh = renderer.addMesh(model);
+
+			unsigned int seed = 1u;
+			for (int i = 0; i < count; i++) {
+				glm::vec3 c;
+				for (int k = 0; k < 3; k++) {
+					c[k] = (randomFloat(seed) - 0.5f) * 2000.0f;
+				}
+				renderer.addObject(mesh, glm::translate(glm::mat4(1.0f), c), texture);
+			}
+
+			float submitMs = 0.0f;
+			float frameMs = 0.0f;
+
+			// The first frame uploads the meshes and is not timed
+			for (int iteration = 0; iteration <= ITERATIONS; iteration++) {
+				Clock::time_point start = Clock::now();
+
+				queue.begin(&cam);
+				renderer.submit(&queue, &cam);
+				queue.execute();
+				renderer.endFrame();
+
+				// Wait for the GPU so the frame time covers the draws
+				glFinish();
+
+				if (iteration > 0) {
+					submitMs += renderer.getSubmitMs() / ITERATIONS;
+					frameMs += elapsedMs(start) / ITERATIONS;
+				}
+			}
+
+			const RenderStats& stats = queue.getStats();
+
+			std::cout << "MultiDrawRenderer (" << (mode == CULL_GPU ? "GPU" : "CPU") << " cull, "
+				<< (renderer.isIndirect() ? "indirect" : "one by one") << "): " << count << " objects, ";
+			if (mode == CULL_CPU) {
+				std::cout << renderer.getVisibleObjects() << " visible, ";
+			}
+			std::cout << "submit "
+				<< submitMs << " ms, frame " << frameMs << " ms, " << stats.drawCalls << " draw calls, "
+				<< stats.glCallsIssued << " GL calls" << std::endl;
+
+			renderer.destroy();
+		}
+
+		frameUniforms.destroy();
+		GLStateCache::get().bindBufferBase(GL_UNIFORM_BUFFER, GE_FRAME_DATA_BINDING, engineFrameData);
+
+		queue.destroy();
+	}
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "Camera.h"
+#include "FrustumCuller.h"
+#include "JobSystem.h"
+#include "OcclusionCuller.h"
+#include "Model.h"
+#include "Texture.h"
+#include "RenderQueue.h"
+#include "StreamBuffer.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Draws many opaque objects, each with its own mesh, transform and
+	// texture, with one glMultiDrawArraysIndirect call per texture
+	//
+	// The meshes share one vertex buffer and one VAO. Every frame the
+	// visible objects are sorted by texture, an indirect command is written
+	// for each of them and their transforms go into a per draw buffer read
+	// as an instanced attribute. Each command's base instance selects its
+	// transform, so the number of GL calls doesn't grow with the objects
+	//
+	// With GL 4.3 the culling can move to the GPU. The objects then live in
+	// a storage buffer, only changed objects are uploaded, and a compute
+	// shader tests them against the frustum and appends indirect commands
+	// for the visible ones. Nothing is read back, the draw consumes the
+	// commands directly
+	//
+	// Without multi draw indirect and base instance (GL 4.3, or the ARB
+	// extensions) every object becomes an ordinary packet instead
+	class MultiDrawRenderer : public Renderable {
+	public:
+		// Where the frustum culling runs
+		enum CullMode {
+			CULL_CPU = 0,
+			CULL_GPU
+		};
+
+		MultiDrawRenderer();
+		~MultiDrawRenderer();
+
+		// Create shaders, buffers and the VAO
+		void init();
+
+		// Add a model's vertices to the shared vertex buffer, returns its mesh index
+		int addMesh(Model* model);
+
+		// Add an object drawing a mesh, returns its index
+		int addObject(int mesh, const glm::mat4& transform, Texture* texture);
+
+		void setTransform(int object, const glm::mat4& transform);
+
+		// Cull the objects and add one packet per texture
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Fence this frame's commands and transforms, call once the queue has executed
+		void endFrame();
+
+		// Switch between CPU and GPU culling, CULL_GPU is ignored if unsupported
+		void setCullMode(CullMode mode);
+
+		// Workers sharing the CPU culling of large object counts, optional
+		void setJobSystem(JobSystem* js) {
+			jobs = js;
+		}
+
+		// Objects hidden in the occlusion culler's depth buffer are skipped
+		// when culling on the CPU. Render the occluders before submit,
+		// nullptr turns it off
+		void setOcclusionCuller(OcclusionCuller* oc) {
+			occlusion = oc;
+		}
+
+		OcclusionCuller* getOcclusionCuller() {
+			return occlusion;
+		}
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		int getNumObjects() {
+			return (int)objects.size();
+		}
+
+		// Not known when culling on the GPU, returns -1
+		int getVisibleObjects() {
+			return visibleObjects;
+		}
+
+		bool isIndirect() {
+			return indirect;
+		}
+
+		CullMode getCullMode() {
+			return cullMode;
+		}
+
+		bool isGPUCullingSupported() {
+			return gpuCullingSupported;
+		}
+
+		// CPU time of the last submit, culling included
+		float getSubmitMs() {
+			return submitMs;
+		}
+
+		// Print the submit and frame times and the GL calls for 100 to
+		// 100000 objects drawing model to the console, culled with mode.
+		// Uses its own queue and camera, so call it outside the frame
+		static void runBenchmark(Model* model, Texture* texture, JobSystem* jobs, CullMode mode = CULL_CPU);
+
+	private:
+		// Range of the shared vertex buffer holding one mesh
+		struct Mesh {
+			GLint first;
+			GLsizei count;
+
+			// Bounding sphere around the model origin
+			float radius;
+		};
+
+		struct Object {
+			int mesh;
+			glm::mat4 transform;
+			Texture* texture;
+
+			// Mesh radius scaled by the largest axis of the transform
+			float radius;
+		};
+
+		// Visible object ready to be sorted into commands
+		struct VisibleObject {
+			GLuint texture;
+			float depth;
+			int object;
+		};
+
+		// Object as the cull compute shader reads it, std430 layout
+		struct GPUObject {
+			glm::mat4 transform;
+
+			// World space bounding sphere, w is the radius
+			glm::vec4 sphere;
+
+			// Mesh range, first command slot of the texture group and the group
+			GLuint first;
+			GLuint count;
+			GLuint commandStart;
+			GLuint group;
+		};
+
+		// Objects sharing a texture, a contiguous range of slots
+		struct TextureGroup {
+			GLuint texture;
+			int start;
+			int size;
+		};
+
+		// Record the VAO, again whenever the per draw buffer is replaced
+		void buildVertexArray();
+
+		// Fallback without multi draw indirect, one packet per object
+		void submitObjects(RenderQueue* queue, Camera* cam);
+
+		// CPU culling path, commands written to the stream buffers
+		void submitCPU(RenderQueue* queue, Camera* cam);
+
+		// GPU culling path
+		void submitGPU(RenderQueue* queue, Camera* cam);
+
+		// Order the objects by texture into slots and upload all of them
+		void rebuildGPUObjects();
+
+		// Upload the slots changed since the last frame
+		void uploadGPUObjects();
+
+		// Copy an object into its slot of gpuObjects
+		void fillGPUObject(int object, int slot, int group, int commandStart);
+
+	private:
+		// Member fields
+		// Program object that contains the shaders
+		GLuint programId;
+
+		// Opaque and culled. Without the vertex array, which is rebuilt
+		// when meshes are added or the cull mode changes
+		const PipelineState* pipeline;
+
+		GLint vertexPos3DLocation;
+		GLint vertexUVLocation;
+
+		// A mat4 attribute takes four consecutive locations
+		GLint drawTransformLocation;
+
+		GLint samplerId;
+
+		bool indirect;
+
+		// Shared vertex buffer, uploaded at submit when meshes were added
+		GLuint vboMeshes;
+		std::vector<Vertex> vertices;
+		bool meshesDirty;
+
+		// Per frame commands and transforms
+		StreamBuffer commandStream;
+		StreamBuffer drawStream;
+
+		VertexArray vertexArray;
+
+		// Per draw buffer recorded in the VAO
+		GLuint layoutBuffer;
+
+		std::vector<Mesh> meshes;
+		std::vector<Object> objects;
+
+		CullMode cullMode;
+		bool gpuCullingSupported;
+
+		// Bounding spheres of the objects for CPU culling, same indices as objects
+		FrustumCuller culler;
+		std::vector<int> visibleIndices;
+		JobSystem* jobs;
+		OcclusionCuller* occlusion;
+
+		// ARB_indirect_parameters, the draw reads the visible count instead
+		// of skipping the empty commands at the end of each group
+		bool indirectCount;
+
+		// Compute programs clearing the commands and culling the objects
+		GLuint clearProgramId;
+		GLuint cullProgramId;
+		GLint clearCommandsLocation;
+		GLint clearGroupsLocation;
+		GLint planesLocation;
+		GLint numObjectsLocation;
+
+		// Objects, commands and visible counts per texture group in graphics memory
+		GLuint objectBuffer;
+		GLuint commandBuffer;
+		GLuint countBuffer;
+
+		// CPU copy of the objects in slot order
+		std::vector<GPUObject> gpuObjects;
+		std::vector<int> objectSlots;
+		std::vector<TextureGroup> groups;
+		std::vector<int> dirtySlots;
+		bool gpuLayoutDirty;
+
+		float submitMs;
+
+		// Reused every frame
+		std::vector<VisibleObject> visible;
+		std::vector<DrawArraysIndirectCommand> commands;
+		std::vector<glm::mat4> transforms;
+
+		int visibleObjects;
+	};
+}
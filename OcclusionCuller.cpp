@@ -0,0 +1,397 @@
+#include "OcclusionCuller.h"
+#include "SimdConfig.h"
+#include "Timing.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace GE {
+	OcclusionCuller::OcclusionCuller(int _width, int _height) {
+		width = _width / TILE_WIDTH * TILE_WIDTH;
+		height = _height / TILE_HEIGHT * TILE_HEIGHT;
+		tilesX = width / TILE_WIDTH;
+		tilesY = height / TILE_HEIGHT;
+
+		bins.resize(tilesX * tilesY);
+		depth.assign(width * height, 1.0f);
+		tileMaxDepth.assign(tilesX * tilesY, 1.0f);
+
+		viewProjection = glm::mat4(1.0f);
+		ready = false;
+		jobs = nullptr;
+
+		rasterizedTriangles = 0;
+		rasterMs = 0.0f;
+		numTested = 0;
+		numOccluded = 0;
+	}
+
+	const char* OcclusionCuller::getSIMDName() {
+#if defined(GE_SIMD_AVX2)
+		return "AVX2";
+#elif defined(GE_SIMD_SSE)
+		return "SSE";
+#else
+		return "scalar";
+#endif
+	}
+
+	int OcclusionCuller::addOccluderMesh(const glm::vec3* positions, int numVertices) {
+		Mesh mesh;
+		mesh.first = (int)meshPositions.size();
+		mesh.count = numVertices;
+
+		meshPositions.insert(meshPositions.end(), positions, positions + numVertices);
+		meshes.push_back(mesh);
+
+		return (int)meshes.size() - 1;
+	}
+
+	int OcclusionCuller::addOccluderMesh(Model* model) {
+		Vertex* v = (Vertex*)model->getVertices();
+		int n = model->getNumVertices();
+
+		std::vector<glm::vec3> positions(n);
+		for (int i = 0; i < n; i++) {
+			positions[i] = glm::vec3(v[i].x, v[i].y, v[i].z);
+		}
+
+		return addOccluderMesh(positions.data(), n);
+	}
+
+	int OcclusionCuller::addOccluder(int mesh, const glm::mat4& transform) {
+		Occluder occ;
+		occ.mesh = mesh;
+		occ.transform = transform;
+		occluders.push_back(occ);
+
+		return (int)occluders.size() - 1;
+	}
+
+	void OcclusionCuller::setOccluderTransform(int occluder, const glm::mat4& transform) {
+		occluders[occluder].transform = transform;
+	}
+
+	void OcclusionCuller::clearOccluders() {
+		occluders.clear();
+	}
+
+	void OcclusionCuller::transformOccluder(int occluder, const glm::mat4& vp, int first) {
+		const Occluder& occ = occluders[occluder];
+		const Mesh& mesh = meshes[occ.mesh];
+		glm::mat4 m = vp * occ.transform;
+
+		for (int i = 0; i < mesh.count / 3; i++) {
+			ScreenTriangle& t = triangles[first + i];
+			t.minX = 1;
+			t.maxX = 0;
+
+			// Triangles crossing the near plane are dropped rather than
+			// clipped, losing an occluder only means less gets culled
+			glm::vec3 s[3];
+			bool inFront = true;
+
+			for (int k = 0; k < 3 && inFront; k++) {
+				glm::vec4 clip = m * glm::vec4(meshPositions[mesh.first + i * 3 + k], 1.0f);
+
+				if (clip.w <= 0.0f || clip.z < -clip.w) {
+					inFront = false;
+					break;
+				}
+
+				glm::vec3 ndc = glm::vec3(clip) / clip.w;
+				s[k] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f);
+			}
+
+			if (!inFront) {
+				continue;
+			}
+
+			// Counter clockwise triangles face the camera
+			float area = (s[1].x - s[0].x) * (s[2].y - s[0].y) - (s[1].y - s[0].y) * (s[2].x - s[0].x);
+			if (area <= 0.0f) {
+				continue;
+			}
+
+			t.minX = std::max(0, (int)std::floor(std::min(s[0].x, std::min(s[1].x, s[2].x))));
+			t.maxX = std::min(width - 1, (int)std::floor(std::max(s[0].x, std::max(s[1].x, s[2].x))));
+			t.minY = std::max(0, (int)std::floor(std::min(s[0].y, std::min(s[1].y, s[2].y))));
+			t.maxY = std::min(height - 1, (int)std::floor(std::max(s[0].y, std::max(s[1].y, s[2].y))));
+
+			if (t.minY > t.maxY) {
+				t.minX = 1;
+				t.maxX = 0;
+				continue;
+			}
+
+			// Edge k runs from vertex k to the next, positive on its left.
+			// A shared edge is always set up from the same end and negated
+			// for the other triangle, so rounding can't leave a pixel centre
+			// on it outside both and punch holes between triangles
+			for (int k = 0; k < 3; k++) {
+				const glm::vec3& p0 = s[k];
+				const glm::vec3& p1 = s[(k + 1) % 3];
+				bool flip = p1.x < p0.x || (p1.x == p0.x && p1.y < p0.y);
+
+				const glm::vec3& from = flip ? p1 : p0;
+				const glm::vec3& to = flip ? p0 : p1;
+				float sign = flip ? -1.0f : 1.0f;
+
+				float a = from.y - to.y;
+				float b = to.x - from.x;
+				float c = -(a * from.x + b * from.y);
+
+				t.edgeA[k] = a * sign;
+				t.edgeB[k] = b * sign;
+				t.edgeC[k] = c * sign;
+			}
+
+			// Depth is linear in screen space. The edge opposite a vertex
+			// divided by the area is that vertex's barycentric weight
+			float inv = 1.0f / area;
+			t.depthA = (s[0].z * t.edgeA[1] + s[1].z * t.edgeA[2] + s[2].z * t.edgeA[0]) * inv;
+			t.depthB = (s[0].z * t.edgeB[1] + s[1].z * t.edgeB[2] + s[2].z * t.edgeB[0]) * inv;
+			t.depthC = (s[0].z * t.edgeC[1] + s[1].z * t.edgeC[2] + s[2].z * t.edgeC[0]) * inv;
+		}
+	}
+
+	// Keep the nearest depth of the pixels in [x, end) of the row that are
+	// inside the triangle. x and end are multiples of the SIMD width
+	static inline void rasterizeSpan(float* row, int x, int end, float py,
+		const float* edgeA, const float* edgeB, const float* edgeC, float depthA, float depthB, float depthC) {
+		float row0 = edgeB[0] * py + edgeC[0];
+		float row1 = edgeB[1] * py + edgeC[1];
+		float row2 = edgeB[2] * py + edgeC[2];
+		float rowZ = depthB * py + depthC;
+
+#if defined(GE_SIMD_AVX2)
+		const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 a0 = _mm256_set1_ps(edgeA[0]), r0 = _mm256_set1_ps(row0);
+		__m256 a1 = _mm256_set1_ps(edgeA[1]), r1 = _mm256_set1_ps(row1);
+		__m256 a2 = _mm256_set1_ps(edgeA[2]), r2 = _mm256_set1_ps(row2);
+		__m256 az = _mm256_set1_ps(depthA), rz = _mm256_set1_ps(rowZ);
+
+		for (; x < end; x += 8) {
+			__m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lanes);
+
+			__m256 inside = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a0, px), r0), zero, _CMP_GE_OQ);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a1, px), r1), zero, _CMP_GE_OQ));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a2, px), r2), zero, _CMP_GE_OQ));
+
+			__m256 z = _mm256_add_ps(_mm256_mul_ps(az, px), rz);
+			__m256 d = _mm256_loadu_ps(row + x);
+			_mm256_storeu_ps(row + x, _mm256_blendv_ps(d, _mm256_min_ps(d, z), inside));
+		}
+#elif defined(GE_SIMD_SSE)
+		const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+		const __m128 zero = _mm_setzero_ps();
+		__m128 a0 = _mm_set1_ps(edgeA[0]), r0 = _mm_set1_ps(row0);
+		__m128 a1 = _mm_set1_ps(edgeA[1]), r1 = _mm_set1_ps(row1);
+		__m128 a2 = _mm_set1_ps(edgeA[2]), r2 = _mm_set1_ps(row2);
+		__m128 az = _mm_set1_ps(depthA), rz = _mm_set1_ps(rowZ);
+
+		for (; x < end; x += 4) {
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+
+			__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), zero);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), zero));
+
+			__m128 z = _mm_add_ps(_mm_mul_ps(az, px), rz);
+			__m128 d = _mm_loadu_ps(row + x);
+			__m128 nearer = _mm_min_ps(d, z);
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, d)));
+		}
+#else
+		for (; x < end; x++) {
+			float px = x + 0.5f;
+
+			if (edgeA[0] * px + row0 >= 0.0f && edgeA[1] * px + row1 >= 0.0f && edgeA[2] * px + row2 >= 0.0f) {
+				row[x] = std::min(row[x], depthA * px + rowZ);
+			}
+		}
+#endif
+	}
+
+#if defined(GE_SIMD_AVX2)
+	const int SPAN_WIDTH = 8;
+#elif defined(GE_SIMD_SSE)
+	const int SPAN_WIDTH = 4;
+#else
+	const int SPAN_WIDTH = 1;
+#endif
+
+	void OcclusionCuller::rasterizeTile(int tile) {
+		int tileX = (tile % tilesX) * TILE_WIDTH;
+		int tileY = (tile / tilesX) * TILE_HEIGHT;
+
+		for (int y = tileY; y < tileY + TILE_HEIGHT; y++) {
+			std::fill(depth.begin() + y * width + tileX, depth.begin() + y * width + tileX + TILE_WIDTH, 1.0f);
+		}
+
+		for (int i : bins[tile]) {
+			const ScreenTriangle& t = triangles[i];
+
+			// Whole SIMD spans, the tile width is a multiple of the span
+			// so they never leave the tile
+			int x0 = std::max(t.minX, tileX) / SPAN_WIDTH * SPAN_WIDTH;
+			int x1 = (std::min(t.maxX, tileX + TILE_WIDTH - 1) / SPAN_WIDTH + 1) * SPAN_WIDTH;
+			int y0 = std::max(t.minY, tileY);
+			int y1 = std::min(t.maxY, tileY + TILE_HEIGHT - 1);
+
+			for (int y = y0; y <= y1; y++) {
+				rasterizeSpan(&depth[y * width], x0, x1, y + 0.5f,
+					t.edgeA, t.edgeB, t.edgeC, t.depthA, t.depthB, t.depthC);
+			}
+		}
+
+		float farthest = 0.0f;
+		for (int y = tileY; y < tileY + TILE_HEIGHT; y++) {
+			const float* row = &depth[y * width + tileX];
+			for (int x = 0; x < TILE_WIDTH; x++) {
+				farthest = std::max(farthest, row[x]);
+			}
+		}
+		tileMaxDepth[tile] = farthest;
+	}
+
+	void OcclusionCuller::render(Camera* cam) {
+		Clock::time_point start = Clock::now();
+
+		viewProjection = cam->getViewProjectionMatrix();
+
+		// Every occluder writes its triangles to its own range
+		occluderFirst.resize(occluders.size());
+		int numTriangles = 0;
+		for (int i = 0; i < (int)occluders.size(); i++) {
+			occluderFirst[i] = numTriangles;
+			numTriangles += meshes[occluders[i].mesh].count / 3;
+		}
+		triangles.resize(numTriangles);
+
+		JobSystem::RangeFunc transform = [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				transformOccluder(i, viewProjection, occluderFirst[i]);
+			}
+		};
+
+		if (jobs != nullptr && occluders.size() > 1) {
+			jobs->parallelFor((int)occluders.size(), 1, transform);
+		}
+		else {
+			transform(0, (int)occluders.size());
+		}
+
+		// Bin in triangle order so every tile draws its triangles in the
+		// same order whichever worker takes it
+		for (std::vector<int>& bin : bins) {
+			bin.clear();
+		}
+
+		rasterizedTriangles = 0;
+		for (int i = 0; i < numTriangles; i++) {
+			const ScreenTriangle& t = triangles[i];
+			if (t.minX > t.maxX) {
+				continue;
+			}
+
+			rasterizedTriangles++;
+
+			for (int ty = t.minY / TILE_HEIGHT; ty <= t.maxY / TILE_HEIGHT; ty++) {
+				for (int tx = t.minX / TILE_WIDTH; tx <= t.maxX / TILE_WIDTH; tx++) {
+					bins[ty * tilesX + tx].push_back(i);
+				}
+			}
+		}
+
+		// Tiles are independent, each worker owns the pixels it writes
+		JobSystem::RangeFunc raster = [&](int begin, int end) {
+			for (int tile = begin; tile < end; tile++) {
+				rasterizeTile(tile);
+			}
+		};
+
+		if (jobs != nullptr) {
+			jobs->parallelFor(tilesX * tilesY, 1, raster);
+		}
+		else {
+			raster(0, tilesX * tilesY);
+		}
+
+		ready = true;
+		numTested = 0;
+		numOccluded = 0;
+
+		rasterMs = elapsedMs(start);
+	}
+
+	bool OcclusionCuller::testAABB(const AABB& box) const {
+		numTested++;
+
+		if (!ready) {
+			return true;
+		}
+
+		// Screen rectangle and nearest depth of the box corners
+		glm::vec2 screenMin(FLT_MAX);
+		glm::vec2 screenMax(-FLT_MAX);
+		float nearest = FLT_MAX;
+
+		for (int k = 0; k < 8; k++) {
+			glm::vec3 corner((k & 1) ? box.max.x : box.min.x, (k & 2) ? box.max.y : box.min.y, (k & 4) ? box.max.z : box.min.z);
+			glm::vec4 clip = viewProjection * glm::vec4(corner, 1.0f);
+
+			// Reaches behind the near plane, assume visible
+			if (clip.w <= 0.0f || clip.z < -clip.w) {
+				return true;
+			}
+
+			glm::vec3 ndc = glm::vec3(clip) / clip.w;
+			glm::vec2 s((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height);
+
+			screenMin = glm::min(screenMin, s);
+			screenMax = glm::max(screenMax, s);
+			nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+		}
+
+		int x0 = std::max(0, (int)std::floor(screenMin.x));
+		int x1 = std::min(width - 1, (int)std::floor(screenMax.x));
+		int y0 = std::max(0, (int)std::floor(screenMin.y));
+		int y1 = std::min(height - 1, (int)std::floor(screenMax.y));
+
+		if (x0 > x1 || y0 > y1) {
+			return true;
+		}
+
+		for (int ty = y0 / TILE_HEIGHT; ty <= y1 / TILE_HEIGHT; ty++) {
+			for (int tx = x0 / TILE_WIDTH; tx <= x1 / TILE_WIDTH; tx++) {
+				// Behind everything drawn in the tile, no need to look closer
+				if (nearest > tileMaxDepth[ty * tilesX + tx]) {
+					continue;
+				}
+
+				int px0 = std::max(x0, tx * TILE_WIDTH);
+				int px1 = std::min(x1, tx * TILE_WIDTH + TILE_WIDTH - 1);
+				int py0 = std::max(y0, ty * TILE_HEIGHT);
+				int py1 = std::min(y1, ty * TILE_HEIGHT + TILE_HEIGHT - 1);
+
+				for (int y = py0; y <= py1; y++) {
+					const float* row = &depth[y * width];
+					for (int x = px0; x <= px1; x++) {
+						if (nearest <= row[x]) {
+							return true;
+						}
+					}
+				}
+			}
+		}
+
+		numOccluded++;
+		return false;
+	}
+
+	bool OcclusionCuller::testSphere(glm::vec3 centre, float radius) const {
+		return testAABB(AABB(centre - glm::vec3(radius), centre + glm::vec3(radius)));
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <atomic>
+#include <vector>
+#include "Camera.h"
+#include "Frustum.h"
+#include "JobSystem.h"
+#include "Model.h"
+
+namespace GE {
+	// Software occlusion culling. A few large, low poly occluder meshes
+	// are rasterised on the CPU into a small depth buffer every frame, and
+	// object bounds are tested against it before they are submitted
+	//
+	// The buffer is split into tiles. Triangles are binned into the tiles
+	// they touch and the tiles are rasterised in parallel on the job system,
+	// several pixels of a row at a time with SIMD. Each tile also keeps its
+	// farthest depth, so most tests are settled per tile without looking at
+	// the pixels
+	class OcclusionCuller {
+	public:
+		// Width must be a multiple of TILE_WIDTH and height of TILE_HEIGHT
+		static const int TILE_WIDTH = 32;
+		static const int TILE_HEIGHT = 16;
+
+		OcclusionCuller(int width = 256, int height = 144);
+		~OcclusionCuller() {}
+
+		// Add an occluder mesh as a triangle list of positions, returns its index
+		int addOccluderMesh(const glm::vec3* positions, int numVertices);
+		int addOccluderMesh(Model* model);
+
+		// Place a mesh in the world, returns the occluder index
+		int addOccluder(int mesh, const glm::mat4& transform);
+
+		void setOccluderTransform(int occluder, const glm::mat4& transform);
+
+		// Remove every occluder, the meshes are kept
+		void clearOccluders();
+
+		// Workers sharing the transform and rasterisation, optional
+		void setJobSystem(JobSystem* js) {
+			jobs = js;
+		}
+
+		// Rasterise the occluders from the camera, call once per frame
+		// before testing. Resets the statistics
+		void render(Camera* cam);
+
+		// False if the bounds are certainly hidden behind the occluders.
+		// Safe to call from several threads once render has returned
+		bool testAABB(const AABB& box) const;
+		bool testSphere(glm::vec3 centre, float radius) const;
+
+		// Accessors
+		int getWidth() {
+			return width;
+		}
+
+		int getHeight() {
+			return height;
+		}
+
+		// Triangles that reached the depth buffer in the last render
+		int getRasterizedTriangles() {
+			return rasterizedTriangles;
+		}
+
+		// Time to transform, bin and rasterise the occluders
+		float getRasterMs() {
+			return rasterMs;
+		}
+
+		// Tests since the last render and how many were hidden
+		int getNumTested() {
+			return numTested;
+		}
+
+		int getNumOccluded() {
+			return numOccluded;
+		}
+
+		float getCulledFraction() {
+			return numTested > 0 ? (float)numOccluded / (float)numTested : 0.0f;
+		}
+
+		// Name of the instruction set the rasteriser was compiled for
+		static const char* getSIMDName();
+
+	private:
+		// Range of meshPositions holding one mesh
+		struct Mesh {
+			int first;
+			int count;
+		};
+
+		struct Occluder {
+			int mesh;
+			glm::mat4 transform;
+		};
+
+		// Triangle in pixel coordinates, y up, with its edge functions
+		// a * x + b * y + c (positive inside) and depth plane
+		struct ScreenTriangle {
+			float edgeA[3];
+			float edgeB[3];
+			float edgeC[3];
+			float depthA, depthB, depthC;
+
+			// Pixel bounds, minX > maxX if the triangle was rejected
+			int minX, maxX;
+			int minY, maxY;
+		};
+
+		// Project the triangles of one occluder into triangles from first
+		void transformOccluder(int occluder, const glm::mat4& viewProjection, int first);
+
+		// Clear one tile and rasterise the triangles binned into it
+		void rasterizeTile(int tile);
+
+	private:
+		int width;
+		int height;
+		int tilesX;
+		int tilesY;
+
+		std::vector<glm::vec3> meshPositions;
+		std::vector<Mesh> meshes;
+		std::vector<Occluder> occluders;
+
+		// Per frame triangles, the triangles touching each tile, and the
+		// first triangle of each occluder
+		std::vector<ScreenTriangle> triangles;
+		std::vector<std::vector<int>> bins;
+		std::vector<int> occluderFirst;
+
+		// Nearest occluder depth per pixel and the farthest of each tile.
+		// Depth is 0 at the near plane and 1 at the far plane
+		std::vector<float> depth;
+		std::vector<float> tileMaxDepth;
+
+		glm::mat4 viewProjection;
+		bool ready;
+
+		JobSystem* jobs;
+
+		int rasterizedTriangles;
+		float rasterMs;
+
+		// Counted by the const tests, possibly from several threads
+		mutable std::atomic<int> numTested;
+		mutable std::atomic<int> numOccluded;
+	};
+}
@@ -0,0 +1,223 @@
+#include "OcclusionQueries.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include "FrameUniforms.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <iostream>
+
+namespace GE {
+	OcclusionQueries::OcclusionQueries() {
+		programId = 0;
+		pipeline = nullptr;
+		vboCube = 0;
+		frame = 0;
+		queriesIssued = 0;
+		hiddenObjects = 0;
+	}
+
+	void OcclusionQueries::init() {
+		// Only depth matters, the colour writes are masked off
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			GE_OBJECT_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"void main() {\n"
+			"gl_Position = viewProjection * transform * vec4(vertexPos3D, 1);\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"fragmentColour = vec4(1.0);\n"
+			"}\n" };
+
+		// Built in the background. Proxies drawn meanwhile use the grey
+		// fallback, which writes the same depth with colour still masked
+		const char* attributes[] = { "vertexPos3D" };
+		vertexPos3DLocation = 0;
+
+		programId = ShaderLibrary::get().requestProgramFromSource(V_ShaderCode[0], F_ShaderCode[0], "", attributes, 1);
+
+		if (programId == 0) {
+			std::cerr << "Failed to create OcclusionQueries program. Check console for errors" << std::endl;
+			return;
+		}
+
+		// 12 triangles of the unit cube. Faces aren't culled so the winding
+		// doesn't matter
+		const float c[8][3] = {
+			{ 0, 0, 0 }, { 1, 0, 0 }, { 1, 1, 0 }, { 0, 1, 0 },
+			{ 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 }
+		};
+		const int faces[6][4] = {
+			{ 0, 1, 2, 3 }, { 5, 4, 7, 6 }, { 4, 0, 3, 7 },
+			{ 1, 5, 6, 2 }, { 3, 2, 6, 7 }, { 4, 5, 1, 0 }
+		};
+
+		std::vector<glm::vec3> vertices;
+		for (int f = 0; f < 6; f++) {
+			const int order[6] = { 0, 1, 2, 0, 2, 3 };
+			for (int i = 0; i < 6; i++) {
+				const float* p = c[faces[f][order[i]]];
+				vertices.push_back(glm::vec3(p[0], p[1], p[2]));
+			}
+		}
+
+		glGenBuffers(1, &vboCube);
+		GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, vboCube);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+
+		vertexArray.addAttrib(vboCube, vertexPos3DLocation, 3, GL_FLOAT, sizeof(glm::vec3), 0);
+		vertexArray.build();
+
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = vertexArray.getName();
+		desc.depthWrite = false;
+		desc.colorWrite = false;
+		pipeline = PipelineCache::get().create(desc);
+	}
+
+	void OcclusionQueries::beginFrame() {
+		frame++;
+		queriesIssued = 0;
+		hiddenObjects = 0;
+	}
+
+	int OcclusionQueries::addObject() {
+		Object obj;
+		glGenQueries(MAX_PENDING, obj.queries);
+
+		for (int i = 0; i < MAX_PENDING; i++) {
+			obj.issuedFrame[i] = 0;
+		}
+
+		obj.latest = 0;
+		obj.visible = true;
+		obj.visibleResults = 0;
+
+		objects.push_back(obj);
+		return (int)objects.size() - 1;
+	}
+
+	void OcclusionQueries::collectResults(Object& obj) {
+		while (true) {
+			// Oldest query still in flight
+			int oldest = -1;
+			for (int i = 0; i < MAX_PENDING; i++) {
+				if (obj.issuedFrame[i] != 0 && (oldest == -1 || obj.issuedFrame[i] < obj.issuedFrame[oldest])) {
+					oldest = i;
+				}
+			}
+
+			if (oldest == -1) {
+				return;
+			}
+
+			// Never wait, a result that isn't ready is tried again next frame
+			GLuint available = 0;
+			glGetQueryObjectuiv(obj.queries[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				return;
+			}
+
+			GLuint samples = 0;
+			glGetQueryObjectuiv(obj.queries[oldest], GL_QUERY_RESULT, &samples);
+			obj.issuedFrame[oldest] = 0;
+
+			obj.visible = samples > 0;
+			obj.visibleResults = obj.visible ? obj.visibleResults + 1 : 0;
+		}
+	}
+
+	GLuint OcclusionQueries::submit(RenderQueue* queue, Camera* cam, int object, const glm::mat4& transform, const AABB& box) {
+		Object& obj = objects[object];
+
+		collectResults(obj);
+
+		if (!obj.visible) {
+			hiddenObjects++;
+		}
+
+		if (programId == 0) {
+			return 0;
+		}
+
+		// World space bounds of the box
+		AABB world(glm::vec3(transform * glm::vec4(box.min, 1.0f)), glm::vec3(transform * glm::vec4(box.min, 1.0f)));
+		for (int k = 1; k < 8; k++) {
+			glm::vec3 corner((k & 1) ? box.max.x : box.min.x, (k & 2) ? box.max.y : box.min.y, (k & 4) ? box.max.z : box.min.z);
+			world.expand(glm::vec3(transform * glm::vec4(corner, 1.0f)));
+		}
+
+		// With the camera inside the box the proxy would be clipped by the
+		// near plane, draw the object and stop querying
+		glm::vec3 camPos = cam->getPos();
+		glm::vec3 margin(cam->getNearClip());
+		if (glm::all(glm::greaterThanEqual(camPos, world.min - margin)) && glm::all(glm::lessThanEqual(camPos, world.max + margin))) {
+			obj.visible = true;
+			obj.latest = 0;
+			return 0;
+		}
+
+		// Stably visible objects are requeried now and then, staggered so
+		// they don't all fall on the same frame
+		bool stable = obj.visible && obj.visibleResults >= STABLE_RESULTS;
+		bool due = !stable || (frame + object) % REQUERY_INTERVAL == 0;
+
+		// Condition on the latest query issued before this frame, this
+		// frame's proxy is drawn after the object
+		GLuint condition = stable ? 0 : obj.latest;
+
+		int slot = -1;
+		for (int i = 0; i < MAX_PENDING && due; i++) {
+			if (obj.issuedFrame[i] == 0) {
+				slot = i;
+				break;
+			}
+		}
+
+		if (slot == -1) {
+			return condition;
+		}
+
+		ObjectData objectData;
+		objectData.transform = glm::scale(glm::translate(transform, box.min), box.max - box.min);
+
+		DrawPacket packet;
+		packet.pass = PASS_QUERY;
+		packet.pipeline = pipeline;
+		packet.fallbackProgramId = ShaderLibrary::get().getFallbackProgram();
+		packet.mode = GL_TRIANGLES;
+		packet.count = 36;
+		packet.drawDataOffset = queue->allocateDrawData(&objectData, sizeof(objectData));
+		packet.drawDataSize = sizeof(objectData);
+		packet.query = obj.queries[slot];
+		packet.depth = glm::length(world.getCentre() - camPos);
+		packet.owner = this;
+
+		queue->submit(packet);
+
+		obj.issuedFrame[slot] = frame;
+		obj.latest = obj.queries[slot];
+		queriesIssued++;
+
+		return condition;
+	}
+
+	void OcclusionQueries::destroy() {
+		for (Object& obj : objects) {
+			glDeleteQueries(MAX_PENDING, obj.queries);
+		}
+		objects.clear();
+
+		// The program belongs to the shader library
+		glDeleteBuffers(1, &vboCube);
+		GLStateCache::get().onBufferDeleted(vboCube);
+
+		vertexArray.destroy();
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "Camera.h"
+#include "Frustum.h"
+#include "RenderQueue.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Hardware occlusion queries for heavy objects. Each frame an object's
+	// bounding box is drawn after the opaque pass, without writing colour
+	// or depth, inside an occlusion query. The object's own draw is then
+	// skipped with conditional rendering while the box stays hidden
+	//
+	// Results are read back only once the GPU reports them available,
+	// usually one or two frames later, so the CPU never waits. Objects that
+	// have been visible for a while are only queried every few frames and
+	// drawn unconditionally in between
+	class OcclusionQueries : public Renderable {
+	public:
+		// Queries in flight per object
+		static const int MAX_PENDING = 3;
+
+		// Visible results in a row before an object counts as stably visible
+		static const int STABLE_RESULTS = 4;
+
+		// Frames between queries of a stably visible object
+		static const int REQUERY_INTERVAL = 8;
+
+		OcclusionQueries();
+		~OcclusionQueries() {}
+
+		// Create the proxy box program and vertex array
+		void init();
+
+		// Start a frame, resets the counters
+		void beginFrame();
+
+		// Register an object, returns its index
+		int addObject();
+
+		// Collect finished results, submit the object's proxy box if it is
+		// due a query, and return the query its draw should be conditional
+		// on (DrawPacket::conditionQuery), 0 to draw it unconditionally.
+		// box is in the object space of transform
+		GLuint submit(RenderQueue* queue, Camera* cam, int object, const glm::mat4& transform, const AABB& box);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam) {}
+
+		void destroy();
+
+		// Accessors
+		// Proxies submitted this frame
+		int getQueriesIssued() {
+			return queriesIssued;
+		}
+
+		// Objects whose last result was hidden
+		int getHiddenObjects() {
+			return hiddenObjects;
+		}
+
+	private:
+		struct Object {
+			GLuint queries[MAX_PENDING];
+
+			// Frame each query was issued in, 0 when free
+			unsigned int issuedFrame[MAX_PENDING];
+
+			// Most recently issued query, the condition for the next draws
+			GLuint latest;
+
+			// Last result read back and how many visible results in a row
+			bool visible;
+			int visibleResults;
+		};
+
+		// Read the results the GPU has finished with, oldest first
+		void collectResults(Object& obj);
+
+	private:
+		GLuint programId;
+		GLint vertexPos3DLocation;
+
+		// Unit cube from 0 to 1, scaled to each box in the transform
+		GLuint vboCube;
+		VertexArray vertexArray;
+
+		// Depth tested but writing neither depth nor colour
+		const PipelineState* pipeline;
+
+		std::vector<Object> objects;
+
+		unsigned int frame;
+		int queriesIssued;
+		int hiddenObjects;
+	};
+}
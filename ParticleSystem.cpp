@@ -0,0 +1,508 @@
+#include "ParticleSystem.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include "ShaderUtils.h"
+#include "FrameUniforms.h"
+#include "Random.h"
+#include "SimdConfig.h"
+#include "Timing.h"
+#include <algorithm>
+#include <iostream>
+
+namespace GE {
+	// Arrays are padded to the AVX2 width whichever path is compiled
+	const int PARTICLE_BLOCK = 8;
+
+	// Particles per job system batch, a multiple of the block
+	const int PARTICLE_BATCH = 16384;
+
+	// Stream space reserved up front, grows with the particle count
+	const GLsizeiptr PARTICLE_STREAM_SIZE = 1024 * 1024;
+
+	static uint32_t packColour(glm::vec4 c) {
+		glm::uvec4 b = glm::uvec4(glm::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f);
+		return b.r | (b.g << 8) | (b.b << 16) | (b.a << 24);
+	}
+
+	// Lanes of the block at first holding particles rather than padding
+	static inline int validLanes(int first, int count, int width) {
+		int n = count - first;
+		return n >= width ? (1 << width) - 1 : (1 << n) - 1;
+	}
+
+	ParticleSystem::ParticleSystem() {
+		programs[0].programId = programs[1].programId = 0;
+		programs[0].pipeline = programs[1].pipeline = nullptr;
+		jobs = nullptr;
+		sorted = true;
+		spawnMs = simulateMs = compactMs = writeMs = sortMs = 0.0f;
+	}
+
+	const char* ParticleSystem::getSIMDName() {
+#if defined(GE_SIMD_AVX2)
+		return "AVX2";
+#elif defined(GE_SIMD_SSE)
+		return "SSE";
+#else
+		return "scalar";
+#endif
+	}
+
+	void ParticleSystem::init() {
+		// No vertex buffer, each instance is expanded into two triangles
+		// from gl_VertexID along the camera's right and up axes
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			"in vec4 particlePosSize;\n"
+			"in vec4 particleColour;\n"
+			"out vec2 uv;\n"
+			"out vec4 colour;\n"
+			"const vec2 corners[6] = vec2[6](vec2(-0.5, -0.5), vec2(0.5, -0.5), vec2(0.5, 0.5),\n"
+			"	vec2(-0.5, -0.5), vec2(0.5, 0.5), vec2(-0.5, 0.5));\n"
+			"void main() {\n"
+			"vec2 corner = corners[gl_VertexID];\n"
+			"vec3 right = vec3(view[0][0], view[1][0], view[2][0]);\n"
+			"vec3 up = vec3(view[0][1], view[1][1], view[2][1]);\n"
+			"vec3 p = particlePosSize.xyz + (right * corner.x + up * corner.y) * particlePosSize.w;\n"
+			"gl_Position = viewProjection * vec4(p, 1);\n"
+			"uv = corner + 0.5;\n"
+			"colour = particleColour;\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			GE_TRANSPARENT_OUTPUT_GLSL
+			"in vec2 uv;\n"
+			"in vec4 colour;\n"
+			"uniform sampler2D sampler;\n"
+			"uniform int useTexture;\n"
+			"void main()\n"
+			"{\n"
+			"if (useTexture != 0) {\n"
+			"	writeTransparent(texture(sampler, uv) * colour);\n"
+			"}\n"
+			"else {\n"
+			"	float d = length(uv - 0.5) * 2.0;\n"
+			"	writeTransparent(vec4(colour.rgb, colour.a * clamp(1.0 - d * d, 0.0, 1.0)));\n"
+			"}\n"
+			"}\n" };
+
+		const char* attributes[] = { "particlePosSize", "particleColour" };
+		const char* defines[2] = { "", "GE_WEIGHTED_OIT" };
+
+		// Built in the background, packets are skipped until they're ready
+		for (int i = 0; i < 2; i++) {
+			DrawProgram& program = programs[i];
+			program.samplerId = program.useTextureLocation = -1;
+			program.programId = ShaderLibrary::get().requestProgramFromSource(V_ShaderCode[0], F_ShaderCode[0], defines[i], attributes, 2,
+				[&program](GLuint programId) {
+					program.samplerId = glGetUniformLocation(programId, "sampler");
+					program.useTextureLocation = glGetUniformLocation(programId, "useTexture");
+				});
+
+			if (program.programId == 0) {
+				std::cerr << "Failed to create ParticleSystem program. Check console for errors" << std::endl;
+				programs[0].programId = 0;
+				return;
+			}
+		}
+
+		// Bound in the order of attributes
+		posSizeLocation = 0;
+		colourLocation = 1;
+
+		instanceStream.init(GL_ARRAY_BUFFER, PARTICLE_STREAM_SIZE);
+
+		// Offsets are set per draw, the instances move every frame
+		vertexArray.addAttrib(instanceStream.getBuffer(), posSizeLocation, 4, GL_FLOAT, sizeof(ParticleInstance), offsetof(ParticleInstance, x), 1);
+		vertexArray.addAttrib(instanceStream.getBuffer(), colourLocation, 4, GL_UNSIGNED_BYTE, sizeof(ParticleInstance), offsetof(ParticleInstance, colour), 1, GL_TRUE);
+		vertexArray.build();
+
+		// Depth tested against the scene without writing it, blended in
+		// order or into the OIT targets
+		for (int i = 0; i < 2; i++) {
+			PipelineDesc desc;
+			desc.programId = programs[i].programId;
+			desc.vao = vertexArray.getName();
+			desc.depthWrite = false;
+			if (i == 0) {
+				desc.setBlend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			}
+			else {
+				WeightedBlendedOIT::setAccumulateBlend(desc);
+			}
+			programs[i].pipeline = PipelineCache::get().create(desc);
+		}
+	}
+
+	int ParticleSystem::addEmitter(const ParticleEmitterDesc& desc, Texture* texture) {
+		Emitter e;
+		e.desc = desc;
+		e.texture = texture;
+		e.count = 0;
+		e.spawnAccumulator = 0.0f;
+		e.seed = 0x9E3779B9u * (unsigned int)(emitters.size() + 1);
+		e.instanceOffset = 0;
+		e.sorter.setJobSystem(jobs);
+		e.moved = true;
+
+		int padded = (desc.maxParticles + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK * PARTICLE_BLOCK;
+		e.posX.assign(padded, 0.0f);
+		e.posY.assign(padded, 0.0f);
+		e.posZ.assign(padded, 0.0f);
+		e.velX.assign(padded, 0.0f);
+		e.velY.assign(padded, 0.0f);
+		e.velZ.assign(padded, 0.0f);
+		e.age.assign(padded, 0.0f);
+		e.invLife.assign(padded, 1.0f);
+		e.size.assign(padded, 0.0f);
+		e.colour.assign(padded, 0u);
+
+		emitters.push_back(e);
+		return (int)emitters.size() - 1;
+	}
+
+	void ParticleSystem::setEmitterPosition(int emitter, glm::vec3 position) {
+		emitters[emitter].desc.position = position;
+	}
+
+	int ParticleSystem::getNumParticles() {
+		int n = 0;
+		for (const Emitter& e : emitters) {
+			n += e.count;
+		}
+		return n;
+	}
+
+	void ParticleSystem::spawn(Emitter& e, float deltaSeconds) {
+		const ParticleEmitterDesc& d = e.desc;
+
+		e.spawnAccumulator += d.spawnRate * deltaSeconds;
+		int n = (int)e.spawnAccumulator;
+		e.spawnAccumulator -= n;
+
+		n = std::min(n, d.maxParticles - e.count);
+		uint32_t colour = packColour(d.startColour);
+
+		for (int i = e.count; i < e.count + n; i++) {
+			e.posX[i] = d.position.x;
+			e.posY[i] = d.position.y;
+			e.posZ[i] = d.position.z;
+			e.velX[i] = d.velocity.x + (randomFloat(e.seed) * 2.0f - 1.0f) * d.velocitySpread;
+			e.velY[i] = d.velocity.y + (randomFloat(e.seed) * 2.0f - 1.0f) * d.velocitySpread;
+			e.velZ[i] = d.velocity.z + (randomFloat(e.seed) * 2.0f - 1.0f) * d.velocitySpread;
+			e.age[i] = 0.0f;
+			e.invLife[i] = 1.0f / (d.minLife + (d.maxLife - d.minLife) * randomFloat(e.seed));
+			e.size[i] = d.startSize;
+			e.colour[i] = colour;
+		}
+
+		e.count += n;
+	}
+
+	int ParticleSystem::simulateRange(Emitter& e, int begin, int end, float dt) {
+		const ParticleEmitterDesc& d = e.desc;
+		glm::vec4 dc = d.endColour - d.startColour;
+
+		int* dead = deadIndices.data() + begin;
+		int numDead = 0;
+
+#if defined(GE_SIMD_AVX2)
+		const __m256 vdt = _mm256_set1_ps(dt);
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 gx = _mm256_set1_ps(d.gravity.x * dt);
+		const __m256 gy = _mm256_set1_ps(d.gravity.y * dt);
+		const __m256 gz = _mm256_set1_ps(d.gravity.z * dt);
+		const __m256 s0 = _mm256_set1_ps(d.startSize);
+		const __m256 ds = _mm256_set1_ps(d.endSize - d.startSize);
+		__m256 c0[4], c1[4];
+		for (int k = 0; k < 4; k++) {
+			c0[k] = _mm256_set1_ps(d.startColour[k] * 255.0f + 0.5f);
+			c1[k] = _mm256_set1_ps(dc[k] * 255.0f);
+		}
+
+		for (int i = begin; i < end; i += 8) {
+			__m256 vx = _mm256_add_ps(_mm256_loadu_ps(&e.velX[i]), gx);
+			__m256 vy = _mm256_add_ps(_mm256_loadu_ps(&e.velY[i]), gy);
+			__m256 vz = _mm256_add_ps(_mm256_loadu_ps(&e.velZ[i]), gz);
+			_mm256_storeu_ps(&e.velX[i], vx);
+			_mm256_storeu_ps(&e.velY[i], vy);
+			_mm256_storeu_ps(&e.velZ[i], vz);
+
+			_mm256_storeu_ps(&e.posX[i], _mm256_add_ps(_mm256_loadu_ps(&e.posX[i]), _mm256_mul_ps(vx, vdt)));
+			_mm256_storeu_ps(&e.posY[i], _mm256_add_ps(_mm256_loadu_ps(&e.posY[i]), _mm256_mul_ps(vy, vdt)));
+			_mm256_storeu_ps(&e.posZ[i], _mm256_add_ps(_mm256_loadu_ps(&e.posZ[i]), _mm256_mul_ps(vz, vdt)));
+
+			__m256 age = _mm256_add_ps(_mm256_loadu_ps(&e.age[i]), vdt);
+			_mm256_storeu_ps(&e.age[i], age);
+
+			// Fraction of the life used, clamped so dead particles still pack cleanly
+			__m256 t = _mm256_mul_ps(age, _mm256_loadu_ps(&e.invLife[i]));
+			numDead = appendLanes(dead, numDead, i, _mm256_movemask_ps(_mm256_cmp_ps(t, one, _CMP_GE_OQ)) & validLanes(i, e.count, 8), 8);
+			t = _mm256_min_ps(t, one);
+			_mm256_storeu_ps(&e.size[i], _mm256_add_ps(s0, _mm256_mul_ps(ds, t)));
+
+			__m256i packed = _mm256_setzero_si256();
+			for (int k = 0; k < 4; k++) {
+				__m256i channel = _mm256_cvttps_epi32(_mm256_add_ps(c0[k], _mm256_mul_ps(c1[k], t)));
+				packed = _mm256_or_si256(packed, _mm256_slli_epi32(channel, k * 8));
+			}
+			_mm256_storeu_si256((__m256i*)&e.colour[i], packed);
+		}
+#elif defined(GE_SIMD_SSE)
+		const __m128 vdt = _mm_set1_ps(dt);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 gx = _mm_set1_ps(d.gravity.x * dt);
+		const __m128 gy = _mm_set1_ps(d.gravity.y * dt);
+		const __m128 gz = _mm_set1_ps(d.gravity.z * dt);
+		const __m128 s0 = _mm_set1_ps(d.startSize);
+		const __m128 ds = _mm_set1_ps(d.endSize - d.startSize);
+		__m128 c0[4], c1[4];
+		for (int k = 0; k < 4; k++) {
+			c0[k] = _mm_set1_ps(d.startColour[k] * 255.0f + 0.5f);
+			c1[k] = _mm_set1_ps(dc[k] * 255.0f);
+		}
+
+		for (int i = begin; i < end; i += 4) {
+			__m128 vx = _mm_add_ps(_mm_loadu_ps(&e.velX[i]), gx);
+			__m128 vy = _mm_add_ps(_mm_loadu_ps(&e.velY[i]), gy);
+			__m128 vz = _mm_add_ps(_mm_loadu_ps(&e.velZ[i]), gz);
+			_mm_storeu_ps(&e.velX[i], vx);
+			_mm_storeu_ps(&e.velY[i], vy);
+			_mm_storeu_ps(&e.velZ[i], vz);
+
+			_mm_storeu_ps(&e.posX[i], _mm_add_ps(_mm_loadu_ps(&e.posX[i]), _mm_mul_ps(vx, vdt)));
+			_mm_storeu_ps(&e.posY[i], _mm_add_ps(_mm_loadu_ps(&e.posY[i]), _mm_mul_ps(vy, vdt)));
+			_mm_storeu_ps(&e.posZ[i], _mm_add_ps(_mm_loadu_ps(&e.posZ[i]), _mm_mul_ps(vz, vdt)));
+
+			__m128 age = _mm_add_ps(_mm_loadu_ps(&e.age[i]), vdt);
+			_mm_storeu_ps(&e.age[i], age);
+
+			// Fraction of the life used, clamped so dead particles still pack cleanly
+			__m128 t = _mm_mul_ps(age, _mm_loadu_ps(&e.invLife[i]));
+			numDead = appendLanes(dead, numDead, i, _mm_movemask_ps(_mm_cmpge_ps(t, one)) & validLanes(i, e.count, 4), 4);
+			t = _mm_min_ps(t, one);
+			_mm_storeu_ps(&e.size[i], _mm_add_ps(s0, _mm_mul_ps(ds, t)));
+
+			__m128i packed = _mm_setzero_si128();
+			for (int k = 0; k < 4; k++) {
+				__m128i channel = _mm_cvttps_epi32(_mm_add_ps(c0[k], _mm_mul_ps(c1[k], t)));
+				packed = _mm_or_si128(packed, _mm_slli_epi32(channel, k * 8));
+			}
+			_mm_storeu_si128((__m128i*)&e.colour[i], packed);
+		}
+#else
+		for (int i = begin; i < end; i++) {
+			e.velX[i] += d.gravity.x * dt;
+			e.velY[i] += d.gravity.y * dt;
+			e.velZ[i] += d.gravity.z * dt;
+			e.posX[i] += e.velX[i] * dt;
+			e.posY[i] += e.velY[i] * dt;
+			e.posZ[i] += e.velZ[i] * dt;
+			e.age[i] += dt;
+
+			float t = e.age[i] * e.invLife[i];
+			if (t >= 1.0f && i < e.count) {
+				dead[numDead++] = i;
+			}
+
+			t = std::min(t, 1.0f);
+			e.size[i] = d.startSize + (d.endSize - d.startSize) * t;
+			e.colour[i] = packColour(d.startColour + dc * t);
+		}
+#endif
+
+		return numDead;
+	}
+
+	void ParticleSystem::removeDead(Emitter& e, int numBatches) {
+		// Highest index first, so the last particle is always alive when
+		// it is moved: any dead one above the current index is already gone
+		for (int b = numBatches - 1; b >= 0; b--) {
+			const int* dead = deadIndices.data() + b * PARTICLE_BATCH;
+
+			for (int j = batchCounts[b] - 1; j >= 0; j--) {
+				int i = dead[j];
+				int last = --e.count;
+
+				if (i != last) {
+					e.posX[i] = e.posX[last];
+					e.posY[i] = e.posY[last];
+					e.posZ[i] = e.posZ[last];
+					e.velX[i] = e.velX[last];
+					e.velY[i] = e.velY[last];
+					e.velZ[i] = e.velZ[last];
+					e.age[i] = e.age[last];
+					e.invLife[i] = e.invLife[last];
+					e.size[i] = e.size[last];
+					e.colour[i] = e.colour[last];
+				}
+			}
+		}
+	}
+
+	void ParticleSystem::update(float deltaSeconds) {
+		Clock::time_point start = Clock::now();
+
+		for (Emitter& e : emitters) {
+			spawn(e, deltaSeconds);
+			e.moved = true;
+		}
+
+		spawnMs = elapsedMs(start);
+		simulateMs = compactMs = 0.0f;
+
+		for (Emitter& e : emitters) {
+			if (e.count == 0) {
+				continue;
+			}
+
+			start = Clock::now();
+
+			int padded = (e.count + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK * PARTICLE_BLOCK;
+			int numBatches = (padded + PARTICLE_BATCH - 1) / PARTICLE_BATCH;
+			batchCounts.resize(numBatches);
+			deadIndices.resize(padded);
+
+			JobSystem::RangeFunc simulate = [&](int begin, int end) {
+				batchCounts[begin / PARTICLE_BATCH] = simulateRange(e, begin, end, deltaSeconds);
+			};
+
+			if (jobs != nullptr) {
+				jobs->parallelFor(padded, PARTICLE_BATCH, simulate);
+			}
+			else {
+				for (int b = 0; b < numBatches; b++) {
+					simulate(b * PARTICLE_BATCH, std::min(padded, (b + 1) * PARTICLE_BATCH));
+				}
+			}
+
+			simulateMs += elapsedMs(start);
+			start = Clock::now();
+
+			// Unordered, submit sorts them back to front for drawing
+			removeDead(e, numBatches);
+
+			compactMs += elapsedMs(start);
+		}
+	}
+
+	void ParticleSystem::writeInstances(const Emitter& e, int begin, int end, const uint32_t* order, ParticleInstance* out) {
+		for (int i = begin; i < end; i++) {
+			int src = order ? (int)order[i] : i;
+			ParticleInstance& p = out[i];
+			p.x = e.posX[src];
+			p.y = e.posY[src];
+			p.z = e.posZ[src];
+			p.size = e.size[src];
+			p.colour = e.colour[src];
+		}
+	}
+
+	void ParticleSystem::submit(RenderQueue* queue, Camera* cam) {
+		if (programs[0].programId == 0) {
+			return;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		instanceStream.beginFrame();
+		queue->addFenceWait(instanceStream.getFenceWaitMs());
+		sortMs = 0.0f;
+		glm::mat4 view = cam->getViewMatrix();
+
+		// Every emitter's instances go straight into the stream buffer,
+		// each worker fills its own range
+		for (Emitter& e : emitters) {
+			if (e.count == 0) {
+				continue;
+			}
+
+			ParticleInstance* out = (ParticleInstance*)instanceStream.allocate(e.count * sizeof(ParticleInstance), 16, &e.instanceOffset);
+
+			// Particles move every update, the order is only reused by
+			// frames drawn before the next one
+			const uint32_t* order = nullptr;
+			if (sorted) {
+				order = e.sorter.sort(e.posX.data(), e.posY.data(), e.posZ.data(), e.count, view, e.moved).data();
+				sortMs += e.sorter.getKeyMs() + e.sorter.getSortMs();
+				e.moved = false;
+			}
+
+			JobSystem::RangeFunc write = [&](int begin, int end) {
+				writeInstances(e, begin, end, order, out);
+			};
+
+			if (jobs != nullptr) {
+				jobs->parallelFor(e.count, PARTICLE_BATCH, write);
+			}
+			else {
+				write(0, e.count);
+			}
+		}
+
+		instanceStream.flush();
+
+		writeMs = elapsedMs(start) - sortMs;
+
+		glm::vec3 camPos = cam->getPos();
+		const PipelineState* pipeline = programs[queue->getWeightedOIT() != nullptr ? 1 : 0].pipeline;
+
+		for (int i = 0; i < (int)emitters.size(); i++) {
+			const Emitter& e = emitters[i];
+			if (e.count == 0) {
+				continue;
+			}
+
+			DrawPacket packet;
+			packet.pass = PASS_TRANSPARENT;
+			packet.pipeline = pipeline;
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = e.texture ? e.texture->getTextureName() : 0;
+			packet.mode = GL_TRIANGLES;
+			packet.count = 6;
+			packet.instanceCount = e.count;
+			packet.depth = glm::length(e.desc.position - camPos);
+			packet.owner = this;
+			packet.ownerIndex = i;
+
+			queue->submit(packet);
+		}
+	}
+
+	void ParticleSystem::endFrame() {
+		instanceStream.endFrame();
+	}
+
+	void ParticleSystem::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		//Camera matrices come from the shared FrameData block
+		GLStateCache::get().uniform1i(getDrawProgram(packet.pipeline).samplerId, 0);
+	}
+
+	void ParticleSystem::setDrawUniforms(const DrawPacket& packet) {
+		const Emitter& e = emitters[packet.ownerIndex];
+		GLStateCache& gl = GLStateCache::get();
+
+		gl.uniform1i(getDrawProgram(packet.pipeline).useTextureLocation, e.texture != nullptr ? 1 : 0);
+
+		// Point the instance attributes at this emitter's particles. The
+		// stream buffer can be replaced when it grows, so bind it every time
+		GLintptr base = instanceStream.getRegionOffset() + e.instanceOffset;
+		gl.bindBuffer(GL_ARRAY_BUFFER, instanceStream.getBuffer());
+		glVertexAttribPointer(posSizeLocation, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleInstance),
+			(const void*)(base + offsetof(ParticleInstance, x)));
+		glVertexAttribPointer(colourLocation, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ParticleInstance),
+			(const void*)(base + offsetof(ParticleInstance, colour)));
+	}
+
+	void ParticleSystem::destroy() {
+		// The programs belong to the shader library
+		programs[0].programId = programs[1].programId = 0;
+		programs[0].pipeline = programs[1].pipeline = nullptr;
+
+		instanceStream.destroy();
+		vertexArray.destroy();
+	}
+}
@@ -0,0 +1,230 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "Camera.h"
+#include "JobSystem.h"
+#include "RenderQueue.h"
+#include "StreamBuffer.h"
+#include "Texture.h"
+#include "TransparencySorter.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// How an emitter spawns its particles and how they change over their life
+	struct ParticleEmitterDesc {
+		glm::vec3 position;
+
+		// Particles per second and the most alive at once
+		float spawnRate;
+		int maxParticles;
+
+		// Life in seconds, picked at random between the two
+		float minLife;
+		float maxLife;
+
+		// Initial velocity plus a random offset of up to velocitySpread on each axis
+		glm::vec3 velocity;
+		float velocitySpread;
+
+		// Acceleration applied every update
+		glm::vec3 gravity;
+
+		// Size and colour go from start to end over the life
+		float startSize;
+		float endSize;
+		glm::vec4 startColour;
+		glm::vec4 endColour;
+
+		ParticleEmitterDesc() {
+			position = glm::vec3(0.0f);
+			spawnRate = 1000.0f;
+			maxParticles = 10000;
+			minLife = 1.0f;
+			maxLife = 2.0f;
+			velocity = glm::vec3(0.0f, 5.0f, 0.0f);
+			velocitySpread = 1.0f;
+			gravity = glm::vec3(0.0f, -9.8f, 0.0f);
+			startSize = 0.5f;
+			endSize = 0.1f;
+			startColour = glm::vec4(1.0f);
+			endColour = glm::vec4(1.0f, 1.0f, 1.0f, 0.0f);
+		}
+	};
+
+	// Camera facing particles simulated on the CPU. Each emitter keeps its
+	// particles structure of arrays and updates them with SIMD, split
+	// across the job system. Every frame the particles are written straight
+	// into a streamed buffer and each emitter is drawn with one instanced
+	// draw, the vertex shader expands every instance into a quad facing
+	// the camera
+	class ParticleSystem : public Renderable {
+	public:
+		ParticleSystem();
+		~ParticleSystem() {}
+
+		// Create the program, VAO and stream buffer
+		void init();
+
+		// Add an emitter, texture is optional (a soft disc without),
+		// returns the emitter index
+		int addEmitter(const ParticleEmitterDesc& desc, Texture* texture = nullptr);
+
+		void setEmitterPosition(int emitter, glm::vec3 position);
+
+		// Workers sharing the update and the buffer writes, optional
+		void setJobSystem(JobSystem* js) {
+			jobs = js;
+			for (Emitter& e : emitters) {
+				e.sorter.setJobSystem(js);
+			}
+		}
+
+		// Write each emitter's particles furthest first so they blend
+		// correctly, on by default
+		void setSorted(bool sort) {
+			sorted = sort;
+		}
+
+		bool isSorted() {
+			return sorted;
+		}
+
+		// Spawn new particles, move them and remove the dead ones
+		void update(float deltaSeconds);
+
+		// Write the particles to the stream buffer and add one packet per emitter
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Fence this frame's particles, call once the queue has executed
+		void endFrame();
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+		void setDrawUniforms(const DrawPacket& packet);
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		int getNumParticles();
+
+		// Time of each stage in the last update and submit
+		float getSpawnMs() {
+			return spawnMs;
+		}
+
+		float getSimulateMs() {
+			return simulateMs;
+		}
+
+		float getCompactMs() {
+			return compactMs;
+		}
+
+		float getWriteMs() {
+			return writeMs;
+		}
+
+		// Key build and radix sort, 0 when not sorted
+		float getSortMs() {
+			return sortMs;
+		}
+
+		// Name of the instruction set the update was compiled for
+		static const char* getSIMDName();
+
+	private:
+		// One particle as the vertex shader reads it
+		struct ParticleInstance {
+			float x, y, z;
+			float size;
+
+			// RGBA8, read normalised
+			uint32_t colour;
+		};
+
+		struct Emitter {
+			ParticleEmitterDesc desc;
+			Texture* texture;
+
+			// Alive particles are [0, count), the arrays are padded to a
+			// whole number of SIMD blocks
+			std::vector<float> posX, posY, posZ;
+			std::vector<float> velX, velY, velZ;
+			std::vector<float> age;
+			std::vector<float> invLife;
+			std::vector<float> size;
+			std::vector<uint32_t> colour;
+			int count;
+
+			// Fraction of a particle carried to the next update
+			float spawnAccumulator;
+			unsigned int seed;
+
+			// Where this frame's instances start in the stream buffer region
+			GLintptr instanceOffset;
+
+			// Back to front order of the particles. It can be kept while no
+			// update has moved them since, frames drawn between two fixed
+			// steps only redo it if the camera moved
+			TransparencySorter sorter;
+			bool moved;
+		};
+
+		void spawn(Emitter& e, float deltaSeconds);
+
+		// Move the particles in [begin, end) and write the indices of those
+		// that died, in order, to deadIndices from begin. Returns how many died
+		int simulateRange(Emitter& e, int begin, int end, float deltaSeconds);
+
+		// Remove the dead particles by moving the last living ones into
+		// their place, the cost only grows with the deaths
+		void removeDead(Emitter& e, int numBatches);
+
+		// Copy instances [begin, end) in drawing order, order is null to
+		// keep the particles' own order
+		void writeInstances(const Emitter& e, int begin, int end, const uint32_t* order, ParticleInstance* out);
+
+		// Program, its uniforms and its pipeline
+		struct DrawProgram {
+			GLuint programId;
+			GLint samplerId;
+			GLint useTextureLocation;
+			const PipelineState* pipeline;
+		};
+
+		// The permutation a packet was submitted with
+		const DrawProgram& getDrawProgram(const PipelineState* pipeline) {
+			return pipeline == programs[1].pipeline ? programs[1] : programs[0];
+		}
+
+	private:
+		// Blending and GE_WEIGHTED_OIT permutations, picked by the render
+		// queue's transparency mode. Both share the attribute locations
+		DrawProgram programs[2];
+		GLint posSizeLocation;
+		GLint colourLocation;
+
+		// Instance attributes only, the corners come from gl_VertexID
+		VertexArray vertexArray;
+		StreamBuffer instanceStream;
+
+		std::vector<Emitter> emitters;
+		JobSystem* jobs;
+
+		// Particles that died in each update batch and their indices, each
+		// batch writes from its own start
+		std::vector<int> batchCounts;
+		std::vector<int> deadIndices;
+
+		bool sorted;
+
+		float spawnMs;
+		float simulateMs;
+		float compactMs;
+		float writeMs;
+		float sortMs;
+	};
+}
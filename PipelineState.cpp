@@ -0,0 +1,152 @@
+#include "PipelineState.h"
+#include "GLStateCache.h"
+
+namespace GE {
+	bool PipelineDesc::operator==(const PipelineDesc& other) const {
+		return programId == other.programId && vao == other.vao &&
+			depthTest == other.depthTest && depthFunc == other.depthFunc &&
+			depthWrite == other.depthWrite && colorWrite == other.colorWrite &&
+			blend == other.blend && blendSrc == other.blendSrc && blendDst == other.blendDst &&
+			blendSrcAlpha == other.blendSrcAlpha && blendDstAlpha == other.blendDstAlpha &&
+			cull == other.cull && cullMode == other.cullMode &&
+			polygonOffset == other.polygonOffset &&
+			offsetFactor == other.offsetFactor && offsetUnits == other.offsetUnits;
+	}
+
+	int PipelineState::apply(const PipelineState* previous) const {
+		GLStateCache& gl = GLStateCache::get();
+		const PipelineDesc* prev = previous != nullptr ? &previous->desc : nullptr;
+		int calls = 0;
+
+		if (prev == nullptr || desc.depthTest != prev->depthTest) {
+			gl.setEnabled(GL_DEPTH_TEST, desc.depthTest);
+			calls++;
+		}
+
+		// Values that only matter while their enable bit is on are left
+		// alone when it is off, so they are only known to match previous
+		// if it had the bit on too
+		if (desc.depthTest && (prev == nullptr || !prev->depthTest || desc.depthFunc != prev->depthFunc)) {
+			gl.depthFunc(desc.depthFunc);
+			calls++;
+		}
+
+		if (prev == nullptr || desc.depthWrite != prev->depthWrite) {
+			gl.depthMask(desc.depthWrite ? GL_TRUE : GL_FALSE);
+			calls++;
+		}
+
+		if (prev == nullptr || desc.colorWrite != prev->colorWrite) {
+			gl.colorMask(desc.colorWrite ? GL_TRUE : GL_FALSE);
+			calls++;
+		}
+
+		if (prev == nullptr || desc.blend != prev->blend) {
+			gl.setEnabled(GL_BLEND, desc.blend);
+			calls++;
+		}
+
+		if (desc.blend && (prev == nullptr || !prev->blend || desc.blendSrc != prev->blendSrc || desc.blendDst != prev->blendDst ||
+			desc.blendSrcAlpha != prev->blendSrcAlpha || desc.blendDstAlpha != prev->blendDstAlpha)) {
+			gl.blendFuncSeparate(desc.blendSrc, desc.blendDst, desc.blendSrcAlpha, desc.blendDstAlpha);
+			calls++;
+		}
+
+		if (prev == nullptr || desc.cull != prev->cull) {
+			gl.setEnabled(GL_CULL_FACE, desc.cull);
+			calls++;
+		}
+
+		if (desc.cull && (prev == nullptr || !prev->cull || desc.cullMode != prev->cullMode)) {
+			gl.cullFace(desc.cullMode);
+			calls++;
+		}
+
+		if (prev == nullptr || desc.polygonOffset != prev->polygonOffset) {
+			gl.setEnabled(GL_POLYGON_OFFSET_FILL, desc.polygonOffset);
+			calls++;
+		}
+
+		if (desc.polygonOffset && (prev == nullptr || !prev->polygonOffset || desc.offsetFactor != prev->offsetFactor || desc.offsetUnits != prev->offsetUnits)) {
+			gl.polygonOffset(desc.offsetFactor, desc.offsetUnits);
+			calls++;
+		}
+
+		return calls;
+	}
+
+	PipelineCache& PipelineCache::get() {
+		static PipelineCache cache;
+		return cache;
+	}
+
+	PipelineCache::~PipelineCache() {
+		destroy();
+	}
+
+	// 64 bit FNV-1a over each field, not the struct bytes, which include padding
+	static void hashValue(uint64_t& hash, uint32_t value) {
+		for (int i = 0; i < 4; i++) {
+			hash ^= (value >> (i * 8)) & 0xFF;
+			hash *= 0x100000001b3ull;
+		}
+	}
+
+	static uint32_t floatBits(GLfloat f) {
+		union { GLfloat f; uint32_t u; } bits;
+		bits.f = f;
+		return bits.u;
+	}
+
+	uint64_t PipelineCache::hashDesc(const PipelineDesc& desc) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		hashValue(hash, desc.programId);
+		hashValue(hash, desc.vao);
+		hashValue(hash, (desc.depthTest ? 1 : 0) | (desc.depthWrite ? 2 : 0) | (desc.colorWrite ? 4 : 0) |
+			(desc.blend ? 8 : 0) | (desc.cull ? 16 : 0) | (desc.polygonOffset ? 32 : 0));
+		hashValue(hash, desc.depthFunc);
+		hashValue(hash, desc.blendSrc);
+		hashValue(hash, desc.blendDst);
+		hashValue(hash, desc.blendSrcAlpha);
+		hashValue(hash, desc.blendDstAlpha);
+		hashValue(hash, desc.cullMode);
+		hashValue(hash, floatBits(desc.offsetFactor));
+		hashValue(hash, floatBits(desc.offsetUnits));
+		return hash;
+	}
+
+	const PipelineState* PipelineCache::create(const PipelineDesc& desc) {
+		uint64_t hash = hashDesc(desc);
+
+		auto range = byHash.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			PipelineState* pipeline = pipelines[it->second - 1];
+			if (pipeline->desc == desc) {
+				return pipeline;
+			}
+		}
+
+		int id = (int)pipelines.size() + 1;
+		pipelines.push_back(new PipelineState(desc, id, hash));
+		byHash.insert(std::make_pair(hash, id));
+		return pipelines.back();
+	}
+
+	void PipelineCache::bind(const PipelineState* pipeline) {
+		// Other code may have changed the state since, so set all of it
+		// and let the state cache skip what is unchanged
+		GLStateCache& gl = GLStateCache::get();
+		gl.useProgram(pipeline->getProgram());
+		gl.bindVertexArray(pipeline->getVertexArray());
+		pipeline->apply(nullptr);
+	}
+
+	void PipelineCache::destroy() {
+		for (PipelineState* pipeline : pipelines) {
+			delete pipeline;
+		}
+
+		pipelines.clear();
+		byHash.clear();
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace GE {
+	// Everything a pipeline sets, filled in by a renderer at init and
+	// handed to PipelineCache::create. The defaults are an opaque draw:
+	// depth tested and written, no blending, no culling
+	struct PipelineDesc {
+		GLuint programId;
+
+		// Vertex array holding the full vertex layout. 0 if every packet
+		// brings its own, one per mesh for example
+		GLuint vao;
+
+		bool depthTest;
+		GLenum depthFunc;
+		bool depthWrite;
+		bool colorWrite;
+
+		bool blend;
+		GLenum blendSrc, blendDst;
+		GLenum blendSrcAlpha, blendDstAlpha;
+
+		bool cull;
+		GLenum cullMode;
+
+		// GL_POLYGON_OFFSET_FILL with factor and units
+		bool polygonOffset;
+		GLfloat offsetFactor, offsetUnits;
+
+		PipelineDesc() {
+			programId = 0;
+			vao = 0;
+			depthTest = true;
+			depthFunc = GL_LESS;
+			depthWrite = true;
+			colorWrite = true;
+			blend = false;
+			blendSrc = blendSrcAlpha = GL_SRC_ALPHA;
+			blendDst = blendDstAlpha = GL_ONE_MINUS_SRC_ALPHA;
+			cull = false;
+			cullMode = GL_BACK;
+			polygonOffset = false;
+			offsetFactor = offsetUnits = 0.0f;
+		}
+
+		// Blend colour and alpha with the same factors
+		void setBlend(GLenum src, GLenum dst) {
+			setBlendSeparate(src, dst, src, dst);
+		}
+
+		void setBlendSeparate(GLenum srcRGB, GLenum dstRGB, GLenum srcAlpha, GLenum dstAlpha) {
+			blend = true;
+			blendSrc = srcRGB;
+			blendDst = dstRGB;
+			blendSrcAlpha = srcAlpha;
+			blendDstAlpha = dstAlpha;
+		}
+
+		void setPolygonOffset(GLfloat factor, GLfloat units) {
+			polygonOffset = true;
+			offsetFactor = factor;
+			offsetUnits = units;
+		}
+
+		bool operator==(const PipelineDesc& other) const;
+	};
+
+	// Immutable program, vertex layout and fixed function state, made once
+	// by the PipelineCache. Switching pipelines only touches the state
+	// that differs, so a change of pipeline costs as many GL calls as the
+	// two pipelines have differences
+	class PipelineState {
+	public:
+		// Set the fixed function state that differs from previous, all of
+		// it if previous is nullptr. The program and vertex array are left
+		// to the caller, the render queue substitutes fallback programs.
+		// Returns the number of state calls made
+		int apply(const PipelineState* previous) const;
+
+		// Accessors
+		const PipelineDesc& getDesc() const {
+			return desc;
+		}
+
+		GLuint getProgram() const {
+			return desc.programId;
+		}
+
+		GLuint getVertexArray() const {
+			return desc.vao;
+		}
+
+		bool isBlended() const {
+			return desc.blend;
+		}
+
+		// Small number in creation order, used in the render queue's sort key
+		int getId() const {
+			return id;
+		}
+
+		uint64_t getHash() const {
+			return hash;
+		}
+
+	private:
+		friend class PipelineCache;
+
+		PipelineState(const PipelineDesc& desc, int id, uint64_t hash) : desc(desc), id(id), hash(hash) {}
+
+	private:
+		const PipelineDesc desc;
+		const int id;
+		const uint64_t hash;
+	};
+
+	// Makes and owns every PipelineState. Renderers asking for the same
+	// description get the same pipeline, so packets can compare pipelines
+	// by pointer
+	class PipelineCache {
+	public:
+		// One cache per GL context, the engine only has one
+		static PipelineCache& get();
+
+		PipelineCache() {}
+		~PipelineCache();
+
+		// Pipeline for desc, made the first time it is asked for
+		const PipelineState* create(const PipelineDesc& desc);
+
+		// Set a pipeline's program, vertex array and state, for drawing
+		// outside the render queue
+		void bind(const PipelineState* pipeline);
+
+		// Release method to free up objects. Pipelines handed out before
+		// must not be used afterwards
+		void destroy();
+
+		// Accessors
+		int getPipelineCount() {
+			return (int)pipelines.size();
+		}
+
+	private:
+		static uint64_t hashDesc(const PipelineDesc& desc);
+
+	private:
+		// Indexed by id - 1
+		std::vector<PipelineState*> pipelines;
+
+		// Ids by description hash
+		std::unordered_multimap<uint64_t, int> byHash;
+	};
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+namespace GE {
+	// Next value in [0, 1) of a linear congruential generator. Cheap and
+	// repeatable, for benchmarks and scattering objects, not statistics
+	inline float randomFloat(unsigned int& seed) {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	}
+}
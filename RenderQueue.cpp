@@ -0,0 +1,352 @@
+#include "RenderQueue.h"
+#include "ShaderLibrary.h"
+#include "ShaderUtils.h"
+
+namespace GE {
+	// Bit widths of the key fields
+	const int KEY_PASS_BITS = 4;
+	const int KEY_PIPELINE_BITS = 12;
+	const int KEY_TEXTURE_BITS = 16;
+	const int KEY_VAO_BITS = 12;
+	const int KEY_DEPTH_BITS = 20;
+
+	// Keep the low bits of a value so it fits in a key field
+	static uint64_t keyField(uint64_t value, int bits) {
+		return value & ((1ull << bits) - 1);
+	}
+
+	// Owner of the packets drawn with their fallback program, which has
+	// no uniforms of its own beyond the shared blocks
+	class FallbackRenderable : public Renderable {
+	public:
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam) {}
+	};
+
+	static FallbackRenderable fallbackOwner;
+
+	RenderQueue::RenderQueue() {
+		camera = nullptr;
+		farClip = 1.0f;
+		oit = nullptr;
+		pipelineDiffing = true;
+		streamFenceWaitMs = 0.0f;
+		nextTimer = 0;
+		timing = false;
+		transparentGpuMs = 0.0f;
+
+		for (int i = 0; i < NUM_TIMER_QUERIES; i++) {
+			timerQueries[i] = 0;
+			timerPending[i] = false;
+		}
+	}
+
+	void RenderQueue::init() {
+		drawData.init(GE_OBJECT_DATA_BINDING);
+
+		if (GLEW_VERSION_3_3 || GLEW_ARB_timer_query) {
+			glGenQueries(NUM_TIMER_QUERIES, timerQueries);
+		}
+	}
+
+	void RenderQueue::destroy() {
+		drawData.destroy();
+
+		if (timerQueries[0] != 0) {
+			glDeleteQueries(NUM_TIMER_QUERIES, timerQueries);
+		}
+	}
+
+	void RenderQueue::begin(Camera* cam) {
+		camera = cam;
+		farClip = cam->getFarClip();
+		packets.clear();
+		drawData.reset();
+		streamFenceWaitMs = 0.0f;
+
+		// Count the GL calls of the whole frame, including those made at submit
+		GLStateCache::get().resetCounters();
+	}
+
+	void RenderQueue::submit(const DrawPacket& packet) {
+		packets.push_back(packet);
+
+		DrawPacket& p = packets.back();
+		if (p.vao == 0) {
+			p.vao = p.pipeline->getVertexArray();
+		}
+		p.key = makeKey(p, farClip);
+	}
+
+	uint64_t RenderQueue::makeKey(const DrawPacket& packet, float farClip) {
+		// Quantise the depth to the key field
+		float d = packet.depth / farClip;
+		if (d < 0.0f) d = 0.0f;
+		if (d > 1.0f) d = 1.0f;
+		uint64_t depth = (uint64_t)(d * ((1 << KEY_DEPTH_BITS) - 1));
+
+		// Pipeline ids and GL names are small integers so their low bits are
+		// enough to group packets, execute compares the full values before
+		// skipping a bind
+		uint64_t pipeline = keyField(packet.pipeline->getId(), KEY_PIPELINE_BITS);
+		uint64_t texture = keyField(packet.textureName, KEY_TEXTURE_BITS);
+		uint64_t vao = keyField(packet.vao, KEY_VAO_BITS);
+
+		uint64_t key = keyField(packet.pass, KEY_PASS_BITS);
+
+		if (packet.pass == PASS_TRANSPARENT) {
+			// Furthest first so blending is correct, then by state
+			key = (key << KEY_DEPTH_BITS) | (((1 << KEY_DEPTH_BITS) - 1) - depth);
+			key = (key << KEY_PIPELINE_BITS) | pipeline;
+			key = (key << KEY_TEXTURE_BITS) | texture;
+			key = (key << KEY_VAO_BITS) | vao;
+		}
+		else {
+			// State first to minimise binds, then front to back for early depth rejection
+			key = (key << KEY_PIPELINE_BITS) | pipeline;
+			key = (key << KEY_TEXTURE_BITS) | texture;
+			key = (key << KEY_VAO_BITS) | vao;
+			key = (key << KEY_DEPTH_BITS) | depth;
+		}
+
+		return key;
+	}
+
+	GLenum RenderQueue::getOcclusionQueryTarget() {
+		return (GLEW_VERSION_3_3 || GLEW_ARB_occlusion_query2) ? GL_ANY_SAMPLES_PASSED : GL_SAMPLES_PASSED;
+	}
+
+	void RenderQueue::sortPackets() {
+		size_t n = packets.size();
+
+		keys.resize(n);
+		keysTemp.resize(n);
+		sortedIndices.resize(n);
+		indicesTemp.resize(n);
+
+		for (size_t i = 0; i < n; i++) {
+			keys[i] = packets[i].key;
+			sortedIndices[i] = (uint32_t)i;
+		}
+
+		// Eight passes of eight bits, least significant digit first
+		// The sort is stable so each pass keeps the order of the previous ones
+		for (int shift = 0; shift < 64; shift += 8) {
+			size_t histogram[256] = { 0 };
+
+			for (size_t i = 0; i < n; i++) {
+				histogram[(keys[i] >> shift) & 0xFF]++;
+			}
+
+			// Every key has the same digit, nothing to move
+			if (n == 0 || histogram[(keys[0] >> shift) & 0xFF] == n) {
+				continue;
+			}
+
+			// Turn the counts into the start position of each digit
+			size_t offset = 0;
+			for (int d = 0; d < 256; d++) {
+				size_t c = histogram[d];
+				histogram[d] = offset;
+				offset += c;
+			}
+
+			for (size_t i = 0; i < n; i++) {
+				size_t dst = histogram[(keys[i] >> shift) & 0xFF]++;
+				keysTemp[dst] = keys[i];
+				indicesTemp[dst] = sortedIndices[i];
+			}
+
+			keys.swap(keysTemp);
+			sortedIndices.swap(indicesTemp);
+		}
+	}
+
+	void RenderQueue::beginTransparentPass() {
+		// Read back the oldest finished timing without waiting
+		for (int k = 0; k < NUM_TIMER_QUERIES; k++) {
+			int i = (nextTimer + k) % NUM_TIMER_QUERIES;
+			if (!timerPending[i]) {
+				continue;
+			}
+
+			GLuint available = 0;
+			glGetQueryObjectuiv(timerQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				break;
+			}
+
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(timerQueries[i], GL_QUERY_RESULT, &ns);
+			transparentGpuMs = ns / 1000000.0f;
+			timerPending[i] = false;
+		}
+
+		timing = timerQueries[nextTimer] != 0 && !timerPending[nextTimer];
+		if (timing) {
+			glBeginQuery(GL_TIME_ELAPSED, timerQueries[nextTimer]);
+		}
+
+		if (oit != nullptr) {
+			oit->beginAccumulate();
+		}
+	}
+
+	void RenderQueue::endTransparentPass() {
+		if (oit != nullptr) {
+			oit->composite();
+		}
+
+		if (timing) {
+			glEndQuery(GL_TIME_ELAPSED);
+			timerPending[nextTimer] = true;
+			nextTimer = (nextTimer + 1) % NUM_TIMER_QUERIES;
+		}
+	}
+
+	void RenderQueue::execute() {
+		stats.reset();
+		stats.packets = (int)packets.size();
+
+		sortPackets();
+
+		// Every packet's per draw uniforms in one upload
+		drawData.upload();
+
+		GLStateCache& gl = GLStateCache::get();
+
+		GLenum queryTarget = getOcclusionQueryTarget();
+
+		ShaderLibrary& library = ShaderLibrary::get();
+
+		// The state is unknown until the first pipeline sets all of it
+		const PipelineState* currentPipeline = nullptr;
+		GLuint currentProgram = 0;
+		GLuint currentVao = 0;
+		GLenum currentTextureTarget = GL_TEXTURE_2D;
+		GLuint currentTexture = 0;
+		bool inTransparentPass = false;
+
+		for (uint32_t idx : sortedIndices) {
+			const DrawPacket& p = packets[idx];
+
+			// Transparent packets sort last
+			if (p.pass == PASS_TRANSPARENT && !inTransparentPass) {
+				beginTransparentPass();
+				inTransparentPass = true;
+
+				// The OIT targets set their own state
+				currentPipeline = nullptr;
+			}
+
+			// A program still building draws with the fallback, whose
+			// uniforms the owner doesn't know, or not at all
+			GLuint programId = p.pipeline->getProgram();
+			Renderable* owner = p.owner;
+
+			if (!library.isReady(programId)) {
+				if (p.fallbackProgramId == 0) {
+					stats.skippedDraws++;
+					continue;
+				}
+
+				programId = p.fallbackProgramId;
+				owner = &fallbackOwner;
+				stats.fallbackDraws++;
+			}
+
+			if (p.pipeline != currentPipeline) {
+				stats.stateCalls += p.pipeline->apply(pipelineDiffing ? currentPipeline : nullptr);
+				currentPipeline = p.pipeline;
+				stats.pipelineSwitches++;
+			}
+			else if (!pipelineDiffing) {
+				stats.stateCalls += p.pipeline->apply(nullptr);
+			}
+
+			if (programId != currentProgram) {
+				gl.useProgram(programId);
+				currentProgram = programId;
+				stats.programSwitches++;
+
+				// Owners sharing a program set the same per frame uniforms
+				owner->bindProgramUniforms(p, camera);
+			}
+
+			if (p.vao != currentVao) {
+				gl.bindVertexArray(p.vao);
+				currentVao = p.vao;
+				stats.bufferBinds++;
+			}
+
+			if (p.textureName != currentTexture || p.textureTarget != currentTextureTarget) {
+				gl.bindTexture(0, p.textureTarget, p.textureName);
+				currentTexture = p.textureName;
+				currentTextureTarget = p.textureTarget;
+				stats.textureBinds++;
+			}
+
+			if (p.drawDataSize > 0) {
+				drawData.bindRange(p.drawDataOffset, p.drawDataSize);
+			}
+
+			owner->setDrawUniforms(p);
+
+			if (p.query != 0) {
+				glBeginQuery(queryTarget, p.query);
+				stats.occlusionQueries++;
+			}
+
+			if (p.conditionQuery != 0) {
+				glBeginConditionalRender(p.conditionQuery, GL_QUERY_NO_WAIT);
+				stats.conditionalDraws++;
+			}
+
+			if (p.drawCount > 0) {
+				gl.bindBuffer(GL_DRAW_INDIRECT_BUFFER, p.indirectBuffer);
+
+				if (p.indirectCountBuffer != 0) {
+					gl.bindBuffer(GL_PARAMETER_BUFFER_ARB, p.indirectCountBuffer);
+					glMultiDrawArraysIndirectCountARB(p.mode, (const void*)p.indirectOffset, p.indirectCountOffset, p.drawCount, 0);
+				}
+				else {
+					glMultiDrawArraysIndirect(p.mode, (const void*)p.indirectOffset, p.drawCount, 0);
+				}
+				stats.indirectDraws += p.drawCount;
+			}
+			else if (p.instanceCount > 0) {
+				glDrawArraysInstanced(p.mode, p.first, p.count, p.instanceCount);
+			}
+			else {
+				glDrawArrays(p.mode, p.first, p.count);
+			}
+			stats.drawCalls++;
+
+			if (p.conditionQuery != 0) {
+				glEndConditionalRender();
+			}
+
+			if (p.query != 0) {
+				glEndQuery(queryTarget);
+			}
+		}
+
+		if (inTransparentPass) {
+			endTransparentPass();
+		}
+
+		// Every draw reading the ring has been issued, fence its region
+		drawData.endFrame();
+
+		// Leave the context clean for code drawing outside the queue,
+		// glClear needs the write masks back on
+		gl.bindVertexArray(0);
+		gl.useProgram(0);
+		gl.depthMask(GL_TRUE);
+		gl.colorMask(GL_TRUE);
+
+		stats.glCallsIssued = gl.getCounters().issued;
+		stats.glCallsElided = gl.getCounters().elided;
+		stats.fenceWaitMs = drawData.getFenceWaitMs() + streamFenceWaitMs;
+		stats.transparentGpuMs = transparentGpuMs;
+	}
+}
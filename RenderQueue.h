@@ -0,0 +1,297 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstdint>
+#include <vector>
+#include "Camera.h"
+#include "GLStateCache.h"
+#include "PipelineState.h"
+#include "UniformRing.h"
+#include "WeightedBlendedOIT.h"
+
+namespace GE {
+	class RenderQueue;
+	struct DrawPacket;
+
+	// Implemented by anything that submits packets to the render queue
+	// The queue owns the binds that are shared between packets (program,
+	// texture, vertex array) and calls back for the renderer specific parts
+	class Renderable {
+	public:
+		virtual ~Renderable() {}
+
+		// Called after the packet's program becomes current, set per frame
+		// uniforms such as the view and projection matrices
+		virtual void bindProgramUniforms(const DrawPacket& packet, Camera* cam) = 0;
+
+		// Called for every packet just before it is drawn, set per object uniforms
+		virtual void setDrawUniforms(const DrawPacket& packet) {}
+	};
+
+	// Render passes in the order they are drawn
+	enum RenderPass {
+		PASS_BACKGROUND = 0,	// Skybox, drawn first without depth test
+		PASS_OPAQUE,			// Sorted by state then front to back
+		PASS_QUERY,				// Occlusion query proxies, tested against the opaque depth
+		PASS_TRANSPARENT,		// Sorted back to front
+		NUM_PASSES
+	};
+
+	// Everything needed to issue one draw call
+	struct DrawPacket {
+		// Sort key, built by RenderQueue::submit
+		uint64_t key;
+
+		RenderPass pass;
+
+		// Program and fixed function state, from PipelineCache::create at
+		// the renderer's init
+		const PipelineState* pipeline;
+
+		// Drawn instead while the pipeline's program is still being built
+		// by the ShaderLibrary, without the owner's uniform callbacks. 0
+		// skips the packet until then
+		GLuint fallbackProgramId;
+
+		GLenum textureTarget;
+		GLuint textureName;
+
+		// Vertex array object holding the full vertex layout, 0 to use
+		// the pipeline's
+		GLuint vao;
+
+		GLenum mode;
+		GLint first;
+		GLsizei count;
+
+		// Greater than 0 for an instanced draw
+		GLsizei instanceCount;
+
+		// Greater than 0 for a multi draw indirect packet, drawCount
+		// DrawArraysIndirectCommands at indirectOffset in indirectBuffer
+		// replace first, count and instanceCount
+		GLuint indirectBuffer;
+		GLintptr indirectOffset;
+		GLsizei drawCount;
+
+		// Optional GLuint in indirectCountBuffer holding how many of the
+		// drawCount commands to draw, written by the GPU
+		GLuint indirectCountBuffer;
+		GLintptr indirectCountOffset;
+
+		// Range of the queue's per draw uniform ring bound to the ObjectData
+		// block, from RenderQueue::allocateDrawData. Size 0 for none
+		GLintptr drawDataOffset;
+		GLsizeiptr drawDataSize;
+
+		// Occlusion query counting the samples this draw passes, 0 for none
+		GLuint query;
+
+		// Only draw if this query's samples passed. Conditional rendering
+		// never waits, the draw goes ahead if the result isn't ready. 0 to
+		// always draw
+		GLuint conditionQuery;
+
+		// Distance from the camera used to order packets within a pass
+		float depth;
+
+		// Renderer that submitted the packet and its own index for the packet
+		Renderable* owner;
+		int ownerIndex;
+
+		DrawPacket() {
+			key = 0;
+			pass = PASS_OPAQUE;
+			pipeline = nullptr;
+			fallbackProgramId = 0;
+			textureTarget = GL_TEXTURE_2D;
+			textureName = 0;
+			vao = 0;
+			mode = GL_TRIANGLES;
+			first = 0;
+			count = 0;
+			instanceCount = 0;
+			indirectBuffer = 0;
+			indirectOffset = 0;
+			drawCount = 0;
+			indirectCountBuffer = 0;
+			indirectCountOffset = 0;
+			drawDataOffset = 0;
+			drawDataSize = 0;
+			query = 0;
+			conditionQuery = 0;
+			depth = 0.0f;
+			owner = nullptr;
+			ownerIndex = 0;
+		}
+	};
+
+	// Layout of one command in a GL_DRAW_INDIRECT_BUFFER for glMultiDrawArraysIndirect
+	struct DrawArraysIndirectCommand {
+		GLuint count;
+		GLuint instanceCount;
+		GLuint first;
+		GLuint baseInstance;
+	};
+
+	// Counters for the last executed frame
+	struct RenderStats {
+		int packets;
+		int drawCalls;
+
+		// Draws issued through multi draw indirect calls
+		int indirectDraws;
+
+		// Draws wrapped in conditional rendering and occlusion queries issued
+		int conditionalDraws;
+		int occlusionQueries;
+		int programSwitches;
+
+		// Pipeline changes and the state calls they made
+		int pipelineSwitches;
+		int stateCalls;
+
+		int textureBinds;
+		int bufferBinds;
+
+		// GL calls sent to the driver and skipped by the state cache
+		int glCallsIssued;
+		int glCallsElided;
+
+		// CPU time spent waiting for the GPU to release dynamic buffer
+		// regions, the queue's own and those reported by the renderers
+		float fenceWaitMs;
+
+		// Packets whose program was still building, drawn with their
+		// fallback program or skipped
+		int fallbackDraws;
+		int skippedDraws;
+
+		// GPU time of the transparent pass a few frames ago, including the
+		// OIT resolve. 0 without timer queries
+		float transparentGpuMs;
+
+		RenderStats() {
+			reset();
+		}
+
+		void reset() {
+			packets = drawCalls = indirectDraws = conditionalDraws = occlusionQueries = programSwitches = textureBinds = bufferBinds = 0;
+			pipelineSwitches = stateCalls = 0;
+			glCallsIssued = glCallsElided = 0;
+			fallbackDraws = skippedDraws = 0;
+			fenceWaitMs = 0.0f;
+			transparentGpuMs = 0.0f;
+		}
+	};
+
+	// Collects draw packets from the renderers each frame, sorts them by a
+	// 64 bit key so packets sharing a program, texture and vertex array end
+	// up next to each other and executes them skipping redundant binds
+	// All GL state goes through the GLStateCache
+	//
+	// Opaque key:      pass:4 | pipeline:12 | texture:16 | vao:12 | depth:20
+	// Transparent key: pass:4 | inverted depth:20 | pipeline:12 | texture:16 | vao:12
+	class RenderQueue {
+	public:
+		RenderQueue();
+		~RenderQueue() {}
+
+		// Create the per draw uniform ring
+		void init();
+
+		void destroy();
+
+		// Start a new frame, the camera is used for depth and passed to the owners
+		void begin(Camera* cam);
+
+		// Add a packet, its key is computed from the packet fields
+		void submit(const DrawPacket& packet);
+
+		// Copy per draw uniform data (e.g. ObjectData) into this frame's ring
+		// Store the returned offset and the size in the packet
+		GLintptr allocateDrawData(const void* data, GLsizeiptr size) {
+			return drawData.allocate(data, size);
+		}
+
+		// Count a renderer's stream buffer fence wait in this frame's stats,
+		// call with its getFenceWaitMs() after beginFrame
+		void addFenceWait(float ms) {
+			streamFenceWaitMs += ms;
+		}
+
+		// Sort the packets and issue the GL calls
+		void execute();
+
+		// Draw the transparent pass with weighted blended OIT instead of
+		// blending in order, nullptr to go back to sorted blending. The
+		// frame must be drawn into oit's scene
+		void setWeightedOIT(WeightedBlendedOIT* weighted) {
+			oit = weighted;
+		}
+
+		WeightedBlendedOIT* getWeightedOIT() {
+			return oit;
+		}
+
+		// Only set the state that differs from the last pipeline (the
+		// default), or all of every packet's state to compare the cost
+		void setPipelineDiffing(bool diff) {
+			pipelineDiffing = diff;
+		}
+
+		bool getPipelineDiffing() {
+			return pipelineDiffing;
+		}
+
+		// Statistics for the last executed frame
+		const RenderStats& getStats() {
+			return stats;
+		}
+
+		// Build the sort key for a packet
+		static uint64_t makeKey(const DrawPacket& packet, float farClip);
+
+		// Target packet queries are issued with, GL_ANY_SAMPLES_PASSED when
+		// supported (GL 3.3 or ARB_occlusion_query2), else GL_SAMPLES_PASSED
+		static GLenum getOcclusionQueryTarget();
+
+	private:
+		// LSD radix sort of the packet keys into sortedIndices
+		void sortPackets();
+
+		// Wrap the transparent pass in a timer query and the OIT targets
+		void beginTransparentPass();
+		void endTransparentPass();
+
+	private:
+		Camera* camera;
+		float farClip;
+
+		std::vector<DrawPacket> packets;
+
+		// Per draw uniform blocks of every packet, written once per frame
+		UniformRing drawData;
+
+		// Key and packet index pairs, double buffered for the radix sort
+		std::vector<uint64_t> keys, keysTemp;
+		std::vector<uint32_t> sortedIndices, indicesTemp;
+
+		RenderStats stats;
+
+		// Fence waits reported by the renderers since begin
+		float streamFenceWaitMs;
+
+		// Transparent pass resolved with weighted blended OIT, optional
+		WeightedBlendedOIT* oit;
+
+		bool pipelineDiffing;
+
+		// Timer queries of the transparent pass in flight
+		static const int NUM_TIMER_QUERIES = 3;
+		GLuint timerQueries[NUM_TIMER_QUERIES];
+		bool timerPending[NUM_TIMER_QUERIES];
+		int nextTimer;
+		bool timing;
+		float transparentGpuMs;
+	};
+}
@@ -0,0 +1,457 @@
+#include "ScatterSystem.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <glm/gtc/type_ptr.hpp>
+
+namespace GE {
+	// Hash the cell coordinates so every cell gets its own repeatable
+	// random sequence, whichever thread generates it
+	static unsigned int hashCell(unsigned int seed, unsigned int speciesIdx, unsigned int x, unsigned int z) {
+		unsigned int h = seed * 0x9E3779B9u;
+		h ^= speciesIdx * 0x85EBCA6Bu + (h << 6) + (h >> 2);
+		h ^= x * 0xC2B2AE35u + (h << 6) + (h >> 2);
+		h ^= z * 0x27D4EB2Fu + (h << 6) + (h >> 2);
+		return h ? h : 1u;
+	}
+
+	// Xorshift random number in the range 0 to 1
+	static float nextRandom(unsigned int& state) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state & 0xFFFFFF) / 16777216.0f;
+	}
+
+	// Two quads crossed at right angles, standing on y = 0
+	static const Vertex card[] = {
+		Vertex(-0.5f, 0.0f, 0.0f, 0.0f, 1.0f),
+		Vertex(0.5f, 0.0f, 0.0f, 1.0f, 1.0f),
+		Vertex(0.5f, 1.0f, 0.0f, 1.0f, 0.0f),
+
+		Vertex(0.5f, 1.0f, 0.0f, 1.0f, 0.0f),
+		Vertex(-0.5f, 1.0f, 0.0f, 0.0f, 0.0f),
+		Vertex(-0.5f, 0.0f, 0.0f, 0.0f, 1.0f),
+
+		Vertex(0.0f, 0.0f, -0.5f, 0.0f, 1.0f),
+		Vertex(0.0f, 0.0f, 0.5f, 1.0f, 1.0f),
+		Vertex(0.0f, 1.0f, 0.5f, 1.0f, 0.0f),
+
+		Vertex(0.0f, 1.0f, 0.5f, 1.0f, 0.0f),
+		Vertex(0.0f, 1.0f, -0.5f, 0.0f, 0.0f),
+		Vertex(0.0f, 0.0f, -0.5f, 0.0f, 1.0f)
+	};
+
+	ScatterSystem::ScatterSystem(Heightmap* hm, int _clusterCells) {
+		heightmap = hm;
+		clusterCells = _clusterCells;
+
+		// Cells are the squares between heightmap pixels
+		clustersX = (heightmap->getWidth() - 1 + clusterCells - 1) / clusterCells;
+		clustersZ = (heightmap->getHeight() - 1 + clusterCells - 1) / clusterCells;
+
+		totalInstances = 0;
+		programId = 0;
+		visibleClusters = visibleInstances = drawCalls = 0;
+	}
+
+	ScatterSystem::~ScatterSystem() {
+		for (SpeciesData& sd : species) {
+			delete sd.mask;
+		}
+	}
+
+	int ScatterSystem::addSpecies(const ScatterSpecies& desc) {
+		SpeciesData sd;
+		sd.desc = desc;
+		sd.mask = nullptr;
+		sd.numInstances = 0;
+		sd.vboMesh = sd.vboInstances = sd.vboDraw = 0;
+		sd.pipeline = nullptr;
+
+		if (!desc.densityMaskFile.empty()) {
+			sd.mask = new Heightmap(desc.densityMaskFile);
+
+			if (!sd.mask->isLoaded()) {
+				std::cerr << "Density mask for " << desc.name << " not loaded, using full density" << std::endl;
+				delete sd.mask;
+				sd.mask = nullptr;
+			}
+		}
+
+		// Take a copy of the mesh so the bounding radius can be computed
+		if (desc.model != nullptr && desc.model->getVertices() != nullptr) {
+			Vertex* v = (Vertex*)desc.model->getVertices();
+			sd.vertices.assign(v, v + desc.model->getNumVertices());
+		}
+		else {
+			sd.vertices.assign(card, card + sizeof(card) / sizeof(Vertex));
+		}
+
+		sd.radius = 0.0f;
+		for (const Vertex& v : sd.vertices) {
+			sd.radius = glm::max(sd.radius, glm::length(glm::vec3(v.x, v.y, v.z)));
+		}
+
+		species.push_back(sd);
+
+		return (int)species.size() - 1;
+	}
+
+	void ScatterSystem::generateCluster(int clusterIdx, unsigned int seed, std::vector<std::vector<ScatterInstance>>& out) {
+		int cellX0 = (clusterIdx % clustersX) * clusterCells;
+		int cellZ0 = (clusterIdx / clustersX) * clusterCells;
+		int cellX1 = glm::min(cellX0 + clusterCells, heightmap->getWidth() - 1);
+		int cellZ1 = glm::min(cellZ0 + clusterCells, heightmap->getHeight() - 1);
+
+		float cellSize = heightmap->getCellSize();
+		float cellArea = cellSize * cellSize;
+		glm::vec3 origin = heightmap->getOrigin();
+
+		Cluster& cluster = clusters[clusterIdx];
+		bool empty = true;
+
+		out.resize(species.size());
+
+		for (int s = 0; s < (int)species.size(); s++) {
+			SpeciesData& sd = species[s];
+			std::vector<ScatterInstance>& instances = out[s];
+
+			for (int cz = cellZ0; cz < cellZ1; cz++) {
+				for (int cx = cellX0; cx < cellX1; cx++) {
+					unsigned int rng = hashCell(seed, s, cx, cz);
+
+					// Density at the centre of the cell
+					float u = (cx + 0.5f) / (heightmap->getWidth() - 1);
+					float v = (cz + 0.5f) / (heightmap->getHeight() - 1);
+					float maskValue = sd.mask ? sd.mask->sample(u, v) : 1.0f;
+
+					float expected = sd.desc.density * cellArea * maskValue;
+					int count = (int)expected;
+
+					// Fractional part decides if there is one more instance
+					if (nextRandom(rng) < expected - count) {
+						count++;
+					}
+
+					for (int i = 0; i < count; i++) {
+						float px = origin.x + (cx + nextRandom(rng)) * cellSize;
+						float pz = origin.z + (cz + nextRandom(rng)) * cellSize;
+						float scale = glm::mix(sd.desc.minScale, sd.desc.maxScale, nextRandom(rng));
+						float yaw = nextRandom(rng) * 6.2831853f;
+						float tint = 0.8f + 0.2f * nextRandom(rng);
+
+						// Reject positions outside the allowed height and slope
+						float h = heightmap->getWorldHeight(px, pz);
+						float normalisedH = (h - origin.y) / heightmap->getHeightScale();
+
+						if (normalisedH < sd.desc.minHeight || normalisedH > sd.desc.maxHeight) {
+							continue;
+						}
+
+						if (1.0f - heightmap->getWorldNormal(px, pz).y > sd.desc.maxSlope) {
+							continue;
+						}
+
+						ScatterInstance inst;
+						inst.x = px;
+						inst.y = h;
+						inst.z = pz;
+						inst.scale = scale;
+						inst.cosYaw = std::cos(yaw);
+						inst.sinYaw = std::sin(yaw);
+						inst.tint = tint;
+						inst.unused = 0.0f;
+						instances.push_back(inst);
+
+						// Grow the cluster bounds by the scaled mesh radius
+						glm::vec3 p(px, h, pz);
+						glm::vec3 r(sd.radius * scale);
+						if (empty) {
+							cluster.bounds = AABB(p - r, p + r);
+							empty = false;
+						}
+						else {
+							cluster.bounds.expand(p - r);
+							cluster.bounds.expand(p + r);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void ScatterSystem::generate(JobSystem* jobs, unsigned int seed) {
+		if (!heightmap->isLoaded()) {
+			std::cerr << "ScatterSystem has no heightmap to generate on" << std::endl;
+			return;
+		}
+
+		int numClusters = clustersX * clustersZ;
+		clusters.assign(numClusters, Cluster());
+
+		// Instances of each cluster for each species, filled in on the workers
+		std::vector<std::vector<std::vector<ScatterInstance>>> perCluster(numClusters);
+
+		jobs->parallelFor(numClusters, 1, [&](int begin, int end) {
+			for (int c = begin; c < end; c++) {
+				generateCluster(c, seed, perCluster[c]);
+			}
+		});
+
+		// Join the clusters into one array per species, in cluster order
+		totalInstances = 0;
+		for (int s = 0; s < (int)species.size(); s++) {
+			std::vector<ScatterInstance>& instances = species[s].instances;
+			instances.clear();
+
+			for (int c = 0; c < numClusters; c++) {
+				std::vector<ScatterInstance>& src = perCluster[c][s];
+
+				clusters[c].first.push_back((int)instances.size());
+				clusters[c].count.push_back((int)src.size());
+				instances.insert(instances.end(), src.begin(), src.end());
+
+				// Free as we go, the full set exists twice otherwise
+				std::vector<ScatterInstance>().swap(src);
+			}
+
+			totalInstances += (int)instances.size();
+		}
+
+		clusterVisible.resize(numClusters);
+		clusterDistance.resize(numClusters);
+
+		clusterTree.clear();
+		for (int c = 0; c < numClusters; c++) {
+			clusterTree.insert(clusters[c].bounds, c);
+		}
+
+		std::cout << "ScatterSystem generated " << totalInstances << " instances in " << numClusters << " clusters" << std::endl;
+	}
+
+	void ScatterSystem::createProgram() {
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"in vec2 vUV;\n"
+			"in vec4 instancePosScale;\n"
+			"in vec4 instanceRotTint;\n"
+			"out vec2 uv;\n"
+			"out float tint;\n"
+			"void main() {\n"
+			"vec3 p = vertexPos3D * instancePosScale.w;\n"
+			"float c = instanceRotTint.x;\n"
+			"float s = instanceRotTint.y;\n"
+			"p = vec3(c * p.x + s * p.z, p.y, -s * p.x + c * p.z) + instancePosScale.xyz;\n"
+			"gl_Position = viewProjection * vec4(p, 1);\n"
+			"uv = vUV;\n"
+			"tint = instanceRotTint.z;\n"
+			"}\n" };
+
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			"in vec2 uv;\n"
+			"in float tint;\n"
+			"uniform sampler2D sampler;\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"vec4 colour = texture(sampler, uv);\n"
+			"if (colour.a < 0.5) discard;\n"
+			"fragmentColour = vec4(colour.rgb * tint, colour.a);\n"
+			"}\n" };
+
+		// Built in the background with fixed attribute locations. Packets
+		// are skipped until it's ready, the fallback can't place instances
+		const char* attributes[] = { "vertexPos3D", "vUV", "instancePosScale", "instanceRotTint" };
+		vertexPos3DLocation = 0;
+		vertexUVLocation = 1;
+		instancePosScaleLocation = 2;
+		instanceRotTintLocation = 3;
+		samplerId = -1;
+
+		programId = ShaderLibrary::get().requestProgramFromSource(V_ShaderCode[0], F_ShaderCode[0], "", attributes, 4, [this](GLuint program) {
+			samplerId = glGetUniformLocation(program, "sampler");
+		});
+
+		if (programId == 0) {
+			std::cerr << "Failed to create ScatterSystem program. Check console for errors" << std::endl;
+		}
+	}
+
+	void ScatterSystem::createSpeciesBuffers(SpeciesData& sd) {
+		GLStateCache& gl = GLStateCache::get();
+
+		// Mesh vertices
+		glGenBuffers(1, &sd.vboMesh);
+		gl.bindBuffer(GL_ARRAY_BUFFER, sd.vboMesh);
+		glBufferData(GL_ARRAY_BUFFER, sd.vertices.size() * sizeof(Vertex), sd.vertices.data(), GL_STATIC_DRAW);
+
+		// Every instance, only ever read from by the GPU
+		GLsizeiptr instanceBytes = sd.instances.size() * sizeof(ScatterInstance);
+		glGenBuffers(1, &sd.vboInstances);
+		gl.bindBuffer(GL_COPY_READ_BUFFER, sd.vboInstances);
+		glBufferData(GL_COPY_READ_BUFFER, instanceBytes, sd.instances.empty() ? nullptr : sd.instances.data(), GL_STATIC_COPY);
+
+		// Visible instances are gathered here each frame
+		glGenBuffers(1, &sd.vboDraw);
+		gl.bindBuffer(GL_ARRAY_BUFFER, sd.vboDraw);
+		glBufferData(GL_ARRAY_BUFFER, instanceBytes, nullptr, GL_STREAM_COPY);
+
+		// Record the vertex layout once, mesh per vertex and draw buffer per instance
+		sd.vertexArray.addAttrib(sd.vboMesh, vertexPos3DLocation, 3, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		sd.vertexArray.addAttrib(sd.vboMesh, vertexUVLocation, 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, u));
+		sd.vertexArray.addAttrib(sd.vboDraw, instancePosScaleLocation, 4, GL_FLOAT, sizeof(ScatterInstance), offsetof(ScatterInstance, x), 1);
+		sd.vertexArray.addAttrib(sd.vboDraw, instanceRotTintLocation, 4, GL_FLOAT, sizeof(ScatterInstance), offsetof(ScatterInstance, cosYaw), 1);
+		sd.vertexArray.build();
+
+		// Cards are seen from both sides
+		PipelineDesc desc;
+		desc.programId = programId;
+		desc.vao = sd.vertexArray.getName();
+		desc.cull = sd.desc.model != nullptr;
+		sd.pipeline = PipelineCache::get().create(desc);
+
+		// GPU has its own copy now
+		sd.numInstances = (int)sd.instances.size();
+		std::vector<ScatterInstance>().swap(sd.instances);
+	}
+
+	void ScatterSystem::init() {
+		// Instance attributes need glVertexAttribDivisor, core in GL 3.3
+		if (!GLEW_VERSION_3_3 && !GLEW_ARB_instanced_arrays) {
+			std::cerr << "ScatterSystem needs GL 3.3 or ARB_instanced_arrays, scatter disabled" << std::endl;
+			return;
+		}
+
+		createProgram();
+
+		if (programId == 0) {
+			return;
+		}
+
+		for (SpeciesData& sd : species) {
+			createSpeciesBuffers(sd);
+		}
+	}
+
+	void ScatterSystem::submit(RenderQueue* queue, Camera* cam) {
+		visibleClusters = visibleInstances = drawCalls = 0;
+
+		if (programId == 0 || clusters.empty()) {
+			return;
+		}
+
+		const Frustum& frustum = cam->getFrustum();
+		glm::vec3 camPos = cam->getPos();
+
+		// Per cluster work only, instances are never touched on the CPU
+		std::fill(clusterVisible.begin(), clusterVisible.end(), 0);
+		clusterQuery.clear();
+		clusterTree.queryFrustum(frustum, clusterQuery);
+
+		for (int c : clusterQuery) {
+			const AABB& b = clusters[c].bounds;
+			clusterVisible[c] = 1;
+
+			// Distance from the camera to the closest point of the box
+			glm::vec3 closest = glm::clamp(camPos, b.min, b.max);
+			clusterDistance[c] = glm::length(closest - camPos);
+		}
+
+		visibleClusters = (int)clusterQuery.size();
+
+		GLStateCache& gl = GLStateCache::get();
+
+		for (int s = 0; s < (int)species.size(); s++) {
+			SpeciesData& sd = species[s];
+
+			if (sd.numInstances == 0) {
+				continue;
+			}
+
+			// Orphan last frame's draw buffer so the copies don't wait on it
+			gl.bindBuffer(GL_COPY_READ_BUFFER, sd.vboInstances);
+			gl.bindBuffer(GL_COPY_WRITE_BUFFER, sd.vboDraw);
+			glBufferData(GL_COPY_WRITE_BUFFER, sd.numInstances * sizeof(ScatterInstance), nullptr, GL_STREAM_COPY);
+
+			int count = 0;
+			int runFirst = 0, runCount = 0;
+
+			// Clusters are contiguous in the instance buffer, so neighbouring
+			// visible clusters are merged into a single copy. The extra
+			// iteration flushes the last run
+			for (int c = 0; c <= (int)clusters.size(); c++) {
+				int first = 0, n = 0;
+
+				if (c < (int)clusters.size() && clusterVisible[c] && clusterDistance[c] <= sd.desc.drawDistance) {
+					first = clusters[c].first[s];
+					n = clusters[c].count[s];
+				}
+
+				if (n > 0 && runFirst + runCount == first) {
+					runCount += n;
+					continue;
+				}
+
+				if (runCount > 0) {
+					glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+						runFirst * sizeof(ScatterInstance), count * sizeof(ScatterInstance), runCount * sizeof(ScatterInstance));
+					count += runCount;
+				}
+
+				runFirst = first;
+				runCount = n;
+			}
+
+			if (count == 0) {
+				continue;
+			}
+
+			// One draw for every visible instance of the species
+			DrawPacket packet;
+			packet.pass = PASS_OPAQUE;
+			packet.pipeline = sd.pipeline;
+			packet.textureTarget = GL_TEXTURE_2D;
+			packet.textureName = sd.desc.texture ? sd.desc.texture->getTextureName() : 0;
+			packet.mode = GL_TRIANGLES;
+			packet.count = (GLsizei)sd.vertices.size();
+			packet.instanceCount = count;
+			packet.owner = this;
+			packet.ownerIndex = s;
+
+			queue->submit(packet);
+
+			visibleInstances += count;
+			drawCalls++;
+		}
+	}
+
+	void ScatterSystem::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		// Camera matrices come from the shared FrameData block
+		GLStateCache::get().uniform1i(samplerId, 0);
+	}
+
+	void ScatterSystem::destroy() {
+		GLStateCache& gl = GLStateCache::get();
+
+		for (SpeciesData& sd : species) {
+			glDeleteBuffers(1, &sd.vboMesh);
+			glDeleteBuffers(1, &sd.vboInstances);
+			glDeleteBuffers(1, &sd.vboDraw);
+
+			gl.onBufferDeleted(sd.vboMesh);
+			gl.onBufferDeleted(sd.vboInstances);
+			gl.onBufferDeleted(sd.vboDraw);
+
+			sd.vertexArray.destroy();
+		}
+
+		// The program belongs to the shader library
+		programId = 0;
+	}
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include "Camera.h"
+#include "Model.h"
+#include "Texture.h"
+#include "Heightmap.h"
+#include "Frustum.h"
+#include "DynamicBVH.h"
+#include "JobSystem.h"
+#include "RenderQueue.h"
+#include "VertexArray.h"
+
+namespace GE {
+	// Per instance data streamed to the vertex shader, 32 bytes so a
+	// million instances fit in 32MB of graphics memory
+	struct ScatterInstance {
+		// World position and uniform scale
+		float x, y, z, scale;
+
+		// Rotation about the y axis stored as cos and sin of the angle
+		// plus a brightness variation so copies don't look identical
+		float cosYaw, sinYaw, tint, unused;
+	};
+
+	// Description of one kind of object scattered over the terrain
+	struct ScatterSpecies {
+		std::string name;
+
+		// Mesh to draw, nullptr uses a built-in crossed quad card (grass)
+		Model* model;
+		Texture* texture;
+
+		// Optional greyscale mask, white is full density, black is none
+		std::string densityMaskFile;
+
+		// Instances per square world unit where the mask is white
+		float density;
+
+		// Random scale range
+		float minScale, maxScale;
+
+		// Allowed normalised terrain height range and steepest slope
+		// (1 - normal.y, 0 is flat)
+		float minHeight, maxHeight;
+		float maxSlope;
+
+		// Clusters further than this from the camera are not drawn
+		float drawDistance;
+
+		ScatterSpecies() {
+			model = nullptr;
+			texture = nullptr;
+			density = 1.0f;
+			minScale = maxScale = 1.0f;
+			minHeight = 0.0f;
+			maxHeight = 1.0f;
+			maxSlope = 1.0f;
+			drawDistance = 200.0f;
+		}
+	};
+
+	// Places instances of each species over a heightmap from density masks
+	// Instances are generated per heightmap cell on the job system and
+	// grouped into square clusters of cells with a bounding box. Each frame
+	// only clusters are culled, visible clusters are copied on the GPU into
+	// a draw buffer and each species is drawn with one instanced draw call
+	class ScatterSystem : public Renderable {
+	public:
+		// clusterCells is the width of a cluster in heightmap cells
+		ScatterSystem(Heightmap* hm, int clusterCells = 16);
+		~ScatterSystem();
+
+		// Add a species before calling generate, returns its index
+		int addSpecies(const ScatterSpecies& species);
+
+		// Procedurally create the instances on the worker threads
+		void generate(JobSystem* jobs, unsigned int seed = 1);
+
+		// Create shaders and transfer the generated instances to graphics memory
+		void init();
+
+		// Cull the clusters against the camera, gather the visible instances
+		// and submit one instanced packet per species
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
+
+		// Release the GL objects
+		void destroy();
+
+		// Statistics
+		int getNumInstances() {
+			return totalInstances;
+		}
+
+		int getNumClusters() {
+			return (int)clusters.size();
+		}
+
+		// Values from the last submit
+		int getVisibleClusters() {
+			return visibleClusters;
+		}
+
+		int getVisibleInstances() {
+			return visibleInstances;
+		}
+
+		int getDrawCalls() {
+			return drawCalls;
+		}
+
+	private:
+		// A square group of heightmap cells
+		struct Cluster {
+			AABB bounds;
+
+			// Range of instances for each species in the species instance array
+			std::vector<int> first;
+			std::vector<int> count;
+		};
+
+		// Everything needed to draw one species
+		struct SpeciesData {
+			ScatterSpecies desc;
+			Heightmap* mask;
+
+			// All instances, sorted by cluster so a cluster is a contiguous range
+			// Released once transferred to graphics memory
+			std::vector<ScatterInstance> instances;
+			int numInstances;
+
+			// Mesh vertices and the bounding radius of the mesh at scale 1
+			std::vector<Vertex> vertices;
+			float radius;
+
+			// Mesh stream per vertex and draw buffer stream per instance
+			VertexArray vertexArray;
+			GLuint vboMesh;
+
+			// Shared program with this species' vertex array and culling
+			const PipelineState* pipeline;
+
+			// Static copy of every instance and the per frame buffer of visible ones
+			GLuint vboInstances;
+			GLuint vboDraw;
+		};
+
+		// Generate the instances of one cluster for every species
+		void generateCluster(int clusterIdx, unsigned int seed, std::vector<std::vector<ScatterInstance>>& out);
+
+		void createProgram();
+		void createSpeciesBuffers(SpeciesData& sd);
+
+	private:
+		Heightmap* heightmap;
+		int clusterCells;
+		int clustersX, clustersZ;
+
+		std::vector<SpeciesData> species;
+		std::vector<Cluster> clusters;
+		int totalInstances;
+
+		// Cluster bounds, culled with early outs instead of testing each one
+		DynamicBVH clusterTree;
+		std::vector<int> clusterQuery;
+
+		// Per frame cluster visibility and camera distance
+		std::vector<char> clusterVisible;
+		std::vector<float> clusterDistance;
+
+		// Program shared by all species
+		GLuint programId;
+		GLint vertexPos3DLocation;
+		GLint vertexUVLocation;
+		GLint instancePosScaleLocation;
+		GLint instanceRotTintLocation;
+		GLuint samplerId;
+
+		int visibleClusters;
+		int visibleInstances;
+		int drawCalls;
+	};
+}
@@ -0,0 +1,462 @@
+#include "SceneGraph.h"
+#include "Random.h"
+#include "SimdConfig.h"
+#include "Timing.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+
+namespace GE {
+	// Passed by reference to std::vector, so they need storage
+	const int SceneGraph::NO_PARENT;
+	const int SceneGraph::UPDATE_BATCH;
+
+	// out = a * b, out must not be a or b
+	static inline void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#if defined(GE_SIMD_SSE)
+		__m128 c0 = _mm_loadu_ps(&a[0][0]);
+		__m128 c1 = _mm_loadu_ps(&a[1][0]);
+		__m128 c2 = _mm_loadu_ps(&a[2][0]);
+		__m128 c3 = _mm_loadu_ps(&a[3][0]);
+
+		for (int j = 0; j < 4; j++) {
+			__m128 r = _mm_mul_ps(c0, _mm_set1_ps(b[j][0]));
+			r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(b[j][1])));
+			r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(b[j][2])));
+			r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(b[j][3])));
+			_mm_storeu_ps(&out[j][0], r);
+		}
+#else
+		out = a * b;
+#endif
+	}
+
+	SceneGraph::SceneGraph() {
+		jobs = nullptr;
+		minDirtyLevel = INT_MAX;
+		firstRoot = NO_PARENT;
+		numNodes = 0;
+		orderDirty = false;
+		updatedCount = 0;
+		updateMs = 0.0f;
+	}
+
+	const char* SceneGraph::getSIMDName() {
+#if defined(GE_SIMD_SSE)
+		return "SSE";
+#else
+		return "scalar";
+#endif
+	}
+
+	glm::mat4 SceneGraph::composeTRS(const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale) {
+		glm::mat3 r = glm::mat3_cast(rotation);
+
+		glm::mat4 m;
+		m[0] = glm::vec4(r[0] * scale.x, 0.0f);
+		m[1] = glm::vec4(r[1] * scale.y, 0.0f);
+		m[2] = glm::vec4(r[2] * scale.z, 0.0f);
+		m[3] = glm::vec4(position, 1.0f);
+		return m;
+	}
+
+	int SceneGraph::createNode(int parent) {
+		int node;
+		if (!freeHandles.empty()) {
+			node = freeHandles.back();
+			freeHandles.pop_back();
+		}
+		else {
+			node = (int)indexOf.size();
+			indexOf.push_back(-1);
+			parentOf.push_back(NO_PARENT);
+			firstChild.push_back(NO_PARENT);
+			nextSibling.push_back(NO_PARENT);
+			worldVersions.push_back(0);
+		}
+
+		// A new node is a different matrix to anyone who followed the handle
+		worldVersions[node]++;
+
+		// Stored at the end until the next update sorts it into place
+		indexOf[node] = (int)positions.size();
+		nodeAt.push_back(node);
+		positions.push_back(glm::vec3(0.0f));
+		rotations.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+		scales.push_back(glm::vec3(1.0f));
+		worlds.push_back(glm::mat4(1.0f));
+		parentIndex.push_back(NO_PARENT);
+		dirty.push_back(1);
+		levelOf.push_back(0);
+
+		firstChild[node] = NO_PARENT;
+		link(node, parent);
+
+		numNodes++;
+		orderDirty = true;
+		return node;
+	}
+
+	void SceneGraph::destroyNode(int node) {
+		unlink(node);
+
+		// The storage is dropped by the next rebuild
+		std::vector<int> stack(1, node);
+		while (!stack.empty()) {
+			int n = stack.back();
+			stack.pop_back();
+
+			for (int c = firstChild[n]; c != NO_PARENT; c = nextSibling[c]) {
+				stack.push_back(c);
+			}
+
+			indexOf[n] = -1;
+			parentOf[n] = firstChild[n] = nextSibling[n] = NO_PARENT;
+			freeHandles.push_back(n);
+			numNodes--;
+		}
+
+		orderDirty = true;
+	}
+
+	bool SceneGraph::setParent(int node, int parent) {
+		if (parentOf[node] == parent) {
+			return true;
+		}
+
+		// Walk up from the new parent, meeting node means it's underneath
+		for (int p = parent; p != NO_PARENT; p = parentOf[p]) {
+			if (p == node) {
+				std::cerr << "SceneGraph: can't parent node " << node << " under its own subtree" << std::endl;
+				return false;
+			}
+		}
+
+		unlink(node);
+		link(node, parent);
+
+		markDirty(indexOf[node]);
+		orderDirty = true;
+
+		return true;
+	}
+
+	void SceneGraph::link(int node, int parent) {
+		parentOf[node] = parent;
+
+		int& first = parent == NO_PARENT ? firstRoot : firstChild[parent];
+		nextSibling[node] = first;
+		first = node;
+	}
+
+	void SceneGraph::unlink(int node) {
+		int parent = parentOf[node];
+		int* link = parent == NO_PARENT ? &firstRoot : &firstChild[parent];
+
+		while (*link != node) {
+			link = &nextSibling[*link];
+		}
+		*link = nextSibling[node];
+
+		parentOf[node] = nextSibling[node] = NO_PARENT;
+	}
+
+	void SceneGraph::setPosition(int node, const glm::vec3& position) {
+		int i = indexOf[node];
+		positions[i] = position;
+		markDirty(i);
+	}
+
+	void SceneGraph::setRotation(int node, const glm::quat& rotation) {
+		int i = indexOf[node];
+		rotations[i] = rotation;
+		markDirty(i);
+	}
+
+	void SceneGraph::setScale(int node, const glm::vec3& scale) {
+		int i = indexOf[node];
+		scales[i] = scale;
+		markDirty(i);
+	}
+
+	void SceneGraph::setLocal(int node, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale) {
+		int i = indexOf[node];
+		positions[i] = position;
+		rotations[i] = rotation;
+		scales[i] = scale;
+		markDirty(i);
+	}
+
+	void SceneGraph::markDirty(int index) {
+		dirty[index] = 1;
+
+		// Levels are only known for nodes already in order, a rebuild
+		// finds the shallowest dirty level itself
+		if (!orderDirty) {
+			minDirtyLevel = std::min(minDirtyLevel, levelOf[index]);
+		}
+	}
+
+	void SceneGraph::rebuildOrder() {
+		// Breadth first from the roots, one level at a time
+		std::vector<int> order;
+		order.reserve(numNodes);
+		levelStart.clear();
+
+		for (int r = firstRoot; r != NO_PARENT; r = nextSibling[r]) {
+			order.push_back(r);
+		}
+
+		size_t begin = 0;
+		while (begin < order.size()) {
+			levelStart.push_back((int)begin);
+
+			size_t end = order.size();
+			for (size_t i = begin; i < end; i++) {
+				for (int c = firstChild[order[i]]; c != NO_PARENT; c = nextSibling[c]) {
+					order.push_back(c);
+				}
+			}
+			begin = end;
+		}
+		levelStart.push_back((int)order.size());
+
+		// Move every array into the new order
+		int n = (int)order.size();
+		std::vector<glm::vec3> newPositions(n), newScales(n);
+		std::vector<glm::quat> newRotations(n);
+		std::vector<glm::mat4> newWorlds(n);
+		std::vector<int> newParentIndex(n), newLevelOf(n);
+		std::vector<unsigned char> newDirty(n);
+
+		minDirtyLevel = INT_MAX;
+		int level = 0;
+
+		for (int i = 0; i < n; i++) {
+			int node = order[i];
+			int old = indexOf[node];
+
+			while (i >= levelStart[level + 1]) {
+				level++;
+			}
+
+			newPositions[i] = positions[old];
+			newRotations[i] = rotations[old];
+			newScales[i] = scales[old];
+			newWorlds[i] = worlds[old];
+			newDirty[i] = dirty[old];
+			newLevelOf[i] = level;
+
+			// Parents come first, so theirs is already the new index
+			int parent = parentOf[node];
+			newParentIndex[i] = parent == NO_PARENT ? NO_PARENT : indexOf[parent];
+
+			indexOf[node] = i;
+
+			if (newDirty[i] != 0) {
+				minDirtyLevel = std::min(minDirtyLevel, level);
+			}
+		}
+
+		positions.swap(newPositions);
+		rotations.swap(newRotations);
+		scales.swap(newScales);
+		worlds.swap(newWorlds);
+		parentIndex.swap(newParentIndex);
+		levelOf.swap(newLevelOf);
+		dirty.swap(newDirty);
+		nodeAt.swap(order);
+
+		orderDirty = false;
+	}
+
+	void SceneGraph::composeRange(int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			// Parents are a level up and already final for this update
+			int p = parentIndex[i];
+			if (dirty[i] == 0 && (p == NO_PARENT || dirty[p] != 2)) {
+				continue;
+			}
+
+			glm::mat4 local = composeTRS(positions[i], rotations[i], scales[i]);
+			if (p == NO_PARENT) {
+				worlds[i] = local;
+			}
+			else {
+				multiply(worlds[p], local, worlds[i]);
+			}
+
+			dirty[i] = 2;
+			worldVersions[nodeAt[i]]++;
+		}
+	}
+
+	void SceneGraph::update(JobSystem* js) {
+		Clock::time_point start = Clock::now();
+
+		if (js == nullptr) {
+			js = jobs;
+		}
+
+		if (orderDirty) {
+			rebuildOrder();
+		}
+
+		updatedCount = 0;
+		int numLevels = (int)levelStart.size() - 1;
+
+		// Nothing moved since the last update
+		if (minDirtyLevel >= numLevels) {
+			updateMs = elapsedMs(start);
+			return;
+		}
+
+		for (int level = minDirtyLevel; level < numLevels; level++) {
+			int begin = levelStart[level];
+			int count = levelStart[level + 1] - begin;
+
+			// Nodes of one level only read the level above
+			if (js != nullptr && count > UPDATE_BATCH) {
+				js->parallelFor(count, UPDATE_BATCH, [this, begin](int b, int e) {
+					composeRange(begin + b, begin + e);
+				});
+			}
+			else {
+				composeRange(begin, begin + count);
+			}
+		}
+
+		std::vector<unsigned char>::iterator first = dirty.begin() + levelStart[minDirtyLevel];
+		updatedCount = (int)std::count(first, dirty.end(), 2);
+		std::fill(first, dirty.end(), 0);
+
+		minDirtyLevel = INT_MAX;
+		updateMs = elapsedMs(start);
+	}
+
+	// Rotation of glm::rotate about x, then y, then z, as ModelRenderer used to build it
+	static glm::mat4 eulerTransform(const glm::vec3& position, const glm::vec3& euler, const glm::vec3& scale) {
+		glm::mat4 m = glm::translate(glm::mat4(1.0f), position);
+		m = glm::rotate(m, euler.x, glm::vec3(1.0f, 0.0f, 0.0f));
+		m = glm::rotate(m, euler.y, glm::vec3(0.0f, 1.0f, 0.0f));
+		m = glm::rotate(m, euler.z, glm::vec3(0.0f, 0.0f, 1.0f));
+		return glm::scale(m, scale);
+	}
+
+	static glm::quat eulerQuat(const glm::vec3& euler) {
+		return glm::angleAxis(euler.x, glm::vec3(1.0f, 0.0f, 0.0f)) *
+			glm::angleAxis(euler.y, glm::vec3(0.0f, 1.0f, 0.0f)) *
+			glm::angleAxis(euler.z, glm::vec3(0.0f, 0.0f, 1.0f));
+	}
+
+	void SceneGraph::runBenchmark(int numNodes, JobSystem* jobs) {
+		// Roots with 9 children of 10 children each, 100 nodes per root
+		const int NODES_PER_ROOT = 100;
+		int numRoots = std::max(1, numNodes / NODES_PER_ROOT);
+
+		SceneGraph scene;
+		scene.setJobSystem(jobs);
+
+		// The same transforms by handle for the Euler angle rebuild,
+		// parents are created before their children
+		std::vector<int> parents;
+		std::vector<glm::vec3> positions, eulers;
+		std::vector<int> roots, leaves;
+
+		unsigned int seed = 1u;
+		auto random = [&seed](float range) {
+			return (randomFloat(seed) - 0.5f) * range;
+		};
+
+		auto add = [&](int parent, float spread) {
+			int node = scene.createNode(parent);
+			glm::vec3 position(random(spread), random(spread), random(spread));
+			glm::vec3 euler(random(6.28f), random(6.28f), random(6.28f));
+			scene.setLocal(node, position, eulerQuat(euler), glm::vec3(1.0f));
+			parents.push_back(parent);
+			positions.push_back(position);
+			eulers.push_back(euler);
+			return node;
+		};
+
+		for (int r = 0; r < numRoots; r++) {
+			int root = add(NO_PARENT, 1000.0f);
+			roots.push_back(root);
+			for (int c = 0; c < 9; c++) {
+				int child = add(root, 20.0f);
+				for (int g = 0; g < 10; g++) {
+					leaves.push_back(add(child, 2.0f));
+				}
+			}
+		}
+
+		int total = (int)parents.size();
+		const int ITERATIONS = 10;
+
+		// Every matrix rebuilt every frame, as without the scene graph
+		std::vector<glm::mat4> rebuilt(total);
+		Clock::time_point start = Clock::now();
+		for (int it = 0; it < ITERATIONS; it++) {
+			for (int i = 0; i < total; i++) {
+				glm::mat4 local = eulerTransform(positions[i], eulers[i], glm::vec3(1.0f));
+				rebuilt[i] = parents[i] == NO_PARENT ? local : rebuilt[parents[i]] * local;
+			}
+		}
+		float rebuildMs = elapsedMs(start) / ITERATIONS;
+
+		// First update sorts the nodes and computes everything
+		scene.update();
+		float firstMs = scene.getUpdateMs();
+
+		float maxError = 0.0f;
+		for (int i = 0; i < total; i++) {
+			const glm::mat4& w = scene.getWorldMatrix(i);
+			for (int k = 0; k < 4; k++) {
+				glm::vec4 d = glm::abs(w[k] - rebuilt[i][k]);
+				maxError = std::max(maxError, std::max(std::max(d.x, d.y), std::max(d.z, d.w)));
+			}
+		}
+
+		float staticMs = 0.0f;
+		for (int it = 0; it < ITERATIONS; it++) {
+			scene.update();
+			staticMs += scene.getUpdateMs();
+		}
+
+		// A few leaves move, only they are recomputed
+		int numMoved = std::max(1, (int)leaves.size() / 100);
+		float leavesMs = 0.0f;
+		int leavesUpdated = 0;
+		for (int it = 0; it < ITERATIONS; it++) {
+			for (int m = 0; m < numMoved; m++) {
+				int node = leaves[(m * 97 + it * 13) % leaves.size()];
+				scene.setPosition(node, scene.getPosition(node) + glm::vec3(0.01f, 0.0f, 0.0f));
+			}
+			scene.update();
+			leavesMs += scene.getUpdateMs();
+			leavesUpdated = scene.getUpdatedCount();
+		}
+
+		// A few roots move, taking their whole subtree with them
+		int numRootsMoved = std::max(1, numRoots / 100);
+		float subtreesMs = 0.0f;
+		int subtreesUpdated = 0;
+		for (int it = 0; it < ITERATIONS; it++) {
+			for (int m = 0; m < numRootsMoved; m++) {
+				int node = roots[(m * 97 + it * 13) % roots.size()];
+				scene.setRotation(node, scene.getRotation(node) * glm::angleAxis(0.01f, glm::vec3(0.0f, 1.0f, 0.0f)));
+			}
+			scene.update();
+			subtreesMs += scene.getUpdateMs();
+			subtreesUpdated = scene.getUpdatedCount();
+		}
+
+		std::cout << "Scene graph " << total << " nodes (" << getSIMDName() << "): rebuild all from Euler angles "
+			<< rebuildMs << " ms, first update " << firstMs << " ms" << (maxError < 1e-3f ? "" : " MISMATCH")
+			<< ", static " << staticMs / ITERATIONS << " ms, " << leavesUpdated << " leaves moved "
+			<< leavesMs / ITERATIONS << " ms, " << numRootsMoved << " subtrees moved (" << subtreesUpdated << " nodes) "
+			<< subtreesMs / ITERATIONS << " ms" << std::endl;
+	}
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <cstdint>
+#include <vector>
+#include "JobSystem.h"
+
+namespace GE {
+	// Transform hierarchy of nodes with a local translation, rotation and
+	// scale. World matrices are cached and only recomputed for nodes whose
+	// local transform changed and their descendants, so a frame in which
+	// nothing moved costs nothing
+	//
+	// Nodes are stored breadth first: every level of the tree is one
+	// contiguous range of the arrays and all parents come before their
+	// children. update() then composes a level at a time, each level a
+	// batch of independent parent * local products split over the job
+	// system. Adding, removing or reparenting nodes re-sorts the arrays
+	// at the next update
+	class SceneGraph {
+	public:
+		static const int NO_PARENT = -1;
+
+		// Nodes per job system batch when composing a level
+		static const int UPDATE_BATCH = 4096;
+
+		SceneGraph();
+		~SceneGraph() {}
+
+		// Add a node with an identity transform under parent, returns its
+		// handle. Handles stay valid until the node is destroyed
+		int createNode(int parent = NO_PARENT);
+
+		// Remove a node and everything below it
+		void destroyNode(int node);
+
+		// Move node and its subtree under parent, NO_PARENT makes it a root.
+		// The local transform is kept, so the world transform changes.
+		// Returns false and changes nothing if parent is node or one of
+		// its descendants, which would cut the subtree off in a cycle
+		bool setParent(int node, int parent);
+
+		// Local transform, relative to the parent
+		void setPosition(int node, const glm::vec3& position);
+		void setRotation(int node, const glm::quat& rotation);
+		void setScale(int node, const glm::vec3& scale);
+		void setLocal(int node, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+
+		// Recompute the world matrices of the nodes that moved
+		void update(JobSystem* jobs = nullptr);
+
+		// Workers sharing update, optional
+		void setJobSystem(JobSystem* js) {
+			jobs = js;
+		}
+
+		// Accessors
+		// World matrix as of the last update
+		const glm::mat4& getWorldMatrix(int node) {
+			return worlds[indexOf[node]];
+		}
+
+		const glm::vec3& getPosition(int node) {
+			return positions[indexOf[node]];
+		}
+
+		const glm::quat& getRotation(int node) {
+			return rotations[indexOf[node]];
+		}
+
+		const glm::vec3& getScale(int node) {
+			return scales[indexOf[node]];
+		}
+
+		int getParent(int node) {
+			return parentOf[node];
+		}
+
+		// Changes whenever the node's world matrix is recomputed, so code
+		// following a node can tell whether it moved since it last looked
+		uint32_t getWorldVersion(int node) {
+			return worldVersions[node];
+		}
+
+		int getNodeCount() {
+			return numNodes;
+		}
+
+		// World matrices recomputed by the last update and its time
+		int getUpdatedCount() {
+			return updatedCount;
+		}
+
+		float getUpdateMs() {
+			return updateMs;
+		}
+
+		// Translation, rotation and scale as one matrix, without building
+		// and multiplying a matrix for each
+		static glm::mat4 composeTRS(const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+
+		// Instruction set the level composition was compiled for
+		static const char* getSIMDName();
+
+		// Print update times for a scene of numNodes nodes to the console:
+		// every node moving against rebuilding each matrix from Euler
+		// angles, nothing moving and a few subtrees moving
+		static void runBenchmark(int numNodes, JobSystem* jobs);
+
+	private:
+		// Flag a node's local transform as changed
+		void markDirty(int index);
+
+		// Put the live nodes back in breadth first order
+		void rebuildOrder();
+
+		// Recompute the flagged nodes in [begin, end) of one level
+		void composeRange(int begin, int end);
+
+		// Unlink a node from its parent's children or the roots
+		void unlink(int node);
+		void link(int node, int parent);
+
+	private:
+		JobSystem* jobs;
+
+		// Local transform, world matrix and parent index of every node in
+		// breadth first order. Nodes added since the last update are
+		// appended until the next rebuild
+		std::vector<glm::vec3> positions;
+		std::vector<glm::quat> rotations;
+		std::vector<glm::vec3> scales;
+		std::vector<glm::mat4> worlds;
+		std::vector<int> parentIndex;
+
+		// 1 when the local transform changed, 2 once the world matrix has
+		// been recomputed in this update so the children follow
+		std::vector<unsigned char> dirty;
+
+		// Level of each index and where each level starts, with the end
+		// of the last level at the back
+		std::vector<int> levelOf;
+		std::vector<int> levelStart;
+
+		// Shallowest level holding a dirty node, levels above it are skipped
+		int minDirtyLevel;
+
+		// Handle to index and back, -1 for destroyed handles
+		std::vector<int> indexOf;
+		std::vector<int> nodeAt;
+		std::vector<int> freeHandles;
+
+		// World matrix version by handle, bumped by composeRange and when
+		// a handle is reused. Starts at 1, so 0 is never current
+		std::vector<uint32_t> worldVersions;
+
+		// Tree by handle, children as a sibling list
+		std::vector<int> parentOf;
+		std::vector<int> firstChild;
+		std::vector<int> nextSibling;
+		int firstRoot;
+
+		int numNodes;
+		bool orderDirty;
+
+		int updatedCount;
+		float updateMs;
+	};
+}
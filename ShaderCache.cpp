@@ -0,0 +1,174 @@
+#include "ShaderCache.h"
+#include "Timing.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace GE {
+	// Start of every cache file, bump FILE_VERSION if the layout changes
+	const uint32_t FILE_MAGIC = 0x43534547u;
+	const uint32_t FILE_VERSION = 1u;
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t key;
+		uint32_t format;
+		uint32_t length;
+	};
+
+	// 64 bit FNV-1a, including the terminating zero so "ab" + "c" and
+	// "a" + "bc" give different keys
+	static uint64_t hashString(uint64_t hash, const char* s) {
+		do {
+			hash ^= (unsigned char)*s;
+			hash *= 0x100000001b3ull;
+		} while (*s++ != '\0');
+
+		return hash;
+	}
+
+	static std::string glString(GLenum name) {
+		const GLubyte* s = glGetString(name);
+		return s != nullptr ? (const char*)s : "";
+	}
+
+	ShaderCache& ShaderCache::get() {
+		static ShaderCache cache;
+		return cache;
+	}
+
+	ShaderCache::ShaderCache() {
+		enabled = false;
+		loaded = compiled = rejected = 0;
+		loadMs = compileMs = 0.0f;
+	}
+
+	void ShaderCache::init(const char* dir) {
+		directory = dir;
+		driver = glString(GL_VENDOR) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+
+		formats.clear();
+		if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) {
+			GLint numFormats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+			formats.resize(numFormats);
+			if (numFormats > 0) {
+				glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+			}
+		}
+
+		enabled = !formats.empty();
+		if (!enabled) {
+			std::cout << "Shader cache off, the driver can't save program binaries" << std::endl;
+			return;
+		}
+
+		// Fails harmlessly if it is already there
+#ifdef _WIN32
+		_mkdir(dir);
+#else
+		mkdir(dir, 0755);
+#endif
+	}
+
+	uint64_t ShaderCache::makeKey(const char* const sources[], int numSources, const char* defines) {
+		uint64_t hash = hashString(0xcbf29ce484222325ull, driver.c_str());
+		for (int i = 0; i < numSources; i++) {
+			hash = hashString(hash, sources[i]);
+		}
+
+		return hashString(hash, defines);
+	}
+
+	std::string ShaderCache::getPath(uint64_t key) {
+		char name[24];
+		snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+		return directory + "/" + name;
+	}
+
+	bool ShaderCache::load(uint64_t key, GLuint programId) {
+		if (!enabled) {
+			return false;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		std::ifstream file(getPath(key), std::ios::binary);
+		if (!file) {
+			return false;
+		}
+
+		// A header from another version or key is treated as a miss
+		FileHeader header;
+		if (!file.read((char*)&header, sizeof(header)) || header.magic != FILE_MAGIC ||
+			header.version != FILE_VERSION || header.key != key ||
+			std::find(formats.begin(), formats.end(), (GLint)header.format) == formats.end()) {
+			return false;
+		}
+
+		std::vector<char> binary(header.length);
+		if (!file.read(binary.data(), header.length)) {
+			return false;
+		}
+
+		glProgramBinary(programId, header.format, binary.data(), header.length);
+
+		// The driver can still refuse a binary it wrote, after an update
+		// that kept the version string for example
+		GLint isProgramLinked = GL_FALSE;
+		glGetProgramiv(programId, GL_LINK_STATUS, &isProgramLinked);
+		if (isProgramLinked != GL_TRUE) {
+			rejected++;
+			return false;
+		}
+
+		loaded++;
+		loadMs += elapsedMs(start);
+		return true;
+	}
+
+	void ShaderCache::prepareLink(GLuint programId) {
+		if (enabled) {
+			glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+	}
+
+	void ShaderCache::store(uint64_t key, GLuint programId) {
+		if (!enabled) {
+			return;
+		}
+
+		GLint length = 0;
+		glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) {
+			return;
+		}
+
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(programId, length, &length, &format, binary.data());
+
+		FileHeader header;
+		header.magic = FILE_MAGIC;
+		header.version = FILE_VERSION;
+		header.key = key;
+		header.format = format;
+		header.length = (uint32_t)length;
+
+		std::ofstream file(getPath(key), std::ios::binary | std::ios::trunc);
+		file.write((const char*)&header, sizeof(header));
+		file.write(binary.data(), length);
+
+		if (!file) {
+			std::cerr << "Unable to write shader cache file " << getPath(key) << std::endl;
+		}
+	}
+}
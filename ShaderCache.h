@@ -0,0 +1,94 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace GE {
+	// Linked program binaries kept on disk so later launches can skip
+	// compiling. Each binary is stored under a hash of the shader sources,
+	// anything else that changes the linked program and the driver's
+	// vendor, renderer and version strings, so a driver update or an edited
+	// shader simply misses the cache. A binary the driver still rejects is
+	// compiled again and overwritten
+	//
+	// compileProgram and the other ShaderUtils helpers go through the cache,
+	// nothing else needs to call it directly
+	class ShaderCache {
+	public:
+		// One cache per GL context, the engine only has one
+		static ShaderCache& get();
+
+		ShaderCache();
+
+		// Keep binaries in directory, created if it doesn't exist. Call
+		// once GLEW is initialised. The cache stays off if the driver can't
+		// return program binaries (needs GL 4.1 or ARB_get_program_binary)
+		void init(const char* directory);
+
+		// Key of a program made from one source per stage. defines covers
+		// everything else that changes the link, output names for example
+		uint64_t makeKey(const char* const sources[], int numSources, const char* defines);
+
+		// Link programId from the binary saved under key. False if there is
+		// none or the driver rejected it, the program must then be built
+		// from source as usual
+		bool load(uint64_t key, GLuint programId);
+
+		// Ask the driver to keep the binary of a program about to be linked
+		void prepareLink(GLuint programId);
+
+		// Save the binary of a linked program under key
+		void store(uint64_t key, GLuint programId);
+
+		// Time spent compiling a program the cache didn't have
+		void addCompileTime(float ms) {
+			compiled++;
+			compileMs += ms;
+		}
+
+		// Accessors
+		bool isEnabled() {
+			return enabled;
+		}
+
+		// Programs created from a binary and the time it took
+		int getLoaded() {
+			return loaded;
+		}
+
+		float getLoadMs() {
+			return loadMs;
+		}
+
+		// Programs compiled from source and the time it took
+		int getCompiled() {
+			return compiled;
+		}
+
+		float getCompileMs() {
+			return compileMs;
+		}
+
+		// Binaries found but rejected by the driver
+		int getRejected() {
+			return rejected;
+		}
+
+	private:
+		std::string getPath(uint64_t key);
+
+	private:
+		bool enabled;
+		std::string directory;
+
+		// Vendor, renderer and version strings, part of every key
+		std::string driver;
+
+		// Binary formats the driver accepts
+		std::vector<GLint> formats;
+
+		int loaded, compiled, rejected;
+		float loadMs, compileMs;
+	};
+}
@@ -0,0 +1,374 @@
+#include "ShaderLibrary.h"
+#include "ShaderCache.h"
+#include "GLStateCache.h"
+#include "Timing.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+namespace GE {
+	// Deepest chain of includes before giving up, catches include cycles
+	const int MAX_INCLUDE_DEPTH = 16;
+
+	ShaderLibrary& ShaderLibrary::get() {
+		static ShaderLibrary library;
+		return library;
+	}
+
+	ShaderLibrary::ShaderLibrary() {
+		fallbackProgramId = 0;
+		requests = 0;
+	}
+
+	void ShaderLibrary::init(const char* dir) {
+		directory = dir;
+
+		addInclude("FrameData.glsl", GE_FRAME_DATA_GLSL);
+		addInclude("ObjectData.glsl", GE_OBJECT_DATA_GLSL);
+		addInclude("TransparentOutput.glsl", GE_TRANSPARENT_OUTPUT_GLSL);
+
+		// Cheap enough to build at once, it stands in for the others
+		const GLchar* V_ShaderCode =
+			"#version 140\n"
+			GE_FRAME_DATA_GLSL
+			GE_OBJECT_DATA_GLSL
+			"in vec3 vertexPos3D;\n"
+			"void main() {\n"
+			"gl_Position = viewProjection * transform * vec4(vertexPos3D, 1);\n"
+			"}\n";
+
+		const GLchar* F_ShaderCode =
+			"#version 140\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"fragmentColour = vec4(0.5, 0.5, 0.5, 1.0);\n"
+			"}\n";
+
+		const char* attributes[] = { "vertexPos3D" };
+		fallbackProgramId = getProgramFromSource(V_ShaderCode, F_ShaderCode, "", attributes, 1);
+	}
+
+	void ShaderLibrary::addInclude(const char* name, const char* source) {
+		includes[name] = source;
+	}
+
+	bool ShaderLibrary::findInclude(const std::string& name, std::string& out) {
+		auto it = includes.find(name);
+		if (it != includes.end()) {
+			out = it->second;
+			return true;
+		}
+
+		out = loadShaderSourceCode((directory + "/" + name).c_str());
+		return !out.empty();
+	}
+
+	bool ShaderLibrary::resolveIncludes(const std::string& source, std::string& out,
+		std::unordered_map<std::string, bool>& included, int depth) {
+		if (depth > MAX_INCLUDE_DEPTH) {
+			std::cerr << "Shader includes nested too deeply, check for a cycle" << std::endl;
+			return false;
+		}
+
+		std::istringstream lines(source);
+		std::string line;
+
+		while (std::getline(lines, line)) {
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+				out += line + "\n";
+				continue;
+			}
+
+			size_t open = line.find('"', start);
+			size_t close = open != std::string::npos ? line.find('"', open + 1) : std::string::npos;
+			if (close == std::string::npos) {
+				std::cerr << "Malformed shader include: " << line << std::endl;
+				return false;
+			}
+
+			std::string name = line.substr(open + 1, close - open - 1);
+			if (included[name]) {
+				continue;
+			}
+			included[name] = true;
+
+			std::string text;
+			if (!findInclude(name, text)) {
+				std::cerr << "Shader include not found: " << name << std::endl;
+				return false;
+			}
+
+			if (!resolveIncludes(text, out, included, depth + 1)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	std::string ShaderLibrary::preprocess(const std::string& source, const char* defines) {
+		// #version has to stay the first line, the defines go after it
+		std::string out;
+		std::string body = source;
+		if (source.compare(0, 8, "#version") == 0) {
+			size_t end = source.find('\n');
+			out = source.substr(0, end) + "\n";
+			body = end != std::string::npos ? source.substr(end + 1) : "";
+		}
+
+		std::istringstream names(defines);
+		std::string define;
+		while (names >> define) {
+			size_t equals = define.find('=');
+			if (equals == std::string::npos) {
+				out += "#define " + define + " 1\n";
+			}
+			else {
+				out += "#define " + define.substr(0, equals) + " " + define.substr(equals + 1) + "\n";
+			}
+		}
+
+		std::unordered_map<std::string, bool> included;
+		if (!resolveIncludes(body, out, included, 0)) {
+			return "";
+		}
+
+		return out;
+	}
+
+	GLuint ShaderLibrary::getProgram(const char* vertexFile, const char* fragmentFile, const char* defines,
+		const char* const attributes[], int numAttributes) {
+		std::string vertexSource = loadShaderSourceCode((directory + "/" + vertexFile).c_str());
+		std::string fragmentSource = loadShaderSourceCode((directory + "/" + fragmentFile).c_str());
+
+		if (vertexSource.empty() || fragmentSource.empty()) {
+			requests++;
+			return 0;
+		}
+
+		return findOrBuild(vertexSource.c_str(), fragmentSource.c_str(), defines, attributes, numAttributes, nullptr, true);
+	}
+
+	GLuint ShaderLibrary::getProgramFromSource(const char* vertexSource, const char* fragmentSource, const char* defines,
+		const char* const attributes[], int numAttributes) {
+		return findOrBuild(vertexSource, fragmentSource, defines, attributes, numAttributes, nullptr, true);
+	}
+
+	GLuint ShaderLibrary::requestProgram(const char* vertexFile, const char* fragmentFile, const char* defines,
+		const char* const attributes[], int numAttributes, const ReadyFunc& onReady) {
+		std::string vertexSource = loadShaderSourceCode((directory + "/" + vertexFile).c_str());
+		std::string fragmentSource = loadShaderSourceCode((directory + "/" + fragmentFile).c_str());
+
+		if (vertexSource.empty() || fragmentSource.empty()) {
+			requests++;
+			return 0;
+		}
+
+		return findOrBuild(vertexSource.c_str(), fragmentSource.c_str(), defines, attributes, numAttributes, onReady, false);
+	}
+
+	GLuint ShaderLibrary::requestProgramFromSource(const char* vertexSource, const char* fragmentSource, const char* defines,
+		const char* const attributes[], int numAttributes, const ReadyFunc& onReady) {
+		return findOrBuild(vertexSource, fragmentSource, defines, attributes, numAttributes, onReady, false);
+	}
+
+	GLuint ShaderLibrary::findOrBuild(const char* vertexSource, const char* fragmentSource, const char* defines,
+		const char* const attributes[], int numAttributes, const ReadyFunc& onReady, bool wait) {
+		requests++;
+
+		std::string v = preprocess(vertexSource, defines);
+		std::string f = preprocess(fragmentSource, defines);
+		if (v.empty() || f.empty()) {
+			return 0;
+		}
+
+		// The attribute locations are part of the program too
+		std::string key = v + '\0' + f;
+		for (int i = 0; i < numAttributes; i++) {
+			key += '\0' + std::string(attributes[i]);
+		}
+
+		GLuint programId;
+		auto it = programs.find(key);
+
+		if (it != programs.end()) {
+			programId = it->second;
+		}
+		else {
+			// The handle exists from now on, the build may come later
+			programId = glCreateProgram();
+			programs[key] = programId;
+
+			PendingProgram& p = pending[programId];
+			p.vertexSource = v;
+			p.fragmentSource = f;
+			p.attributes.assign(attributes, attributes + numAttributes);
+			p.build.programId = programId;
+			p.started = false;
+			p.failed = false;
+			p.buildMs = 0.0f;
+			pendingOrder.push_back(programId);
+
+			// With parallel compile the driver builds on its own threads,
+			// so it can start at once
+			if (hasParallelShaderCompile()) {
+				startBuild(p);
+			}
+		}
+
+		auto building = pending.find(programId);
+		if (building == pending.end()) {
+			if (onReady) {
+				onReady(programId);
+			}
+			return programId;
+		}
+
+		if (onReady) {
+			building->second.onReady.push_back(onReady);
+		}
+
+		if (!wait) {
+			return programId;
+		}
+
+		if (!building->second.started) {
+			startBuild(building->second);
+		}
+
+		if (building->second.failed || !finishBuild(programId)) {
+			return 0;
+		}
+
+		return programId;
+	}
+
+	void ShaderLibrary::startBuild(PendingProgram& p) {
+		Clock::time_point start = Clock::now();
+
+		std::vector<const char*> attributes;
+		for (const std::string& name : p.attributes) {
+			attributes.push_back(name.c_str());
+		}
+
+		const GLchar* v_source_array[] = { p.vertexSource.c_str() };
+		const GLchar* f_source_array[] = { p.fragmentSource.c_str() };
+		beginCompileProgram(v_source_array, f_source_array, p.build, attributes.data(), (int)attributes.size());
+
+		p.started = true;
+		p.buildMs += elapsedMs(start);
+	}
+
+	bool ShaderLibrary::finishBuild(GLuint programId) {
+		PendingProgram& p = pending[programId];
+		Clock::time_point start = Clock::now();
+
+		bool fromCache = p.build.vertexShader == 0;
+		if (!finishCompileProgram(p.build)) {
+			// Stays pending so its draws are never issued
+			std::cerr << "Failed to build shader library program " << programId << std::endl;
+			p.failed = true;
+			return false;
+		}
+
+		if (!fromCache) {
+			ShaderCache::get().addCompileTime(p.buildMs + elapsedMs(start));
+		}
+
+		std::vector<ReadyFunc> onReady;
+		onReady.swap(p.onReady);
+
+		pending.erase(programId);
+		pendingOrder.erase(std::find(pendingOrder.begin(), pendingOrder.end(), programId));
+
+		for (const ReadyFunc& func : onReady) {
+			func(programId);
+		}
+
+		return true;
+	}
+
+	void ShaderLibrary::update() {
+		if (pending.empty()) {
+			return;
+		}
+
+		// Finishing removes from pendingOrder, and an onReady callback may
+		// finish programs further along the copy
+		std::vector<GLuint> order = pendingOrder;
+		int started = 0;
+
+		for (GLuint programId : order) {
+			auto it = pending.find(programId);
+			if (it == pending.end()) {
+				continue;
+			}
+
+			PendingProgram& p = it->second;
+			if (p.failed) {
+				continue;
+			}
+
+			// Without parallel compile a build is submitted in one frame and
+			// checked the next, giving the driver a frame to work on it
+			if (!p.started) {
+				if (started < MAX_BUILDS_PER_FRAME) {
+					startBuild(p);
+					started++;
+				}
+				continue;
+			}
+
+			if (isProgramBuildComplete(p.build)) {
+				finishBuild(programId);
+			}
+		}
+	}
+
+	void ShaderLibrary::warmUp() {
+		if (pending.empty()) {
+			return;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		// Submit everything first so the driver can build them side by side
+		std::vector<GLuint> order = pendingOrder;
+		for (GLuint programId : order) {
+			PendingProgram& p = pending.find(programId)->second;
+			if (!p.started) {
+				startBuild(p);
+			}
+		}
+
+		// Already finished by an onReady callback of an earlier one
+		int built = 0;
+		for (GLuint programId : order) {
+			auto it = pending.find(programId);
+			if (it == pending.end()) {
+				continue;
+			}
+
+			if (!it->second.failed && finishBuild(programId)) {
+				built++;
+			}
+		}
+
+		std::cout << "Shader warm up built " << built << " programs in " << elapsedMs(start) << " ms" << std::endl;
+	}
+
+	void ShaderLibrary::destroy() {
+		for (auto& entry : programs) {
+			glDeleteProgram(entry.second);
+			GLStateCache::get().onProgramDeleted(entry.second);
+		}
+
+		programs.clear();
+		pending.clear();
+		pendingOrder.clear();
+		fallbackProgramId = 0;
+		requests = 0;
+	}
+}
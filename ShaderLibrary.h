@@ -0,0 +1,163 @@
+#pragma once
+#include <GL/glew.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ShaderUtils.h"
+
+namespace GE {
+	// Builds programs from .vs/.fs files (or embedded source) and hands out
+	// shared handles. Before compiling, each stage has
+	//
+	//	#include "name"
+	//
+	// lines replaced by the named include, either one registered with
+	// addInclude or a file in the library's directory, and gets a #define
+	// for every feature in the defines list after its #version line. A
+	// shader can then #ifdef a feature instead of branching on a uniform,
+	// each set of defines being its own permutation
+	//
+	// Programs are looked up by their final source, so renderers asking for
+	// the same program (or the same permutation through different paths)
+	// share one handle. The library owns the programs, renderers must not
+	// delete them
+	//
+	// requestProgram builds without waiting for the driver. Its handle can
+	// go in draw packets straight away, the render queue draws them with
+	// their fallback program or skips them until the build is ready. With
+	// KHR/ARB_parallel_shader_compile the driver builds on its own threads
+	// and update() polls for the finished ones, otherwise update() builds a
+	// few per frame. warmUp() finishes everything requested so far, for a
+	// loading screen
+	class ShaderLibrary {
+	public:
+		// Called with the program once it is built, look up uniforms here
+		typedef std::function<void(GLuint)> ReadyFunc;
+
+		// Builds started per frame by update() without parallel compile
+		static const int MAX_BUILDS_PER_FRAME = 2;
+
+		// One library per GL context, the engine only has one
+		static ShaderLibrary& get();
+
+		ShaderLibrary();
+
+		// Load shader files from directory. Registers the engine blocks as
+		// "FrameData.glsl", "ObjectData.glsl" and "TransparentOutput.glsl"
+		// and builds the fallback program
+		void init(const char* directory);
+
+		// Make source available to #include "name"
+		void addInclude(const char* name, const char* source);
+
+		// Program from two files in the library's directory. defines is a
+		// space separated list of NAME or NAME=VALUE. attributes, if given,
+		// are bound to locations 0, 1, ... so every permutation of a shader
+		// can share one vertex layout. 0 if it fails to build
+		GLuint getProgram(const char* vertexFile, const char* fragmentFile, const char* defines = "",
+			const char* const attributes[] = nullptr, int numAttributes = 0);
+
+		// The same from embedded source
+		GLuint getProgramFromSource(const char* vertexSource, const char* fragmentSource, const char* defines = "",
+			const char* const attributes[] = nullptr, int numAttributes = 0);
+
+		// Like getProgram but never waits for the driver. onReady is called
+		// once the program is built, straight away if it already is. Use
+		// attributes so the vertex layout doesn't need the linked program
+		GLuint requestProgram(const char* vertexFile, const char* fragmentFile, const char* defines = "",
+			const char* const attributes[] = nullptr, int numAttributes = 0, const ReadyFunc& onReady = nullptr);
+
+		GLuint requestProgramFromSource(const char* vertexSource, const char* fragmentSource, const char* defines = "",
+			const char* const attributes[] = nullptr, int numAttributes = 0, const ReadyFunc& onReady = nullptr);
+
+		// True once programId can be drawn with, never waits. Programs that
+		// failed to build never become ready
+		bool isReady(GLuint programId) {
+			return pending.empty() || pending.find(programId) == pending.end();
+		}
+
+		// Call once a frame to finish the builds the driver has completed
+		void update();
+
+		// Build everything requested so far, waiting for the driver
+		void warmUp();
+
+		// Release method to free up objects
+		void destroy();
+
+		// Accessors
+		// Flat grey program drawn in place of one still building. Needs the
+		// position at attribute 0 and the ObjectData block
+		GLuint getFallbackProgram() {
+			return fallbackProgramId;
+		}
+
+		// Programs built and the number of requests they served
+		int getProgramCount() {
+			return (int)programs.size();
+		}
+
+		int getRequestCount() {
+			return requests;
+		}
+
+		// Requested programs not built yet, including failed ones
+		int getPendingCount() {
+			return (int)pending.size();
+		}
+
+	private:
+		// A requested program until it is built
+		struct PendingProgram {
+			std::string vertexSource;
+			std::string fragmentSource;
+			std::vector<std::string> attributes;
+			ProgramBuild build;
+			bool started;
+			bool failed;
+
+			// Time the build has taken on this thread
+			float buildMs;
+
+			std::vector<ReadyFunc> onReady;
+		};
+
+		// Shared by the get and request functions, waits for the build if wait is set
+		GLuint findOrBuild(const char* vertexSource, const char* fragmentSource, const char* defines,
+			const char* const attributes[], int numAttributes, const ReadyFunc& onReady, bool wait);
+
+		// Submit a pending program's compile and link
+		void startBuild(PendingProgram& p);
+
+		// Check a started build, call its onReady and forget it. False if it failed
+		bool finishBuild(GLuint programId);
+
+		// Source with the includes resolved and the defines added, empty
+		// if an include can't be found
+		std::string preprocess(const std::string& source, const char* defines);
+
+		// Replace the #include lines of source, each include is pasted once
+		bool resolveIncludes(const std::string& source, std::string& out, std::unordered_map<std::string, bool>& included, int depth);
+
+		// Text of an include, registered or from a file
+		bool findInclude(const std::string& name, std::string& out);
+
+	private:
+		std::string directory;
+
+		// Registered includes by name
+		std::unordered_map<std::string, std::string> includes;
+
+		// Programs by final vertex source, fragment source and attributes
+		std::unordered_map<std::string, GLuint> programs;
+
+		// Programs not built yet by handle, and the handles in request order
+		std::unordered_map<GLuint, PendingProgram> pending;
+		std::vector<GLuint> pendingOrder;
+
+		GLuint fallbackProgramId;
+
+		int requests;
+	};
+}
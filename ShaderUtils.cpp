@@ -1,5 +1,10 @@
 #include "ShaderUtils.h"
+#include "ShaderCache.h"
+#include "Timing.h"
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 namespace GE {
 	// This is a helper function that allows us to see
@@ -28,80 +33,258 @@ namespace GE {
 		}
 	}
 
-	bool compileProgram(const GLchar* v_shader_sourcecode[], const GLchar* f_shader_sourcecode[], GLuint* programId) {
-		// Create the vertex shader first.
-		// Order doesn't matter but shaders must be created and compiled before
-		// attaching to program
-		GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-
-		// Copy the source to OpenGL ready for compilation
-		glShaderSource(vertexShader, 1, v_shader_sourcecode, nullptr);
-
-		// Compile the code
-		glCompileShader(vertexShader);
-
-		// Check for compiler errors
+	// Compile status of a shader, with the log on failure
+	static bool _checkShaderCompiled(GLuint shaderId, const char* stage) {
 		// Presume shader didn't compile
 		GLint isShaderCompiledOK = GL_FALSE;
 
 		// Get the compile status from OpenGL
-		glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &isShaderCompiledOK);
+		glGetShaderiv(shaderId, GL_COMPILE_STATUS, &isShaderCompiledOK);
 
 		// Has the shader failed to compile?
 		if (isShaderCompiledOK != GL_TRUE) {
 			// Yes, so display an error message
-			std::cerr << "Unable to compile vertex shader" << std::endl;
+			std::cerr << "Unable to compile " << stage << " shader" << std::endl;
 
-			_displayShaderCompilerError(vertexShader);
+			_displayShaderCompilerError(shaderId);
 
 			return false;
 		}
 
-		// Do the same for the fragment shader
-		GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-
-		// Transfer the shader code
-		glShaderSource(fragmentShader, 1, f_shader_sourcecode, NULL);
+		return true;
+	}
 
-		// Compile it
-		glCompileShader(fragmentShader);
+	bool hasParallelShaderCompile() {
+		return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+	}
 
-		// Check for errors.  Code is same as above of getting status
-		// and displaying error message, if necessary
-		isShaderCompiledOK = GL_FALSE;
-		glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &isShaderCompiledOK);
+	void beginCompileProgram(const GLchar* v_shader_sourcecode[], const GLchar* f_shader_sourcecode[], ProgramBuild& build,
+		const GLchar* const attributes[], int numAttributes) {
+		// Create the program object
+		if (build.programId == 0) {
+			build.programId = glCreateProgram();
+		}
 
-		if (isShaderCompiledOK != GL_TRUE) {
-			std::cerr << "Unable to compile fragment shader" << std::endl;
+		// Use the binary from an earlier launch if there is one. The
+		// locations bound below are part of the linked program
+		std::string defines = "fragmentColour=0 fragmentWeight=1";
+		for (int i = 0; i < numAttributes; i++) {
+			defines += " " + std::string(attributes[i]) + "=" + std::to_string(i);
+		}
 
-			_displayShaderCompilerError(fragmentShader);
+		ShaderCache& cache = ShaderCache::get();
+		const GLchar* sources[2] = { v_shader_sourcecode[0], f_shader_sourcecode[0] };
+		build.cacheKey = cache.makeKey(sources, 2, defines.c_str());
 
-			return false;
+		if (cache.load(build.cacheKey, build.programId)) {
+			build.vertexShader = build.fragmentShader = 0;
+			return;
 		}
 
-		// Create the program object
-		*programId = glCreateProgram();
+		// Shaders must be created and compiled before attaching to the
+		// program. Nothing is checked here, the driver can work on them
+		// while the caller gets on with something else
+		build.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(build.vertexShader, 1, v_shader_sourcecode, nullptr);
+		glCompileShader(build.vertexShader);
+
+		build.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(build.fragmentShader, 1, f_shader_sourcecode, nullptr);
+		glCompileShader(build.fragmentShader);
 
 		// Attach shaders to the program object
-		glAttachShader(*programId, vertexShader);
-		glAttachShader(*programId, fragmentShader);
+		glAttachShader(build.programId, build.vertexShader);
+		glAttachShader(build.programId, build.fragmentShader);
+
+		// Fixed draw buffers for the fragment outputs, names the shader
+		// doesn't use are ignored
+		glBindFragDataLocation(build.programId, 0, "fragmentColour");
+		glBindFragDataLocation(build.programId, 1, "fragmentWeight");
+
+		for (int i = 0; i < numAttributes; i++) {
+			glBindAttribLocation(build.programId, i, attributes[i]);
+		}
+
+		// Keep the binary for the cache
+		cache.prepareLink(build.programId);
 
 		// Now link the program to create an executable program we
 		// and use to render the object
 		// Program executable will exist in graphics memory
-		glLinkProgram(*programId);
+		glLinkProgram(build.programId);
+	}
+
+	bool isProgramBuildComplete(const ProgramBuild& build) {
+		if (build.vertexShader == 0 || !hasParallelShaderCompile()) {
+			return true;
+		}
+
+		// Same value for the KHR and ARB extensions, never waits
+		GLint complete = GL_FALSE;
+		glGetProgramiv(build.programId, GL_COMPLETION_STATUS_KHR, &complete);
+		return complete == GL_TRUE;
+	}
+
+	bool finishCompileProgram(ProgramBuild& build) {
+		// Loaded from the cache, already checked
+		if (build.vertexShader == 0) {
+			bindUniformBlocks(build.programId);
+			return true;
+		}
+
+		// Check for compiler errors, the first status query waits for the
+		// driver if the build isn't complete
+		bool compiled = _checkShaderCompiled(build.vertexShader, "vertex") &&
+			_checkShaderCompiled(build.fragmentShader, "fragment");
 
 		// Check for linking errors
 		GLint isProgramLinked = GL_FALSE;
-		glGetProgramiv(*programId, GL_LINK_STATUS, &isProgramLinked);
-		if (isProgramLinked != GL_TRUE) {
-			std::cerr << "Failed to link program" << std::endl;
+		if (compiled) {
+			glGetProgramiv(build.programId, GL_LINK_STATUS, &isProgramLinked);
+			if (isProgramLinked != GL_TRUE) {
+				std::cerr << "Failed to link program" << std::endl;
+			}
+		}
+
+		// Attached shaders are only flagged, they go with the program
+		glDeleteShader(build.vertexShader);
+		glDeleteShader(build.fragmentShader);
+		build.vertexShader = build.fragmentShader = 0;
 
+		if (isProgramLinked != GL_TRUE) {
 			return false;
 		}
 
+		ShaderCache::get().store(build.cacheKey, build.programId);
+
+		bindUniformBlocks(build.programId);
+
 		// Got this far so must be okay, return true
 		return true;
 	}
 
+	bool compileProgram(const GLchar* v_shader_sourcecode[], const GLchar* f_shader_sourcecode[], GLuint* programId,
+		const GLchar* const attributes[], int numAttributes) {
+		Clock::time_point start = Clock::now();
+
+		ProgramBuild build;
+		beginCompileProgram(v_shader_sourcecode, f_shader_sourcecode, build, attributes, numAttributes);
+		*programId = build.programId;
+
+		bool fromCache = build.vertexShader == 0;
+		if (!finishCompileProgram(build)) {
+			glDeleteProgram(build.programId);
+			*programId = 0;
+			return false;
+		}
+
+		if (!fromCache) {
+			ShaderCache::get().addCompileTime(elapsedMs(start));
+		}
+
+		return true;
+	}
+
+	// Program from one shader stage, shared by the transform feedback and
+	// compute builds. varyings, if given, are captured interleaved. The
+	// program is deleted and programId set to 0 if it fails
+	static bool _compileSingleStageProgram(GLenum type, const char* stage, const GLchar* sourcecode[],
+		const GLchar* varyings[], int numVaryings, GLuint* programId) {
+		// The captured varyings are part of the linked program
+		std::string defines;
+		for (int i = 0; i < numVaryings; i++) {
+			defines += std::string(varyings[i]) + " ";
+		}
+
+		ShaderCache& cache = ShaderCache::get();
+		uint64_t key = cache.makeKey(sourcecode, 1, defines.c_str());
+
+		*programId = glCreateProgram();
+		if (cache.load(key, *programId)) {
+			bindUniformBlocks(*programId);
+			return true;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		GLuint shader = glCreateShader(type);
+
+		glShaderSource(shader, 1, sourcecode, nullptr);
+		glCompileShader(shader);
+
+		GLint isProgramLinked = GL_FALSE;
+		if (_checkShaderCompiled(shader, stage)) {
+			glAttachShader(*programId, shader);
+
+			// The captured outputs have to be named before linking
+			if (numVaryings > 0) {
+				glTransformFeedbackVaryings(*programId, numVaryings, varyings, GL_INTERLEAVED_ATTRIBS);
+			}
+
+			cache.prepareLink(*programId);
+			glLinkProgram(*programId);
+
+			glGetProgramiv(*programId, GL_LINK_STATUS, &isProgramLinked);
+			if (isProgramLinked != GL_TRUE) {
+				std::cerr << "Failed to link " << stage << " program" << std::endl;
+			}
+
+			glDetachShader(*programId, shader);
+		}
+
+		// Not needed once linked, or after a failed build
+		glDeleteShader(shader);
+
+		if (isProgramLinked != GL_TRUE) {
+			glDeleteProgram(*programId);
+			*programId = 0;
+			return false;
+		}
+
+		cache.store(key, *programId);
+		cache.addCompileTime(elapsedMs(start));
+
+		bindUniformBlocks(*programId);
+
+		return true;
+	}
+
+	bool compileTransformFeedbackProgram(const GLchar* v_shader_sourcecode[], const GLchar* varyings[], int numVaryings, GLuint* programId) {
+		return _compileSingleStageProgram(GL_VERTEX_SHADER, "transform feedback", v_shader_sourcecode, varyings, numVaryings, programId);
+	}
+
+	bool compileComputeProgram(const GLchar* c_shader_sourcecode[], GLuint* programId) {
+		return _compileSingleStageProgram(GL_COMPUTE_SHADER, "compute", c_shader_sourcecode, nullptr, 0, programId);
+	}
+
+	std::string loadShaderSourceCode(const char* filename) {
+		std::ifstream file(filename);
+		if (!file) {
+			std::cerr << "Unable to open shader file " << filename << std::endl;
+			return "";
+		}
+
+		std::stringstream source;
+		source << file.rdbuf();
+		return source.str();
+	}
+
+	void bindUniformBlocks(GLuint programId) {
+		// Blocks the program doesn't use return GL_INVALID_INDEX
+		GLuint frameBlock = glGetUniformBlockIndex(programId, "FrameData");
+		if (frameBlock != GL_INVALID_INDEX) {
+			glUniformBlockBinding(programId, frameBlock, GE_FRAME_DATA_BINDING);
+		}
+
+		GLuint objectBlock = glGetUniformBlockIndex(programId, "ObjectData");
+		if (objectBlock != GL_INVALID_INDEX) {
+			glUniformBlockBinding(programId, objectBlock, GE_OBJECT_DATA_BINDING);
+		}
+
+		GLuint spawnBlock = glGetUniformBlockIndex(programId, "ParticleSpawn");
+		if (spawnBlock != GL_INVALID_INDEX) {
+			glUniformBlockBinding(programId, spawnBlock, GE_PARTICLE_SPAWN_BINDING);
+		}
+	}
+
 }
\ No newline at end of file
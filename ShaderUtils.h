@@ -1,6 +1,106 @@
 #pragma once
 #include <GL/glew.h>
+#include <cstdint>
+#include <string>
+
+// Uniform buffer binding points shared by every engine shader
+#define GE_FRAME_DATA_BINDING 0
+#define GE_OBJECT_DATA_BINDING 1
+#define GE_PARTICLE_SPAWN_BINDING 2
+
+// GLSL declaration of the per frame uniform block, must match FrameData
+// in FrameUniforms.h. Paste into shader source after the #version line
+#define GE_FRAME_DATA_GLSL \
+	"layout(std140) uniform FrameData {\n" \
+	"mat4 view;\n" \
+	"mat4 projection;\n" \
+	"mat4 viewProjection;\n" \
+	"vec4 cameraPos;\n" \
+	"vec4 time;\n" \
+	"};\n"
+
+// GLSL declaration of the per draw uniform block, must match ObjectData
+// in FrameUniforms.h
+#define GE_OBJECT_DATA_GLSL \
+	"layout(std140) uniform ObjectData {\n" \
+	"mat4 transform;\n" \
+	"};\n"
+
+// Outputs of a blended fragment shader and writeTransparent(colour) to
+// write them. Blends straight into the frame, or in the GE_WEIGHTED_OIT
+// permutation accumulates premultiplied colour and revealage in
+// fragmentColour and the weight in fragmentWeight for weighted blended
+// OIT. Needs GE_FRAME_DATA_GLSL first
+#define GE_TRANSPARENT_OUTPUT_GLSL \
+	"out vec4 fragmentColour;\n" \
+	"out vec4 fragmentWeight;\n" \
+	"void writeTransparent(vec4 colour) {\n" \
+	"#ifdef GE_WEIGHTED_OIT\n" \
+	"float depth = projection[3][2] / (gl_FragCoord.z * 2.0 - 1.0 + projection[2][2]);\n" \
+	"float w = colour.a * clamp(0.03 / (1e-5 + pow(depth / 200.0, 4.0)), 1e-2, 3e3);\n" \
+	"fragmentColour = vec4(colour.rgb * w, colour.a);\n" \
+	"fragmentWeight = vec4(w);\n" \
+	"#else\n" \
+	"fragmentColour = colour;\n" \
+	"fragmentWeight = vec4(0.0);\n" \
+	"#endif\n" \
+	"}\n"
 
 namespace GE {
-	bool compileProgram(const char* v_shader_sourcecode[], const char* f_shader_sourcecode[], GLuint* programId);
-}
\ No newline at end of file
+	// A program being built by beginCompileProgram
+	struct ProgramBuild {
+		GLuint programId;
+
+		// 0 once checked, or when the program came from the ShaderCache
+		GLuint vertexShader;
+		GLuint fragmentShader;
+
+		uint64_t cacheKey;
+
+		ProgramBuild() {
+			programId = vertexShader = fragmentShader = 0;
+			cacheKey = 0;
+		}
+	};
+
+	// Each helper loads the program from the ShaderCache when an earlier
+	// launch saved it, otherwise compiles it and saves the binary
+	//
+	// attributes, if given, are bound to locations 0, 1, ... before linking.
+	// programId is 0 if it fails to build
+	bool compileProgram(const char* v_shader_sourcecode[], const char* f_shader_sourcecode[], GLuint* programId,
+		const char* const attributes[] = nullptr, int numAttributes = 0);
+
+	// compileProgram in two halves so the driver can build while the
+	// caller carries on. begin submits the compile and link into
+	// build.programId (created if 0) without checking anything
+	void beginCompileProgram(const char* v_shader_sourcecode[], const char* f_shader_sourcecode[], ProgramBuild& build,
+		const char* const attributes[] = nullptr, int numAttributes = 0);
+
+	// True once the driver has finished the build, never waits. Always
+	// true without KHR/ARB_parallel_shader_compile
+	bool isProgramBuildComplete(const ProgramBuild& build);
+
+	// Check the build and save it to the cache, waits if it isn't complete.
+	// build.programId is kept on failure, the caller deletes it
+	bool finishCompileProgram(ProgramBuild& build);
+
+	// KHR or ARB_parallel_shader_compile, builds run on driver threads and
+	// their completion can be polled
+	bool hasParallelShaderCompile();
+
+	// Vertex only program whose outputs are captured with transform
+	// feedback, interleaved in the order of varyings. programId is 0 if
+	// it fails to build
+	bool compileTransformFeedbackProgram(const char* v_shader_sourcecode[], const char* varyings[], int numVaryings, GLuint* programId);
+
+	// Compute shader program, needs GL 4.3 or ARB_compute_shader. programId
+	// is 0 if it fails to build
+	bool compileComputeProgram(const char* c_shader_sourcecode[], GLuint* programId);
+
+	// Whole text of a shader file, empty if it can't be read
+	std::string loadShaderSourceCode(const char* filename);
+
+	// Connect the engine uniform blocks used by the program to their binding points
+	void bindUniformBlocks(GLuint programId);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Widest instruction set the compiler was told it can use, shared by the
+// SIMD loops. AVX2 implies SSE2, so GE_SIMD_SSE is set in both cases and
+// code with only a 4 lane path just tests for it
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define GE_SIMD_AVX2
+#define GE_SIMD_SSE
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GE_SIMD_SSE
+#endif
+
+namespace GE {
+	// Write the indices of the lanes set in mask without branching on each
+	// lane, out must have room for width more entries
+	inline int appendLanes(int* out, int n, int first, int mask, int width) {
+		for (int lane = 0; lane < width; lane++) {
+			out[n] = first + lane;
+			n += (mask >> lane) & 1;
+		}
+		return n;
+	}
+}
@@ -1,5 +1,6 @@
 #include "SkyboxRenderer.h"
-#include "ShaderUtils.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
 #include <SDL_image.h>
 #include <iostream>
 #include <glm/gtc/type_ptr.hpp>
@@ -84,7 +85,7 @@ namespace GE {
 	void SkyboxRenderer::createCubemap(std::vector<std::string> filenames) {
 		glGenTextures(1, &skyboxCubeMapName);
 
-		glBindTexture(GL_TEXTURE_CUBE_MAP, skyboxCubeMapName);
+		GLStateCache::get().bindTexture(0, GL_TEXTURE_CUBE_MAP, skyboxCubeMapName);
 
 		for (int faceNum = 0; faceNum < 6; faceNum++) {
 			SDL_Surface* surfaceImage = IMG_Load(filenames[faceNum].c_str());
@@ -124,49 +125,23 @@ namespace GE {
 		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 		
-		glBindTexture(GL_TEXTURE_CUBE_MAP, 0); 
+		GLStateCache::get().bindTexture(0, GL_TEXTURE_CUBE_MAP, 0);
 	}
 
 	void SkyboxRenderer::createCubeVBO() {
 		glGenBuffers(1, &vboSkybox);
-		glBindBuffer(GL_ARRAY_BUFFER, vboSkybox);
+		GLStateCache::get().bindBuffer(GL_ARRAY_BUFFER, vboSkybox);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, vboSkybox);
 	}
 	
 
 	void SkyboxRenderer::createSkyboxProgram() {
 
-		const GLchar* V_ShaderCode[] = {
-			"#version 140\n"
-			"in vec3 vertexPos3D;\n"
-			"out vec3 texCoord;\n"
-			"uniform mat4 view;\n"
-			"uniform mat4 projection;\n"
-			"void main() {\n"
-			"vec4 v = vec4(vertexPos3D.xyz, 1);\n"
-			"v = projection * view * v;\n"
-			"gl_Position = v;\n"
-			"texCoord = vertexPos3D;\n"
-			"}\n" 
-		};
-
-		const GLchar* F_ShaderCode[] = {
-			"#version 140\n"
-			"in vec3 texCoord;\n"
-			"uniform samplerCube sampler;\n"
-			"out vec4 fragmentColour;\n"
-			"void main()\n"
-			"{\n"
-			"fragmentColour = vec4(texture(sampler, texCoord).rgb, 1.0f);\n"
-			"}\n"
-		};
-
-		bool result = compileProgram(V_ShaderCode, F_ShaderCode, &skyboxProgramId);
+		skyboxProgramId = ShaderLibrary::get().getProgram("skybox.vs", "skybox.fs");
 
 		//Check result
 
-		if (!result) {
+		if (skyboxProgramId == 0) {
 			std::cerr << "Failed to create SkyboxRenderer program. Check console for errors" << std::endl;
 
 			return;
@@ -178,57 +153,54 @@ namespace GE {
 		if (vertexLocation == -1) {
 			std::cerr << "Problem getting vertex3DPos" << std::endl;
 		}
+
+		// Cube buffer was created first, record its layout now the location is known
+		vertexArray.addAttrib(vboSkybox, vertexLocation, 3, GL_FLOAT, sizeof(CubeVertex), offsetof(CubeVertex, x));
+		vertexArray.build();
 		
-		viewUniformId = glGetUniformLocation(skyboxProgramId, "view");
-		projectionUniformId = glGetUniformLocation(skyboxProgramId, "projection");
 		samplerId = glGetUniformLocation(skyboxProgramId, "sampler");
 
+		PipelineDesc desc;
+		desc.programId = skyboxProgramId;
+		desc.vao = vertexArray.getName();
+		desc.depthTest = false;
+		pipeline = PipelineCache::get().create(desc);
 	}
 
-	void SkyboxRenderer::draw(Camera* cam) {
-		bool isDepthTestEnable = glIsEnabled(GL_DEPTH_TEST);
-
-		glDisable(GL_DEPTH_TEST);
-
-		glm::mat4 camView = cam->getViewMatrix();
-		glm::mat4 projection = cam->getProjectionMatrix();
-
-		camView[3][0] = 0.0f;
-		camView[3][1] = 0.0f;
-		camView[3][2] = 0.0f;
-
-
-		glUseProgram(skyboxProgramId);
-		glUniformMatrix4fv(viewUniformId, 1, GL_FALSE, glm::value_ptr(camView));
-		glUniformMatrix4fv(projectionUniformId, 1, GL_FALSE, glm::value_ptr(projection));
-
-		glEnableVertexAttribArray(vertexLocation);
-
-		glBindBuffer(GL_ARRAY_BUFFER, vboSkybox);
-
-		glVertexAttribPointer(vertexLocation, 3, GL_FLOAT, GL_FALSE, sizeof(CubeVertex), (void*)offsetof(CubeVertex, x));
-		glActiveTexture(GL_TEXTURE0);
-
-		glUniform1i(samplerId, 0);
-
-		glBindTexture(GL_TEXTURE_CUBE_MAP, skyboxCubeMapName);
-
-		glDrawArrays(GL_TRIANGLES, 0, sizeof(cube) / sizeof(CubeVertex));
-
-		glDisableVertexAttribArray(vertexLocation);
-
-		glUseProgram(0);
-
-		if (isDepthTestEnable) {
-			glEnable(GL_DEPTH_TEST);
+	void SkyboxRenderer::submit(RenderQueue* queue, Camera* cam) {
+		if (pipeline == nullptr) {
+			return;
 		}
+
+		// Background pass is drawn first with depth test off
+		DrawPacket packet;
+		packet.pass = PASS_BACKGROUND;
+		packet.pipeline = pipeline;
+		packet.textureTarget = GL_TEXTURE_CUBE_MAP;
+		packet.textureName = skyboxCubeMapName;
+		packet.mode = GL_TRIANGLES;
+		packet.count = sizeof(cube) / sizeof(CubeVertex);
+		packet.owner = this;
+
+		queue->submit(packet);
 	}
 
+	void SkyboxRenderer::bindProgramUniforms(const DrawPacket& packet, Camera* cam) {
+		// Camera matrices come from the shared FrameData block, the shader
+		// drops the translation from the view so the skybox stays around the camera
+		GLStateCache::get().uniform1i(samplerId, 0);
+	}
 
 	void SkyboxRenderer::destroy() {
-		glDeleteProgram(skyboxProgramId);
+		// The program belongs to the shader library
 		glDeleteBuffers(1, &vboSkybox);
 		glDeleteTextures(1, &skyboxCubeMapName);
+
+		GLStateCache& gl = GLStateCache::get();
+		gl.onBufferDeleted(vboSkybox);
+		gl.onTextureDeleted(skyboxCubeMapName);
+
+		vertexArray.destroy();
 	}
 
 }
\ No newline at end of file
@@ -4,9 +4,11 @@
 #include <vector>
 #include <string>
 #include "Camera.h"
+#include "RenderQueue.h"
+#include "VertexArray.h"
 
 namespace GE {
-	class SkyboxRenderer {
+	class SkyboxRenderer : public Renderable {
 	public:
 
 		SkyboxRenderer(std::string front_fname, std::string back_fname,
@@ -21,6 +23,8 @@ namespace GE {
 			filenames.push_back(front_fname);
 			filenames.push_back(back_fname);
 
+			pipeline = nullptr;
+
 			createCubemap(filenames);
 			createCubeVBO();
 			createSkyboxProgram();
@@ -29,7 +33,11 @@ namespace GE {
 
 		~SkyboxRenderer() {}
 
-		void draw(Camera* cam);
+		// Add the skybox to the background pass of the render queue
+		void submit(RenderQueue* queue, Camera* cam);
+
+		// Render queue callbacks
+		void bindProgramUniforms(const DrawPacket& packet, Camera* cam);
 
 		void destroy();
 
@@ -44,10 +52,12 @@ namespace GE {
 		   GLuint skyboxProgramId;
 		   GLint vertexLocation;
 		   GLuint vboSkybox;
-		   GLuint viewUniformId;
-		   GLuint projectionUniformId;
+		   VertexArray vertexArray;
 		   GLuint samplerId;
 
+		   // Drawn first without depth test, behind everything
+		   const PipelineState* pipeline;
+
 
 	};
 }
@@ -0,0 +1,205 @@
+#include "StreamBuffer.h"
+#include "GLStateCache.h"
+#include "Timing.h"
+#include <cstring>
+#include <iostream>
+
+namespace GE {
+	StreamBuffer::StreamBuffer() {
+		target = GL_ARRAY_BUFFER;
+		buffer = 0;
+		persistent = false;
+		regionSize = 0;
+		used = 0;
+		regionIndex = 0;
+		mapped = nullptr;
+		gpuCapacity = 0;
+		fenceWaitMs = 0.0f;
+
+		for (int i = 0; i < NUM_FRAME_REGIONS; i++) {
+			fences[i] = nullptr;
+		}
+	}
+
+	void StreamBuffer::init(GLenum _target, GLsizeiptr _regionSize) {
+		target = _target;
+		regionSize = _regionSize;
+
+		// Persistent mapping needs buffer storage, the fences need sync objects
+		bool fencesSupported = GLEW_VERSION_3_2 || GLEW_ARB_sync;
+		persistent = fencesSupported && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+
+		if (!persistent) {
+			std::cout << "StreamBuffer: persistent mapping unavailable, using orphaning" << std::endl;
+		}
+
+		allocateStorage();
+	}
+
+	void StreamBuffer::allocateStorage() {
+		glGenBuffers(1, &buffer);
+		GLStateCache::get().bindBuffer(target, buffer);
+
+		if (persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			GLsizeiptr total = regionSize * NUM_FRAME_REGIONS;
+
+			glBufferStorage(target, total, nullptr, flags);
+			mapped = (unsigned char*)glMapBufferRange(target, 0, total, flags);
+
+			if (mapped == nullptr) {
+				std::cerr << "StreamBuffer: failed to map buffer, using orphaning" << std::endl;
+
+				// Immutable storage can't be orphaned, start again with a mutable buffer
+				releaseStorage();
+				persistent = false;
+				allocateStorage();
+			}
+		}
+		else {
+			staging.resize(regionSize);
+			gpuCapacity = 0;
+		}
+	}
+
+	void StreamBuffer::releaseStorage() {
+		if (mapped != nullptr) {
+			GLStateCache::get().bindBuffer(target, buffer);
+			glUnmapBuffer(target);
+			mapped = nullptr;
+		}
+
+		glDeleteBuffers(1, &buffer);
+		GLStateCache::get().onBufferDeleted(buffer);
+		buffer = 0;
+	}
+
+	void StreamBuffer::waitForRegion(int region) {
+		GLsync fence = fences[region];
+		if (fence == nullptr) {
+			return;
+		}
+
+		// Usually already signalled, only flush commands if it isn't
+		GLenum result = glClientWaitSync(fence, 0, 0);
+		while (result == GL_TIMEOUT_EXPIRED) {
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+
+		if (result == GL_WAIT_FAILED) {
+			std::cerr << "StreamBuffer: fence wait failed" << std::endl;
+		}
+
+		glDeleteSync(fence);
+		fences[region] = nullptr;
+	}
+
+	void StreamBuffer::beginFrame() {
+		used = 0;
+		fenceWaitMs = 0.0f;
+
+		if (!persistent) {
+			return;
+		}
+
+		regionIndex = (regionIndex + 1) % NUM_FRAME_REGIONS;
+
+		Clock::time_point start = Clock::now();
+		waitForRegion(regionIndex);
+		fenceWaitMs = elapsedMs(start);
+	}
+
+	void StreamBuffer::grow(GLsizeiptr needed) {
+		GLsizeiptr newSize = regionSize * 2;
+		while (newSize < needed) {
+			newSize *= 2;
+		}
+
+		if (!persistent) {
+			regionSize = newSize;
+			staging.resize(regionSize);
+			return;
+		}
+
+		// Rare, the GPU must finish with every region before the buffer is replaced
+		for (int i = 0; i < NUM_FRAME_REGIONS; i++) {
+			waitForRegion(i);
+		}
+
+		// Keep what this frame has written, offsets are relative to the region
+		std::vector<unsigned char> written(mapped + getRegionOffset(), mapped + getRegionOffset() + used);
+
+		releaseStorage();
+		regionSize = newSize;
+		allocateStorage();
+
+		// Mapping can fail, in which case the data goes to the staging copy
+		if (!written.empty()) {
+			unsigned char* dest = persistent ? mapped + getRegionOffset() : staging.data();
+			std::memcpy(dest, written.data(), written.size());
+		}
+	}
+
+	void* StreamBuffer::allocate(GLsizeiptr size, GLsizeiptr alignment, GLintptr* offset) {
+		GLintptr start = (used + alignment - 1) / alignment * alignment;
+
+		if (start + size > regionSize) {
+			grow(start + size);
+		}
+
+		unsigned char* dest = persistent ? mapped + getRegionOffset() : staging.data();
+		used = start + size;
+
+		*offset = start;
+		return dest + start;
+	}
+
+	GLintptr StreamBuffer::write(const void* data, GLsizeiptr size, GLsizeiptr alignment) {
+		GLintptr offset;
+		void* dest = allocate(size, alignment, &offset);
+		std::memcpy(dest, data, size);
+
+		return offset;
+	}
+
+	void StreamBuffer::flush() {
+		// Coherent mapping, the writes are already visible
+		if (persistent || used == 0) {
+			return;
+		}
+
+		GLStateCache::get().bindBuffer(target, buffer);
+
+		// Orphan the previous frame's storage, growing it if needed
+		if (regionSize > gpuCapacity) {
+			gpuCapacity = regionSize;
+		}
+		glBufferData(target, gpuCapacity, nullptr, GL_STREAM_DRAW);
+		glBufferSubData(target, 0, used, staging.data());
+	}
+
+	void StreamBuffer::endFrame() {
+		if (!persistent) {
+			return;
+		}
+
+		// A region written without a new beginFrame keeps only the latest fence
+		if (fences[regionIndex] != nullptr) {
+			glDeleteSync(fences[regionIndex]);
+		}
+		fences[regionIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void StreamBuffer::destroy() {
+		for (int i = 0; i < NUM_FRAME_REGIONS; i++) {
+			if (fences[i] != nullptr) {
+				glDeleteSync(fences[i]);
+				fences[i] = nullptr;
+			}
+		}
+
+		if (buffer != 0) {
+			releaseStorage();
+		}
+	}
+}
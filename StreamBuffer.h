@@ -0,0 +1,107 @@
+#pragma once
+#include <GL/glew.h>
+#include <vector>
+
+namespace GE {
+	// Ring buffer for data written by the CPU every frame (per draw uniforms,
+	// instance data, particles). The buffer is split into one region per
+	// frame in flight. With GL 4.4 or ARB_buffer_storage it is mapped once,
+	// persistently and coherently, so writing is a plain memcpy with no
+	// driver call. A fence placed after the frame's draws guards each region,
+	// and the CPU only waits when it comes back round to a region the GPU is
+	// still reading
+	//
+	// Without persistent mapping the data is staged on the CPU and uploaded
+	// once per frame into orphaned storage
+	//
+	// Offsets returned by write() are relative to the current frame's region,
+	// add getRegionOffset() when binding
+	class StreamBuffer {
+	public:
+		// Frames the CPU can be ahead of the GPU
+		static const int NUM_FRAME_REGIONS = 3;
+
+		StreamBuffer();
+		~StreamBuffer() {}
+
+		// Create the buffer, regionSize is the space for one frame's data
+		// and grows if a frame needs more
+		void init(GLenum target, GLsizeiptr regionSize);
+
+		// Move to the next region, waiting for the GPU if it is still using it
+		void beginFrame();
+
+		// Copy size bytes into this frame's region, returns the offset from
+		// the start of the region, a multiple of alignment
+		GLintptr write(const void* data, GLsizeiptr size, GLsizeiptr alignment);
+
+		// Reserve size bytes in this frame's region to be filled in place,
+		// e.g. by worker threads, and store its offset like write(). The
+		// pointer stays valid until the next allocate or write
+		void* allocate(GLsizeiptr size, GLsizeiptr alignment, GLintptr* offset);
+
+		// Make the frame's data visible to GL, call before the draws using it
+		void flush();
+
+		// Fence the region once all draws reading it have been issued
+		void endFrame();
+
+		void destroy();
+
+		// Accessors
+		GLuint getBuffer() {
+			return buffer;
+		}
+
+		// Start of the current region in the buffer
+		GLintptr getRegionOffset() {
+			return persistent ? regionIndex * regionSize : 0;
+		}
+
+		GLsizeiptr getUsedBytes() {
+			return used;
+		}
+
+		bool isPersistent() {
+			return persistent;
+		}
+
+		// Time the CPU spent waiting on fences in the last beginFrame
+		float getFenceWaitMs() {
+			return fenceWaitMs;
+		}
+
+	private:
+		// Create the storage, mapped when persistent
+		void allocateStorage();
+		void releaseStorage();
+
+		// Block until the fence of a region is signalled and delete it
+		void waitForRegion(int region);
+
+		// Make room for a frame needing more than the region size
+		void grow(GLsizeiptr needed);
+
+	private:
+		GLenum target;
+		GLuint buffer;
+
+		bool persistent;
+
+		// Size of one frame region and how much of the current one is used
+		GLsizeiptr regionSize;
+		GLsizeiptr used;
+
+		int regionIndex;
+		GLsync fences[NUM_FRAME_REGIONS];
+
+		// Whole buffer when persistent, otherwise nullptr
+		unsigned char* mapped;
+
+		// CPU copy of the frame's data when not persistent
+		std::vector<unsigned char> staging;
+		GLsizeiptr gpuCapacity;
+
+		float fenceWaitMs;
+	};
+}
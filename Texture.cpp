@@ -1,4 +1,5 @@
 #include "Texture.h"
+#include "GLStateCache.h"
 
 namespace GE {
 	void Texture::loadTexture(std::string filename) {
@@ -38,7 +39,7 @@ namespace GE {
 		glGenTextures(1, &textureName);
 
 		//Select created texture for subsequent texture operations to setup the texture for OpenGL
-		glBindTexture(GL_TEXTURE_2D, textureName);
+		GLStateCache::get().bindTexture(0, GL_TEXTURE_2D, textureName);
 
 		//Copy the pixel data from the SDL_Surface object to the OpenGL texture
 		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, surfaceImage->pixels);
@@ -0,0 +1,12 @@
+#pragma once
+#include <chrono>
+
+namespace GE {
+	typedef std::chrono::high_resolution_clock Clock;
+
+	// Milliseconds since start
+	inline float elapsedMs(Clock::time_point start) {
+		std::chrono::duration<float, std::milli> elapsed = Clock::now() - start;
+		return elapsed.count();
+	}
+}
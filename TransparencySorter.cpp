@@ -0,0 +1,245 @@
+#include "TransparencySorter.h"
+#include "Random.h"
+#include "SimdConfig.h"
+#include "Timing.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace GE {
+	// Items per job system batch in the key build and each radix pass
+	const int SORT_BATCH = 65536;
+
+	const float TransparencySorter::REUSE_DISTANCE = 0.05f;
+	const float TransparencySorter::REUSE_COS_ANGLE = 0.9995f;
+
+	// Map a float to an unsigned int that sorts in the same order: flip
+	// every bit of negatives, only the sign bit of positives
+	static inline uint32_t floatKey(float f) {
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		uint32_t mask = (uint32_t)((int32_t)bits >> 31) | 0x80000000u;
+		return bits ^ mask;
+	}
+
+	TransparencySorter::TransparencySorter() {
+		jobs = nullptr;
+		haveLast = false;
+		keyMs = sortMs = 0.0f;
+		reused = false;
+	}
+
+	const char* TransparencySorter::getSIMDName() {
+#if defined(GE_SIMD_AVX2)
+		return "AVX2";
+#elif defined(GE_SIMD_SSE)
+		return "SSE";
+#else
+		return "scalar";
+#endif
+	}
+
+	void TransparencySorter::forEachChunk(int count, const JobSystem::RangeFunc& func) {
+		if (jobs != nullptr) {
+			jobs->parallelFor(count, SORT_BATCH, func);
+			return;
+		}
+
+		for (int begin = 0; begin < count; begin += SORT_BATCH) {
+			func(begin, std::min(count, begin + SORT_BATCH));
+		}
+	}
+
+	void TransparencySorter::buildKeys(const float* x, const float* y, const float* z, int begin, int end, glm::vec4 r) {
+		int i = begin;
+
+		// View space z is negative in front of the camera, so ascending z
+		// is furthest first and the key needs no negating
+#if defined(GE_SIMD_AVX2)
+		const __m256 rx = _mm256_set1_ps(r.x);
+		const __m256 ry = _mm256_set1_ps(r.y);
+		const __m256 rz = _mm256_set1_ps(r.z);
+		const __m256 rw = _mm256_set1_ps(r.w);
+		const __m256i signBit = _mm256_set1_epi32((int)0x80000000u);
+		const __m256i step = _mm256_set1_epi32(8);
+		__m256i index = _mm256_add_epi32(_mm256_set1_epi32(begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+		for (; i + 8 <= end; i += 8) {
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rx, _mm256_loadu_ps(x + i)), _mm256_mul_ps(ry, _mm256_loadu_ps(y + i))),
+				_mm256_add_ps(_mm256_mul_ps(rz, _mm256_loadu_ps(z + i)), rw));
+			__m256i bits = _mm256_castps_si256(d);
+			__m256i mask = _mm256_or_si256(_mm256_srai_epi32(bits, 31), signBit);
+			_mm256_storeu_si256((__m256i*)&keys[i], _mm256_xor_si256(bits, mask));
+			_mm256_storeu_si256((__m256i*)&order[i], index);
+			index = _mm256_add_epi32(index, step);
+		}
+#elif defined(GE_SIMD_SSE)
+		const __m128 rx = _mm_set1_ps(r.x);
+		const __m128 ry = _mm_set1_ps(r.y);
+		const __m128 rz = _mm_set1_ps(r.z);
+		const __m128 rw = _mm_set1_ps(r.w);
+		const __m128i signBit = _mm_set1_epi32((int)0x80000000u);
+		const __m128i step = _mm_set1_epi32(4);
+		__m128i index = _mm_add_epi32(_mm_set1_epi32(begin), _mm_setr_epi32(0, 1, 2, 3));
+
+		for (; i + 4 <= end; i += 4) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, _mm_loadu_ps(x + i)), _mm_mul_ps(ry, _mm_loadu_ps(y + i))),
+				_mm_add_ps(_mm_mul_ps(rz, _mm_loadu_ps(z + i)), rw));
+			__m128i bits = _mm_castps_si128(d);
+			__m128i mask = _mm_or_si128(_mm_srai_epi32(bits, 31), signBit);
+			_mm_storeu_si128((__m128i*)&keys[i], _mm_xor_si128(bits, mask));
+			_mm_storeu_si128((__m128i*)&order[i], index);
+			index = _mm_add_epi32(index, step);
+		}
+#endif
+
+		// Whatever the SIMD loop left over
+		for (; i < end; i++) {
+			keys[i] = floatKey(r.x * x[i] + r.y * y[i] + r.z * z[i] + r.w);
+			order[i] = (uint32_t)i;
+		}
+	}
+
+	void TransparencySorter::radixSort(int count) {
+		int numChunks = (count + SORT_BATCH - 1) / SORT_BATCH;
+		chunkOffsets.resize(numChunks * 256);
+
+		keysTemp.resize(count);
+		orderTemp.resize(count);
+
+		// Four passes of eight bits. Each chunk counts its digits, the
+		// counts are turned into write positions chunk by chunk so the
+		// scatter keeps the order of the previous pass, then every chunk
+		// scatters its own items
+		for (int shift = 0; shift < 32; shift += 8) {
+			forEachChunk(count, [&](int begin, int end) {
+				uint32_t* histogram = &chunkOffsets[(begin / SORT_BATCH) * 256];
+				memset(histogram, 0, 256 * sizeof(uint32_t));
+
+				for (int i = begin; i < end; i++) {
+					histogram[(keys[i] >> shift) & 0xFF]++;
+				}
+			});
+
+			// Every key has the same digit, nothing to move
+			uint32_t first = (keys[0] >> shift) & 0xFF;
+			uint32_t sameDigit = 0;
+			for (int c = 0; c < numChunks; c++) {
+				sameDigit += chunkOffsets[c * 256 + first];
+			}
+
+			if (sameDigit == (uint32_t)count) {
+				continue;
+			}
+
+			uint32_t offset = 0;
+			for (int d = 0; d < 256; d++) {
+				for (int c = 0; c < numChunks; c++) {
+					uint32_t n = chunkOffsets[c * 256 + d];
+					chunkOffsets[c * 256 + d] = offset;
+					offset += n;
+				}
+			}
+
+			forEachChunk(count, [&](int begin, int end) {
+				uint32_t* position = &chunkOffsets[(begin / SORT_BATCH) * 256];
+
+				for (int i = begin; i < end; i++) {
+					uint32_t dst = position[(keys[i] >> shift) & 0xFF]++;
+					keysTemp[dst] = keys[i];
+					orderTemp[dst] = order[i];
+				}
+			});
+
+			keys.swap(keysTemp);
+			order.swap(orderTemp);
+		}
+	}
+
+	const std::vector<uint32_t>& TransparencySorter::sort(const float* x, const float* y, const float* z, int count,
+		const glm::mat4& view, bool itemsChanged) {
+		// Camera position and view direction from the view matrix
+		glm::mat3 rotation(view);
+		glm::vec3 eye = -glm::transpose(rotation) * glm::vec3(view[3]);
+		glm::vec3 forward(-view[0][2], -view[1][2], -view[2][2]);
+
+		reused = !itemsChanged && haveLast && (int)order.size() == count &&
+			glm::length(eye - lastEye) < REUSE_DISTANCE && glm::dot(forward, lastForward) > REUSE_COS_ANGLE;
+
+		if (reused) {
+			keyMs = sortMs = 0.0f;
+			return order;
+		}
+
+		Clock::time_point start = Clock::now();
+
+		keys.resize(count);
+		order.resize(count);
+
+		// Row of the view matrix giving the view space z of a point
+		glm::vec4 depthRow(view[0][2], view[1][2], view[2][2], view[3][2]);
+
+		forEachChunk(count, [&](int begin, int end) {
+			buildKeys(x, y, z, begin, end, depthRow);
+		});
+
+		keyMs = elapsedMs(start);
+		start = Clock::now();
+
+		if (count > 1) {
+			radixSort(count);
+		}
+
+		sortMs = elapsedMs(start);
+
+		lastEye = eye;
+		lastForward = forward;
+		haveLast = true;
+
+		return order;
+	}
+
+	void TransparencySorter::runBenchmark(int count, JobSystem* jobs) {
+		std::vector<float> x(count), y(count), z(count);
+		unsigned int seed = 1u;
+		for (int i = 0; i < count; i++) {
+			float* p[3] = { &x[i], &y[i], &z[i] };
+			for (int k = 0; k < 3; k++) {
+				*p[k] = (randomFloat(seed) - 0.5f) * 200.0f;
+			}
+		}
+
+		glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, 150.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+		TransparencySorter sorter;
+		sorter.setJobSystem(jobs);
+
+		const int ITERATIONS = 10;
+		float keyTotal = 0.0f, sortTotal = 0.0f;
+
+		for (int it = 0; it < ITERATIONS; it++) {
+			sorter.sort(x.data(), y.data(), z.data(), count, view);
+			keyTotal += sorter.getKeyMs();
+			sortTotal += sorter.getSortMs();
+		}
+
+		// Check the order really is back to front. The view looks down -z,
+		// compare the depths as rounded for the keys
+		const std::vector<uint32_t>& order = sorter.getOrder();
+		bool sorted = true;
+		for (int i = 1; i < count && sorted; i++) {
+			sorted = z[order[i - 1]] - 150.0f <= z[order[i]] - 150.0f;
+		}
+
+		// Same items and a camera that moved a little
+		glm::mat4 nudged = glm::translate(view, glm::vec3(0.01f, 0.0f, 0.0f));
+		Clock::time_point start = Clock::now();
+		sorter.sort(x.data(), y.data(), z.data(), count, nudged, false);
+		float reuseMs = elapsedMs(start);
+
+		std::cout << "Transparency sort " << count << " items (" << getSIMDName() << "): keys " << keyTotal / ITERATIONS
+			<< " ms, radix sort " << sortTotal / ITERATIONS << " ms" << (sorted ? "" : " NOT SORTED")
+			<< ", reused " << (sorter.wasReused() ? "yes " : "no ") << reuseMs << " ms" << std::endl;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "JobSystem.h"
+
+namespace GE {
+	// Orders large numbers of blended items (particles, instances) back to
+	// front. The view space depth of every item is turned into an unsigned
+	// key in SIMD and the keys are sorted with a parallel LSD radix sort,
+	// so the cost grows linearly with the item count
+	//
+	// When the items haven't changed and the camera has barely moved since
+	// the last sort the previous order is returned as it is
+	class TransparencySorter {
+	public:
+		// Camera movement under which the previous order is kept, in world
+		// units and as the cosine of the angle the view direction turned
+		static const float REUSE_DISTANCE;
+		static const float REUSE_COS_ANGLE;
+
+		TransparencySorter();
+		~TransparencySorter() {}
+
+		// Workers sharing the key build and the sort, optional
+		void setJobSystem(JobSystem* js) {
+			jobs = js;
+		}
+
+		// Order count items with positions in x, y and z furthest from the
+		// camera first. itemsChanged false allows the last order to be
+		// reused, the items must then be the same as in the last call.
+		// Returns item indices in drawing order
+		const std::vector<uint32_t>& sort(const float* x, const float* y, const float* z, int count,
+			const glm::mat4& view, bool itemsChanged = true);
+
+		// Accessors
+		const std::vector<uint32_t>& getOrder() {
+			return order;
+		}
+
+		// Time of each stage in the last sort, both 0 when it was reused
+		float getKeyMs() {
+			return keyMs;
+		}
+
+		float getSortMs() {
+			return sortMs;
+		}
+
+		bool wasReused() {
+			return reused;
+		}
+
+		// Name of the instruction set the key build was compiled for
+		static const char* getSIMDName();
+
+		// Print key build and sort times for count random items, and the
+		// cost of a reused sort, to the console
+		static void runBenchmark(int count, JobSystem* jobs);
+
+	private:
+		// Keys of the items in [begin, end), ascending key is furthest first
+		void buildKeys(const float* x, const float* y, const float* z, int begin, int end, glm::vec4 depthRow);
+
+		// Stable sort of keys and order by 8 bit digits, least significant first
+		void radixSort(int count);
+
+		// Run func over [0, count) in SORT_BATCH chunks, on the workers if there are any
+		void forEachChunk(int count, const JobSystem::RangeFunc& func);
+
+	private:
+		JobSystem* jobs;
+
+		std::vector<uint32_t> keys, keysTemp;
+		std::vector<uint32_t> order, orderTemp;
+
+		// Digit counts of every chunk for the current pass, turned into
+		// each chunk's write positions
+		std::vector<uint32_t> chunkOffsets;
+
+		// Camera of the last sort, for the reuse test
+		glm::vec3 lastEye;
+		glm::vec3 lastForward;
+		bool haveLast;
+
+		float keyMs;
+		float sortMs;
+		bool reused;
+	};
+}
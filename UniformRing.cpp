@@ -0,0 +1,26 @@
+#include "UniformRing.h"
+#include "GLStateCache.h"
+
+namespace GE {
+	UniformRing::UniformRing() {
+		binding = 0;
+		alignment = 256;
+	}
+
+	void UniformRing::init(GLuint bindingPoint, GLsizeiptr initialCapacity) {
+		binding = bindingPoint;
+
+		// Queried once at init, never on the hot path
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		if (alignment < 1) {
+			alignment = 256;
+		}
+
+		stream.init(GL_UNIFORM_BUFFER, initialCapacity);
+	}
+
+	void UniformRing::bindRange(GLintptr offset, GLsizeiptr size) {
+		GLStateCache::get().bindBufferRange(GL_UNIFORM_BUFFER, binding, stream.getBuffer(),
+			stream.getRegionOffset() + offset, size);
+	}
+}
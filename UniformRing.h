@@ -0,0 +1,59 @@
+#pragma once
+#include <GL/glew.h>
+#include "StreamBuffer.h"
+
+namespace GE {
+	// Per draw uniform data for a whole frame packed into one uniform
+	// buffer. Renderers allocate their block at submit, the ring is
+	// flushed once before drawing and each draw binds its own range
+	class UniformRing {
+	public:
+		UniformRing();
+		~UniformRing() {}
+
+		// Create the buffer, capacity grows when a frame needs more
+		void init(GLuint bindingPoint, GLsizeiptr initialCapacity = 64 * 1024);
+
+		// Start a new frame, waits if the GPU still reads this frame's region
+		void reset() {
+			stream.beginFrame();
+		}
+
+		// Copy size bytes into the ring, returns the offset to bind at draw
+		GLintptr allocate(const void* data, GLsizeiptr size) {
+			return stream.write(data, size, alignment);
+		}
+
+		// Make this frame's data visible to GL
+		void upload() {
+			stream.flush();
+		}
+
+		// Bind the range of one allocation to the binding point
+		void bindRange(GLintptr offset, GLsizeiptr size);
+
+		// Fence the frame's region after its draws have been issued
+		void endFrame() {
+			stream.endFrame();
+		}
+
+		void destroy() {
+			stream.destroy();
+		}
+
+		GLsizeiptr getUsedBytes() {
+			return stream.getUsedBytes();
+		}
+
+		float getFenceWaitMs() {
+			return stream.getFenceWaitMs();
+		}
+
+	private:
+		StreamBuffer stream;
+		GLuint binding;
+
+		// Offsets passed to glBindBufferRange must be a multiple of this
+		GLint alignment;
+	};
+}
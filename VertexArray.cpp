@@ -0,0 +1,197 @@
+#include "VertexArray.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include "Timing.h"
+#include <cstddef>
+#include <iostream>
+
+namespace GE {
+	void VertexArray::addAttrib(GLuint buffer, GLint location, GLint size, GLenum type,
+		GLsizei stride, size_t offset, GLuint divisor, GLboolean normalised) {
+		// Attribute not used by the program, nothing to record
+		if (location < 0) {
+			return;
+		}
+
+		Attrib a;
+		a.buffer = buffer;
+		a.location = location;
+		a.size = size;
+		a.type = type;
+		a.normalised = normalised;
+		a.stride = stride;
+		a.offset = offset;
+		a.divisor = divisor;
+
+		attribs.push_back(a);
+	}
+
+	void VertexArray::build() {
+		GLStateCache& gl = GLStateCache::get();
+
+		if (vao == 0) {
+			glGenVertexArrays(1, &vao);
+		}
+
+		gl.bindVertexArray(vao);
+
+		for (const Attrib& a : attribs) {
+			// Pointer is captured from the buffer bound to GL_ARRAY_BUFFER
+			gl.bindBuffer(GL_ARRAY_BUFFER, a.buffer);
+			glEnableVertexAttribArray(a.location);
+
+			if (a.type == GL_INT || a.type == GL_UNSIGNED_INT) {
+				glVertexAttribIPointer(a.location, a.size, a.type, a.stride, (void*)a.offset);
+			}
+			else {
+				glVertexAttribPointer(a.location, a.size, a.type, a.normalised, a.stride, (void*)a.offset);
+			}
+
+			if (a.divisor != 0) {
+				if (!GLEW_VERSION_3_3 && !GLEW_ARB_instanced_arrays) {
+					std::cerr << "Instanced attributes need GL 3.3 or ARB_instanced_arrays" << std::endl;
+				}
+				else {
+					glVertexAttribDivisor(a.location, a.divisor);
+				}
+			}
+		}
+
+		// Element buffer binding is stored in the VAO
+		if (indexBuffer != 0) {
+			gl.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		}
+
+		gl.bindVertexArray(0);
+	}
+
+	void VertexArray::bind() {
+		GLStateCache::get().bindVertexArray(vao);
+	}
+
+	void VertexArray::destroy() {
+		if (vao != 0) {
+			glDeleteVertexArrays(1, &vao);
+			GLStateCache::get().onVertexArrayDeleted(vao);
+			vao = 0;
+		}
+	}
+
+	void VertexArray::runBenchmark(int numDraws) {
+		// Small interleaved meshes, each in its own buffer like the models
+		struct BenchVertex {
+			float x, y, z;
+			float u, v;
+		};
+
+		const int NUM_MESHES = 256;
+		const int ITERATIONS = 10;
+
+		const GLchar* V_ShaderCode =
+			"#version 140\n"
+			"in vec3 vertexPos3D;\n"
+			"in vec2 vUV;\n"
+			"out vec2 uv;\n"
+			"void main() {\n"
+			"uv = vUV;\n"
+			"gl_Position = vec4(vertexPos3D, 1);\n"
+			"}\n";
+
+		const GLchar* F_ShaderCode =
+			"#version 140\n"
+			"in vec2 uv;\n"
+			"out vec4 fragmentColour;\n"
+			"void main() {\n"
+			"fragmentColour = vec4(uv, 0.0, 1.0);\n"
+			"}\n";
+
+		const char* attributes[] = { "vertexPos3D", "vUV" };
+		GLuint programId = ShaderLibrary::get().getProgramFromSource(V_ShaderCode, F_ShaderCode, "", attributes, 2);
+		if (programId == 0) {
+			std::cerr << "VertexArray benchmark program failed to build" << std::endl;
+			return;
+		}
+
+		GLStateCache& gl = GLStateCache::get();
+
+		// A triangle a few pixels wide, so the draws cost the CPU and not the GPU
+		BenchVertex triangle[3] = {
+			{ 0.0f, 0.0f, 0.0f, 0.0f, 0.0f },
+			{ 0.01f, 0.0f, 0.0f, 1.0f, 0.0f },
+			{ 0.0f, 0.01f, 0.0f, 0.0f, 1.0f }
+		};
+
+		std::vector<GLuint> buffers(NUM_MESHES);
+		std::vector<VertexArray> vertexArrays(NUM_MESHES);
+		glGenBuffers(NUM_MESHES, buffers.data());
+
+		for (int i = 0; i < NUM_MESHES; i++) {
+			gl.bindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
+
+			vertexArrays[i].addAttrib(buffers[i], 0, 3, GL_FLOAT, sizeof(BenchVertex), offsetof(BenchVertex, x));
+			vertexArrays[i].addAttrib(buffers[i], 1, 2, GL_FLOAT, sizeof(BenchVertex), offsetof(BenchVertex, u));
+			vertexArrays[i].build();
+		}
+
+		// The core profile needs some VAO bound, the per draw setup shares
+		// this one the way the renderers did before they had their own
+		GLuint sharedVao = 0;
+		glGenVertexArrays(1, &sharedVao);
+
+		gl.useProgram(programId);
+
+		float vaoMs = 0.0f;
+		float attribMs = 0.0f;
+
+		for (int pass = 0; pass < 2; pass++) {
+			bool useVao = pass == 0;
+
+			// Warm up the driver's copies of the state, not timed
+			for (int iteration = 0; iteration <= ITERATIONS; iteration++) {
+				Clock::time_point start = Clock::now();
+
+				for (int i = 0; i < numDraws; i++) {
+					int mesh = i % NUM_MESHES;
+
+					if (useVao) {
+						vertexArrays[mesh].bind();
+						glDrawArrays(GL_TRIANGLES, 0, 3);
+					}
+					else {
+						gl.bindVertexArray(sharedVao);
+						gl.bindBuffer(GL_ARRAY_BUFFER, buffers[mesh]);
+						glEnableVertexAttribArray(0);
+						glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(BenchVertex), (void*)offsetof(BenchVertex, x));
+						glEnableVertexAttribArray(1);
+						glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(BenchVertex), (void*)offsetof(BenchVertex, u));
+						glDrawArrays(GL_TRIANGLES, 0, 3);
+						glDisableVertexAttribArray(0);
+						glDisableVertexAttribArray(1);
+					}
+				}
+
+				// Wait for the driver so deferred validation is counted
+				glFinish();
+
+				if (iteration > 0) {
+					(useVao ? vaoMs : attribMs) += elapsedMs(start) / ITERATIONS;
+				}
+			}
+		}
+
+		std::cout << "VertexArray: " << numDraws << " draws, VAO bind " << vaoMs << " ms"
+			<< ", per draw attribute setup " << attribMs << " ms"
+			<< " (" << (vaoMs > 0.0f ? attribMs / vaoMs : 0.0f) << "x)" << std::endl;
+
+		gl.bindVertexArray(0);
+		glDeleteVertexArrays(1, &sharedVao);
+		gl.onVertexArrayDeleted(sharedVao);
+
+		for (int i = 0; i < NUM_MESHES; i++) {
+			vertexArrays[i].destroy();
+			glDeleteBuffers(1, &buffers[i]);
+			gl.onBufferDeleted(buffers[i]);
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <GL/glew.h>
+#include <vector>
+
+namespace GE {
+	// Wrapper around a vertex array object (VAO). The vertex layout is
+	// described once at init, recorded into the VAO by build() and from
+	// then on drawing only needs bind()
+	//
+	// Every attribute names its own buffer, so interleaved layouts (one
+	// buffer, several offsets) and separate streams (one buffer per
+	// attribute) are described the same way and can be mixed
+	class VertexArray {
+	public:
+		VertexArray() {
+			vao = 0;
+			indexBuffer = 0;
+		}
+
+		~VertexArray() {}
+
+		// Describe one attribute. stride and offset are in bytes, divisor 1
+		// makes the attribute advance per instance instead of per vertex
+		void addAttrib(GLuint buffer, GLint location, GLint size, GLenum type,
+			GLsizei stride, size_t offset, GLuint divisor = 0, GLboolean normalised = GL_FALSE);
+
+		// Optional element buffer for indexed draws
+		void setIndexBuffer(GLuint buffer) {
+			indexBuffer = buffer;
+		}
+
+		// Create the VAO and record the layout into it
+		void build();
+
+		// Select the VAO into the context
+		void bind();
+
+		// Release the VAO, the buffers belong to the caller
+		void destroy();
+
+		GLuint getName() {
+			return vao;
+		}
+
+		// Print the time of numDraws draws binding a VAO each against
+		// setting the attributes up before every draw to the console
+		static void runBenchmark(int numDraws);
+
+	private:
+		struct Attrib {
+			GLuint buffer;
+			GLint location;
+			GLint size;
+			GLenum type;
+			GLboolean normalised;
+			GLsizei stride;
+			size_t offset;
+			GLuint divisor;
+		};
+
+		GLuint vao;
+		GLuint indexBuffer;
+		std::vector<Attrib> attribs;
+	};
+}
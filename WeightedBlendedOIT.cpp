@@ -0,0 +1,173 @@
+#include "WeightedBlendedOIT.h"
+#include "GLStateCache.h"
+#include "ShaderLibrary.h"
+#include <iostream>
+
+namespace GE {
+	WeightedBlendedOIT::WeightedBlendedOIT() {
+		sceneFramebuffer = accumFramebuffer = 0;
+		sceneColour = depthBuffer = 0;
+		accumTexture = weightTexture = 0;
+		programId = 0;
+		emptyVao = 0;
+		compositePipeline = nullptr;
+		width = height = 0;
+		ready = false;
+	}
+
+	static GLuint createTarget(GLenum internalFormat, GLenum format, int width, int height) {
+		GLuint texture;
+		glGenTextures(1, &texture);
+		GLStateCache::get().bindTexture(0, GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+
+	bool WeightedBlendedOIT::init(int w, int h) {
+		width = w;
+		height = h;
+
+		const GLchar* V_ShaderCode[] = {
+			"#version 140\n"
+			"void main() {\n"
+			"vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+			"gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+			"}\n" };
+
+		// Weighted average colour, alpha is the coverage of all the layers
+		const GLchar* F_ShaderCode[] = {
+			"#version 140\n"
+			"uniform sampler2D accumSampler;\n"
+			"uniform sampler2D weightSampler;\n"
+			"out vec4 fragmentColour;\n"
+			"void main()\n"
+			"{\n"
+			"ivec2 texel = ivec2(gl_FragCoord.xy);\n"
+			"vec4 accum = texelFetch(accumSampler, texel, 0);\n"
+			"if (accum.a >= 1.0) discard;\n"
+			"float weight = texelFetch(weightSampler, texel, 0).r;\n"
+			"fragmentColour = vec4(accum.rgb / max(weight, 1e-5), 1.0 - accum.a);\n"
+			"}\n" };
+
+		// The resolve runs outside the queue's ready checks, so wait for it
+		programId = ShaderLibrary::get().getProgramFromSource(V_ShaderCode[0], F_ShaderCode[0]);
+		if (programId == 0) {
+			std::cerr << "Failed to create WeightedBlendedOIT program. Check console for errors" << std::endl;
+			return false;
+		}
+
+		accumSamplerId = glGetUniformLocation(programId, "accumSampler");
+		weightSamplerId = glGetUniformLocation(programId, "weightSampler");
+
+		glGenVertexArrays(1, &emptyVao);
+
+		// Resolve over the scene without touching its depth
+		PipelineDesc composite;
+		composite.programId = programId;
+		composite.vao = emptyVao;
+		composite.depthTest = false;
+		composite.depthWrite = false;
+		composite.setBlend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		compositePipeline = PipelineCache::get().create(composite);
+
+		glGenRenderbuffers(1, &sceneColour);
+		glBindRenderbuffer(GL_RENDERBUFFER, sceneColour);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+		// Full floats, dense particles overlap enough to overflow half floats
+		accumTexture = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+		weightTexture = createTarget(GL_R32F, GL_RED, width, height);
+
+		glGenFramebuffers(1, &sceneFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneColour);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		bool sceneComplete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+		glGenFramebuffers(1, &accumFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, accumFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, weightTexture, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+		const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		bool accumComplete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if (!sceneComplete || !accumComplete) {
+			std::cerr << "WeightedBlendedOIT framebuffers are incomplete" << std::endl;
+			return false;
+		}
+
+		ready = true;
+		return true;
+	}
+
+	void WeightedBlendedOIT::bindScene() {
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	}
+
+	void WeightedBlendedOIT::beginAccumulate() {
+		glBindFramebuffer(GL_FRAMEBUFFER, accumFramebuffer);
+
+		// Nothing accumulated and everything behind fully revealed
+		const GLfloat clearAccum[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		const GLfloat clearWeight[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		// The clear obeys the colour mask, the query pass turns it off
+		GLStateCache::get().colorMask(GL_TRUE);
+		glClearBufferfv(GL_COLOR, 0, clearAccum);
+		glClearBufferfv(GL_COLOR, 1, clearWeight);
+	}
+
+	void WeightedBlendedOIT::composite() {
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+
+		PipelineCache::get().bind(compositePipeline);
+
+		GLStateCache& gl = GLStateCache::get();
+		gl.uniform1i(accumSamplerId, 0);
+		gl.uniform1i(weightSamplerId, 1);
+		gl.bindTexture(0, GL_TEXTURE_2D, accumTexture);
+		gl.bindTexture(1, GL_TEXTURE_2D, weightTexture);
+
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	void WeightedBlendedOIT::present() {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void WeightedBlendedOIT::destroy() {
+		glDeleteFramebuffers(1, &sceneFramebuffer);
+		glDeleteFramebuffers(1, &accumFramebuffer);
+		glDeleteRenderbuffers(1, &sceneColour);
+		glDeleteRenderbuffers(1, &depthBuffer);
+
+		glDeleteTextures(1, &accumTexture);
+		GLStateCache::get().onTextureDeleted(accumTexture);
+		glDeleteTextures(1, &weightTexture);
+		GLStateCache::get().onTextureDeleted(weightTexture);
+
+		glDeleteVertexArrays(1, &emptyVao);
+		GLStateCache::get().onVertexArrayDeleted(emptyVao);
+
+		// The program belongs to the shader library
+		programId = 0;
+		compositePipeline = nullptr;
+
+		ready = false;
+	}
+}
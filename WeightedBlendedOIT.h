@@ -0,0 +1,76 @@
+#pragma once
+#include <GL/glew.h>
+#include "PipelineState.h"
+
+namespace GE {
+	// Weighted blended order independent transparency (McGuire and Bavoil).
+	// While it is on the frame is drawn offscreen. At the transparent pass
+	// blended draws accumulate into two targets that share the scene's
+	// depth: premultiplied colour times a depth based weight with the
+	// product of (1 - alpha) in alpha, and the sum of the weights. One
+	// fullscreen pass then resolves the weighted average over the opaque
+	// scene, so blended draws need no sorting
+	//
+	// Shaders write through GE_TRANSPARENT_OUTPUT_GLSL and their pipelines
+	// blend with setAccumulateBlend. Every target uses the same blend
+	// function, so it only needs GL 3.0 rather than per draw buffer blending
+	class WeightedBlendedOIT {
+	public:
+		WeightedBlendedOIT();
+		~WeightedBlendedOIT() {}
+
+		// Create the targets for a window of width x height and the resolve
+		// program, false if the framebuffers can't be completed
+		bool init(int width, int height);
+
+		// Draw the rest of the frame offscreen, call before clearing
+		void bindScene();
+
+		// Called by the render queue at the start of its transparent pass,
+		// clears the accumulation targets
+		void beginAccumulate();
+
+		// Called by the render queue after its transparent pass, blends the
+		// resolved transparency over the scene
+		void composite();
+
+		// Copy the finished scene to the window's framebuffer
+		void present();
+
+		// Release method to free up objects
+		void destroy();
+
+		// Blend desc into the accumulation targets: colours and weights add
+		// up, alpha multiplies by (1 - alpha)
+		static void setAccumulateBlend(PipelineDesc& desc) {
+			desc.setBlendSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+		}
+
+		// Accessors
+		bool isReady() {
+			return ready;
+		}
+
+	private:
+		GLuint sceneFramebuffer;
+		GLuint accumFramebuffer;
+
+		// Scene colour and the depth shared by both framebuffers
+		GLuint sceneColour;
+		GLuint depthBuffer;
+
+		// RGBA32F premultiplied colour and revealage, R32F weight sum
+		GLuint accumTexture;
+		GLuint weightTexture;
+
+		// Fullscreen triangle from gl_VertexID, drawn with an empty VAO
+		GLuint programId;
+		GLint accumSamplerId;
+		GLint weightSamplerId;
+		GLuint emptyVao;
+		const PipelineState* compositePipeline;
+
+		int width, height;
+		bool ready;
+	};
+}
@@ -2,6 +2,7 @@
 // Do not use the SDL_main method - allowing us to define custom behaviour
 #define SDL_MAIN_HANDLED
 #include "GameEngine.h"
+#include "ShaderLibrary.h"
 #include <sstream>
 
 using namespace GE;
@@ -17,29 +18,102 @@ int main()
         return -1;
     }
 
+    // Game logic runs in fixed steps, 60 a second, whatever the frame rate
+    const double SIMULATION_STEP = 1.0 / 60.0;
+
+    // Most steps run before a frame. A frame slower than this many steps
+    // drops the rest rather than falling further behind every frame
+    const int MAX_STEPS_PER_FRAME = 5;
+
+    // Frames a second without vsync, higher rates only burn CPU. 0 for no limit
+    const int MAX_FRAME_RATE = 240;
+
     // Store time at two points in the program
     Uint32 last_time = SDL_GetTicks(), current_time = 0;
     int frame_count = 0;
+    int step_count = 0;
+
+    // Time not yet simulated, less than a step after each frame's updates
+    const double ticksPerSecond = (double)SDL_GetPerformanceFrequency();
+    Uint64 last_counter = SDL_GetPerformanceCounter();
+    double accumulator = 0.0;
 
     //MAIN LOOP
     while (ge.keep_running()) {
+        Uint64 counter = SDL_GetPerformanceCounter();
+        accumulator += (counter - last_counter) / ticksPerSecond;
+        last_counter = counter;
+
         // Update game state
-        ge.update();
+        int steps = 0;
+        while (accumulator >= SIMULATION_STEP && steps < MAX_STEPS_PER_FRAME) {
+            ge.update((float)SIMULATION_STEP);
+            accumulator -= SIMULATION_STEP;
+            steps++;
+        }
+        if (steps == MAX_STEPS_PER_FRAME && accumulator >= SIMULATION_STEP) {
+            accumulator = 0.0;
+        }
+        step_count += steps;
 
         ge.processInput();
 
-        // Render the frame to the window and calc frame statistics
-        ge.draw();
+        // Render the frame to the window and calc frame statistics,
+        // blending the last two steps by how far into the next one we are
+        ge.draw((float)(accumulator / SIMULATION_STEP));
         frame_count++;
+
+        if (MAX_FRAME_RATE > 0) {
+            double frameSeconds = (SDL_GetPerformanceCounter() - counter) / ticksPerSecond;
+            double spare = 1.0 / MAX_FRAME_RATE - frameSeconds;
+            if (spare > 0.001) {
+                SDL_Delay((Uint32)(spare * 1000.0));
+            }
+        }
+
         current_time = SDL_GetTicks();
 
         if (current_time - last_time > 1000) {
             // string to hold frame timing and construct this message
             std::ostringstream msg;
-            msg << "FPS = " << frame_count;
+            const RenderStats& stats = ge.getRenderStats();
+            msg << "FPS = " << frame_count
+                << " steps = " << step_count
+                << " | draws = " << stats.drawCalls
+                << " (indirect " << stats.indirectDraws << ")"
+                << " programs = " << stats.programSwitches
+                << " pipelines = " << stats.pipelineSwitches
+                << " state calls " << (ge.isPipelineDiffing() ? "diffed " : "full ") << stats.stateCalls
+                << " textures = " << stats.textureBinds
+                << " | shaders pending = " << ShaderLibrary::get().getPendingCount()
+                << " fallback " << stats.fallbackDraws
+                << " skipped " << stats.skippedDraws
+                << " | GL calls = " << stats.glCallsIssued
+                << " elided = " << stats.glCallsElided
+                << " | fence wait = " << stats.fenceWaitMs << " ms"
+                << " | debris cull = " << (ge.getDebris()->getCullMode() == MultiDrawRenderer::CULL_GPU ? "GPU " : "CPU ")
+                << ge.getDebris()->getSubmitMs() << " ms"
+                << " | queries = " << stats.occlusionQueries
+                << " hidden " << ge.getOcclusionQueries()->getHiddenObjects()
+                << " conditional " << stats.conditionalDraws
+                << " | entities = " << ge.getEntities()->getEntityCount()
+                << " visible " << ge.getEntityCulling()->getNumVisible()
+                << " | transparent " << (ge.isWeightedOIT() ? "oit " : "sorted ") << stats.transparentGpuMs << " ms"
+                << " | particles = " << ge.getParticles()->getNumParticles()
+                << " spawn " << ge.getParticles()->getSpawnMs()
+                << " sim " << ge.getParticles()->getSimulateMs()
+                << " compact " << ge.getParticles()->getCompactMs()
+                << " sort " << ge.getParticles()->getSortMs()
+                << " write " << ge.getParticles()->getWriteMs() << " ms"
+                << " | gpu particles = " << ge.getGPUParticles()->getCapacity()
+                << " cpu " << ge.getGPUParticles()->getUpdateMs()
+                << " gpu " << ge.getGPUParticles()->getGPUUpdateMs() << " ms"
+                << " | occluded = " << (int)(ge.getOcclusion()->getCulledFraction() * 100.0f) << "% raster "
+                << ge.getOcclusion()->getRasterMs() << " ms";
             ge.setwindowtitle(msg.str().c_str());
             // reset the frame counter
             frame_count = 0;
+            step_count = 0;
             // update time between frames
             last_time = current_time;
         }
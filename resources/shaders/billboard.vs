@@ -0,0 +1,11 @@
+#version 140
+uniform mat4 transform;
+uniform mat4 view;
+uniform mat4 projection;
+in vec3 vertexPos3D;
+in vec2 vUV;
+out vec2 uv;
+void main() {
+	gl_Position = projection * view * transform * vec4(vertexPos3D, 1);
+	uv = vUV;
+}
@@ -0,0 +1,10 @@
+#version 140
+#include "FrameData.glsl"
+#include "ObjectData.glsl"
+in vec3 vertexPos3D;
+in vec2 vUV;
+out vec2 uv;
+void main() {
+	gl_Position = viewProjection * transform * vec4(vertexPos3D, 1);
+	uv = vUV;
+}
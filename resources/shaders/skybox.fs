@@ -0,0 +1,8 @@
+#version 140
+in vec3 texCoord;
+uniform samplerCube sampler;
+out vec4 fragmentColour;
+void main()
+{
+	fragmentColour = vec4(texture(sampler, texCoord).rgb, 1.0);
+}
@@ -0,0 +1,9 @@
+#version 140
+#include "FrameData.glsl"
+in vec3 vertexPos3D;
+out vec3 texCoord;
+void main() {
+	// Rotation only, the sky stays centred on the camera
+	gl_Position = projection * mat4(mat3(view)) * vec4(vertexPos3D, 1);
+	texCoord = vertexPos3D;
+}